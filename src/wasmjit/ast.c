@@ -26,6 +26,10 @@
 
 #include <wasmjit/sys.h>
 
+#ifndef __KERNEL__
+#include <unistd.h>
+#endif
+
 void init_instruction(struct Instr *instr)
 {
 	memset(instr, 0, sizeof(*instr));
@@ -177,4 +181,149 @@ void wasmjit_free_module(struct Module *module)
 		}
 		free(module->data_section.datas);
 	}
+
+#ifndef __KERNEL__
+	if (module->data_section.image_size)
+		close(module->data_section.image_fd);
+#endif
+
+	if (module->name_section.func_names) {
+		uint32_t i;
+		for (i = 0; i < module->name_section.n_func_names; ++i) {
+			free(module->name_section.func_names[i].name);
+		}
+		free(module->name_section.func_names);
+	}
+}
+
+static size_t instructions_bytes(const struct Instr *instructions,
+				 size_t n_instructions)
+{
+	size_t i, bytes = n_instructions * sizeof(instructions[0]);
+
+	for (i = 0; i < n_instructions; ++i) {
+		const struct Instr *instr = &instructions[i];
+
+		switch (instr->opcode) {
+		case OPCODE_BLOCK:
+			bytes += instructions_bytes(instr->data.block.instructions,
+						    instr->data.block.n_instructions);
+			break;
+		case OPCODE_LOOP:
+			bytes += instructions_bytes(instr->data.loop.instructions,
+						    instr->data.loop.n_instructions);
+			break;
+		case OPCODE_IF:
+			bytes += instructions_bytes(instr->data.if_.instructions_then,
+						    instr->data.if_.n_instructions_then);
+			bytes += instructions_bytes(instr->data.if_.instructions_else,
+						    instr->data.if_.n_instructions_else);
+			break;
+		case OPCODE_BR_TABLE:
+			bytes += instr->data.br_table.n_labelidxs *
+				sizeof(instr->data.br_table.labelidxs[0]);
+			break;
+		}
+	}
+
+	return bytes;
+}
+
+size_t wasmjit_module_bytes(const struct Module *module)
+{
+	size_t bytes = sizeof(*module);
+	uint32_t i;
+
+	bytes += module->type_section.n_types *
+		sizeof(module->type_section.types[0]);
+
+	bytes += module->import_section.n_imports *
+		sizeof(module->import_section.imports[0]);
+	for (i = 0; i < module->import_section.n_imports; ++i) {
+		bytes += strlen(module->import_section.imports[i].module) + 1;
+		bytes += strlen(module->import_section.imports[i].name) + 1;
+	}
+
+	bytes += module->function_section.n_typeidxs *
+		sizeof(module->function_section.typeidxs[0]);
+	bytes += module->table_section.n_tables *
+		sizeof(module->table_section.tables[0]);
+	bytes += module->memory_section.n_memories *
+		sizeof(module->memory_section.memories[0]);
+
+	bytes += module->global_section.n_globals *
+		sizeof(module->global_section.globals[0]);
+	for (i = 0; i < module->global_section.n_globals; ++i) {
+		bytes += instructions_bytes(module->global_section.globals[i].instructions,
+					    module->global_section.globals[i].n_instructions);
+	}
+
+	bytes += module->export_section.n_exports *
+		sizeof(module->export_section.exports[0]);
+	for (i = 0; i < module->export_section.n_exports; ++i) {
+		if (module->export_section.exports[i].name)
+			bytes += strlen(module->export_section.exports[i].name) + 1;
+	}
+
+	bytes += module->element_section.n_elements *
+		sizeof(module->element_section.elements[0]);
+	for (i = 0; i < module->element_section.n_elements; ++i) {
+		const struct ElementSectionElement *element =
+			&module->element_section.elements[i];
+
+		bytes += instructions_bytes(element->instructions,
+					    element->n_instructions);
+		bytes += element->n_funcidxs * sizeof(element->funcidxs[0]);
+	}
+
+	bytes += module->code_section.n_codes *
+		sizeof(module->code_section.codes[0]);
+	for (i = 0; i < module->code_section.n_codes; ++i) {
+		const struct CodeSectionCode *code = &module->code_section.codes[i];
+
+		bytes += code->n_locals * sizeof(code->locals[0]);
+		bytes += instructions_bytes(code->instructions,
+					    code->n_instructions);
+	}
+
+	bytes += module->data_section.n_datas *
+		sizeof(module->data_section.datas[0]);
+	for (i = 0; i < module->data_section.n_datas; ++i) {
+		const struct DataSectionData *data = &module->data_section.datas[i];
+
+		bytes += instructions_bytes(data->instructions,
+					    data->n_instructions);
+		if (data->buf)
+			bytes += data->buf_size;
+	}
+
+	bytes += module->name_section.n_func_names *
+		sizeof(module->name_section.func_names[0]);
+	for (i = 0; i < module->name_section.n_func_names; ++i) {
+		bytes += strlen(module->name_section.func_names[i].name) + 1;
+	}
+
+	return bytes;
+}
+
+const char *wasmjit_module_func_name(const struct Module *module,
+				     uint32_t funcidx)
+{
+	uint32_t i;
+
+	for (i = 0; i < module->name_section.n_func_names; ++i) {
+		if (module->name_section.func_names[i].funcidx == funcidx)
+			return module->name_section.func_names[i].name;
+	}
+
+	for (i = 0; i < module->export_section.n_exports; ++i) {
+		struct ExportSectionExport *export =
+			&module->export_section.exports[i];
+
+		if (export->idx_type == IMPORT_DESC_TYPE_FUNC &&
+		    export->idx == funcidx)
+			return export->name;
+	}
+
+	return NULL;
 }
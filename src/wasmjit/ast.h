@@ -44,6 +44,8 @@ enum {
 	OPCODE_RETURN = 0x0F,
 	OPCODE_CALL = 0x10,
 	OPCODE_CALL_INDIRECT = 0x11,
+	OPCODE_RETURN_CALL = 0x12,
+	OPCODE_RETURN_CALL_INDIRECT = 0x13,
 
 	/* Parametric Instructions */
 	OPCODE_DROP = 0x1A,
@@ -220,8 +222,69 @@ enum {
 	OPCODE_I64_REINTERPRET_F64 = 0xBD,
 	OPCODE_F32_REINTERPRET_I32 = 0xBE,
 	OPCODE_F64_REINTERPRET_I64 = 0xBF,
+
+	/* followed by an ATOMIC_OPCODE_* */
+	OPCODE_ATOMIC_PREFIX = 0xFE,
+};
+
+/* threads proposal */
+enum {
+	ATOMIC_OPCODE_NOTIFY = 0x00,
+	ATOMIC_OPCODE_I32_WAIT = 0x01,
+	ATOMIC_OPCODE_I64_WAIT = 0x02,
+	ATOMIC_OPCODE_FENCE = 0x03,
+
+	/*
+	  the rest come in groups of seven with the same access shapes:
+	  i32, i64, i32 8_u, i32 16_u, i64 8_u, i64 16_u, i64 32_u
+	 */
+	ATOMIC_OPCODE_I32_LOAD = 0x10,
+	ATOMIC_OPCODE_I64_LOAD = 0x11,
+	ATOMIC_OPCODE_I32_LOAD8_U = 0x12,
+	ATOMIC_OPCODE_I32_LOAD16_U = 0x13,
+	ATOMIC_OPCODE_I64_LOAD8_U = 0x14,
+	ATOMIC_OPCODE_I64_LOAD16_U = 0x15,
+	ATOMIC_OPCODE_I64_LOAD32_U = 0x16,
+	ATOMIC_OPCODE_I32_STORE = 0x17,
+	ATOMIC_OPCODE_I64_STORE = 0x18,
+	ATOMIC_OPCODE_I32_STORE8 = 0x19,
+	ATOMIC_OPCODE_I32_STORE16 = 0x1A,
+	ATOMIC_OPCODE_I64_STORE8 = 0x1B,
+	ATOMIC_OPCODE_I64_STORE16 = 0x1C,
+	ATOMIC_OPCODE_I64_STORE32 = 0x1D,
+	ATOMIC_OPCODE_I32_RMW_ADD = 0x1E,
+	ATOMIC_OPCODE_I32_RMW_SUB = 0x25,
+	ATOMIC_OPCODE_I32_RMW_AND = 0x2C,
+	ATOMIC_OPCODE_I32_RMW_OR = 0x33,
+	ATOMIC_OPCODE_I32_RMW_XOR = 0x3A,
+	ATOMIC_OPCODE_I32_RMW_XCHG = 0x41,
+	ATOMIC_OPCODE_I32_RMW_CMPXCHG = 0x48,
+	ATOMIC_OPCODE_I64_RMW32_CMPXCHG_U = 0x4E,
 };
 
+#define ATOMIC_OPCODE_GROUP(op) (((op) - ATOMIC_OPCODE_I32_LOAD) / 7)
+#define ATOMIC_OPCODE_SHAPE(op) (((op) - ATOMIC_OPCODE_I32_LOAD) % 7)
+
+/* bytes accessed by an atomic opcode, 0 if there's no such opcode */
+__attribute__ ((unused))
+static unsigned wasmjit_atomic_access_size(uint32_t opcode)
+{
+	static const unsigned char sizes[7] = {4, 8, 1, 2, 1, 2, 4};
+
+	switch (opcode) {
+	case ATOMIC_OPCODE_NOTIFY:
+	case ATOMIC_OPCODE_I32_WAIT:
+		return 4;
+	case ATOMIC_OPCODE_I64_WAIT:
+		return 8;
+	default:
+		if (opcode < ATOMIC_OPCODE_I32_LOAD ||
+		    opcode > ATOMIC_OPCODE_I64_RMW32_CMPXCHG_U)
+			return 0;
+		return sizes[ATOMIC_OPCODE_SHAPE(opcode)];
+	}
+}
+
 enum {
 	VALTYPE_NULL = 0x40,
 	VALTYPE_I32 = 0x7f,
@@ -289,6 +352,8 @@ struct GlobalType {
 
 struct Limits {
 	uint32_t min, max;
+	/* only memories can be shared, and only with a max */
+	uint8_t shared;
 };
 
 #define FUNC_TYPE_N_OUTPUTS(ft) ((ft)->output_type == VALTYPE_NULL ? 0 : 1)
@@ -315,11 +380,16 @@ struct MemoryType {
 
 struct Instr {
 	uint8_t opcode;
+	/* module offset of the opcode */
+	uint32_t offset;
 	union {
 		struct BlockLoopExtra {
 			uint8_t blocktype;
 			size_t n_instructions;
 			struct Instr *instructions;
+			/* code section index + 1 of the callee a block
+			   was inlined from, 0 otherwise */
+			uint32_t inlined;
 		} block, loop;
 		struct IfExtra {
 			uint8_t blocktype;
@@ -338,10 +408,10 @@ struct Instr {
 		} br_table;
 		struct {
 			uint32_t funcidx;
-		} call;
+		} call, return_call;
 		struct {
 			uint32_t typeidx;
-		} call_indirect;
+		} call_indirect, return_call_indirect;
 		struct LocalExtra {
 			uint32_t localidx;
 		} get_local, set_local, tee_local;
@@ -351,6 +421,7 @@ struct Instr {
 		struct LoadStoreExtra {
 			uint32_t align;
 			uint32_t offset;
+			uint32_t memidx;
 		} i32_load, i64_load, f32_load, f64_load,
 		    i32_load8_s, i32_load8_u, i32_load16_s, i32_load16_u,
 		    i64_load8_s, i64_load8_u, i64_load16_s, i64_load16_u,
@@ -358,6 +429,16 @@ struct Instr {
 		    i32_store, i64_store, f32_store, f64_store,
 		    i32_store8, i32_store16, i64_store8, i64_store16,
 		    i64_store32;
+		struct AtomicExtra {
+			uint32_t opcode;
+			/* unused by ATOMIC_OPCODE_FENCE */
+			uint32_t align;
+			uint32_t offset;
+			uint32_t memidx;
+		} atomic;
+		struct MemoryExtra {
+			uint32_t memidx;
+		} memory_size, memory_grow;
 		struct {
 			uint32_t value;
 		} i32_const;
@@ -456,6 +537,8 @@ struct CodeSection {
 	uint32_t n_codes;
 	struct CodeSectionCode {
 		uint32_t size;
+		/* module offset of the function body */
+		uint32_t offset;
 		uint32_t n_locals;
 		struct CodeSectionCodeLocal {
 			uint32_t count;
@@ -468,6 +551,10 @@ struct CodeSection {
 
 struct DataSection {
 	uint32_t n_datas;
+	/* when image_size isn't 0 every segment was written at its
+	   offset into memory 0 of the image_fd memfd and has no buf */
+	int image_fd;
+	size_t image_size;
 	struct DataSectionData {
 		uint32_t memidx;
 		size_t n_instructions;
@@ -477,6 +564,15 @@ struct DataSection {
 	} *datas;
 };
 
+/* only the function names subsection of the "name" custom section */
+struct NameSection {
+	uint32_t n_func_names;
+	struct NameSectionFuncName {
+		uint32_t funcidx;
+		char *name;
+	} *func_names;
+};
+
 struct Module {
 	struct TypeSection type_section;
 	struct ImportSection import_section;
@@ -489,10 +585,16 @@ struct Module {
 	struct ElementSection element_section;
 	struct CodeSection code_section;
 	struct DataSection data_section;
+	struct NameSection name_section;
 };
 
 void wasmjit_init_module(struct Module *module);
 void wasmjit_free_module(struct Module *modules);
+/* heap bytes held by a parsed module, strings and instructions
+   included */
+size_t wasmjit_module_bytes(const struct Module *module);
+const char *wasmjit_module_func_name(const struct Module *module,
+				     uint32_t funcidx);
 
 #ifdef __cplusplus
 }
@@ -113,6 +113,10 @@ void dump_instruction(const struct Instr *instruction, int indent)
 		printf("%*scall 0x%" PRIx32 "\n", sps, "",
 		       instruction->data.call.funcidx);
 		break;
+	case OPCODE_RETURN_CALL:
+		printf("%*sreturn_call 0x%" PRIx32 "\n", sps, "",
+		       instruction->data.return_call.funcidx);
+		break;
 	case OPCODE_DROP:
 		printf("%*sdrop\n", sps, "");
 		break;
@@ -41,6 +41,17 @@
 
 #define FUNC_EXIT_CONT SIZE_MAX
 
+/* above this many zeroed locals the prologue uses rep stosq */
+#define WASMJIT_ZERO_LOCALS_REP_THRESHOLD 16
+
+/* %r12-%r15, for locals of functions compiled with
+   WASMJIT_COMPILE_FLAG_OPTIMIZE */
+#define WASMJIT_N_LOCAL_REGS 4
+/* weighted uses below which a local stays in its frame slot */
+#define WASMJIT_LOCAL_REG_MIN_USES 3
+/* uses nested deeper than 4 loops count no more */
+#define WASMJIT_LOCAL_USES_MAX_WEIGHT 4096
+
 static DEFINE_VECTOR_GROW(memrefs, struct MemoryReferences);
 
 struct BranchPoints {
@@ -53,6 +64,17 @@ struct BranchPoints {
 
 static DEFINE_VECTOR_GROW(bp, struct BranchPoints);
 
+/* conditional jumps to the out-of-line trap stubs after the epilogue */
+struct TrapPoints {
+	size_t n_elts;
+	struct TrapPointElt {
+		size_t rel_offset;
+		int reason;
+	} *elts;
+};
+
+static DEFINE_VECTOR_GROW(trap_points, struct TrapPoints);
+
 struct LabelContinuations {
 	size_t n_elts;
 	size_t *elts;
@@ -70,6 +92,9 @@ struct StaticStack {
 			STACK_F64 = VALTYPE_F64,
 			STACK_LABEL,
 		} type;
+		/* localidx + 1 of the local the value was read from, 0 if
+		   unknown or the local was written since */
+		size_t local;
 		union {
 			struct {
 				size_t arity;
@@ -82,6 +107,78 @@ struct StaticStack {
 static DEFINE_VECTOR_GROW(stack, struct StaticStack);
 static DEFINE_VECTOR_TRUNCATE(stack, struct StaticStack);
 
+/* sites that ran fewer times than this keep the default layout */
+#define WASMJIT_PGO_MIN_COUNT 64
+
+/* rarely taken code moved after the epilogue by profile-guided layout */
+struct ColdBlocks {
+	size_t n_elts;
+	struct ColdBlock {
+		/* jcc rel32 into the block */
+		size_t rel_offset;
+		/* either the br of a br_if... */
+		const struct Instr *br;
+		/* ...or an if arm, which continues after the if */
+		const struct Instr *instructions;
+		size_t n_instructions;
+		size_t label_idx;
+		size_t profile_next;
+		struct StaticStack sstack;
+		/* ...or a passed epoch deadline, which resumes after
+		   the check */
+		int epoch;
+		size_t resume_offset;
+		uint32_t wasm_offset;
+		int misaligned;
+	} *elts;
+};
+
+static DEFINE_VECTOR_GROW(cold_blocks, struct ColdBlocks);
+
+static DEFINE_VECTOR_GROW(pc_map, struct WasmJITPcMap);
+
+/* code from code_offset on belongs to wasm_offset, pc_map may be NULL */
+static int record_pc(struct WasmJITPcMap *pc_map, size_t code_offset,
+		     uint32_t wasm_offset)
+{
+	struct WasmJITPcMapElt *last;
+
+	if (!pc_map)
+		return 1;
+
+	if (pc_map->n_elts) {
+		last = &pc_map->elts[pc_map->n_elts - 1];
+		if (last->code_offset == code_offset) {
+			/* the previous position emitted no code */
+			last->wasm_offset = wasm_offset;
+			if (pc_map->n_elts > 1 &&
+			    last[-1].wasm_offset == wasm_offset)
+				pc_map->n_elts -= 1;
+			return 1;
+		}
+		if (last->wasm_offset == wasm_offset)
+			return 1;
+	}
+
+	if (!pc_map_grow(pc_map, 1))
+		return 0;
+	last = &pc_map->elts[pc_map->n_elts - 1];
+	last->code_offset = code_offset;
+	last->wasm_offset = wasm_offset;
+
+	return 1;
+}
+
+struct ProfileMD {
+	/* emit counters, or lay out code according to counters */
+	int record;
+	const uint64_t *counters;
+	/* counter offset of the next site, sites are numbered in
+	   instruction pre-order with then arms before else arms */
+	size_t next;
+	struct ColdBlocks cold;
+};
+
 static int push_stack(struct StaticStack *sstack, unsigned type)
 {
 	assert(type == STACK_I32 ||
@@ -89,6 +186,7 @@ static int push_stack(struct StaticStack *sstack, unsigned type)
 	if (!stack_grow(sstack, 1))
 		return 0;
 	sstack->elts[sstack->n_elts - 1].type = type;
+	sstack->elts[sstack->n_elts - 1].local = 0;
 	return 1;
 }
 
@@ -164,11 +262,111 @@ static void encode_le_uint32_t(uint32_t val, char *buf)
 	}					\
 	while (0)
 
+enum {
+	LOCAL_INIT_UNKNOWN,
+	LOCAL_INIT_ZERO,
+	LOCAL_INIT_WRITTEN,
+};
+
 struct LocalsMD {
 	wasmjit_valtype_t valtype;
 	int32_t fp_offset;
+	int init;
+	/* the local lives in %r12 + reg if reg >= 0, its frame slot then
+	   holds the caller's value of that register */
+	int reg;
+	/* the local's value + checked_end was found to be below the size
+	   of memory checked_memidx during straight-line run checked_run */
+	size_t checked_run;
+	uint32_t checked_memidx;
+	uint32_t checked_end;
 };
 
+/*
+ * Swap register cached locals into %r12-%r15, each frame slot keeps
+ * the caller's register until emit_local_regs_restore()
+ */
+static int emit_local_regs_load(struct SizedBuffer *output,
+				const struct LocalsMD *locals_md,
+				size_t n_locals)
+{
+	char buf[sizeof(uint32_t)];
+	size_t i;
+
+	for (i = 0; i < n_locals; ++i) {
+		char inst[3];
+
+		if (locals_md[i].reg < 0)
+			continue;
+
+		/* mov fp_offset(%rbp), %rax */
+		OUTS("\x48\x8b\x85");
+		encode_le_uint32_t(locals_md[i].fp_offset, buf);
+		if (!output_buf(output, buf, sizeof(uint32_t)))
+			goto error;
+
+		/* mov %r12 + reg, fp_offset(%rbp) */
+		memcpy(inst, "\x4c\x89\xa5", 3);
+		inst[2] += 8 * locals_md[i].reg;
+		OUTSN(inst, 3);
+		if (!output_buf(output, buf, sizeof(uint32_t)))
+			goto error;
+
+		/* mov %rax, %r12 + reg */
+		memcpy(inst, "\x49\x89\xc4", 3);
+		inst[2] += locals_md[i].reg;
+		OUTSN(inst, 3);
+	}
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+/* give the caller back its %r12-%r15, leaves everything else alone */
+static int emit_local_regs_restore(struct SizedBuffer *output,
+				   const struct LocalsMD *locals_md,
+				   size_t n_locals)
+{
+	char buf[sizeof(uint32_t)];
+	size_t i;
+
+	for (i = 0; i < n_locals; ++i) {
+		char inst[3];
+
+		if (locals_md[i].reg < 0)
+			continue;
+
+		/* mov fp_offset(%rbp), %r12 + reg */
+		memcpy(inst, "\x4c\x8b\xa5", 3);
+		inst[2] += 8 * locals_md[i].reg;
+		OUTSN(inst, 3);
+		encode_le_uint32_t(locals_md[i].fp_offset, buf);
+		if (!output_buf(output, buf, sizeof(uint32_t)))
+			goto error;
+	}
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+/* forget what is known about a local that is about to be written */
+static void clobber_local(struct LocalsMD *locals_md,
+			  struct StaticStack *sstack,
+			  size_t localidx)
+{
+	size_t i;
+
+	locals_md[localidx].checked_run = 0;
+	for (i = 0; i < sstack->n_elts; ++i) {
+		if (sstack->elts[i].local == localidx + 1)
+			sstack->elts[i].local = 0;
+	}
+}
+
 static int emit_br_code(struct SizedBuffer *output,
 			struct StaticStack *sstack,
 			struct BranchPoints *branches,
@@ -313,6 +511,9 @@ struct InstructionMD {
 			size_t jump_to_else_offset;
 			size_t jump_to_after_else_offset;
 			int did_else;
+			/* then arm moved out of line, or compiled after the else arm */
+			int cold, swapped;
+			size_t profile_second, profile_end;
 		} if_;
 	} data;
 };
@@ -541,256 +742,2726 @@ static int emit_trap(struct SizedBuffer *output,
 	return 0;
 }
 
-static int wasmjit_compile_instruction(const struct FuncType *func_types,
-				       const struct ModuleTypes *module_types,
-				       const struct FuncType *type,
-				       struct SizedBuffer *output,
-				       struct BranchPoints *branches,
-				       struct MemoryReferences *memrefs,
-				       struct LocalsMD *locals_md,
-				       size_t n_locals,
-				       size_t n_frame_locals,
-				       struct StaticStack *sstack,
-				       const struct Instr *instruction,
-				       int check_stack,
-				       unsigned flags)
+/* jcc rel32 to the out-of-line stub for `reason` */
+static int emit_cold_trap_jcc(struct SizedBuffer *output,
+			      struct TrapPoints *traps,
+			      const char *jcc,
+			      int reason)
 {
-	char buf[sizeof(uint64_t)];
-
-	(void)n_locals;
+	char buf[sizeof(uint32_t)];
+	size_t trap_idx;
 
-	switch (instruction->opcode) {
-	case OPCODE_UNREACHABLE:
-		if (!emit_trap(output, memrefs, flags, WASMJIT_TRAP_UNREACHABLE))
-			goto error;
-		break;
-	case OPCODE_NOP:
-		break;
-	case OPCODE_BLOCK:
-	case OPCODE_LOOP: {
-		/* handled by wasmjit_compile_instructions */
-		assert(0);
-		break;
-	}
-	case OPCODE_IF: {
-		/* handled by wasmjit_compile_instructions */
-		assert(0);
-		break;
-	}
-	case OPCODE_BR_IF:
-	case OPCODE_BR: {
-		size_t je_offset;
-		const struct BrIfExtra *extra;
+	OUTS(jcc);
+	OUTNULL(sizeof(uint32_t));
 
-		if (instruction->opcode == OPCODE_BR_IF) {
-			/* LOGIC: v = pop_stack() */
+	trap_idx = traps->n_elts;
+	if (!trap_points_grow(traps, 1))
+		goto error;
+	traps->elts[trap_idx].rel_offset = output->n_elts - sizeof(uint32_t);
+	traps->elts[trap_idx].reason = reason;
 
-			/* pop %rsi */
-			assert(peek_stack(sstack) == STACK_I32);
-			if (!pop_stack(sstack))
-				goto error;
-			OUTS("\x5e");
+	return 1;
 
-			/* LOGIC: if (v) br(); */
+ error:
+	return 0;
+}
 
-			/* testl %esi, %esi */
-			OUTS("\x85\xf6");
+/*
+ * Tier 0 hotness counter, decrements self->tier_countdown and calls
+ * wasmjit_tier_up(self) when it reaches zero. Values are all on the
+ * machine stack at the points this is emitted so no registers need
+ * saving; stack_depth is the number of slots below %rbp.
+ */
+static int emit_tier_counter(struct SizedBuffer *output,
+			     struct MemoryReferences *memrefs,
+			     unsigned flags,
+			     size_t stack_depth)
+{
+	char buf[sizeof(uint64_t)];
+	size_t memref_idx, jnz_offset;
 
-			/* je AFTER_BR */
-			je_offset = output->n_elts;
-			OUTS("\x74\x01");
+	/* mov $self, %rax */
+	OUTS("\x48\xb8");
+	OUTNULL(8);
+	memref_idx = memrefs->n_elts;
+	if (!memrefs_grow(memrefs, 1))
+		goto error;
+	memrefs->elts[memref_idx].type = MEMREF_SELF;
+	memrefs->elts[memref_idx].code_offset = output->n_elts - 8;
 
-			extra = &instruction->data.br_if;
-		}
-		else {
-			extra = &instruction->data.br;;
-			/* appease gcc */
-			je_offset = 0;
-		}
+	/* subl $1, tier_countdown(%rax) */
+	OUTS("\x83\xa8");
+	encode_le_uint32_t(offsetof(struct FuncInst, tier_countdown), buf);
+	if (!output_buf(output, buf, sizeof(uint32_t)))
+		goto error;
+	OUTB(1);
 
-		if (!emit_br_code(output, sstack, branches, extra->labelidx))
-			goto error;
+	/* jnz SKIP */
+	OUTS("\x75");
+	OUTB(0);
+	jnz_offset = output->n_elts;
 
-		if (instruction->opcode == OPCODE_BR_IF) {
-			/* update je operand in previous if block */
-			int ret;
-			size_t offset =
-				output->n_elts - je_offset - 2;
-			assert(offset < 128 && offset > 0);
-			assert(sizeof(buf) >= 2);
-			ret =
-				snprintf(buf, sizeof(buf), "\x74%c",
-					 (int)offset);
-			if (ret < 0)
-				goto error;
-			assert(strlen(buf) == 2);
-			memcpy(&output->elts[je_offset], buf,
-			       2);
-		}
+	/* mov %rax, %rdi */
+	OUTS("\x48\x89\xc7");
 
-		break;
-	}
-	case OPCODE_BR_TABLE: {
-		size_t table_offset, i, default_branch_offset;
+	/* mov $wasmjit_tier_up, %rax */
+	OUTS("\x48\xb8");
+	OUTNULL(8);
+	memref_idx = memrefs->n_elts;
+	if (!memrefs_grow(memrefs, 1))
+		goto error;
+	memrefs->elts[memref_idx].type = MEMREF_TIER_UP;
+	memrefs->elts[memref_idx].code_offset = output->n_elts - 8;
 
-		/* jump to the right code based on the input value */
+	/* align to 16 bytes */
+	if (stack_depth % 2)
+		/* sub $8, %rsp */
+		OUTS("\x48\x83\xec\x08");
 
-		/* pop %rax */
-		OUTS("\x58");
-		if (!pop_stack(sstack))
-			goto error;
+	if (!emit_indirect_call(output, flags))
+		goto error;
 
-		/* cmp $const, %eax */
-		OUTS("\x3d");
-		/* const = instruction->data.br_table.n_labelidxs */
-		encode_le_uint32_t(instruction->data.br_table.n_labelidxs,
-				   buf);
-		if (!output_buf(output, buf, sizeof(uint32_t)))
-			goto error;
+	if (stack_depth % 2)
+		/* add $8, %rsp */
+		OUTS("\x48\x83\xc4\x08");
 
-		/* jae default_branch */
-		OUTS("\x0f\x83\x90\x90\x90\x90");
-		default_branch_offset = output->n_elts;
+	/* SKIP: */
+	output->elts[jnz_offset - 1] = output->n_elts - jnz_offset;
 
-		/* NB: BCB mitigation */
-		/* sbb %ecx, %ecx */
-		OUTS("\x19\xc9");
-		/* and %ecx, %eax */
-		OUTS("\x21\xc8");
+	return 1;
 
-		/* lea 7 + INDIRECT_JUMP_SIZE(flags)(%rip), %rdx */
-		OUTS("\x48\x8d\x15");
-		OUTB(0);
-		OUTB(0); OUTB(0); OUTB(0);
-		encode_le_uint32_t(7 + INDIRECT_JUMP_SIZE(flags),
-				   &output->elts[output->n_elts - 4]);
+ error:
+	return 0;
+}
 
-		/* movsxl (%rdx, %rax, 4), %rax */
-		OUTS("\x48\x63\x04\x82");
-		/* add %rdx, %rax */
-		OUTS("\x48\x01\xd0");
+/* rdtsc; shl $32, %rdx; or %rdx, %rax */
+#define RDTSC_RAX "\x0f\x31\x48\xc1\xe2\x20\x48\x09\xd0"
 
-		if (!emit_indirect_jump(output, flags))
-			goto error;
+/*
+ * Counts the call in self->stats and with WASMJIT_COMPILE_FLAG_CYCLES
+ * saves the timestamp counter in the frame slot below the locals.
+ * Clobbers %rax and %rdx.
+ */
+static int emit_stats_entry(struct SizedBuffer *output,
+			    struct MemoryReferences *memrefs,
+			    unsigned flags,
+			    size_t n_frame_locals)
+{
+	char buf[sizeof(uint64_t)];
+	size_t memref_idx;
+	int32_t slot;
 
-		/* output nop for each branch */
-		table_offset = output->n_elts;
-		for (i = 0; i < instruction->data.br_table.n_labelidxs; ++i) {
-			OUTS("\x90\x90\x90\x90");
-		}
+	/* mov $self, %rax */
+	OUTS("\x48\xb8");
+	OUTNULL(8);
+	memref_idx = memrefs->n_elts;
+	if (!memrefs_grow(memrefs, 1))
+		goto error;
+	memrefs->elts[memref_idx].type = MEMREF_SELF;
+	memrefs->elts[memref_idx].code_offset = output->n_elts - 8;
 
-		for (i = 0; i < instruction->data.br_table.n_labelidxs; ++i) {
-			/* store ip offset */
-			uint32_t ip_offset = output->n_elts - table_offset;
-			encode_le_uint32_t(ip_offset,
-					   &output->elts[table_offset + i * sizeof(uint32_t)]);
+	/* incq stats.calls(%rax) */
+	OUTS("\x48\xff\x80");
+	encode_le_uint32_t(offsetof(struct FuncInst, stats.calls), buf);
+	if (!output_buf(output, buf, sizeof(uint32_t)))
+		goto error;
 
-			/* output branch */
-			if (!emit_br_code(output, sstack, branches,
-					  instruction->data.br_table.labelidxs[i]))
-				goto error;
-		}
+	if (!(flags & WASMJIT_COMPILE_FLAG_CYCLES))
+		return 1;
 
-		/* store ip offset, output default branch */
-		encode_le_uint32_t(output->n_elts - default_branch_offset,
-				   &output->elts[default_branch_offset - 4]);
-		if (!emit_br_code(output, sstack, branches,
-				  instruction->data.br_table.labelidx))
-			goto error;
+	if (__builtin_mul_overflow(n_frame_locals, -8, &slot))
+		goto error;
 
-		break;
-	}
-	case OPCODE_RETURN:
-		/* shift $arity values from top of stock to below */
+	OUTS(RDTSC_RAX);
 
-		if (FUNC_TYPE_N_OUTPUTS(type)) {
-			int32_t out, extra = 0;
+	/* mov %rax, slot(%rbp) */
+	OUTS("\x48\x89\x85");
+	encode_le_uint32_t(slot, buf);
+	if (!output_buf(output, buf, sizeof(uint32_t)))
+		goto error;
 
-			/* lea (arity - 1)*8(%rsp), %rsi */
-			OUTS("\x48\x8d\x74\x24");
-			OUTB(((intmax_t) (FUNC_TYPE_N_OUTPUTS(type) - 1)) * 8);
+	return 1;
 
-			/* lea (-8 * (n_frame_locals + 1))(%rbp), %rdi */
-			OUTS("\x48\x8d\xbd");
+ error:
+	return 0;
+}
 
-			if (WASMJIT_DEBUG_STACK) {
-				if (n_frame_locals >= SIZE_MAX - 1)
-					goto error;
-				extra = 1;
-			} else {
-				if (n_frame_locals == SIZE_MAX)
-					goto error;
-			}
+/*
+ * Adds the cycles since emit_stats_entry() to self->stats, emitted
+ * wherever the frame is torn down. Clobbers %rax, %rcx and %rdx.
+ */
+static int emit_stats_exit(struct SizedBuffer *output,
+			   struct MemoryReferences *memrefs,
+			   size_t n_frame_locals)
+{
+	char buf[sizeof(uint64_t)];
+	size_t memref_idx;
+	int32_t slot;
 
-			if (__builtin_mul_overflow(n_frame_locals + 1 + extra, -8, &out))
-				goto error;
-			encode_le_uint32_t(out, buf);
-			if (!output_buf(output, buf, sizeof(uint32_t)))
-				goto error;
+	if (__builtin_mul_overflow(n_frame_locals, -8, &slot))
+		goto error;
 
-			/* mov $arity, %rcx */
-			OUTS("\x48\xc7\xc1");
-			encode_le_uint32_t(FUNC_TYPE_N_OUTPUTS(type), buf);
-			if (!output_buf(output, buf, sizeof(uint32_t)))
-				goto error;
+	OUTS(RDTSC_RAX);
 
-			/* std */
-			OUTS("\xfd");
+	/* sub slot(%rbp), %rax */
+	OUTS("\x48\x2b\x85");
+	encode_le_uint32_t(slot, buf);
+	if (!output_buf(output, buf, sizeof(uint32_t)))
+		goto error;
+
+	/* mov $self, %rcx */
+	OUTS("\x48\xb9");
+	OUTNULL(8);
+	memref_idx = memrefs->n_elts;
+	if (!memrefs_grow(memrefs, 1))
+		goto error;
+	memrefs->elts[memref_idx].type = MEMREF_SELF;
+	memrefs->elts[memref_idx].code_offset = output->n_elts - 8;
+
+	/* add %rax, stats.cycles(%rcx) */
+	OUTS("\x48\x01\x81");
+	encode_le_uint32_t(offsetof(struct FuncInst, stats.cycles), buf);
+	if (!output_buf(output, buf, sizeof(uint32_t)))
+		goto error;
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+static int ends_fuel_run(const struct Instr *instruction)
+{
+	switch (instruction->opcode) {
+	case OPCODE_BLOCK:
+	case OPCODE_LOOP:
+	case OPCODE_IF:
+	case OPCODE_BR:
+	case OPCODE_BR_IF:
+	case OPCODE_BR_TABLE:
+	case OPCODE_RETURN:
+	case OPCODE_UNREACHABLE:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Charges the instructions up to and including the next branch or
+ * block against the thread's fuel before running them, every branch
+ * target starts such a run. Values are all on the machine stack at
+ * the start of an instruction so %rax is free.
+ */
+static int emit_fuel_charge(struct SizedBuffer *output,
+			    struct MemoryReferences *memrefs,
+			    struct TrapPoints *traps,
+			    const struct Instr *instructions,
+			    size_t n_instructions)
+{
+	char buf[sizeof(uint64_t)];
+	size_t memref_idx, cost;
+
+	for (cost = 0; cost < n_instructions;) {
+		if (ends_fuel_run(&instructions[cost++]))
+			break;
+	}
+
+	/* mov $fuel_offset, %rax */
+	OUTS("\x48\xb8");
+	OUTNULL(8);
+	memref_idx = memrefs->n_elts;
+	if (!memrefs_grow(memrefs, 1))
+		goto error;
+	memrefs->elts[memref_idx].type = MEMREF_FUEL;
+	memrefs->elts[memref_idx].code_offset = output->n_elts - 8;
+
+	/* subq $cost, %fs:(%rax) */
+	OUTS("\x64\x48\x81\x28");
+	encode_le_uint32_t(cost, buf);
+	if (!output_buf(output, buf, sizeof(uint32_t)))
+		goto error;
+
+	/* js OUT_OF_FUEL */
+	if (!emit_cold_trap_jcc(output, traps, "\x0f\x88",
+				WASMJIT_TRAP_OUT_OF_FUEL))
+		goto error;
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+static size_t site_counters(const struct Instr *instruction)
+{
+	switch (instruction->opcode) {
+	case OPCODE_IF:
+	case OPCODE_BR_IF:
+		/* executed, taken */
+		return 2;
+	case OPCODE_BR_TABLE:
+		/* one per index, the last one counts the default */
+		return instruction->data.br_table.n_labelidxs + 1;
+	case OPCODE_CALL_INDIRECT:
+		/* executed, majority candidate, lead of the candidate */
+		return 3;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Counters used by instructions, starting at offset base. The offsets
+ * of call_indirect candidates are stored to targets if not NULL.
+ */
+static size_t walk_sites(const struct Instr *instructions,
+			 size_t n_instructions,
+			 size_t base,
+			 size_t *targets, size_t *n_targets)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i < n_instructions; ++i) {
+		const struct Instr *instruction = &instructions[i];
+
+		if (instruction->opcode == OPCODE_CALL_INDIRECT) {
+			if (targets)
+				targets[*n_targets] = base + n + 1;
+			*n_targets += 1;
+		}
+
+		n += site_counters(instruction);
+		switch (instruction->opcode) {
+		case OPCODE_BLOCK:
+		case OPCODE_LOOP:
+			n += walk_sites(instruction->data.block.instructions,
+					instruction->data.block.n_instructions,
+					base + n, targets, n_targets);
+			break;
+		case OPCODE_IF:
+			n += walk_sites(instruction->data.if_.instructions_then,
+					instruction->data.if_.n_instructions_then,
+					base + n, targets, n_targets);
+			n += walk_sites(instruction->data.if_.instructions_else,
+					instruction->data.if_.n_instructions_else,
+					base + n, targets, n_targets);
+			break;
+		default:
+			break;
+		}
+	}
+
+	return n;
+}
+
+static size_t count_counters(const struct Instr *instructions,
+			     size_t n_instructions)
+{
+	size_t n_targets = 0;
+	return walk_sites(instructions, n_instructions, 0, NULL, &n_targets);
+}
+
+size_t wasmjit_profile_n_counters(const struct CodeSectionCode *code)
+{
+	return count_counters(code->instructions, code->n_instructions);
+}
+
+size_t wasmjit_profile_targets(const struct CodeSectionCode *code,
+			       size_t *targets)
+{
+	size_t n_targets = 0;
+	walk_sites(code->instructions, code->n_instructions, 0,
+		   targets, &n_targets);
+	return n_targets;
+}
+
+struct InlinedCounters {
+	const uint64_t *caller;
+	size_t n_caller, caller_pos;
+	const struct WasmJITFunctionProfile *callees;
+	size_t n_callees;
+	uint64_t *out;
+	size_t pos;
+};
+
+static int inline_counters(struct InlinedCounters *ic,
+			   const struct Instr *instructions,
+			   size_t n_instructions)
+{
+	size_t i, n;
+
+	for (i = 0; i < n_instructions; ++i) {
+		const struct Instr *instruction = &instructions[i];
+
+		if (instruction->opcode == OPCODE_BLOCK &&
+		    instruction->data.block.inlined) {
+			const struct WasmJITFunctionProfile *callee;
+			size_t codeidx = instruction->data.block.inlined - 1;
+
+			n = count_counters(instruction->data.block.instructions,
+					   instruction->data.block.n_instructions);
+			if (codeidx >= ic->n_callees)
+				return 0;
+			callee = &ic->callees[codeidx];
+			/* leaves have no call_indirect, the counts copy as is */
+			if (callee->n_counters == n)
+				memcpy(&ic->out[ic->pos], callee->counters,
+				       n * sizeof(ic->out[0]));
+			ic->pos += n;
+			continue;
+		}
+
+		n = site_counters(instruction);
+		if (n > ic->n_caller - ic->caller_pos)
+			return 0;
+		memcpy(&ic->out[ic->pos], &ic->caller[ic->caller_pos],
+		       n * sizeof(ic->out[0]));
+		ic->pos += n;
+		ic->caller_pos += n;
+
+		switch (instruction->opcode) {
+		case OPCODE_BLOCK:
+		case OPCODE_LOOP:
+			if (!inline_counters(ic, instruction->data.block.instructions,
+					     instruction->data.block.n_instructions))
+				return 0;
+			break;
+		case OPCODE_IF:
+			if (!inline_counters(ic, instruction->data.if_.instructions_then,
+					     instruction->data.if_.n_instructions_then) ||
+			    !inline_counters(ic, instruction->data.if_.instructions_else,
+					     instruction->data.if_.n_instructions_else))
+				return 0;
+			break;
+		default:
+			break;
+		}
+	}
+
+	return 1;
+}
+
+int wasmjit_profile_inline_counters(const struct CodeSectionCode *code,
+				    const uint64_t *caller,
+				    size_t n_caller,
+				    const struct WasmJITFunctionProfile *callees,
+				    size_t n_callees,
+				    uint64_t *out)
+{
+	struct InlinedCounters ic;
+
+	ic.caller = caller;
+	ic.n_caller = n_caller;
+	ic.caller_pos = 0;
+	ic.callees = callees;
+	ic.n_callees = n_callees;
+	ic.out = out;
+	ic.pos = 0;
+
+	return inline_counters(&ic, code->instructions, code->n_instructions) &&
+		ic.caller_pos == n_caller;
+}
+
+/* returns the counter offset of instruction, which is the next site */
+static size_t profile_site(struct ProfileMD *profile,
+			   const struct Instr *instruction)
+{
+	size_t offset = profile->next;
+	profile->next += site_counters(instruction);
+	return offset;
+}
+
+/* recorded counters of a site with an execution count, if it ran enough */
+static const uint64_t *site_profile(const struct ProfileMD *profile,
+				    size_t offset)
+{
+	if (!profile->counters ||
+	    profile->counters[offset] < WASMJIT_PGO_MIN_COUNT)
+		return NULL;
+	return &profile->counters[offset];
+}
+
+/* mov $counters, %rcx */
+static int emit_profile_base(struct SizedBuffer *output,
+			     struct MemoryReferences *memrefs)
+{
+	char buf[sizeof(uint64_t)];
+	size_t memref_idx;
+
+	OUTS("\x48\xb9");
+	OUTNULL(8);
+	memref_idx = memrefs->n_elts;
+	if (!memrefs_grow(memrefs, 1))
+		goto error;
+	memrefs->elts[memref_idx].type = MEMREF_PROFILE;
+	memrefs->elts[memref_idx].code_offset = output->n_elts - 8;
+	memrefs->elts[memref_idx].idx = 0;
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+/* op with a disp32 of the counter at offset, relative to %rcx */
+static int emit_counter_op(struct SizedBuffer *output,
+			   const char *op, size_t offset)
+{
+	char buf[sizeof(uint32_t)];
+
+	if (offset > INT32_MAX / 8)
+		goto error;
+
+	OUTS(op);
+	encode_le_uint32_t(offset * 8, buf);
+	if (!output_buf(output, buf, sizeof(uint32_t)))
+		goto error;
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+/* counts the site and whether test was non-zero, clobbers %rcx, %rdx */
+static int emit_profile_cond(struct SizedBuffer *output,
+			     struct MemoryReferences *memrefs,
+			     size_t offset,
+			     const char *test)
+{
+	if (!emit_profile_base(output, memrefs))
+		goto error;
+
+	/* incq executed(%rcx) */
+	if (!emit_counter_op(output, "\x48\xff\x81", offset))
+		goto error;
+
+	/* xor %edx, %edx */
+	OUTS("\x31\xd2");
+
+	/* test %reg, %reg */
+	OUTS(test);
+
+	/* setne %dl */
+	OUTS("\x0f\x95\xc2");
+
+	/* add %rdx, taken(%rcx) */
+	if (!emit_counter_op(output, "\x48\x01\x91", offset + 1))
+		goto error;
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+/* histogram of the br_table index in %eax, clobbers %rcx, %rdx */
+static int emit_profile_br_table(struct SizedBuffer *output,
+				 struct MemoryReferences *memrefs,
+				 size_t offset,
+				 uint32_t n_labelidxs)
+{
+	char buf[sizeof(uint32_t)];
+
+	encode_le_uint32_t(n_labelidxs, buf);
+
+	/* mov %eax, %edx */
+	OUTS("\x89\xc2");
+
+	/* cmp $n_labelidxs, %edx */
+	OUTS("\x81\xfa");
+	if (!output_buf(output, buf, sizeof(uint32_t)))
+		goto error;
+
+	/* jb COUNT */
+	OUTS("\x72\x05");
+
+	/* mov $n_labelidxs, %edx */
+	OUTS("\xba");
+	if (!output_buf(output, buf, sizeof(uint32_t)))
+		goto error;
+
+	/* COUNT: */
+	if (!emit_profile_base(output, memrefs))
+		goto error;
+
+	/* incq counters(%rcx, %rdx, 8) */
+	if (!emit_counter_op(output, "\x48\xff\x84\xd1", offset))
+		goto error;
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+/*
+ * Majority vote over the FuncInst in %rax, clobbers %rcx. If a target
+ * makes up more than half of the calls it ends up as the candidate,
+ * and its lead is at most its count minus that of all other targets.
+ */
+static int emit_profile_call_indirect(struct SizedBuffer *output,
+				      struct MemoryReferences *memrefs,
+				      size_t offset)
+{
+	if (!emit_profile_base(output, memrefs))
+		goto error;
+
+	/* incq executed(%rcx) */
+	if (!emit_counter_op(output, "\x48\xff\x81", offset))
+		goto error;
+
+	/* cmp candidate(%rcx), %rax */
+	if (!emit_counter_op(output, "\x48\x3b\x81", offset + 1))
+		goto error;
+
+	/* je INC */
+	OUTS("\x74\x1a");
+
+	/* cmpq $0, lead(%rcx) */
+	if (!emit_counter_op(output, "\x48\x83\xb9", offset + 2))
+		goto error;
+	OUTB(0);
+
+	/* je REPLACE */
+	OUTS("\x74\x09");
+
+	/* decq lead(%rcx) */
+	if (!emit_counter_op(output, "\x48\xff\x89", offset + 2))
+		goto error;
+
+	/* jmp DONE */
+	OUTS("\xeb\x0e");
+
+	/* REPLACE: mov %rax, candidate(%rcx) */
+	if (!emit_counter_op(output, "\x48\x89\x81", offset + 1))
+		goto error;
+
+	/* INC: incq lead(%rcx) */
+	if (!emit_counter_op(output, "\x48\xff\x81", offset + 2))
+		goto error;
+
+	/* DONE: */
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+/* jne rel32 to a new cold block entered with the current stack */
+static struct ColdBlock *emit_cold_jump(struct SizedBuffer *output,
+					struct ProfileMD *profile,
+					const struct StaticStack *sstack)
+{
+	char buf[sizeof(uint32_t)];
+	struct ColdBlock *block;
+
+	/* jne COLD */
+	OUTS("\x0f\x85");
+	OUTNULL(sizeof(uint32_t));
+
+	if (!cold_blocks_grow(&profile->cold, 1)) {
+		profile->cold.elts = NULL;
+		profile->cold.n_elts = 0;
+		goto error;
+	}
+	block = &profile->cold.elts[profile->cold.n_elts - 1];
+	memset(block, 0, sizeof(*block));
+	block->rel_offset = output->n_elts - sizeof(uint32_t);
+
+	if (sstack->n_elts) {
+		if (!stack_grow(&block->sstack, sstack->n_elts))
+			goto error;
+		memcpy(block->sstack.elts, sstack->elts,
+		       sstack->n_elts * sizeof(sstack->elts[0]));
+	}
+
+	return block;
+
+ error:
+	return NULL;
+}
+
+/*
+ * Compares the thread's epoch deadline against the engine epoch and
+ * leaves for a stub calling wasmjit_epoch_deadline_reached() once it
+ * has passed. Same constraints as emit_tier_counter(), also clobbers
+ * %rcx.
+ */
+static int emit_epoch_check(struct SizedBuffer *output,
+			    struct MemoryReferences *memrefs,
+			    struct ProfileMD *profile,
+			    uint32_t wasm_offset,
+			    size_t stack_depth)
+{
+	char buf[sizeof(uint64_t)];
+	size_t memref_idx;
+	struct ColdBlock *block;
+
+	/* mov $deadline_offset, %rax */
+	OUTS("\x48\xb8");
+	OUTNULL(8);
+	memref_idx = memrefs->n_elts;
+	if (!memrefs_grow(memrefs, 1))
+		goto error;
+	memrefs->elts[memref_idx].type = MEMREF_EPOCH_DEADLINE;
+	memrefs->elts[memref_idx].code_offset = output->n_elts - 8;
+
+	/* mov %fs:(%rax), %rax */
+	OUTS("\x64\x48\x8b");
+	OUTB(0x00);
+
+	/* mov $epoch, %rcx */
+	OUTS("\x48\xb9");
+	OUTNULL(8);
+	memref_idx = memrefs->n_elts;
+	if (!memrefs_grow(memrefs, 1))
+		goto error;
+	memrefs->elts[memref_idx].type = MEMREF_EPOCH;
+	memrefs->elts[memref_idx].code_offset = output->n_elts - 8;
+
+	/* cmp (%rcx), %rax */
+	OUTS("\x48\x3b\x01");
+
+	/* jbe EPOCH_STUB */
+	OUTS("\x0f\x86");
+	OUTNULL(sizeof(uint32_t));
+
+	if (!cold_blocks_grow(&profile->cold, 1)) {
+		profile->cold.elts = NULL;
+		profile->cold.n_elts = 0;
+		goto error;
+	}
+	block = &profile->cold.elts[profile->cold.n_elts - 1];
+	memset(block, 0, sizeof(*block));
+	block->rel_offset = output->n_elts - sizeof(uint32_t);
+	block->epoch = 1;
+	block->resume_offset = output->n_elts;
+	block->wasm_offset = wasm_offset;
+	block->misaligned = stack_depth % 2;
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+static int emit_epoch_stub(struct SizedBuffer *output,
+			   struct MemoryReferences *memrefs,
+			   unsigned flags,
+			   const struct ColdBlock *block)
+{
+	char buf[sizeof(uint64_t)];
+	size_t memref_idx;
+
+	if (block->misaligned)
+		/* sub $8, %rsp */
+		OUTS("\x48\x83\xec\x08");
+
+	/* mov $wasmjit_epoch_deadline_reached, %rax */
+	OUTS("\x48\xb8");
+	OUTNULL(8);
+	memref_idx = memrefs->n_elts;
+	if (!memrefs_grow(memrefs, 1))
+		goto error;
+	memrefs->elts[memref_idx].type = MEMREF_EPOCH_DEADLINE_REACHED;
+	memrefs->elts[memref_idx].code_offset = output->n_elts - 8;
+
+	if (!emit_indirect_call(output, flags))
+		goto error;
+
+	if (block->misaligned)
+		/* add $8, %rsp */
+		OUTS("\x48\x83\xc4\x08");
+
+	/* jmp RESUME */
+	OUTS("\xe9");
+	encode_le_uint32_t(block->resume_offset - (output->n_elts + 4), buf);
+	if (!output_buf(output, buf, sizeof(uint32_t)))
+		goto error;
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+static int functype_equal(const struct FuncType *a, const struct FuncType *b)
+{
+	return wasmjit_typelist_equal(a->n_inputs, a->input_types,
+				      b->n_inputs, b->input_types) &&
+		wasmjit_typelist_equal(FUNC_TYPE_N_OUTPUTS(a),
+				       FUNC_TYPE_OUTPUT_TYPES(a),
+				       FUNC_TYPE_N_OUTPUTS(b),
+				       FUNC_TYPE_OUTPUT_TYPES(b));
+}
+
+/* mov $imm, %(e|r)(ax|cx|dx|...) */
+static int emit_mov_imm(struct SizedBuffer *output, int is_64,
+			unsigned reg, uint64_t imm)
+{
+	char buf[sizeof(uint64_t)];
+	char op;
+
+	assert(reg < 8);
+	op = 0xb8 + reg;
+
+	if (is_64)
+		OUTS("\x48");
+	OUTSN(&op, 1);
+	if (is_64) {
+		encode_le_uint64_t(imm, buf);
+		if (!output_buf(output, buf, sizeof(uint64_t)))
+			goto error;
+	} else {
+		encode_le_uint32_t(imm, buf);
+		if (!output_buf(output, buf, sizeof(uint32_t)))
+			goto error;
+	}
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+/* floor(hi * 2^n / d), requires hi < d */
+static uint64_t udiv_shifted(uint64_t hi, uint64_t d, int n)
+{
+	uint64_t q = 0;
+	int i;
+
+	assert(hi < d);
+	for (i = 0; i < n; ++i) {
+		int carry = !!(hi >> 63);
+		hi <<= 1;
+		q <<= 1;
+		if (carry || hi >= d) {
+			hi -= d;
+			q |= 1;
+		}
+	}
+
+	return q;
+}
+
+/* Hacker's Delight, 10-1: magic number for signed division by 2 <= d < 2^(n-1) */
+static void signed_magic(uint64_t d, int n,
+			 uint64_t *magic, int *shift)
+{
+	const uint64_t two_n1 = UINT64_C(1) << (n - 1);
+	uint64_t anc, q1, r1, q2, r2, delta;
+	int p;
+
+	anc = two_n1 - 1 - two_n1 % d;
+	p = n - 1;
+	q1 = two_n1 / anc;
+	r1 = two_n1 - q1 * anc;
+	q2 = two_n1 / d;
+	r2 = two_n1 - q2 * d;
+	do {
+		p += 1;
+		q1 *= 2;
+		r1 *= 2;
+		if (r1 >= anc) {
+			q1 += 1;
+			r1 -= anc;
+		}
+		q2 *= 2;
+		r2 *= 2;
+		if (r2 >= d) {
+			q2 += 1;
+			r2 -= d;
+		}
+		delta = d - r2;
+	} while (q1 < delta || (q1 == delta && r1 == 0));
+
+	*magic = q2 + 1;
+	*shift = p - n;
+}
+
+/* divisors that emit_const_divrem() handles without runtime checks */
+static int is_const_divisor(const struct Instr *prev,
+			    const struct Instr *instruction)
+{
+	switch (instruction->opcode) {
+	case OPCODE_I32_DIV_U:
+	case OPCODE_I32_REM_U:
+		return prev->opcode == OPCODE_I32_CONST &&
+			prev->data.i32_const.value != 0;
+	case OPCODE_I32_DIV_S:
+	case OPCODE_I32_REM_S:
+		return prev->opcode == OPCODE_I32_CONST &&
+			prev->data.i32_const.value != 0 &&
+			prev->data.i32_const.value != UINT32_MAX;
+	case OPCODE_I64_DIV_U:
+	case OPCODE_I64_REM_U:
+		return prev->opcode == OPCODE_I64_CONST &&
+			prev->data.i64_const.value != 0;
+	case OPCODE_I64_DIV_S:
+	case OPCODE_I64_REM_S:
+		return prev->opcode == OPCODE_I64_CONST &&
+			prev->data.i64_const.value != 0 &&
+			prev->data.i64_const.value != UINT64_MAX;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * <const> followed by a div/rem: the divisor is never pushed and the
+ * zero and overflow checks are unnecessary. Positive divisors are
+ * strength-reduced to shifts or a multiply by the reciprocal.
+ */
+static int emit_const_divrem(struct SizedBuffer *output,
+			     struct StaticStack *sstack,
+			     const struct Instr *prev,
+			     const struct Instr *instruction)
+{
+	int is_64, is_signed, is_rem, n;
+	uint64_t d;
+
+	switch (instruction->opcode) {
+	case OPCODE_I32_DIV_S:
+	case OPCODE_I32_DIV_U:
+	case OPCODE_I32_REM_S:
+	case OPCODE_I32_REM_U:
+		is_64 = 0;
+		n = 32;
+		d = prev->data.i32_const.value;
+		break;
+	case OPCODE_I64_DIV_S:
+	case OPCODE_I64_DIV_U:
+	case OPCODE_I64_REM_S:
+	case OPCODE_I64_REM_U:
+		is_64 = 1;
+		n = 64;
+		d = prev->data.i64_const.value;
+		break;
+	default:
+		assert(0);
+		__builtin_unreachable();
+	}
+
+	is_signed = (instruction->opcode == OPCODE_I32_DIV_S ||
+		     instruction->opcode == OPCODE_I32_REM_S ||
+		     instruction->opcode == OPCODE_I64_DIV_S ||
+		     instruction->opcode == OPCODE_I64_REM_S);
+	is_rem = (instruction->opcode == OPCODE_I32_REM_S ||
+		  instruction->opcode == OPCODE_I32_REM_U ||
+		  instruction->opcode == OPCODE_I64_REM_S ||
+		  instruction->opcode == OPCODE_I64_REM_U);
+
+	assert(peek_stack(sstack) == (is_64 ? STACK_I64 : STACK_I32));
+	(void)sstack;
+
+#define OUTW(str)				\
+	do {					\
+		if (is_64)			\
+			OUTS("\x48");		\
+		OUTS(str);			\
+	}					\
+	while (0)
+
+	if (d == 1) {
+		if (is_rem) {
+			/* xor %eax, %eax */
+			OUTS("\x31\xc0");
+			/* mov %rax, (%rsp) */
+			OUTS("\x48\x89\x04\x24");
+		}
+	} else if (is_signed && (d >> (n - 1))) {
+		/* negative divisor other than -1, idiv cannot fault */
+
+		/* mov (%rsp), %(e|r)ax */
+		OUTW("\x8b\x04\x24");
+		if (!emit_mov_imm(output, is_64, 1, d))
+			goto error;
+		/* cltd|cqto */
+		OUTW("\x99");
+		/* idiv %(e|r)cx */
+		OUTW("\xf7\xf9");
+		if (is_rem) {
+			/* mov %(e|r)dx, (%rsp) */
+			OUTW("\x89\x14\x24");
+		} else {
+			/* mov %(e|r)ax, (%rsp) */
+			OUTW("\x89\x04\x24");
+		}
+	} else if (!(d & (d - 1))) {
+		int k = __builtin_ctzll(d);
+
+		/* mov (%rsp), %(e|r)ax */
+		OUTW("\x8b\x04\x24");
+
+		if (!is_signed) {
+			if (is_rem) {
+				if (!emit_mov_imm(output, is_64, 1, d - 1))
+					goto error;
+				/* and %(e|r)cx, %(e|r)ax */
+				OUTW("\x21\xc8");
+			} else {
+				/* shr $k, %(e|r)ax */
+				OUTW("\xc1\xe8");
+				OUTB(k);
+			}
+			/* mov %(e|r)ax, (%rsp) */
+			OUTW("\x89\x04\x24");
+		} else {
+			/* bias negative dividends by d - 1 so the shift rounds to zero */
+
+			/* mov %(e|r)ax, %(e|r)dx */
+			OUTW("\x89\xc2");
+			/* sar $(n - 1), %(e|r)dx */
+			OUTW("\xc1\xfa");
+			OUTB(n - 1);
+			/* shr $(n - k), %(e|r)dx */
+			OUTW("\xc1\xea");
+			OUTB(n - k);
+			/* add %(e|r)ax, %(e|r)dx */
+			OUTW("\x01\xc2");
+
+			if (is_rem) {
+				if (!emit_mov_imm(output, is_64, 1, -d))
+					goto error;
+				/* and %(e|r)cx, %(e|r)dx */
+				OUTW("\x21\xca");
+				/* sub %(e|r)dx, %(e|r)ax */
+				OUTW("\x29\xd0");
+				/* mov %(e|r)ax, (%rsp) */
+				OUTW("\x89\x04\x24");
+			} else {
+				/* sar $k, %(e|r)dx */
+				OUTW("\xc1\xfa");
+				OUTB(k);
+				/* mov %(e|r)dx, (%rsp) */
+				OUTW("\x89\x14\x24");
+			}
+		}
+	} else if (!is_signed) {
+		/* Granlund-Montgomery: q = (t + ((x - t) >> 1)) >> (l - 1), t = mulhi(m, x) */
+		int l = n - __builtin_clzll((d - 1) << (64 - n));
+		uint64_t hi = (l == 64 ? 0 : UINT64_C(1) << l) - d;
+		uint64_t m = udiv_shifted(hi, d, n) + 1;
+
+		/* mov (%rsp), %(e|r)cx */
+		OUTW("\x8b\x0c\x24");
+		if (!emit_mov_imm(output, is_64, 0, m))
+			goto error;
+		/* mul %(e|r)cx */
+		OUTW("\xf7\xe1");
+		/* mov %(e|r)cx, %(e|r)ax */
+		OUTW("\x89\xc8");
+		/* sub %(e|r)dx, %(e|r)ax */
+		OUTW("\x29\xd0");
+		/* shr %(e|r)ax */
+		OUTW("\xd1\xe8");
+		/* add %(e|r)dx, %(e|r)ax */
+		OUTW("\x01\xd0");
+		if (l > 1) {
+			/* shr $(l - 1), %(e|r)ax */
+			OUTW("\xc1\xe8");
+			OUTB(l - 1);
+		}
+
+		if (is_rem) {
+			if (!emit_mov_imm(output, is_64, 2, d))
+				goto error;
+			/* imul %(e|r)dx, %(e|r)ax */
+			OUTW("\x0f\xaf\xc2");
+			/* sub %(e|r)ax, %(e|r)cx */
+			OUTW("\x29\xc1");
+			/* mov %(e|r)cx, (%rsp) */
+			OUTW("\x89\x0c\x24");
+		} else {
+			/* mov %(e|r)ax, (%rsp) */
+			OUTW("\x89\x04\x24");
+		}
+	} else {
+		uint64_t magic;
+		int shift;
+
+		signed_magic(d, n, &magic, &shift);
+
+		/* mov (%rsp), %(e|r)cx */
+		OUTW("\x8b\x0c\x24");
+		if (!emit_mov_imm(output, is_64, 0, magic))
+			goto error;
+		/* imul %(e|r)cx */
+		OUTW("\xf7\xe9");
+		if ((magic >> (n - 1)) & 1) {
+			/* add %(e|r)cx, %(e|r)dx */
+			OUTW("\x01\xca");
+		}
+		if (shift) {
+			/* sar $shift, %(e|r)dx */
+			OUTW("\xc1\xfa");
+			OUTB(shift);
+		}
+		/* mov %(e|r)cx, %(e|r)ax */
+		OUTW("\x89\xc8");
+		/* shr $(n - 1), %(e|r)ax */
+		OUTW("\xc1\xe8");
+		OUTB(n - 1);
+		/* add %(e|r)ax, %(e|r)dx */
+		OUTW("\x01\xc2");
+
+		if (is_rem) {
+			if (!emit_mov_imm(output, is_64, 0, d))
+				goto error;
+			/* imul %(e|r)ax, %(e|r)dx */
+			OUTW("\x0f\xaf\xd0");
+			/* sub %(e|r)dx, %(e|r)cx */
+			OUTW("\x29\xd1");
+			/* mov %(e|r)cx, (%rsp) */
+			OUTW("\x89\x0c\x24");
+		} else {
+			/* mov %(e|r)dx, (%rsp) */
+			OUTW("\x89\x14\x24");
+		}
+	}
+
+#undef OUTW
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+static const char *const call_arg_movs[] = {
+	"\x48\x8b\xbc\x24",	/* mov N(%rsp), %rdi */
+	"\x48\x8b\xb4\x24",	/* mov N(%rsp), %rsi */
+	"\x48\x8b\x94\x24",	/* mov N(%rsp), %rdx */
+	"\x48\x8b\x8c\x24",	/* mov N(%rsp), %rcx */
+	"\x4c\x8b\x84\x24",	/* mov N(%rsp), %r8 */
+	"\x4c\x8b\x8c\x24",	/* mov N(%rsp), %r9 */
+};
+
+static const char *const call_arg_f32_movs[] = {
+	"\xf3\x0f\x10\x84\x24",	/* movss N(%rsp), %xmm0 */
+	"\xf3\x0f\x10\x8c\x24",	/* movss N(%rsp), %xmm1 */
+	"\xf3\x0f\x10\x94\x24",	/* movss N(%rsp), %xmm2 */
+	"\xf3\x0f\x10\x9c\x24",	/* movss N(%rsp), %xmm3 */
+	"\xf3\x0f\x10\xa4\x24",	/* movss N(%rsp), %xmm4 */
+	"\xf3\x0f\x10\xac\x24",	/* movss N(%rsp), %xmm5 */
+	"\xf3\x0f\x10\xb4\x24",	/* movss N(%rsp), %xmm6 */
+	"\xf3\x0f\x10\xbc\x24",	/* movss N(%rsp), %xmm7 */
+};
+
+static const char *const call_arg_f64_movs[] = {
+	"\xf2\x0f\x10\x84\x24",	/* movsd N(%rsp), %xmm0 */
+	"\xf2\x0f\x10\x8c\x24",	/* movsd N(%rsp), %xmm1 */
+	"\xf2\x0f\x10\x94\x24",	/* movsd N(%rsp), %xmm2 */
+	"\xf2\x0f\x10\x9c\x24",	/* movsd N(%rsp), %xmm3 */
+	"\xf2\x0f\x10\xa4\x24",	/* movsd N(%rsp), %xmm4 */
+	"\xf2\x0f\x10\xac\x24",	/* movsd N(%rsp), %xmm5 */
+	"\xf2\x0f\x10\xb4\x24",	/* movsd N(%rsp), %xmm6 */
+	"\xf2\x0f\x10\xbc\x24",	/* movsd N(%rsp), %xmm7 */
+};
+
+/* whether input idx is passed on the machine stack */
+static int input_on_stack(const struct FuncType *ft, size_t idx)
+{
+	size_t i, n_movs = 0, n_xmm_movs = 0;
+
+	for (i = 0; i <= idx; ++i) {
+		if ((ft->input_types[i] == VALTYPE_I32 ||
+		     ft->input_types[i] == VALTYPE_I64) &&
+		    n_movs < 6) {
+			if (i == idx)
+				return 0;
+			n_movs += 1;
+		} else if ((ft->input_types[i] == VALTYPE_F32 ||
+			    ft->input_types[i] == VALTYPE_F64) &&
+			   n_xmm_movs < 8) {
+			if (i == idx)
+				return 0;
+			n_xmm_movs += 1;
+		}
+	}
+
+	return 1;
+}
+
+static size_t n_stack_args(const struct FuncType *ft)
+{
+	size_t i, n_stack = 0;
+
+	for (i = 0; i < ft->n_inputs; ++i) {
+		if (input_on_stack(ft, i))
+			n_stack += 1;
+	}
+
+	return n_stack;
+}
+
+/*
+  A tail call reuses the current frame. Callers always reserve an even
+  number of slots for stack arguments, so the return address is moved
+  by the difference in reserved slots, keeping the top of the argument
+  area fixed. Callers restore %rsp from %rbp after a call so this is
+  safe.
+ */
+static int tail_call_frame_delta(const struct FuncType *type,
+				 const struct FuncType *ft)
+{
+	size_t n_cur_stack = n_stack_args(type), n_stack = n_stack_args(ft);
+
+	return (int) (n_stack + n_stack % 2) - (int) (n_cur_stack + n_cur_stack % 2);
+}
+
+/* max extra slots used below the operand stack by a tail call */
+static size_t tail_call_scratch(const struct FuncType *type,
+				const struct FuncType *ft)
+{
+	size_t n = ft->n_inputs + 2;
+
+	if (tail_call_frame_delta(type, ft))
+		n += n_stack_args(ft) + 2;
+
+	return n;
+}
+
+/* br_table with at most this many runs of equal targets becomes a compare tree */
+#define WASMJIT_BR_TABLE_MAX_TREE_RUNS 8
+
+struct BrTableJumps {
+	size_t n_elts;
+	struct BrTableJump {
+		size_t rel_offset;
+		size_t pad;
+	} *elts;
+};
+
+static DEFINE_VECTOR_GROW(br_table_jumps, struct BrTableJumps);
+
+struct BrTableRun {
+	uint32_t start;
+	size_t pad;
+};
+
+/* jmp|jcc rel32 to a landing pad, fixed up once the pads are emitted */
+static int emit_pad_jump(struct SizedBuffer *output,
+			 struct BrTableJumps *jumps,
+			 const char *op,
+			 size_t pad)
+{
+	char buf[sizeof(uint32_t)];
+	size_t jump_idx;
+
+	OUTS(op);
+	OUTNULL(sizeof(uint32_t));
+
+	jump_idx = jumps->n_elts;
+	if (!br_table_jumps_grow(jumps, 1))
+		goto error;
+	jumps->elts[jump_idx].rel_offset = output->n_elts - sizeof(uint32_t);
+	jumps->elts[jump_idx].pad = pad;
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+/* binary search on %eax over runs [lo, hi) */
+static int emit_br_table_tree(struct SizedBuffer *output,
+			      struct BrTableJumps *jumps,
+			      const struct BrTableRun *runs,
+			      size_t lo, size_t hi)
+{
+	char buf[sizeof(uint32_t)];
+	size_t mid, jae_offset;
+
+	assert(hi > lo);
+	if (hi - lo == 1) {
+		/* jmp PAD */
+		return emit_pad_jump(output, jumps, "\xe9", runs[lo].pad);
+	}
+
+	mid = lo + (hi - lo) / 2;
+
+	/* cmp $start, %eax */
+	OUTS("\x3d");
+	encode_le_uint32_t(runs[mid].start, buf);
+	if (!output_buf(output, buf, sizeof(uint32_t)))
+		goto error;
+
+	/* jae RIGHT */
+	OUTS("\x0f\x83");
+	OUTNULL(sizeof(uint32_t));
+	jae_offset = output->n_elts;
+
+	if (!emit_br_table_tree(output, jumps, runs, lo, mid))
+		goto error;
+
+	/* RIGHT: */
+	encode_le_uint32_t(output->n_elts - jae_offset,
+			   &output->elts[jae_offset - sizeof(uint32_t)]);
+	if (!emit_br_table_tree(output, jumps, runs, mid, hi))
+		goto error;
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+/*
+ * The index is in %eax. Every distinct target label gets a single
+ * landing pad with its emit_br_code() body. Tables with only a few
+ * runs of equal targets dispatch through a compare tree, otherwise
+ * through a table of 1, 2 or 4 byte backward distances from the table
+ * (placed after the pads) to the pad. A profiled hot index (or
+ * n_labelidxs for the default) is checked before either.
+ */
+static int emit_br_table(struct SizedBuffer *output,
+			 struct StaticStack *sstack,
+			 struct BranchPoints *branches,
+			 const struct Instr *instruction,
+			 uint32_t hot,
+			 unsigned flags)
+{
+	char buf[sizeof(uint32_t)];
+	const uint32_t *labelidxs = instruction->data.br_table.labelidxs;
+	uint32_t n_labelidxs = instruction->data.br_table.n_labelidxs;
+	size_t *label_pads = NULL, *pad_offsets = NULL;
+	uint32_t *pad_labels = NULL;
+	struct BrTableRun *runs = NULL;
+	struct BrTableJumps jumps = { 0, NULL };
+	size_t n_labels = 0, n_pads = 0, n_runs, default_pad, i;
+	size_t lea_offset = 0, load_offset = 0;
+	int ret;
+
+	for (i = 0; i < sstack->n_elts; ++i) {
+		if (sstack->elts[i].type == STACK_LABEL)
+			n_labels += 1;
+	}
+
+	label_pads = malloc(n_labels * sizeof(label_pads[0]));
+	pad_labels = malloc(n_labels * sizeof(pad_labels[0]));
+	pad_offsets = malloc(n_labels * sizeof(pad_offsets[0]));
+	if (!label_pads || !pad_labels || !pad_offsets)
+		goto error;
+
+	for (i = 0; i < n_labels; ++i)
+		label_pads[i] = SIZE_MAX;
+
+	/* assign pads in order of first use */
+	for (i = 0; i <= n_labelidxs; ++i) {
+		uint32_t labelidx = i < n_labelidxs
+			? labelidxs[i]
+			: instruction->data.br_table.labelidx;
+		if (labelidx >= n_labels)
+			goto error;
+		if (label_pads[labelidx] == SIZE_MAX) {
+			pad_labels[n_pads] = labelidx;
+			label_pads[labelidx] = n_pads;
+			n_pads += 1;
+		}
+	}
+	default_pad = label_pads[instruction->data.br_table.labelidx];
+
+	n_runs = 1;
+	for (i = 1; i <= n_labelidxs; ++i) {
+		size_t prev = label_pads[labelidxs[i - 1]];
+		size_t cur = i < n_labelidxs ? label_pads[labelidxs[i]] : default_pad;
+		if (cur != prev)
+			n_runs += 1;
+	}
+
+	if (hot < n_labelidxs) {
+		/* cmp $hot, %eax */
+		OUTS("\x3d");
+		encode_le_uint32_t(hot, buf);
+		if (!output_buf(output, buf, sizeof(uint32_t)))
+			goto error;
+
+		/* je HOT_PAD */
+		if (!emit_pad_jump(output, &jumps, "\x0f\x84",
+				   label_pads[labelidxs[hot]]))
+			goto error;
+	} else if (hot == n_labelidxs) {
+		/* cmp $n_labelidxs, %eax */
+		OUTS("\x3d");
+		encode_le_uint32_t(n_labelidxs, buf);
+		if (!output_buf(output, buf, sizeof(uint32_t)))
+			goto error;
+
+		/* jae DEFAULT_PAD */
+		if (!emit_pad_jump(output, &jumps, "\x0f\x83", default_pad))
+			goto error;
+	}
+
+	if (n_runs <= WASMJIT_BR_TABLE_MAX_TREE_RUNS) {
+		size_t run = 0;
+
+		runs = calloc(n_runs, sizeof(runs[0]));
+		if (!runs)
+			goto error;
+
+		for (i = 0; i <= n_labelidxs; ++i) {
+			size_t cur = i < n_labelidxs ? label_pads[labelidxs[i]] : default_pad;
+			if (i && cur == runs[run - 1].pad)
+				continue;
+			runs[run].start = i;
+			runs[run].pad = cur;
+			run += 1;
+		}
+		assert(run == n_runs);
+
+		if (!emit_br_table_tree(output, &jumps, runs, 0, n_runs))
+			goto error;
+	} else {
+		/* cmp $n_labelidxs, %eax */
+		OUTS("\x3d");
+		encode_le_uint32_t(n_labelidxs, buf);
+		if (!output_buf(output, buf, sizeof(uint32_t)))
+			goto error;
+
+		/* jae DEFAULT_PAD */
+		if (!emit_pad_jump(output, &jumps, "\x0f\x83", default_pad))
+			goto error;
+
+		/* NB: BCB mitigation */
+		/* sbb %ecx, %ecx */
+		OUTS("\x19\xc9");
+		/* and %ecx, %eax */
+		OUTS("\x21\xc8");
+
+		/* lea TABLE(%rip), %rdx */
+		OUTS("\x48\x8d\x15");
+		OUTNULL(sizeof(uint32_t));
+		lea_offset = output->n_elts;
+
+		/* movz(b|w)l|movl (%rdx, %rax, width), %eax */
+		load_offset = output->n_elts;
+		OUTS("\x90\x90\x90\x90");
+
+		/* neg %rax */
+		OUTS("\x48\xf7\xd8");
+		/* add %rdx, %rax */
+		OUTS("\x48\x01\xd0");
+
+		if (!emit_indirect_jump(output, flags))
+			goto error;
+	}
+
+	for (i = 0; i < n_pads; ++i) {
+		pad_offsets[i] = output->n_elts;
+		if (!emit_br_code(output, sstack, branches, pad_labels[i]))
+			goto error;
+	}
+
+	for (i = 0; i < jumps.n_elts; ++i) {
+		struct BrTableJump *jump = &jumps.elts[i];
+		encode_le_uint32_t(pad_offsets[jump->pad] - jump->rel_offset -
+				   sizeof(uint32_t),
+				   &output->elts[jump->rel_offset]);
+	}
+
+	if (!runs) {
+		size_t table_offset = output->n_elts;
+		/* the first pad is the furthest from the table */
+		size_t max_distance = table_offset - pad_offsets[0];
+		size_t width;
+
+		if (max_distance <= UINT8_MAX) {
+			width = 1;
+			/* movzbl (%rdx, %rax, 1), %eax */
+			memcpy(&output->elts[load_offset], "\x0f\xb6\x04\x02", 4);
+		} else if (max_distance <= UINT16_MAX) {
+			width = 2;
+			/* movzwl (%rdx, %rax, 2), %eax */
+			memcpy(&output->elts[load_offset], "\x0f\xb7\x04\x42", 4);
+		} else if (max_distance <= UINT32_MAX) {
+			width = 4;
+			/* movl (%rdx, %rax, 4), %eax; nop */
+			memcpy(&output->elts[load_offset], "\x8b\x04\x82\x90", 4);
+		} else {
+			goto error;
+		}
+
+		encode_le_uint32_t(table_offset - lea_offset,
+				   &output->elts[lea_offset - sizeof(uint32_t)]);
+
+		for (i = 0; i < n_labelidxs; ++i) {
+			size_t pad = label_pads[labelidxs[i]];
+			encode_le_uint32_t(table_offset - pad_offsets[pad], buf);
+			if (!output_buf(output, buf, width))
+				goto error;
+		}
+	}
+
+	if (0) {
+	error:
+		ret = 0;
+	} else {
+		ret = 1;
+	}
+
+	free(jumps.elts);
+	free(runs);
+	free(pad_offsets);
+	free(pad_labels);
+	free(label_pads);
+
+	return ret;
+}
+
+static unsigned memory_strategy(const struct ModuleTypes *module_types,
+				uint32_t memidx)
+{
+	return module_types->memory_strategies
+		? module_types->memory_strategies[memidx]
+		: MEMORY_STRATEGY_RELOAD;
+}
+
+static int emit_memref(struct MemoryReferences *memrefs, size_t code_offset,
+		       int type, uint32_t idx)
+{
+	size_t memref_idx;
+
+	memref_idx = memrefs->n_elts;
+	if (!memrefs_grow(memrefs, 1))
+		return 0;
+	memrefs->elts[memref_idx].type = type;
+	memrefs->elts[memref_idx].code_offset = code_offset;
+	memrefs->elts[memref_idx].idx = idx;
+
+	return 1;
+}
+
+/*
+ * cmp <bound of memory memidx>, %rsi. Only the flags are meaningful
+ * afterwards, clobbers %rax.
+ */
+static int emit_memory_bound_cmp(struct SizedBuffer *output,
+				 struct MemoryReferences *memrefs,
+				 const struct ModuleTypes *module_types,
+				 uint32_t memidx)
+{
+	char buf[sizeof(uint64_t)];
+	uint64_t bound;
+
+	if (memidx >= module_types->n_mems)
+		goto error;
+
+	if (memory_strategy(module_types, memidx) == MEMORY_STRATEGY_FIXED) {
+		bound = (uint64_t) module_types->memorytypes[memidx].limits.min *
+			WASM_PAGE_SIZE;
+		if (bound < 0x80000000) {
+			/* cmp $bound, %rsi */
+			OUTS("\x48\x81\xfe");
+			encode_le_uint32_t(bound, buf);
+			if (!output_buf(output, buf, sizeof(uint32_t)))
+				goto error;
+		} else {
+			/* movq $bound, %rax */
+			if (!emit_mov_imm(output, 1, 0, bound))
+				goto error;
+
+			/* cmp %rax, %rsi */
+			OUTS("\x48\x39\xc6");
+		}
+		return 1;
+	}
+
+	/* movq $const, %rax */
+	OUTS("\x48\xb8");
+	OUTNULL(8);
+	if (!emit_memref(memrefs, output->n_elts - 8, MEMREF_MEM, memidx))
+		goto error;
+
+	/* cmp size_offset(%rax), %rsi */
+	OUTS("\x48\x3b\x70");
+	OUTB(offsetof(struct MemInst, size));
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+/* base of memory memidx into %rax, leaves the flags alone */
+static int emit_memory_base(struct SizedBuffer *output,
+			    struct MemoryReferences *memrefs,
+			    const struct ModuleTypes *module_types,
+			    uint32_t memidx)
+{
+	char buf[sizeof(uint64_t)];
+
+	assert(memidx < module_types->n_mems);
+
+	/* movq $const, %rax */
+	OUTS("\x48\xb8");
+	OUTNULL(8);
+
+	if (memory_strategy(module_types, memidx) != MEMORY_STRATEGY_RELOAD)
+		return emit_memref(memrefs, output->n_elts - 8,
+				   MEMREF_MEM_DATA, memidx);
+
+	if (!emit_memref(memrefs, output->n_elts - 8, MEMREF_MEM, memidx))
+		goto error;
+
+	/* mov data_off(%rax), %rax */
+	OUTS("\x48\x8b\x40");
+	OUTB(offsetof(struct MemInst, data));
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+/*
+ * Threads proposal atomics. Accesses are bounds checked like plain
+ * ones and trap unless naturally aligned. Loads are plain movs and
+ * everything else is xchg or lock prefixed, which is all x86 needs for
+ * sequentially consistent accesses. Leaves the host address in %rsi,
+ * clobbers %rax.
+ */
+static int emit_atomic_address(struct SizedBuffer *output,
+			       struct TrapPoints *traps,
+			       struct MemoryReferences *memrefs,
+			       const struct ModuleTypes *module_types,
+			       unsigned mem_size,
+			       const struct AtomicExtra *extra)
+{
+	char buf[sizeof(uint64_t)];
+	uint32_t real_offset;
+
+	/* LOGIC: ea += memarg.offset + mem_size - 1 */
+	if (__builtin_add_overflow(mem_size - 1, extra->offset, &real_offset))
+		goto error;
+
+	if (real_offset) {
+		/* can't encode this into the following instruction */
+		if (real_offset >= 0x80000000)
+			goto error;
+
+		/* add <VAL>, %rsi */
+		OUTS("\x48\x81\xc6");
+		encode_le_uint32_t(real_offset, buf);
+		if (!output_buf(output, buf, sizeof(uint32_t)))
+			goto error;
+	}
+
+	if (!emit_memory_bound_cmp(output, memrefs, module_types,
+				   extra->memidx))
+		goto error;
+
+	/* jae MEMORY_OVERFLOW */
+	if (!emit_cold_trap_jcc(output, traps, "\x0f\x83",
+				WASMJIT_TRAP_MEMORY_OVERFLOW))
+		goto error;
+
+	if (mem_size > 1) {
+		/* sub $mem_size - 1, %rsi */
+		OUTS("\x48\x83\xee");
+		OUTB(mem_size - 1);
+
+		/* test $mem_size - 1, %sil */
+		OUTS("\x40\xf6\xc6");
+		OUTB(mem_size - 1);
+
+		/* jnz UNALIGNED_ATOMIC */
+		if (!emit_cold_trap_jcc(output, traps, "\x0f\x85",
+					WASMJIT_TRAP_UNALIGNED_ATOMIC))
+			goto error;
+	}
+
+	if (!emit_memory_base(output, memrefs, module_types, extra->memidx))
+		goto error;
+
+	/* add %rax, %rsi */
+	OUTS("\x48\x01\xc6");
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+/* zero extending load of (%rsi) into %rax */
+static int emit_atomic_load(struct SizedBuffer *output, unsigned mem_size)
+{
+	switch (mem_size) {
+	case 1:
+		/* movzbl (%rsi), %eax */
+		OUTS("\x0f\xb6\x06");
+		break;
+	case 2:
+		/* movzwl (%rsi), %eax */
+		OUTS("\x0f\xb7\x06");
+		break;
+	case 4:
+		/* mov (%rsi), %eax */
+		OUTS("\x8b\x06");
+		break;
+	case 8:
+		/* mov (%rsi), %rax */
+		OUTS("\x48\x8b\x06");
+		break;
+	default:
+		assert(0);
+		__builtin_unreachable();
+	}
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+/* xchg %(r|e)di/%di/%dil, (%rsi) */
+static int emit_atomic_xchg(struct SizedBuffer *output, unsigned mem_size)
+{
+	switch (mem_size) {
+	case 1:
+		OUTS("\x40\x86\x3e");
+		break;
+	case 2:
+		OUTS("\x66\x87\x3e");
+		break;
+	case 4:
+		OUTS("\x87\x3e");
+		break;
+	case 8:
+		OUTS("\x48\x87\x3e");
+		break;
+	default:
+		assert(0);
+		__builtin_unreachable();
+	}
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+/* lock cmpxchg %(r|e)cx/%cx/%cl, (%rsi) */
+static int emit_atomic_cmpxchg(struct SizedBuffer *output, unsigned mem_size)
+{
+	switch (mem_size) {
+	case 1:
+		OUTS("\xf0\x0f\xb0\x0e");
+		break;
+	case 2:
+		OUTS("\x66\xf0\x0f\xb1\x0e");
+		break;
+	case 4:
+		OUTS("\xf0\x0f\xb1\x0e");
+		break;
+	case 8:
+		OUTS("\xf0\x48\x0f\xb1\x0e");
+		break;
+	default:
+		assert(0);
+		__builtin_unreachable();
+	}
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+/* zero extends the low mem_size bytes of %rdi into %rax */
+static int emit_atomic_result(struct SizedBuffer *output, unsigned mem_size)
+{
+	switch (mem_size) {
+	case 1:
+		/* movzbl %dil, %eax */
+		OUTS("\x40\x0f\xb6\xc7");
+		break;
+	case 2:
+		/* movzwl %di, %eax */
+		OUTS("\x0f\xb7\xc7");
+		break;
+	case 4:
+		/* mov %edi, %eax */
+		OUTS("\x89\xf8");
+		break;
+	case 8:
+		/* mov %rdi, %rax */
+		OUTS("\x48\x89\xf8");
+		break;
+	default:
+		assert(0);
+		__builtin_unreachable();
+	}
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+static int emit_atomic(struct SizedBuffer *output,
+		       struct TrapPoints *traps,
+		       struct MemoryReferences *memrefs,
+		       const struct ModuleTypes *module_types,
+		       size_t n_frame_locals,
+		       struct StaticStack *sstack,
+		       const struct AtomicExtra *extra,
+		       unsigned flags)
+{
+	char buf[sizeof(uint64_t)];
+	unsigned mem_size, group, valtype, helper;
+	size_t memref_idx, cur_stack_depth;
+
+	mem_size = wasmjit_atomic_access_size(extra->opcode);
+
+	if (extra->opcode != ATOMIC_OPCODE_FENCE &&
+	    extra->memidx >= module_types->n_mems)
+		goto error;
+
+	switch (extra->opcode) {
+	case ATOMIC_OPCODE_FENCE:
+		/* mfence */
+		OUTS("\x0f\xae\xf0");
+		return 1;
+	case ATOMIC_OPCODE_NOTIFY:
+		assert(peek_stack(sstack) == STACK_I32);
+		if (!pop_stack(sstack))
+			goto error;
+		assert(peek_stack(sstack) == STACK_I32);
+		if (!pop_stack(sstack))
+			goto error;
+
+		/* pop %rcx */
+		OUTS("\x59");
+		/* pop %rsi */
+		OUTS("\x5e");
+
+		if (!emit_atomic_address(output, traps, memrefs, module_types,
+					 mem_size, extra))
+			goto error;
+
+		/* mov %rsi, %rdi */
+		OUTS("\x48\x89\xf7");
+		/* mov %ecx, %esi */
+		OUTS("\x89\xce");
+
+		helper = MEMREF_ATOMIC_NOTIFY;
+		goto call;
+	case ATOMIC_OPCODE_I32_WAIT:
+	case ATOMIC_OPCODE_I64_WAIT:
+		assert(peek_stack(sstack) == STACK_I64);
+		if (!pop_stack(sstack))
+			goto error;
+		assert(peek_stack(sstack) ==
+		       (extra->opcode == ATOMIC_OPCODE_I64_WAIT
+			? STACK_I64 : STACK_I32));
+		if (!pop_stack(sstack))
+			goto error;
+		assert(peek_stack(sstack) == STACK_I32);
+		if (!pop_stack(sstack))
+			goto error;
+
+		/* known at compile time, nothing after this runs */
+		if (!module_types->memorytypes[extra->memidx].limits.shared) {
+			if (!emit_trap(output, memrefs, flags,
+				       WASMJIT_TRAP_WAIT_ON_UNSHARED_MEMORY))
+				goto error;
+			if (!push_stack(sstack, STACK_I32))
+				goto error;
+			return 1;
+		}
+
+		/* pop %rdx */
+		OUTS("\x5a");
+		/* pop %rcx */
+		OUTS("\x59");
+		/* pop %rsi */
+		OUTS("\x5e");
+
+		if (!emit_atomic_address(output, traps, memrefs, module_types,
+					 mem_size, extra))
+			goto error;
+
+		/* mov %rsi, %rdi */
+		OUTS("\x48\x89\xf7");
+		/* mov %rcx, %rsi */
+		OUTS("\x48\x89\xce");
+
+		helper = extra->opcode == ATOMIC_OPCODE_I64_WAIT
+			? MEMREF_ATOMIC_WAIT64 : MEMREF_ATOMIC_WAIT32;
+		goto call;
+	default:
+		break;
+	}
+
+	assert(mem_size);
+	group = ATOMIC_OPCODE_GROUP(extra->opcode);
+	switch (ATOMIC_OPCODE_SHAPE(extra->opcode)) {
+	case 0:
+	case 2:
+	case 3:
+		valtype = STACK_I32;
+		break;
+	default:
+		valtype = STACK_I64;
+		break;
+	}
+
+	/* LOGIC: operands go to %rcx (cmpxchg replacement), %rdi and %rsi */
+	switch (group) {
+	case 0:
+		break;
+	case 8:
+		assert(peek_stack(sstack) == valtype);
+		if (!pop_stack(sstack))
+			goto error;
+		/* pop %rcx */
+		OUTS("\x59");
+		/* fall through */
+	default:
+		assert(peek_stack(sstack) == valtype);
+		if (!pop_stack(sstack))
+			goto error;
+		/* pop %rdi */
+		OUTS("\x5f");
+		break;
+	}
+
+	assert(peek_stack(sstack) == STACK_I32);
+	if (!pop_stack(sstack))
+		goto error;
+	/* pop %rsi */
+	OUTS("\x5e");
+
+	if (!emit_atomic_address(output, traps, memrefs, module_types,
+				 mem_size, extra))
+		goto error;
+
+	switch (group) {
+	case 0:
+		/* load */
+		if (!emit_atomic_load(output, mem_size))
+			goto error;
+		break;
+	case 1:
+		/* store, xchg rather than mov so it's a full barrier */
+		if (!emit_atomic_xchg(output, mem_size))
+			goto error;
+		return 1;
+	case 2:
+	case 3:
+		/* add and sub */
+		if (group == 3)
+			/* neg %rdi */
+			OUTS("\x48\xf7\xdf");
+
+		/* lock xadd %(r|e)di/%di/%dil, (%rsi) */
+		switch (mem_size) {
+		case 1: OUTS("\xf0\x40\x0f\xc0\x3e"); break;
+		case 2: OUTS("\x66\xf0\x0f\xc1\x3e"); break;
+		case 4: OUTS("\xf0\x0f\xc1\x3e"); break;
+		case 8: OUTS("\xf0\x48\x0f\xc1\x3e"); break;
+		default: assert(0); __builtin_unreachable(); break;
+		}
+
+		if (!emit_atomic_result(output, mem_size))
+			goto error;
+		break;
+	case 4:
+	case 5:
+	case 6: {
+		/* and, or and xor have no fetching form, loop on cmpxchg */
+		size_t loop_offset;
+
+		if (!emit_atomic_load(output, mem_size))
+			goto error;
+
+		loop_offset = output->n_elts;
+
+		/* mov %rax, %rcx */
+		OUTS("\x48\x89\xc1");
+
+		switch (group) {
+		case 4:
+			/* and %rdi, %rcx */
+			OUTS("\x48\x21\xf9");
+			break;
+		case 5:
+			/* or %rdi, %rcx */
+			OUTS("\x48\x09\xf9");
+			break;
+		case 6:
+			/* xor %rdi, %rcx */
+			OUTS("\x48\x31\xf9");
+			break;
+		}
+
+		/* a failed cmpxchg leaves the current value in %rax */
+		if (!emit_atomic_cmpxchg(output, mem_size))
+			goto error;
+
+		/* jne loop */
+		OUTS("\x75");
+		OUTB((intmax_t) loop_offset - (intmax_t) (output->n_elts + 1));
+		break;
+	}
+	case 7:
+		/* xchg */
+		if (!emit_atomic_xchg(output, mem_size))
+			goto error;
+		if (!emit_atomic_result(output, mem_size))
+			goto error;
+		break;
+	case 8: {
+		/* cmpxchg */
+		size_t jz_offset = 0, jmp_offset = 0;
+
+		/* mov %rdi, %rax */
+		OUTS("\x48\x89\xf8");
+
+		/* an expected value wider than the access never matches
+		   the zero extended load, so only load */
+		if (mem_size < (valtype == STACK_I64 ? 8U : 4U)) {
+			/* shr $bits, %(r|e)di */
+			if (valtype == STACK_I64)
+				OUTS("\x48");
+			OUTS("\xc1\xef");
+			OUTB(mem_size * 8);
+
+			/* jz CMPXCHG */
+			OUTS("\x74");
+			OUTB(0);
+			jz_offset = output->n_elts;
+
+			if (!emit_atomic_load(output, mem_size))
+				goto error;
+
+			/* jmp DONE */
+			OUTS("\xeb");
+			OUTB(0);
+			jmp_offset = output->n_elts;
+
+			output->elts[jz_offset - 1] = output->n_elts - jz_offset;
+		}
+
+		if (!emit_atomic_cmpxchg(output, mem_size))
+			goto error;
+
+		switch (mem_size) {
+		case 1:
+			/* movzbl %al, %eax */
+			OUTS("\x0f\xb6\xc0");
+			break;
+		case 2:
+			/* movzwl %ax, %eax */
+			OUTS("\x0f\xb7\xc0");
+			break;
+		case 4:
+			/* mov %eax, %eax */
+			OUTS("\x89\xc0");
+			break;
+		}
+
+		if (jmp_offset)
+			output->elts[jmp_offset - 1] = output->n_elts - jmp_offset;
+		break;
+	}
+	default:
+		assert(0);
+		__builtin_unreachable();
+	}
+
+	/* push %rax */
+	OUTS("\x50");
+	if (!push_stack(sstack, valtype))
+		goto error;
+
+	return 1;
+
+ call:
+	cur_stack_depth = n_frame_locals + stack_depth(sstack);
+
+	/* mov $const, %rax */
+	OUTS("\x48\xb8");
+	OUTNULL(8);
+	memref_idx = memrefs->n_elts;
+	if (!memrefs_grow(memrefs, 1))
+		goto error;
+	memrefs->elts[memref_idx].type = helper;
+	memrefs->elts[memref_idx].code_offset = output->n_elts - 8;
+
+	/* align to 16 bytes */
+	if (cur_stack_depth % 2)
+		/* sub $8, %rsp */
+		OUTS("\x48\x83\xec\x08");
+
+	if (!emit_indirect_call(output, flags))
+		goto error;
+
+	if (cur_stack_depth % 2)
+		/* add $8, %rsp */
+		OUTS("\x48\x83\xc4\x08");
+
+	/* push %rax */
+	OUTS("\x50");
+	if (!push_stack(sstack, STACK_I32))
+		goto error;
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+static int wasmjit_compile_instruction(const struct FuncType *func_types,
+				       const struct ModuleTypes *module_types,
+				       const struct FuncType *type,
+				       struct SizedBuffer *output,
+				       struct BranchPoints *branches,
+				       struct TrapPoints *traps,
+				       struct ProfileMD *profile,
+				       struct MemoryReferences *memrefs,
+				       struct LocalsMD *locals_md,
+				       size_t n_locals,
+				       size_t n_frame_locals,
+				       struct StaticStack *sstack,
+				       const struct Instr *instruction,
+				       size_t run,
+				       int check_stack,
+				       unsigned flags)
+{
+	char buf[sizeof(uint64_t)];
+
+	switch (instruction->opcode) {
+	case OPCODE_UNREACHABLE:
+		if (!emit_trap(output, memrefs, flags, WASMJIT_TRAP_UNREACHABLE))
+			goto error;
+		break;
+	case OPCODE_NOP:
+		break;
+	case OPCODE_BLOCK:
+	case OPCODE_LOOP: {
+		/* handled by wasmjit_compile_instructions */
+		assert(0);
+		break;
+	}
+	case OPCODE_IF: {
+		/* handled by wasmjit_compile_instructions */
+		assert(0);
+		break;
+	}
+	case OPCODE_BR_IF:
+	case OPCODE_BR: {
+		size_t je_offset, offset;
+		const struct BrIfExtra *extra;
+		const uint64_t *counts;
+
+		if (instruction->opcode == OPCODE_BR_IF) {
+			/* LOGIC: v = pop_stack() */
+
+			/* pop %rsi */
+			assert(peek_stack(sstack) == STACK_I32);
+			if (!pop_stack(sstack))
+				goto error;
+			OUTS("\x5e");
+
+			offset = profile_site(profile, instruction);
+			if (profile->record &&
+			    !emit_profile_cond(output, memrefs, offset,
+					       "\x85\xf6"))
+				goto error;
+
+			/* LOGIC: if (v) br(); */
+
+			/* testl %esi, %esi */
+			OUTS("\x85\xf6");
+
+			/* rarely taken, move the br code out of line */
+			counts = site_profile(profile, offset);
+			if (counts && counts[1] * 16 <= counts[0]) {
+				struct ColdBlock *block;
+
+				block = emit_cold_jump(output, profile, sstack);
+				if (!block)
+					goto error;
+				block->br = instruction;
+				break;
+			}
+
+			/* je AFTER_BR */
+			je_offset = output->n_elts;
+			OUTS("\x74\x01");
+
+			extra = &instruction->data.br_if;
+		}
+		else {
+			extra = &instruction->data.br;;
+			/* appease gcc */
+			je_offset = 0;
+		}
+
+		if (!emit_br_code(output, sstack, branches, extra->labelidx))
+			goto error;
+
+		if (instruction->opcode == OPCODE_BR_IF) {
+			/* update je operand in previous if block */
+			int ret;
+			size_t offset =
+				output->n_elts - je_offset - 2;
+			assert(offset < 128 && offset > 0);
+			assert(sizeof(buf) >= 2);
+			ret =
+				snprintf(buf, sizeof(buf), "\x74%c",
+					 (int)offset);
+			if (ret < 0)
+				goto error;
+			assert(strlen(buf) == 2);
+			memcpy(&output->elts[je_offset], buf,
+			       2);
+		}
+
+		break;
+	}
+	case OPCODE_BR_TABLE: {
+		uint32_t n_labelidxs = instruction->data.br_table.n_labelidxs;
+		uint32_t hot = UINT32_MAX;
+		size_t offset;
+
+		/* jump to the right code based on the input value */
+
+		/* pop %rax */
+		OUTS("\x58");
+		if (!pop_stack(sstack))
+			goto error;
+
+		offset = profile_site(profile, instruction);
+		if (profile->record &&
+		    !emit_profile_br_table(output, memrefs, offset, n_labelidxs))
+			goto error;
+
+		/* check an index taken at least half the time first */
+		if (profile->counters) {
+			const uint64_t *counts = &profile->counters[offset];
+			uint64_t total = 0;
+			uint32_t i;
+
+			for (i = 0; i <= n_labelidxs; ++i) {
+				total += counts[i];
+				if (hot == UINT32_MAX || counts[i] > counts[hot])
+					hot = i;
+			}
+
+			if (total < WASMJIT_PGO_MIN_COUNT ||
+			    counts[hot] * 2 < total)
+				hot = UINT32_MAX;
+		}
+
+		if (!emit_br_table(output, sstack, branches, instruction,
+				   hot, flags))
+			goto error;
+
+		break;
+	}
+	case OPCODE_RETURN:
+		/* shift $arity values from top of stock to below */
+
+		if (FUNC_TYPE_N_OUTPUTS(type)) {
+			int32_t out, extra = 0;
+
+			/* lea (arity - 1)*8(%rsp), %rsi */
+			OUTS("\x48\x8d\x74\x24");
+			OUTB(((intmax_t) (FUNC_TYPE_N_OUTPUTS(type) - 1)) * 8);
+
+			/* lea (-8 * (n_frame_locals + 1))(%rbp), %rdi */
+			OUTS("\x48\x8d\xbd");
+
+			if (WASMJIT_DEBUG_STACK) {
+				if (n_frame_locals >= SIZE_MAX - 1)
+					goto error;
+				extra = 1;
+			} else {
+				if (n_frame_locals == SIZE_MAX)
+					goto error;
+			}
+
+			if (__builtin_mul_overflow(n_frame_locals + 1 + extra, -8, &out))
+				goto error;
+			encode_le_uint32_t(out, buf);
+			if (!output_buf(output, buf, sizeof(uint32_t)))
+				goto error;
+
+			/* mov $arity, %rcx */
+			OUTS("\x48\xc7\xc1");
+			encode_le_uint32_t(FUNC_TYPE_N_OUTPUTS(type), buf);
+			if (!output_buf(output, buf, sizeof(uint32_t)))
+				goto error;
+
+			/* std */
+			OUTS("\xfd");
 
 			/* rep movsq */
 			OUTS("\x48\xa5");
 
-			/* cld */
-			OUTS("\xfc");
+			/* cld */
+			OUTS("\xfc");
+		}
+
+		/* adjust stack to top of arity */
+		/* lea (arity + n_frame_locals)*-8(%rbp), %rsp */
+		OUTS("\x48\x8d\xa5");
+		if (n_frame_locals > SIZE_MAX - FUNC_TYPE_N_OUTPUTS(type))
+			goto error;
+		{
+			int32_t out, extra = 0;
+			if (WASMJIT_DEBUG_STACK) {
+				extra = 1;
+			}
+			if (__builtin_mul_overflow(n_frame_locals + FUNC_TYPE_N_OUTPUTS(type) + extra, -8, &out))
+				goto error;
+			encode_le_uint32_t(out, buf);
+			if (!output_buf(output, buf, sizeof(uint32_t)))
+				goto error;
+		}
+
+		/* jmp <EPILOGUE> */
+		{
+			size_t branch_idx;
+
+			branch_idx = branches->n_elts;
+			if (!bp_grow(branches, 1))
+				goto error;
+
+			branches->elts[branch_idx].branch_offset =
+				output->n_elts;
+			branches->elts[branch_idx].continuation_idx =
+				FUNC_EXIT_CONT;
+
+			OUTS("\xe9\x90\x90\x90\x90");
+		}
+
+		break;
+	case OPCODE_CALL:
+	case OPCODE_CALL_INDIRECT: {
+		size_t i;
+		size_t n_movs, n_xmm_movs, n_stack;
+		int aligned = 0;
+		const struct FuncType *ft;
+		size_t cur_stack_depth = n_frame_locals;
+
+		/* add current stack depth */
+		cur_stack_depth += stack_depth(sstack);
+
+		if (instruction->opcode == OPCODE_CALL_INDIRECT) {
+			size_t offset, je_offset = 0;
+			const uint64_t *counts;
+			uint64_t guess = UINT64_MAX;
+
+			ft = &func_types[instruction->data.call_indirect.typeidx];
+
+			/* call a target that was hit 90% of the time
+			   without going through the runtime */
+			offset = profile_site(profile, instruction);
+			counts = site_profile(profile, offset);
+			if (counts && counts[2] * 10 >= counts[0] * 8 &&
+			    counts[1] < module_types->n_funcs &&
+			    functype_equal(ft, &module_types->functypes[counts[1]]))
+				guess = counts[1];
+
+			assert(peek_stack(sstack) == STACK_I32);
+			if (!pop_stack(sstack))
+				goto error;
+			cur_stack_depth -= 1;
+
+			/* mov $const, %rdi */
+			OUTS("\x48\xbf");
+			OUTNULL(8);
+			{
+				size_t memref_idx;
+				memref_idx = memrefs->n_elts;
+				if (!memrefs_grow(memrefs, 1))
+					goto error;
+
+				memrefs->elts[memref_idx].type =
+					MEMREF_TABLE;
+				memrefs->elts[memref_idx].code_offset =
+					output->n_elts - 8;
+				memrefs->elts[memref_idx].idx =
+					0;
+			}
+
+			/* mov $const, %rsi */
+			OUTS("\x48\xbe");
+			OUTNULL(8);
+			{
+				size_t memref_idx;
+				memref_idx = memrefs->n_elts;
+				if (!memrefs_grow(memrefs, 1))
+					goto error;
+
+				memrefs->elts[memref_idx].type =
+					MEMREF_TYPE;
+				memrefs->elts[memref_idx].code_offset =
+					output->n_elts - 8;
+				memrefs->elts[memref_idx].idx =
+					instruction->data.call_indirect.typeidx;
+			}
+
+			/* pop %rdx */
+			OUTS("\x5a");
+
+			if (guess != UINT64_MAX) {
+				size_t memref_idx;
+
+				/* mov %edx, %edx */
+				OUTS("\x89\xd2");
+
+				/* cmp length(%rdi), %rdx */
+				OUTS("\x48\x3b\x57");
+				OUTB(offsetof(struct TableInst, length));
+
+				/* jae RESOLVE */
+				OUTS("\x73\x1e");
+
+				/* NB: BCB mitigation */
+				/* sbb %rcx, %rcx */
+				OUTS("\x48\x19\xc9");
+				/* and %rcx, %rdx */
+				OUTS("\x48\x21\xca");
+
+				/* mov data(%rdi), %rcx */
+				OUTS("\x48\x8b\x4f");
+				OUTB(offsetof(struct TableInst, data));
+
+				/* mov $guess, %rax */
+				OUTS("\x48\xb8");
+				OUTNULL(8);
+				memref_idx = memrefs->n_elts;
+				if (!memrefs_grow(memrefs, 1))
+					goto error;
+				memrefs->elts[memref_idx].type = MEMREF_FUNC;
+				memrefs->elts[memref_idx].code_offset =
+					output->n_elts - 8;
+				memrefs->elts[memref_idx].idx = guess;
+
+				/* cmp (%rcx, %rdx, 8), %rax */
+				OUTS("\x48\x3b\x04\xd1");
+
+				/* je RESOLVED */
+				OUTS("\x0f\x84");
+				OUTNULL(4);
+				je_offset = output->n_elts;
+			}
+
+			/* RESOLVE: */
+
+			/* mov $const, %rax */
+			OUTS("\x48\xb8");
+			OUTNULL(8);
+			// address of _resolve_indirect_call
+			{
+				size_t memref_idx;
+				memref_idx = memrefs->n_elts;
+				if (!memrefs_grow(memrefs, 1))
+					goto error;
+
+				memrefs->elts[memref_idx].type =
+					MEMREF_RESOLVE_INDIRECT_CALL;
+				memrefs->elts[memref_idx].code_offset =
+					output->n_elts - 8;
+			}
+
+			/* align to 16 bytes */
+			if (cur_stack_depth % 2)
+				/* sub $8, %rsp */
+				OUTS("\x48\x83\xec\x08");
+
+			if (!emit_indirect_call(output, flags))
+				goto error;
+
+			if (cur_stack_depth % 2)
+				/* add $8, %rsp */
+				OUTS("\x48\x83\xc4\x08");
+
+			/* RESOLVED: */
+			if (je_offset)
+				encode_le_uint32_t(output->n_elts - je_offset,
+						   &output->elts[je_offset - 4]);
+
+			if (profile->record &&
+			    !emit_profile_call_indirect(output, memrefs, offset))
+				goto error;
+		} else {
+			uint32_t fidx =
+				instruction->data.call.funcidx;
+			ft = &module_types->functypes[fidx];
+
+			/* movq $const, %rax */
+			OUTS("\x48\xb8");
+			OUTNULL(8);
+			{
+				size_t memref_idx;
+
+				memref_idx = memrefs->n_elts;
+				if (!memrefs_grow(memrefs, 1))
+					goto error;
+
+				memrefs->elts[memref_idx].type =
+					MEMREF_FUNC;
+				memrefs->elts[memref_idx].code_offset =
+					output->n_elts - 8;
+				memrefs->elts[memref_idx].idx = fidx;
+			}
 		}
 
-		/* adjust stack to top of arity */
-		/* lea (arity + n_frame_locals)*-8(%rbp), %rsp */
-		OUTS("\x48\x8d\xa5");
-		if (n_frame_locals > SIZE_MAX - FUNC_TYPE_N_OUTPUTS(type))
-			goto error;
 		{
-			int32_t out, extra = 0;
-			if (WASMJIT_DEBUG_STACK) {
-				extra = 1;
+			/* add stack contribution from spilled arguments */
+			n_movs = 0;
+			n_xmm_movs = 0;
+			n_stack = 0;
+			for (i = 0; i < ft->n_inputs; ++i) {
+				if ((ft->input_types[i] == VALTYPE_I32 ||
+				     ft->input_types[i] == VALTYPE_I64)
+				    && n_movs < 6) {
+					n_movs += 1;
+				} else if (ft->input_types[i] ==
+					   VALTYPE_F32
+					   && n_xmm_movs < 8) {
+					n_xmm_movs += 1;
+				} else if (ft->input_types[i] ==
+					   VALTYPE_F64
+					   && n_xmm_movs < 8) {
+					n_xmm_movs += 1;
+				} else {
+					n_stack += 1;
+				}
 			}
-			if (__builtin_mul_overflow(n_frame_locals + FUNC_TYPE_N_OUTPUTS(type) + extra, -8, &out))
+
+			/* NB: stack arguments always get an even number of
+			   slots, a tail call in the callee relies on this */
+			aligned = cur_stack_depth % 2 + n_stack % 2;
+		}
+
+		if (check_stack) {
+			/* save funcinst ptr */
+			/* push %rbx */
+			OUTS("\x53");
+			cur_stack_depth += 1;
+			/* mov %rax, %rbx */
+			OUTS("\x48\x89\xc3");
+
+			/* get stack limit */
+			/* mov $const, %rax */
+			OUTS("\x48\xb8");
+			OUTNULL(8);
+			{
+				size_t memref_idx;
+				memref_idx = memrefs->n_elts;
+				if (!memrefs_grow(memrefs, 1))
+					goto error;
+
+				memrefs->elts[memref_idx].type =
+					MEMREF_STACK_TOP;
+				memrefs->elts[memref_idx].code_offset =
+					output->n_elts - 8;
+			}
+
+			if (cur_stack_depth % 2) {
+				/* sub $8, %rsp */
+				OUTS("\x48\x83\xec\x08");
+			}
+			if (!emit_indirect_call(output, flags))
 				goto error;
-			encode_le_uint32_t(out, buf);
+			if (cur_stack_depth % 2) {
+				/* add $8, %rsp */
+				OUTS("\x48\x83\xc4\x08");
+			}
+
+			/* the tier thread stores stack_usage before
+			   compiled_code, load them in the other order so
+			   new code is never checked against an old bound */
+			/* mov compiled_code_off(%rbx), %rcx */
+			OUTS("\x48\x8b\x4b");
+			OUTB(offsetof(struct FuncInst, compiled_code));
+
+			/* mov stack_usage(%rbx), %rdx */
+			OUTS("\x48\x8b\x53");
+			OUTB(offsetof(struct FuncInst, stack_usage));
+
+			/* mov %rsp, %rdi */
+			OUTS("\x48\x89\xe7");
+
+			/* add burden of stack arguments and alignment
+			   to stack usage requirement of function */
+			if (n_stack + aligned) {
+				/* add $((n_stack + alignment)*8), %rdx */
+				OUTS("\x48\x81\xc2");
+				encode_le_uint32_t((n_stack + aligned) * 8, buf);
+				if (!output_buf(output, buf, sizeof(uint32_t)))
+					goto error;
+				/* NB: should not overflow */
+			}
+
+			/* sub %rdx, %rdi */
+			OUTS("\x48\x29\xd7");
+
+			/* check for overflow */
+			/* jb <next_instructions> */
+			OUTS("\x72");
+			OUTB(5);
+
+			/* cmp %rdi, %rax */
+			OUTS("\x48\x39\xf8");
+
+			/* jbe TRAP_SIZE */
+			OUTS("\x76");
+			OUTB(TRAP_SIZE(flags));
+
+			emit_trap(output, memrefs, flags, WASMJIT_TRAP_STACK_OVERFLOW);
+
+			/* mov %rcx, %rax */
+			OUTS("\x48\x89\xc8");
+			cur_stack_depth -= 1;
+			/* pop %rbx */
+			OUTS("\x5b");
+		} else {
+			/* mov compiled_code_off(%rax), %rax */
+			OUTS("\x48\x8b\x40");
+			OUTB(offsetof(struct FuncInst, compiled_code));
+		}
+
+		/* align stack to 16-byte boundary */
+		if (aligned) {
+			/* sub $(aligned * 8), %rsp */
+			OUTS("\x48\x83\xec");
+			OUTB(aligned * 8);
+		}
+
+		/* push stack arguments, last one first */
+		{
+			size_t n_pushed = 0;
+
+			for (i = ft->n_inputs; i--;) {
+				if (!input_on_stack(ft, i))
+					continue;
+
+				/* push N(%rsp) */
+				OUTS("\xff\xb4\x24");
+				encode_le_uint32_t((ft->n_inputs - i - 1 +
+						    n_pushed + aligned) * 8,
+						   buf);
+				if (!output_buf(output, buf, sizeof(uint32_t)))
+					goto error;
+				n_pushed += 1;
+			}
+
+			assert(n_pushed == n_stack);
+		}
+
+		n_movs = 0;
+		n_xmm_movs = 0;
+		for (i = 0; i < ft->n_inputs; ++i) {
+			intmax_t stack_offset;
+			assert(sstack->
+			       elts[sstack->n_elts - ft->n_inputs +
+				    i].type ==
+			       ft->input_types[i]);
+
+			stack_offset =
+				(ft->n_inputs - i - 1 + n_stack + aligned) * 8;
+
+			/* mov -n_inputs + i(%rsp), %rdi */
+			if ((ft->input_types[i] == VALTYPE_I32 ||
+			     ft->input_types[i] == VALTYPE_I64)
+			    && n_movs < 6) {
+				OUTS(call_arg_movs[n_movs]);
+				n_movs += 1;
+			} else if (ft->input_types[i] ==
+				   VALTYPE_F32
+				   && n_xmm_movs < 8) {
+				OUTS(call_arg_f32_movs[n_xmm_movs]);
+				n_xmm_movs += 1;
+			} else if (ft->input_types[i] ==
+				   VALTYPE_F64
+				   && n_xmm_movs < 8) {
+				OUTS(call_arg_f64_movs[n_xmm_movs]);
+				n_xmm_movs += 1;
+			} else {
+				continue;
+			}
+
+			encode_le_uint32_t(stack_offset, buf);
 			if (!output_buf(output, buf, sizeof(uint32_t)))
 				goto error;
 		}
 
-		/* jmp <EPILOGUE> */
+		if (!emit_indirect_call(output, flags))
+			goto error;
+
+		/* clean up stack */
+		/* NB: restore relative to %rbp instead of adding
+		   (n_stack + n_inputs + aligned) * 8 since a tail call
+		   in the callee may have moved its return address */
 		{
-			size_t branch_idx;
+			int32_t out;
+			size_t depth = cur_stack_depth - ft->n_inputs;
 
-			branch_idx = branches->n_elts;
-			if (!bp_grow(branches, 1))
+			if (WASMJIT_DEBUG_STACK)
+				depth += 1;
+
+			/* lea -depth*8(%rbp), %rsp */
+			OUTS("\x48\x8d\xa5");
+			if (__builtin_mul_overflow(depth, -8, &out))
+				goto error;
+			encode_le_uint32_t(out, buf);
+			if (!output_buf(output, buf, sizeof(uint32_t)))
 				goto error;
+		}
 
-			branches->elts[branch_idx].branch_offset =
-				output->n_elts;
-			branches->elts[branch_idx].continuation_idx =
-				FUNC_EXIT_CONT;
+		if (!stack_truncate(sstack,
+				    sstack->n_elts -
+				    ft->n_inputs))
+			goto error;
 
-			OUTS("\xe9\x90\x90\x90\x90");
-		}
+		if (FUNC_TYPE_N_OUTPUTS(ft)) {
+			assert(FUNC_TYPE_N_OUTPUTS(ft) == 1);
+			if (FUNC_TYPE_OUTPUT_TYPES(ft)[0] == VALTYPE_F32) {
+				/* movd %xmm0, %eax */
+				OUTS("\x66\x0f\x7e\xc0");
+			} else if (FUNC_TYPE_OUTPUT_TYPES(ft)[0] == VALTYPE_F64) {
+				/* movq %xmm0, %rax */
+				OUTS("\x66\x48\x0f\x7e\xc0");
+			}
+			/* push %rax */
+			OUTS("\x50");
 
+			if (!push_stack(sstack, FUNC_TYPE_OUTPUT_TYPES(ft)[0]))
+				goto error;
+		}
 		break;
-	case OPCODE_CALL:
-	case OPCODE_CALL_INDIRECT: {
-		size_t i;
-		size_t n_movs, n_xmm_movs, n_stack;
-		int aligned = 0;
+	}
+	case OPCODE_RETURN_CALL:
+	case OPCODE_RETURN_CALL_INDIRECT: {
+		size_t i, n_movs, n_xmm_movs, n_stack;
+		int delta;
 		const struct FuncType *ft;
 		size_t cur_stack_depth = n_frame_locals;
+		uint8_t stack_args[FUNC_TYPE_MAX_INPUTS];
+		int32_t out;
 
 		/* add current stack depth */
 		cur_stack_depth += stack_depth(sstack);
 
-		if (instruction->opcode == OPCODE_CALL_INDIRECT) {
-			ft = &func_types[instruction->data.call_indirect.typeidx];
+		/* the callee reuses the frame, stop timing before it does */
+		if (flags & WASMJIT_COMPILE_FLAG_CYCLES) {
+			if (!emit_stats_exit(output, memrefs, n_frame_locals))
+				goto error;
+		}
+
+		if (instruction->opcode == OPCODE_RETURN_CALL_INDIRECT) {
+			ft = &func_types[instruction->data.return_call_indirect.typeidx];
 			assert(peek_stack(sstack) == STACK_I32);
 			if (!pop_stack(sstack))
 				goto error;
@@ -827,7 +3498,7 @@ static int wasmjit_compile_instruction(const struct FuncType *func_types,
 				memrefs->elts[memref_idx].code_offset =
 					output->n_elts - 8;
 				memrefs->elts[memref_idx].idx =
-					instruction->data.call_indirect.typeidx;
+					instruction->data.return_call_indirect.typeidx;
 			}
 
 			/* pop %rdx */
@@ -836,7 +3507,6 @@ static int wasmjit_compile_instruction(const struct FuncType *func_types,
 			/* mov $const, %rax */
 			OUTS("\x48\xb8");
 			OUTNULL(8);
-			// address of _resolve_indirect_call
 			{
 				size_t memref_idx;
 				memref_idx = memrefs->n_elts;
@@ -862,7 +3532,7 @@ static int wasmjit_compile_instruction(const struct FuncType *func_types,
 				OUTS("\x48\x83\xc4\x08");
 		} else {
 			uint32_t fidx =
-				instruction->data.call.funcidx;
+				instruction->data.return_call.funcidx;
 			ft = &module_types->functypes[fidx];
 
 			/* movq $const, %rax */
@@ -883,34 +3553,14 @@ static int wasmjit_compile_instruction(const struct FuncType *func_types,
 			}
 		}
 
-		{
-			/* add stack contribution from spilled arguments */
-			n_movs = 0;
-			n_xmm_movs = 0;
-			n_stack = 0;
-			for (i = 0; i < ft->n_inputs; ++i) {
-				if ((ft->input_types[i] == VALTYPE_I32 ||
-				     ft->input_types[i] == VALTYPE_I64)
-				    && n_movs < 6) {
-					n_movs += 1;
-				} else if (ft->input_types[i] ==
-					   VALTYPE_F32
-					   && n_xmm_movs < 8) {
-					n_xmm_movs += 1;
-				} else if (ft->input_types[i] ==
-					   VALTYPE_F64
-					   && n_xmm_movs < 8) {
-					n_xmm_movs += 1;
-				} else {
-					n_stack += 1;
-				}
-			}
+		assert(FUNC_TYPE_N_OUTPUTS(ft) == FUNC_TYPE_N_OUTPUTS(type));
 
-			aligned = (cur_stack_depth + n_stack) % 2;
-		}
+		delta = tail_call_frame_delta(type, ft);
 
 		if (check_stack) {
-			/* save funcinst ptr */
+			/* the callee's frame starts where our return
+			   address will be, not at the current %rsp */
+
 			/* push %rbx */
 			OUTS("\x53");
 			cur_stack_depth += 1;
@@ -944,23 +3594,25 @@ static int wasmjit_compile_instruction(const struct FuncType *func_types,
 				OUTS("\x48\x83\xc4\x08");
 			}
 
+			/* the tier thread stores stack_usage before
+			   compiled_code, load them in the other order so
+			   new code is never checked against an old bound */
+			/* mov compiled_code_off(%rbx), %rcx */
+			OUTS("\x48\x8b\x4b");
+			OUTB(offsetof(struct FuncInst, compiled_code));
+
 			/* mov stack_usage(%rbx), %rdx */
 			OUTS("\x48\x8b\x53");
 			OUTB(offsetof(struct FuncInst, stack_usage));
 
-			/* mov %rsp, %rdi */
-			OUTS("\x48\x89\xe7");
-
-			/* add burden of stack arguments and alignment
-			   to stack usage requirement of function */
-			if (n_stack + aligned) {
-				/* add $((n_stack + alignment)*8), %rdx */
-				OUTS("\x48\x81\xc2");
-				encode_le_uint32_t((n_stack + aligned) * 8, buf);
-				if (!output_buf(output, buf, sizeof(uint32_t)))
-					goto error;
-				/* NB: should not overflow */
-			}
+			/* lea (8 - delta * 8)(%rbp), %rdi */
+			OUTS("\x48\x8d\xbd");
+			if (__builtin_mul_overflow(delta, -8, &out) ||
+			    __builtin_add_overflow(out, 8, &out))
+				goto error;
+			encode_le_uint32_t(out, buf);
+			if (!output_buf(output, buf, sizeof(uint32_t)))
+				goto error;
 
 			/* sub %rdx, %rdi */
 			OUTS("\x48\x29\xd7");
@@ -979,128 +3631,164 @@ static int wasmjit_compile_instruction(const struct FuncType *func_types,
 
 			emit_trap(output, memrefs, flags, WASMJIT_TRAP_STACK_OVERFLOW);
 
-			/* restore funcinst ptr */
-			/* mov %rbx, %rax */
-			OUTS("\x48\x89\xd8");
+			/* mov %rcx, %rax */
+			OUTS("\x48\x89\xc8");
 			cur_stack_depth -= 1;
 			/* pop %rbx */
 			OUTS("\x5b");
+		} else {
+			/* mov compiled_code_off(%rax), %rax */
+			OUTS("\x48\x8b\x40");
+			OUTB(offsetof(struct FuncInst, compiled_code));
 		}
 
-		/* mov compiled_code_off(%rax), %rax */
-		OUTS("\x48\x8b\x40");
-		OUTB(offsetof(struct FuncInst, compiled_code));
-
-		/* align stack to 16-byte boundary */
-		{
-			if (aligned)
-				/* sub $8, %rsp */
-				OUTS("\x48\x83\xec\x08");
-		}
-
+		/* load register arguments, remember stack arguments */
 		n_movs = 0;
 		n_xmm_movs = 0;
 		n_stack = 0;
 		for (i = 0; i < ft->n_inputs; ++i) {
-			static const char *const movs[] = {
-				"\x48\x8b\xbc\x24",	/* mov N(%rsp), %rdi */
-				"\x48\x8b\xb4\x24",	/* mov N(%rsp), %rsi */
-				"\x48\x8b\x94\x24",	/* mov N(%rsp), %rdx */
-				"\x48\x8b\x8c\x24",	/* mov N(%rsp), %rcx */
-				"\x4c\x8b\x84\x24",	/* mov N(%rsp), %r8 */
-				"\x4c\x8b\x8c\x24",	/* mov N(%rsp), %r9 */
-			};
-
-			static const char *const f32_movs[] = {
-				"\xf3\x0f\x10\x84\x24",	/* movss N(%rsp), %xmm0 */
-				"\xf3\x0f\x10\x8c\x24",	/* movss N(%rsp), %xmm1 */
-				"\xf3\x0f\x10\x94\x24",	/* movss N(%rsp), %xmm2 */
-				"\xf3\x0f\x10\x9c\x24",	/* movss N(%rsp), %xmm3 */
-				"\xf3\x0f\x10\xa4\x24",	/* movss N(%rsp), %xmm4 */
-				"\xf3\x0f\x10\xac\x24",	/* movss N(%rsp), %xmm5 */
-				"\xf3\x0f\x10\xb4\x24",	/* movss N(%rsp), %xmm6 */
-				"\xf3\x0f\x10\xbc\x24",	/* movss N(%rsp), %xmm7 */
-			};
-
-			static const char *const f64_movs[] = {
-				"\xf2\x0f\x10\x84\x24",	/* movsd N(%rsp), %xmm0 */
-				"\xf2\x0f\x10\x8c\x24",	/* movsd N(%rsp), %xmm1 */
-				"\xf2\x0f\x10\x94\x24",	/* movsd N(%rsp), %xmm2 */
-				"\xf2\x0f\x10\x9c\x24",	/* movsd N(%rsp), %xmm3 */
-				"\xf2\x0f\x10\xa4\x24",	/* movsd N(%rsp), %xmm4 */
-				"\xf2\x0f\x10\xac\x24",	/* movsd N(%rsp), %xmm5 */
-				"\xf2\x0f\x10\xb4\x24",	/* movsd N(%rsp), %xmm6 */
-				"\xf2\x0f\x10\xbc\x24",	/* movsd N(%rsp), %xmm7 */
-			};
-
-			intmax_t stack_offset;
 			assert(sstack->
 			       elts[sstack->n_elts - ft->n_inputs +
 				    i].type ==
 			       ft->input_types[i]);
 
-			stack_offset =
-				(ft->n_inputs - i - 1 + n_stack + aligned) * 8;
-
-			/* mov -n_inputs + i(%rsp), %rdi */
 			if ((ft->input_types[i] == VALTYPE_I32 ||
 			     ft->input_types[i] == VALTYPE_I64)
 			    && n_movs < 6) {
-				OUTS(movs[n_movs]);
+				OUTS(call_arg_movs[n_movs]);
 				n_movs += 1;
 			} else if (ft->input_types[i] ==
 				   VALTYPE_F32
 				   && n_xmm_movs < 8) {
-				OUTS(f32_movs[n_xmm_movs]);
+				OUTS(call_arg_f32_movs[n_xmm_movs]);
 				n_xmm_movs += 1;
 			} else if (ft->input_types[i] ==
 				   VALTYPE_F64
 				   && n_xmm_movs < 8) {
-				OUTS(f64_movs[n_xmm_movs]);
+				OUTS(call_arg_f64_movs[n_xmm_movs]);
 				n_xmm_movs += 1;
 			} else {
-				stack_offset =
-					(i - (ft->n_inputs - 1) + n_stack + aligned) * 8;
-				OUTS("\xff\xb4\x24");	/* push N(%rsp) */
+				stack_args[n_stack] = i;
 				n_stack += 1;
+				continue;
 			}
 
-			encode_le_uint32_t(stack_offset, buf);
+			encode_le_uint32_t((ft->n_inputs - i - 1) * 8, buf);
 			if (!output_buf(output, buf, sizeof(uint32_t)))
 				goto error;
 		}
 
-		if (!emit_indirect_call(output, flags))
+		if (!emit_local_regs_restore(output, locals_md, n_locals))
 			goto error;
 
-		/* clean up stack */
-		/* add (n_stack + n_inputs + aligned) * 8, %rsp */
-		OUTS("\x48\x81\xc4");
-		encode_le_uint32_t((n_stack + ft->n_inputs + aligned) * 8,
-				   buf);
-		if (!output_buf(output, buf, sizeof(uint32_t)))
+		if (WASMJIT_DEBUG_STACK) {
+			/* mov -(n_frame_locals + 1) * 8(%rbp), %rbx */
+			OUTS("\x48\x8b\x9d");
+			if (__builtin_mul_overflow(n_frame_locals + 1, -8, &out))
+				goto error;
+			encode_le_uint32_t(out, buf);
+			if (!output_buf(output, buf, sizeof(uint32_t)))
+				goto error;
+		}
+
+		if (!delta) {
+			/* stack arguments fit in our incoming argument area,
+			   which is above the frame, so copy them directly */
+			for (i = 0; i < n_stack; ++i) {
+				/* mov N(%rsp), %r11 */
+				OUTS("\x4c\x8b\x9c\x24");
+				encode_le_uint32_t((ft->n_inputs - stack_args[i] - 1) * 8,
+						   buf);
+				if (!output_buf(output, buf, sizeof(uint32_t)))
+					goto error;
+
+				/* mov %r11, (16 + i * 8)(%rbp) */
+				OUTS("\x4c\x89\x9d");
+				encode_le_uint32_t(16 + i * 8, buf);
+				if (!output_buf(output, buf, sizeof(uint32_t)))
+					goto error;
+			}
+
+			/* leave */
+			OUTS("\xc9");
+		} else {
+			/* the new argument area may overlap both the
+			   operand stack and our saved %rbp / return
+			   address, stage everything below the operand
+			   stack first */
+			for (i = n_stack; i--;) {
+				/* push N(%rsp) */
+				OUTS("\xff\xb4\x24");
+				encode_le_uint32_t((ft->n_inputs - stack_args[i] - 1 +
+						    n_stack - i - 1) * 8,
+						   buf);
+				if (!output_buf(output, buf, sizeof(uint32_t)))
+					goto error;
+			}
+
+			/* push 8(%rbp) */
+			OUTS("\xff\x75\x08");
+			/* push 0(%rbp) */
+			OUTS("\xff\x75");
+			OUTB(0);
+
+			for (i = 0; i < n_stack; ++i) {
+				/* mov (16 + i * 8)(%rsp), %r11 */
+				OUTS("\x4c\x8b\x9c\x24");
+				encode_le_uint32_t(16 + i * 8, buf);
+				if (!output_buf(output, buf, sizeof(uint32_t)))
+					goto error;
+
+				/* mov %r11, (16 + (i - delta) * 8)(%rbp) */
+				OUTS("\x4c\x89\x9d");
+				if (__builtin_mul_overflow((intmax_t) i - (intmax_t) delta,
+							   8, &out) ||
+				    __builtin_add_overflow(out, 16, &out))
+					goto error;
+				encode_le_uint32_t(out, buf);
+				if (!output_buf(output, buf, sizeof(uint32_t)))
+					goto error;
+			}
+
+			/* mov 8(%rsp), %r11 */
+			OUTS("\x4c\x8b\x5c\x24\x08");
+
+			/* mov %r11, (8 - delta * 8)(%rbp) */
+			OUTS("\x4c\x89\x9d");
+			if (__builtin_mul_overflow(delta, -8, &out) ||
+			    __builtin_add_overflow(out, 8, &out))
+				goto error;
+			encode_le_uint32_t(out, buf);
+			if (!output_buf(output, buf, sizeof(uint32_t)))
+				goto error;
+
+			/* mov (%rsp), %r10 */
+			OUTS("\x4c\x8b\x14\x24");
+
+			/* lea (8 - delta * 8)(%rbp), %rsp */
+			OUTS("\x48\x8d\xa5");
+			encode_le_uint32_t(out, buf);
+			if (!output_buf(output, buf, sizeof(uint32_t)))
+				goto error;
+
+			/* mov %r10, %rbp */
+			OUTS("\x4c\x89\xd5");
+		}
+
+		if (!emit_indirect_jump(output, flags))
 			goto error;
 
+		/* code after this is unreachable but must type check */
 		if (!stack_truncate(sstack,
 				    sstack->n_elts -
 				    ft->n_inputs))
 			goto error;
 
 		if (FUNC_TYPE_N_OUTPUTS(ft)) {
-			assert(FUNC_TYPE_N_OUTPUTS(ft) == 1);
-			if (FUNC_TYPE_OUTPUT_TYPES(ft)[0] == VALTYPE_F32) {
-				/* movd %xmm0, %eax */
-				OUTS("\x66\x0f\x7e\xc0");
-			} else if (FUNC_TYPE_OUTPUT_TYPES(ft)[0] == VALTYPE_F64) {
-				/* movq %xmm0, %rax */
-				OUTS("\x66\x48\x0f\x7e\xc0");
-			}
-			/* push %rax */
-			OUTS("\x50");
-
 			if (!push_stack(sstack, FUNC_TYPE_OUTPUT_TYPES(ft)[0]))
 				goto error;
 		}
+
 		break;
 	}
 	case OPCODE_DROP:
@@ -1135,49 +3823,72 @@ static int wasmjit_compile_instruction(const struct FuncType *func_types,
 
 		break;
 	}
-	case OPCODE_GET_LOCAL:
-		assert(instruction->data.get_local.localidx < n_locals);
-		push_stack(sstack,
-			   locals_md[instruction->data.
-				     get_local.localidx].valtype);
+	case OPCODE_GET_LOCAL: {
+		uint32_t localidx = instruction->data.get_local.localidx;
+
+		assert(localidx < n_locals);
+		push_stack(sstack, locals_md[localidx].valtype);
+		sstack->elts[sstack->n_elts - 1].local = localidx + 1;
+
+		if (locals_md[localidx].reg >= 0) {
+			/* push %r12 + reg */
+			OUTS("\x41");
+			OUTB(0x54 + locals_md[localidx].reg);
+			break;
+		}
 
 		/* push fp_offset(%rbp) */
 		OUTS("\xff\xb5");
-		encode_le_uint32_t(locals_md
-				   [instruction->data.get_local.localidx]
-				   .fp_offset, buf);
+		encode_le_uint32_t(locals_md[localidx].fp_offset, buf);
 		if (!output_buf(output, buf, sizeof(uint32_t)))
 			goto error;
 		break;
-	case OPCODE_SET_LOCAL:
-		assert(peek_stack(sstack) ==
-		       locals_md[instruction->data.
-				 set_local.localidx].valtype);
+	}
+	case OPCODE_SET_LOCAL: {
+		uint32_t localidx = instruction->data.set_local.localidx;
+
+		assert(peek_stack(sstack) == locals_md[localidx].valtype);
+		pop_stack(sstack);
+		clobber_local(locals_md, sstack, localidx);
+
+		if (locals_md[localidx].reg >= 0) {
+			/* pop %r12 + reg */
+			OUTS("\x41");
+			OUTB(0x5c + locals_md[localidx].reg);
+			break;
+		}
 
 		/* pop fp_offset(%rbp) */
 		OUTS("\x8f\x85");
-		encode_le_uint32_t(locals_md
-				   [instruction->data.set_local.localidx]
-				   .fp_offset, buf);
+		encode_le_uint32_t(locals_md[localidx].fp_offset, buf);
 		if (!output_buf(output, buf, sizeof(uint32_t)))
 			goto error;
-		pop_stack(sstack);
 		break;
-	case OPCODE_TEE_LOCAL:
-		assert(peek_stack(sstack) ==
-		       locals_md[instruction->data.
-				 tee_local.localidx].valtype);
+	}
+	case OPCODE_TEE_LOCAL: {
+		uint32_t localidx = instruction->data.tee_local.localidx;
+
+		assert(peek_stack(sstack) == locals_md[localidx].valtype);
+		clobber_local(locals_md, sstack, localidx);
+		sstack->elts[sstack->n_elts - 1].local = localidx + 1;
+
+		if (locals_md[localidx].reg >= 0) {
+			/* mov (%rsp), %r12 + reg */
+			OUTS("\x4c\x8b");
+			OUTB(0x24 + 8 * locals_md[localidx].reg);
+			OUTS("\x24");
+			break;
+		}
 
 		/* mov (%rsp), %rax */
 		OUTS("\x48\x8b\x04\x24");
 		/* movq %rax, fp_offset(%rbp) */
 		OUTS("\x48\x89\x85");
-		encode_le_uint32_t(locals_md
-				   [instruction->data.tee_local.localidx]
-				   .fp_offset, buf);
+		encode_le_uint32_t(locals_md[localidx].fp_offset, buf);
 		if (!output_buf(output, buf, sizeof(uint32_t)))
 			goto error;
 		break;
+	}
 	case OPCODE_GET_GLOBAL: {
 		uint32_t gidx = instruction->data.get_global.globalidx;
 		unsigned type;
@@ -1308,6 +4019,94 @@ static int wasmjit_compile_instruction(const struct FuncType *func_types,
 
 		break;
 	}
+	case OPCODE_MEMORY_SIZE: {
+		uint32_t memidx = instruction->data.memory_size.memidx;
+
+		if (memidx >= module_types->n_mems)
+			goto error;
+
+		if (memory_strategy(module_types, memidx) ==
+		    MEMORY_STRATEGY_FIXED) {
+			/* push $pages */
+			OUTS("\x68");
+			encode_le_uint32_t(module_types->memorytypes[memidx].limits.min,
+					   buf);
+			if (!output_buf(output, buf, sizeof(uint32_t)))
+				goto error;
+		} else {
+			/* movq $const, %rax */
+			OUTS("\x48\xb8");
+			OUTNULL(8);
+			if (!emit_memref(memrefs, output->n_elts - 8,
+					 MEMREF_MEM, memidx))
+				goto error;
+
+			/* mov size_offset(%rax), %rax */
+			OUTS("\x48\x8b\x40");
+			OUTB(offsetof(struct MemInst, size));
+
+			/* shr $16, %rax */
+			OUTS("\x48\xc1\xe8\x10");
+
+			/* push %rax */
+			OUTS("\x50");
+		}
+
+		if (!push_stack(sstack, STACK_I32))
+			goto error;
+		break;
+	}
+	case OPCODE_MEMORY_GROW: {
+		size_t memref_idx, cur_stack_depth;
+
+		assert(peek_stack(sstack) == STACK_I32);
+		if (!pop_stack(sstack))
+			goto error;
+
+		cur_stack_depth = n_frame_locals + stack_depth(sstack);
+
+		if (instruction->data.memory_grow.memidx >=
+		    module_types->n_mems)
+			goto error;
+
+		/* movq $const, %rdi */
+		OUTS("\x48\xbf");
+		OUTNULL(8);
+		if (!emit_memref(memrefs, output->n_elts - 8, MEMREF_MEM,
+				 instruction->data.memory_grow.memidx))
+			goto error;
+
+		/* pop %rsi */
+		OUTS("\x5e");
+
+		/* mov $wasmjit_grow_memory, %rax */
+		OUTS("\x48\xb8");
+		OUTNULL(8);
+		memref_idx = memrefs->n_elts;
+		if (!memrefs_grow(memrefs, 1))
+			goto error;
+		memrefs->elts[memref_idx].type = MEMREF_GROW_MEMORY;
+		memrefs->elts[memref_idx].code_offset = output->n_elts - 8;
+
+		/* align to 16 bytes */
+		if (cur_stack_depth % 2)
+			/* sub $8, %rsp */
+			OUTS("\x48\x83\xec\x08");
+
+		if (!emit_indirect_call(output, flags))
+			goto error;
+
+		if (cur_stack_depth % 2)
+			/* add $8, %rsp */
+			OUTS("\x48\x83\xc4\x08");
+
+		/* push %rax */
+		OUTS("\x50");
+
+		if (!push_stack(sstack, STACK_I32))
+			goto error;
+		break;
+	}
 	case OPCODE_I32_LOAD:
 	case OPCODE_I64_LOAD:
 	case OPCODE_F32_LOAD:
@@ -1325,8 +4124,9 @@ static int wasmjit_compile_instruction(const struct FuncType *func_types,
 	case OPCODE_I64_STORE32:
 	case OPCODE_I64_STORE8: {
 		const struct LoadStoreExtra *extra;
-		size_t mem_size;
+		size_t mem_size, addr_local;
 		uint32_t real_offset;
+		int checked, is_store = 0;
 
 		switch (instruction->opcode) {
 		case OPCODE_I64_LOAD:
@@ -1415,6 +4215,7 @@ static int wasmjit_compile_instruction(const struct FuncType *func_types,
 			assert(peek_stack(sstack) == STACK_I64);
 			extra = &instruction->data.i64_store32;
 		after:
+			is_store = 1;
 			if (!pop_stack(sstack))
 				goto error;
 
@@ -1431,6 +4232,7 @@ static int wasmjit_compile_instruction(const struct FuncType *func_types,
 
 		/* pop %rsi */
 		assert(peek_stack(sstack) == STACK_I32);
+		addr_local = sstack->elts[sstack->n_elts - 1].local;
 		if (!pop_stack(sstack))
 			goto error;
 		OUTS("\x5e");
@@ -1457,72 +4259,46 @@ static int wasmjit_compile_instruction(const struct FuncType *func_types,
 				goto error;
 		}
 
-		{
-			/* LOGIC: size = store->mems.elts[maddr].size */
-
-			/* movq $const, %rax */
-			OUTS("\x48\xb8");
-			OUTNULL(8);
-
-			/* add reference to max */
-			{
-				size_t memref_idx;
-
-				memref_idx = memrefs->n_elts;
-				if (!memrefs_grow(memrefs, 1))
-					goto error;
-
-				memrefs->elts[memref_idx].type =
-					MEMREF_MEM;
-				memrefs->elts[memref_idx].code_offset =
-					output->n_elts - 8;
-				memrefs->elts[memref_idx].idx =
-					0;
+		/* memory never shrinks, so an address read from a local
+		   that was already checked with at least this offset
+		   since the local was last written can't overflow */
+		checked = 0;
+		if ((flags & WASMJIT_COMPILE_FLAG_OPTIMIZE) && addr_local) {
+			struct LocalsMD *local = &locals_md[addr_local - 1];
+
+			if (local->checked_run == run &&
+			    local->checked_memidx == extra->memidx &&
+			    local->checked_end >= real_offset) {
+				checked = 1;
+			} else {
+				local->checked_run = run;
+				local->checked_memidx = extra->memidx;
+				local->checked_end = real_offset;
 			}
+		}
 
-			/* mov size_offset(%rax), %rax */
-			OUTS("\x48\x8b\x40");
-			OUTB(offsetof(struct MemInst, size));
-
-			/* LOGIC: if ea >= size then trap() */
-
-			/* cmp %rax, %rsi */
-			OUTS("\x48\x39\xc6");
-
-			/* jb AFTER_TRAP: */
-			OUTS("\x72");
-			OUTB(TRAP_SIZE(flags));
-			if (!emit_trap(output, memrefs, flags, WASMJIT_TRAP_MEMORY_OVERFLOW))
+		/* LOGIC: if ea >= store->mems.elts[maddr].size then trap() */
+		if (!checked || !is_store) {
+			/* loads still need the flags to mask the address */
+			if (!emit_memory_bound_cmp(output, memrefs, module_types,
+						   extra->memidx))
 				goto error;
 		}
 
-		/* LOGIC: data = store->mems.elts[maddr].data */
-		{
-			/* movq $const, %rax */
-			OUTS("\x48\xb8");
-			OUTNULL(8);
-
-			/* add reference to data */
-			{
-				size_t memref_idx;
-
-				memref_idx = memrefs->n_elts;
-				if (!memrefs_grow(memrefs, 1))
-					goto error;
-
-				memrefs->elts[memref_idx].type =
-					MEMREF_MEM;
-				memrefs->elts[memref_idx].code_offset =
-					output->n_elts - 8;
-				memrefs->elts[memref_idx].idx =
-					0;
-			}
-
-			/* mov data_off(%rax), %rax */
-			OUTS("\x48\x8b\x40");
-			OUTB(offsetof(struct MemInst, data));
+		if (!checked) {
+			/* jb AFTER_TRAP: */
+			OUTS("\x72");
+			OUTB(TRAP_SIZE(flags));
+			if (!emit_trap(output, memrefs, flags,
+				       WASMJIT_TRAP_MEMORY_OVERFLOW))
+				goto error;
 		}
 
+		/* LOGIC: data = store->mems.elts[maddr].data */
+		if (!emit_memory_base(output, memrefs, module_types,
+				      extra->memidx))
+			goto error;
+
 
 		switch (instruction->opcode) {
 		case OPCODE_I32_LOAD:
@@ -1641,6 +4417,12 @@ static int wasmjit_compile_instruction(const struct FuncType *func_types,
 
 		break;
 	}
+	case OPCODE_ATOMIC_PREFIX:
+		if (!emit_atomic(output, traps, memrefs, module_types,
+				 n_frame_locals, sstack,
+				 &instruction->data.atomic, flags))
+			goto error;
+		break;
 	case OPCODE_I32_CONST:
 		/* mov $value, %eax */
 		OUTS("\xb8");
@@ -2010,31 +4792,82 @@ static int wasmjit_compile_instruction(const struct FuncType *func_types,
 		/* pop %rdi */
 		OUTS("\x5f");
 
-		/* mov (%rsp), %(r|e)ax */
+		/* test %(r|e)di, %(r|e)di */
 		if (stack_type == STACK_I64)
 			OUTS("\x48");
-		OUTS("\x8b\x04\x24");
+		OUTS("\x85\xff");
+
+		/* jz DIVIDE_BY_ZERO */
+		if (!emit_cold_trap_jcc(output, traps, "\x0f\x84",
+					WASMJIT_TRAP_INTEGER_DIVIDE_BY_ZERO))
+			goto error;
 
+		/* mov (%rsp), %(r|e)ax */
 		if (stack_type == STACK_I64)
 			OUTS("\x48");
+		OUTS("\x8b\x04\x24");
 
 		switch (instruction->opcode) {
 		case OPCODE_I32_DIV_S:
 		case OPCODE_I32_REM_S:
 		case OPCODE_I64_DIV_S:
-		case OPCODE_I64_REM_S:
-			/* cld|cqto */
+		case OPCODE_I64_REM_S: {
+			size_t jne_offset, jmp_offset;
+
+			/* LOGIC: idiv faults on INT_MIN / -1, handle -1 apart */
+
+			/* cmp $-1, %(r|e)di */
+			if (stack_type == STACK_I64)
+				OUTS("\x48");
+			OUTS("\x83\xff\xff");
+
+			/* jne IDIV */
+			OUTS("\x75");
+			OUTB(0);
+			jne_offset = output->n_elts;
+
+			if (instruction->opcode == OPCODE_I32_DIV_S ||
+			    instruction->opcode == OPCODE_I64_DIV_S) {
+				/* neg %(r|e)ax */
+				if (stack_type == STACK_I64)
+					OUTS("\x48");
+				OUTS("\xf7\xd8");
+
+				/* jo INTEGER_OVERFLOW */
+				if (!emit_cold_trap_jcc(output, traps, "\x0f\x80",
+							WASMJIT_TRAP_INTEGER_OVERFLOW))
+					goto error;
+			} else {
+				/* xor %edx, %edx */
+				OUTS("\x31\xd2");
+			}
+
+			/* jmp STORE */
+			OUTS("\xeb");
+			OUTB(0);
+			jmp_offset = output->n_elts;
+
+			/* IDIV: */
+			output->elts[jne_offset - 1] = output->n_elts - jne_offset;
+
+			if (stack_type == STACK_I64)
+				OUTS("\x48");
+			/* cltd|cqto */
 			OUTS("\x99");
 			/* idiv %(r|e)di */
 			if (stack_type == STACK_I64)
 				OUTS("\x48");
 			OUTS("\xf7\xff");
+
+			/* STORE: */
+			output->elts[jmp_offset - 1] = output->n_elts - jmp_offset;
 			break;
+		}
 		case OPCODE_I32_DIV_U:
 		case OPCODE_I32_REM_U:
 		case OPCODE_I64_DIV_U:
 		case OPCODE_I64_REM_U:
-			/* xor %(r|e)dx, %(r|e)dx */
+			/* xor %edx, %edx */
 			OUTS("\x31\xd2");
 			/* div %(r|e)di */
 			if (stack_type == STACK_I64)
@@ -2358,13 +5191,17 @@ static int wasmjit_compile_instructions(const struct FuncType *func_types,
 					struct SizedBuffer *output,
 					struct LabelContinuations *labels,
 					struct BranchPoints *branches,
+					struct TrapPoints *traps,
+					struct ProfileMD *profile,
 					struct MemoryReferences *memrefs,
+					struct WasmJITPcMap *pc_map,
 					struct LocalsMD *locals_md,
 					size_t n_locals,
 					size_t n_frame_locals,
 					struct StaticStack *sstack,
 					const struct Instr *instructions,
 					size_t n_instructions,
+					size_t *run,
 					size_t *max_stack,
 					unsigned flags)
 {
@@ -2403,6 +5240,10 @@ static int wasmjit_compile_instructions(const struct FuncType *func_types,
 			struct InstructionMD imd2;
 			const struct Instr *instruction = &imd.instructions[i];
 
+			if (!record_pc(pc_map, output->n_elts,
+				       instruction->offset))
+				goto error;
+
 			if (WASMJIT_DEBUG_STACK) {
 				/* mov %rsp, %rax */
 				OUTS("\x48\x89\xe0");
@@ -2419,6 +5260,18 @@ static int wasmjit_compile_instructions(const struct FuncType *func_types,
 				OUTS("\xcc");
 			}
 
+			/* every branch target starts a new run */
+			if (!i || ends_fuel_run(&imd.instructions[i - 1]))
+				*run += 1;
+
+			if ((flags & WASMJIT_COMPILE_FLAG_FUEL) &&
+			    (!i || ends_fuel_run(&imd.instructions[i - 1]))) {
+				if (!emit_fuel_charge(output, memrefs, traps,
+						      &imd.instructions[i],
+						      imd.n_instructions - i))
+					goto error;
+			}
+
 			switch (instruction->opcode) {
 			case OPCODE_BLOCK:
 			case OPCODE_LOOP: {
@@ -2457,12 +5310,33 @@ static int wasmjit_compile_instructions(const struct FuncType *func_types,
 					struct StackElt *elt =
 						&sstack->elts[imd2.data.block.stack_idx];
 					elt->type = STACK_LABEL;
+					elt->local = 0;
 					elt->data.label.arity = arity;
 					elt->data.label.continuation_idx = imd2.data.block.label_idx;
 				}
 
 				imd2.data.block.output_idx = output->n_elts;
 
+				/* loop back-edges count towards tier-up */
+				if (instruction->opcode == OPCODE_LOOP &&
+				    (flags & WASMJIT_COMPILE_FLAG_TIER_COUNTERS)) {
+					if (!emit_tier_counter(output, memrefs, flags,
+							       n_frame_locals +
+							       stack_depth(sstack) +
+							       !!WASMJIT_DEBUG_STACK))
+						goto error;
+				}
+
+				if (instruction->opcode == OPCODE_LOOP &&
+				    (flags & WASMJIT_COMPILE_FLAG_EPOCH)) {
+					if (!emit_epoch_check(output, memrefs, profile,
+							      instruction->offset,
+							      n_frame_locals +
+							      stack_depth(sstack) +
+							      !!WASMJIT_DEBUG_STACK))
+						goto error;
+				}
+
 				imd2.instructions = instruction->data.block.instructions;
 				imd2.n_instructions = instruction->data.block.n_instructions;
 				break;
@@ -2471,6 +5345,8 @@ static int wasmjit_compile_instructions(const struct FuncType *func_types,
 				int arity =
 					instruction->data.if_.blocktype !=
 					VALTYPE_NULL ? 1 : 0;
+				size_t offset;
+				const uint64_t *counts;
 
 #ifdef DEBUG_COMPILE
 					const char *result = "";
@@ -2486,13 +5362,35 @@ static int wasmjit_compile_instructions(const struct FuncType *func_types,
 				/* pop %rax */
 				OUTS("\x58");
 
+				offset = profile_site(profile, instruction);
+				if (profile->record &&
+				    !emit_profile_cond(output, memrefs, offset,
+						       "\x85\xc0"))
+					goto error;
+
+				/* a rarely taken then arm without an else is
+				   moved out of line, a colder then arm is
+				   placed after the else arm */
+				counts = site_profile(profile, offset);
+				imd2.data.if_.cold = counts &&
+					!instruction->data.if_.n_instructions_else &&
+					counts[1] * 16 <= counts[0];
+				imd2.data.if_.swapped = counts &&
+					instruction->data.if_.n_instructions_else &&
+					counts[1] * 2 < counts[0];
+
 				/* if not true jump to else case */
 				/* test %eax, %eax */
 				OUTS("\x85\xc0");
 
 				imd2.data.if_.jump_to_else_offset = output->n_elts + 2;
-				/* je else_offset */
-				OUTS("\x0f\x84\x90\x90\x90\x90");
+				if (imd2.data.if_.swapped) {
+					/* jne then_offset */
+					OUTS("\x0f\x85\x90\x90\x90\x90");
+				} else if (!imd2.data.if_.cold) {
+					/* je else_offset */
+					OUTS("\x0f\x84\x90\x90\x90\x90");
+				}
 
 				/* output then case */
 				imd2.data.if_.label_idx = labels->n_elts;
@@ -2506,31 +5404,76 @@ static int wasmjit_compile_instructions(const struct FuncType *func_types,
 					struct StackElt *elt =
 						&sstack->elts[imd2.data.if_.stack_idx];
 					elt->type = STACK_LABEL;
+					elt->local = 0;
 					elt->data.label.arity = arity;
 					elt->data.label.continuation_idx = imd2.data.if_.label_idx;
 				}
 
 				imd2.data.if_.did_else = 0;
 
-				imd2.instructions = instruction->data.if_.instructions_then;
-				imd2.n_instructions = instruction->data.if_.n_instructions_then;
+				if (imd2.data.if_.cold) {
+					struct ColdBlock *block;
+
+					/* jne COLD_THEN */
+					block = emit_cold_jump(output, profile, sstack);
+					if (!block)
+						goto error;
+					block->instructions = instruction->data.if_.instructions_then;
+					block->n_instructions = instruction->data.if_.n_instructions_then;
+					block->label_idx = imd2.data.if_.label_idx;
+					block->profile_next = profile->next;
+					profile->next += count_counters(block->instructions,
+									block->n_instructions);
+
+					imd2.instructions = NULL;
+					imd2.n_instructions = 0;
+				} else if (imd2.data.if_.swapped) {
+					imd2.data.if_.profile_second = profile->next;
+					profile->next +=
+						count_counters(instruction->data.if_.instructions_then,
+							       instruction->data.if_.n_instructions_then);
+					imd2.data.if_.profile_end = profile->next +
+						count_counters(instruction->data.if_.instructions_else,
+							       instruction->data.if_.n_instructions_else);
+
+					imd2.instructions = instruction->data.if_.instructions_else;
+					imd2.n_instructions = instruction->data.if_.n_instructions_else;
+				} else {
+					imd2.instructions = instruction->data.if_.instructions_then;
+					imd2.n_instructions = instruction->data.if_.n_instructions_then;
+				}
 				break;
 			}
 			default:
 #ifdef DEBUG_COMPILE
 					dump_instruction(instruction, stack_sz);
 #endif
+				if (i + 1 < imd.n_instructions &&
+				    is_const_divisor(instruction,
+						     &imd.instructions[i + 1])) {
+					if (!emit_const_divrem(output, sstack,
+							       instruction,
+							       &imd.instructions[i + 1]))
+						goto error;
+					i += 1;
+					instruction = &imd.instructions[i];
+					break;
+				}
+
 				if (!wasmjit_compile_instruction(func_types,
 								 module_types,
 								 type,
 								 output,
 								 branches,
+								 traps,
+								 profile,
 								 memrefs,
 								 locals_md,
 								 n_locals,
 								 n_frame_locals,
 								 sstack,
 								 instruction,
+								 *run,
 								 !!max_stack,
 								 flags))
 					goto error;
@@ -2540,6 +5483,13 @@ static int wasmjit_compile_instructions(const struct FuncType *func_types,
 			if (max_stack) {
 				size_t n_values;
 				n_values = stack_depth(sstack);
+				if (instruction->opcode == OPCODE_RETURN_CALL) {
+					n_values += tail_call_scratch(type,
+								      &module_types->functypes[instruction->data.return_call.funcidx]);
+				} else if (instruction->opcode == OPCODE_RETURN_CALL_INDIRECT) {
+					n_values += tail_call_scratch(type,
+								      &func_types[instruction->data.return_call_indirect.typeidx]);
+				}
 				*max_stack = MMAX(*max_stack, n_values);
 			}
 
@@ -2586,6 +5536,7 @@ static int wasmjit_compile_instructions(const struct FuncType *func_types,
 
 				for (j = 0; j < arity; ++j) {
 					sstack->elts[imd.data.if_.stack_idx + j].type = instruction->data.block.blocktype;
+					sstack->elts[imd.data.if_.stack_idx + j].local = 0;
 				}
 
 				switch (instruction->opcode) {
@@ -2608,13 +5559,25 @@ static int wasmjit_compile_instructions(const struct FuncType *func_types,
 				size_t arity =
 					instruction->data.if_.blocktype !=
 					VALTYPE_NULL ? 1 : 0;
+				/* the arm compiled second */
+				const struct Instr *instructions_else =
+					instruction->data.if_.instructions_else;
+				size_t n_instructions_else =
+					instruction->data.if_.n_instructions_else;
+
+				if (imd.data.if_.swapped) {
+					instructions_else = instruction->data.if_.instructions_then;
+					n_instructions_else = instruction->data.if_.n_instructions_then;
+				}
 
-				if (!imd.data.if_.did_else) {
+				if (imd.data.if_.cold) {
+					/* then arm is a cold block */
+				} else if (!imd.data.if_.did_else) {
 					/* if (else_exist) {
 					   jump after else
 					   }
 					*/
-					if (instruction->data.if_.n_instructions_else) {
+					if (n_instructions_else) {
 						imd.data.if_.jump_to_after_else_offset = output->n_elts + 1;
 						/* jmp after_else_offset */
 						OUTS("\xe9\x90\x90\x90\x90");
@@ -2633,7 +5596,7 @@ static int wasmjit_compile_instructions(const struct FuncType *func_types,
 				}
 
 				if (!imd.data.if_.did_else &&
-				    instruction->data.if_.n_instructions_else) {
+				    n_instructions_else) {
 					/* if (else_exist) {
 					   output else case
 					   }
@@ -2654,9 +5617,12 @@ static int wasmjit_compile_instructions(const struct FuncType *func_types,
 						goto error;
 					stack = new_stack;
 
+					if (imd.data.if_.swapped)
+						profile->next = imd.data.if_.profile_second;
+
 					imd.cont = 0;
-					imd.instructions = instruction->data.if_.instructions_else;
-					imd.n_instructions = instruction->data.if_.n_instructions_else;
+					imd.instructions = instructions_else;
+					imd.n_instructions = n_instructions_else;
 					imd.data.if_.did_else = 1;
 
 					memcpy(&stack[stack_sz - 1],
@@ -2672,10 +5638,14 @@ static int wasmjit_compile_instructions(const struct FuncType *func_types,
 
 					for (j = 0; j < arity; ++j) {
 						sstack->elts[imd.data.if_.stack_idx + j].type = instruction->data.if_.blocktype;
+						sstack->elts[imd.data.if_.stack_idx + j].local = 0;
 					}
 
 					/* set labels position */
 					labels->elts[imd.data.if_.label_idx] = output->n_elts;
+
+					if (imd.data.if_.swapped)
+						profile->next = imd.data.if_.profile_end;
 				}
 				break;
 			}
@@ -2696,24 +5666,172 @@ static int wasmjit_compile_instructions(const struct FuncType *func_types,
 	return ret;
 }
 
+/*
+ * Walk the straight-line prefix of the body, stopping at the first
+ * control-flow instruction. Non-argument locals that are written there
+ * before they are read don't have to be zeroed in the prologue.
+ */
+static void find_local_inits(struct LocalsMD *locals_md,
+			     size_t n_inputs, size_t n_locals,
+			     const struct Instr *instructions,
+			     size_t n_instructions)
+{
+	size_t i;
+
+	for (i = n_inputs; i < n_locals; ++i)
+		locals_md[i].init = LOCAL_INIT_UNKNOWN;
+
+	for (i = 0; i < n_instructions; ++i) {
+		uint32_t localidx;
+		switch (instructions[i].opcode) {
+		case OPCODE_GET_LOCAL:
+			localidx = instructions[i].data.get_local.localidx;
+			if (localidx >= n_inputs &&
+			    locals_md[localidx].init == LOCAL_INIT_UNKNOWN)
+				locals_md[localidx].init = LOCAL_INIT_ZERO;
+			break;
+		case OPCODE_SET_LOCAL:
+		case OPCODE_TEE_LOCAL:
+			/* set_local and tee_local share the same extra */
+			localidx = instructions[i].data.set_local.localidx;
+			if (localidx >= n_inputs &&
+			    locals_md[localidx].init == LOCAL_INIT_UNKNOWN)
+				locals_md[localidx].init = LOCAL_INIT_WRITTEN;
+			break;
+		case OPCODE_UNREACHABLE:
+		case OPCODE_BLOCK:
+		case OPCODE_LOOP:
+		case OPCODE_IF:
+		case OPCODE_BR:
+		case OPCODE_BR_IF:
+		case OPCODE_BR_TABLE:
+		case OPCODE_RETURN:
+		case OPCODE_RETURN_CALL:
+		case OPCODE_RETURN_CALL_INDIRECT:
+			goto done;
+		default:
+			break;
+		}
+	}
+
+ done:
+	for (i = n_inputs; i < n_locals; ++i) {
+		if (locals_md[i].init == LOCAL_INIT_UNKNOWN)
+			locals_md[i].init = LOCAL_INIT_ZERO;
+	}
+}
+
+/* uses of each local, weighted by 8 for every loop they are nested in */
+static void count_local_uses(uint64_t *uses,
+			     const struct Instr *instructions,
+			     size_t n_instructions,
+			     uint64_t weight)
+{
+	size_t i;
+
+	for (i = 0; i < n_instructions; ++i) {
+		const struct Instr *instruction = &instructions[i];
+
+		switch (instruction->opcode) {
+		case OPCODE_GET_LOCAL:
+			uses[instruction->data.get_local.localidx] += weight;
+			break;
+		case OPCODE_SET_LOCAL:
+		case OPCODE_TEE_LOCAL:
+			/* set_local and tee_local share the same extra */
+			uses[instruction->data.set_local.localidx] += weight;
+			break;
+		case OPCODE_BLOCK:
+			count_local_uses(uses, instruction->data.block.instructions,
+					 instruction->data.block.n_instructions,
+					 weight);
+			break;
+		case OPCODE_LOOP:
+			count_local_uses(uses, instruction->data.loop.instructions,
+					 instruction->data.loop.n_instructions,
+					 MMIN(weight * 8, WASMJIT_LOCAL_USES_MAX_WEIGHT));
+			break;
+		case OPCODE_IF:
+			count_local_uses(uses, instruction->data.if_.instructions_then,
+					 instruction->data.if_.n_instructions_then,
+					 weight);
+			count_local_uses(uses, instruction->data.if_.instructions_else,
+					 instruction->data.if_.n_instructions_else,
+					 weight);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/*
+ * Give the most used integer locals in the frame one of the
+ * callee-saved %r12-%r15 each. Locals used only a few times aren't
+ * worth the swap in the prologue and the epilogue.
+ */
+static int find_local_regs(struct LocalsMD *locals_md, size_t n_locals,
+			   const struct Instr *instructions,
+			   size_t n_instructions)
+{
+	uint64_t *uses;
+	size_t i;
+	int reg;
+
+	uses = calloc(n_locals, sizeof(uses[0]));
+	if (n_locals && !uses)
+		return 0;
+
+	count_local_uses(uses, instructions, n_instructions, 1);
+
+	for (reg = 0; reg < WASMJIT_N_LOCAL_REGS; ++reg) {
+		size_t best = n_locals;
+
+		for (i = 0; i < n_locals; ++i) {
+			if (locals_md[i].reg >= 0 ||
+			    locals_md[i].fp_offset > 0 ||
+			    (locals_md[i].valtype != VALTYPE_I32 &&
+			     locals_md[i].valtype != VALTYPE_I64) ||
+			    uses[i] < WASMJIT_LOCAL_REG_MIN_USES)
+				continue;
+			if (best == n_locals || uses[i] > uses[best])
+				best = i;
+		}
+
+		if (best == n_locals)
+			break;
+		locals_md[best].reg = reg;
+	}
+
+	free(uses);
+
+	return 1;
+}
+
 char *wasmjit_compile_function(const struct FuncType *func_types,
 			       const struct ModuleTypes *module_types,
 			       const struct FuncType *type,
 			       const struct CodeSectionCode *code,
 			       struct MemoryReferences *memrefs,
+			       struct WasmJITPcMap *pc_map,
 			       size_t *out_size,
 			       size_t *stack_usage,
+			       const struct WasmJITFunctionProfile *fprofile,
 			       unsigned flags)
 {
 	char buf[sizeof(uint32_t)];
 	struct SizedBuffer outputv = { 0, NULL };
 	struct SizedBuffer *output = &outputv;
 	struct BranchPoints branches = { 0, NULL };
+	struct TrapPoints traps = { 0, NULL };
+	struct ProfileMD profile = { 0, NULL, 0, { 0, NULL } };
+	size_t epilogue_offset;
 	struct StaticStack sstack = { 0, NULL };
 	struct LabelContinuations labels = { 0, NULL };
 	struct LocalsMD *locals_md = NULL;
 	size_t n_frame_locals;
 	size_t n_locals;
+	size_t run = 0;
 	char *out;
 
 	{
@@ -2778,11 +5896,28 @@ char *wasmjit_compile_function(const struct FuncType *func_types,
 			}
 		}
 
+		find_local_inits(locals_md, type->n_inputs, n_locals,
+				 code->instructions, code->n_instructions);
+
+		for (i = 0; i < n_locals; ++i)
+			locals_md[i].reg = -1;
+		if ((flags & WASMJIT_COMPILE_FLAG_OPTIMIZE) &&
+		    !find_local_regs(locals_md, n_locals, code->instructions,
+				     code->n_instructions))
+			goto error;
+
 		if (n_locals - type->n_inputs > SIZE_MAX - (n_movs + n_xmm_movs))
 			goto error;
 		n_frame_locals = n_movs + n_xmm_movs + (n_locals - type->n_inputs);
+		/* the last slot holds the entry timestamp */
+		if (flags & WASMJIT_COMPILE_FLAG_CYCLES)
+			n_frame_locals += 1;
 	}
 
+	/* the prologue belongs to the function body */
+	if (!record_pc(pc_map, 0, code->offset))
+		goto error;
+
 	/* output prologue, i.e. create stack frame */
 	{
 		size_t n_movs = 0, n_xmm_movs = 0, i;
@@ -2873,31 +6008,70 @@ char *wasmjit_compile_function(const struct FuncType *func_types,
 		}
 
 		/* initialize and push locals to stack */
-		if (n_locals - type->n_inputs) {
-			if (n_locals - type->n_inputs == 1) {
-				/* movq $0, (%rsp) */
-				if (!output_buf
-				    (output, "\x48\xc7\x04\x24\x00\x00\x00\x00",
-				     8))
-					goto error;
-			} else {
+		{
+			size_t n_zero = 0;
+
+			for (i = type->n_inputs; i < n_locals; ++i) {
+				if (locals_md[i].init == LOCAL_INIT_ZERO)
+					n_zero += 1;
+			}
+
+			if (n_zero == n_locals - type->n_inputs &&
+			    n_zero > WASMJIT_ZERO_LOCALS_REP_THRESHOLD) {
+				/* the timestamp slot sits below the locals */
+				if (flags & WASMJIT_COMPILE_FLAG_CYCLES)
+					n_zero += 1;
+
 				/* mov %rsp, %rdi */
 				OUTS("\x48\x89\xe7");
 				/* xor %rax, %rax */
 				OUTS("\x48\x31\xc0");
 				/* mov $n_locals, %rcx */
 				OUTS("\x48\xc7\xc1");
-				if (n_locals - type->n_inputs > INT32_MAX)
+				if (n_zero > INT32_MAX)
 					goto error;
-				encode_le_uint32_t(n_locals - type->n_inputs, buf);
+				encode_le_uint32_t(n_zero, buf);
 				if (!output_buf(output, buf, sizeof(uint32_t)))
 					goto error;
 				/* rep stosq */
 				OUTS("\xf3\x48\xab");
+			} else if (n_zero) {
+				/* xorps %xmm0, %xmm0 */
+				OUTS("\x0f\x57\xc0");
+
+				/* adjacent locals are zeroed in pairs,
+				   local i + 1 lives just below local i */
+				i = type->n_inputs;
+				while (i < n_locals) {
+					if (locals_md[i].init != LOCAL_INIT_ZERO) {
+						i += 1;
+						continue;
+					}
+
+					if (i + 1 < n_locals &&
+					    locals_md[i + 1].init == LOCAL_INIT_ZERO) {
+						/* movups %xmm0, N(%rbp) */
+						OUTS("\x0f\x11\x85");
+						encode_le_uint32_t(locals_md[i + 1].fp_offset,
+								   buf);
+						i += 2;
+					} else {
+						/* movq %xmm0, N(%rbp) */
+						OUTS("\x66\x0f\xd6\x85");
+						encode_le_uint32_t(locals_md[i].fp_offset,
+								   buf);
+						i += 1;
+					}
+					if (!output_buf(output, buf, sizeof(uint32_t)))
+						goto error;
+				}
 			}
 		}
 	}
 
+	if (!emit_local_regs_load(output, locals_md, n_locals))
+		goto error;
+
 	if (WASMJIT_DEBUG_STACK) {
 		/* push %rbx */
 		OUTS("\x53");
@@ -2905,47 +6079,54 @@ char *wasmjit_compile_function(const struct FuncType *func_types,
 		OUTS("\x48\x89\xe3");
 	}
 
+	if (flags & (WASMJIT_COMPILE_FLAG_CALL_COUNTS |
+		     WASMJIT_COMPILE_FLAG_CYCLES)) {
+		if (!emit_stats_entry(output, memrefs, flags, n_frame_locals))
+			goto error;
+	}
+
+	if (flags & WASMJIT_COMPILE_FLAG_TIER_COUNTERS) {
+		if (!emit_tier_counter(output, memrefs, flags,
+				       n_frame_locals + !!WASMJIT_DEBUG_STACK))
+			goto error;
+	}
+
+	if (flags & WASMJIT_COMPILE_FLAG_EPOCH) {
+		if (!emit_epoch_check(output, memrefs, &profile, code->offset,
+				      n_frame_locals + !!WASMJIT_DEBUG_STACK))
+			goto error;
+	}
+
+	if (flags & WASMJIT_COMPILE_FLAG_PROFILE) {
+		profile.record = 1;
+	} else if (fprofile &&
+		   fprofile->n_counters == wasmjit_profile_n_counters(code)) {
+		profile.counters = fprofile->counters;
+	}
+
 	if (!wasmjit_compile_instructions(func_types, module_types, type,
-					  output, &labels, &branches, memrefs,
+					  output, &labels, &branches, &traps,
+					  &profile, memrefs, pc_map,
 					  locals_md, n_locals, n_frame_locals, &sstack,
 					  code->instructions, code->n_instructions,
-					  stack_usage, flags))
+					  &run, stack_usage, flags))
 		goto error;
 
-	if (stack_usage) {
-		/* 1 for return address */
-		/* 1 for rbp */
-		/* plus the locals stored on the frame */
-		*stack_usage += n_frame_locals + 1 + 1;
-		*stack_usage *= 8;
-		/*
-		  add buffer space for calls to runtime support
-		  functions (.e.g. wasmjit_resolve_indirect_call)
-		*/
-		*stack_usage += 128;
-	}
+	/* output epilogue */
+	epilogue_offset = output->n_elts;
 
-	/* fix branch points */
-	{
-		size_t i;
-		for (i = 0; i < branches.n_elts; ++i) {
-			char buf2[1 + sizeof(uint32_t)] = { 0xe9 };
-			struct BranchPointElt *branch = &branches.elts[i];
-			size_t continuation_offset = (branch->continuation_idx == FUNC_EXIT_CONT)
-				? output->n_elts
-				: labels.elts[branch->continuation_idx];
-			uint32_t rel =
-			    continuation_offset - branch->branch_offset -
-			    sizeof(buf2);
-			encode_le_uint32_t(rel, &buf2[1]);
-			memcpy(&output->elts[branch->branch_offset], buf2,
-			       sizeof(buf2));
-		}
-	}
+	/* the body's final end opcode */
+	if (!record_pc(pc_map, epilogue_offset, code->offset + code->size - 1))
+		goto error;
 
-	/* output epilogue */
 	assert(sstack.n_elts == FUNC_TYPE_N_OUTPUTS(type));
 
+	/* the result is still on the stack */
+	if (flags & WASMJIT_COMPILE_FLAG_CYCLES) {
+		if (!emit_stats_exit(output, memrefs, n_frame_locals))
+			goto error;
+	}
+
 	if (FUNC_TYPE_N_OUTPUTS(type)) {
 		assert(FUNC_TYPE_N_OUTPUTS(type) == 1);
 		assert(peek_stack(&sstack) == FUNC_TYPE_OUTPUT_TYPES(type)[0]);
@@ -2968,6 +6149,8 @@ char *wasmjit_compile_function(const struct FuncType *func_types,
 		}
 	}
 
+	if (!emit_local_regs_restore(output, locals_md, n_locals))
+		goto error;
 
 	if (WASMJIT_DEBUG_STACK) {
 		/* pop %rbx */
@@ -2991,6 +6174,126 @@ char *wasmjit_compile_function(const struct FuncType *func_types,
 	/* retq */
 	OUTS("\xc3");
 
+	/* output cold blocks, which may add more cold blocks */
+	{
+		size_t i;
+		for (i = 0; i < profile.cold.n_elts; ++i) {
+			struct ColdBlock *block = &profile.cold.elts[i];
+
+			encode_le_uint32_t(output->n_elts - block->rel_offset -
+					   sizeof(uint32_t),
+					   &output->elts[block->rel_offset]);
+
+			/* continue with the stack at the jump */
+			sstack.n_elts = 0;
+			if (block->sstack.n_elts) {
+				if (!stack_grow(&sstack, block->sstack.n_elts))
+					goto error;
+				memcpy(sstack.elts, block->sstack.elts,
+				       block->sstack.n_elts * sizeof(sstack.elts[0]));
+			}
+
+			if (block->epoch) {
+				if (!record_pc(pc_map, output->n_elts,
+					       block->wasm_offset))
+					goto error;
+				if (!emit_epoch_stub(output, memrefs, flags, block))
+					goto error;
+			} else if (block->br) {
+				if (!record_pc(pc_map, output->n_elts,
+					       block->br->offset))
+					goto error;
+				if (!emit_br_code(output, &sstack, &branches,
+						  block->br->data.br_if.labelidx))
+					goto error;
+			} else {
+				size_t max_stack, label_idx = block->label_idx;
+
+				profile.next = block->profile_next;
+				if (!wasmjit_compile_instructions(func_types, module_types, type,
+								  output, &labels, &branches, &traps,
+								  &profile, memrefs, pc_map,
+								  locals_md, n_locals, n_frame_locals, &sstack,
+								  block->instructions, block->n_instructions,
+								  &run, stack_usage ? &max_stack : NULL,
+								  flags))
+					goto error;
+
+				if (stack_usage)
+					*stack_usage = MMAX(*stack_usage, max_stack);
+
+				/* jmp AFTER_IF */
+				if (!bp_grow(&branches, 1))
+					goto error;
+				branches.elts[branches.n_elts - 1].branch_offset =
+					output->n_elts;
+				branches.elts[branches.n_elts - 1].continuation_idx =
+					label_idx;
+				OUTS("\xe9\x90\x90\x90\x90");
+			}
+		}
+	}
+
+	if (stack_usage) {
+		/* 1 for return address */
+		/* 1 for rbp */
+		/* plus the locals stored on the frame */
+		*stack_usage += n_frame_locals + 1 + 1;
+		*stack_usage *= 8;
+		/*
+		  add buffer space for calls to runtime support
+		  functions (.e.g. wasmjit_resolve_indirect_call)
+		*/
+		*stack_usage += 128;
+	}
+
+	/* fix branch points */
+	{
+		size_t i;
+		for (i = 0; i < branches.n_elts; ++i) {
+			char buf2[1 + sizeof(uint32_t)] = { 0xe9 };
+			struct BranchPointElt *branch = &branches.elts[i];
+			size_t continuation_offset = (branch->continuation_idx == FUNC_EXIT_CONT)
+				? epilogue_offset
+				: labels.elts[branch->continuation_idx];
+			uint32_t rel =
+			    continuation_offset - branch->branch_offset -
+			    sizeof(buf2);
+			encode_le_uint32_t(rel, &buf2[1]);
+			memcpy(&output->elts[branch->branch_offset], buf2,
+			       sizeof(buf2));
+		}
+	}
+
+	/* output out-of-line trap stubs, one per trap reason */
+	if (traps.n_elts &&
+	    !record_pc(pc_map, output->n_elts, WASMJIT_PC_MAP_NO_OFFSET))
+		goto error;
+
+	{
+		size_t i, j;
+		for (i = 0; i < traps.n_elts; ++i) {
+			int reason = traps.elts[i].reason;
+			size_t stub_offset = output->n_elts;
+
+			if (!reason)
+				continue;
+
+			if (!emit_trap(output, memrefs, flags, reason))
+				goto error;
+
+			for (j = i; j < traps.n_elts; ++j) {
+				struct TrapPointElt *trap = &traps.elts[j];
+				if (trap->reason != reason)
+					continue;
+				encode_le_uint32_t(stub_offset - trap->rel_offset -
+						   sizeof(uint32_t),
+						   &output->elts[trap->rel_offset]);
+				trap->reason = 0;
+			}
+		}
+	}
+
 	if (0) {
 	error:
 		free(output->elts);
@@ -3010,6 +6313,10 @@ char *wasmjit_compile_function(const struct FuncType *func_types,
 		free(branches.elts);
 	}
 
+	if (traps.elts) {
+		free(traps.elts);
+	}
+
 	if (sstack.elts) {
 		free(sstack.elts);
 	}
@@ -3018,6 +6325,14 @@ char *wasmjit_compile_function(const struct FuncType *func_types,
 		free(labels.elts);
 	}
 
+	{
+		size_t i;
+		for (i = 0; i < profile.cold.n_elts; ++i) {
+			free(profile.cold.elts[i].sstack.elts);
+		}
+		free(profile.cold.elts);
+	}
+
 	return out;
 }
 
@@ -3204,7 +6519,6 @@ char *wasmjit_compile_invoker_offset(struct FuncType *type,
 	struct SizedBuffer *output = &outputv;
 	char buf[sizeof(uint64_t)];
 	void *out = NULL;
-	int aligned;
 	size_t to_reserve;
 
 	for (i = 0; i < type->n_inputs; ++i) {
@@ -3221,11 +6535,20 @@ char *wasmjit_compile_invoker_offset(struct FuncType *type,
 		}
 	}
 
-	to_reserve = 1 + n_stack;
-	aligned = !(to_reserve % 2);
-	if (aligned) {
-		to_reserve += 1;
-	}
+	/* NB: use a frame pointer, the callee may return with a
+	   different %rsp if it tail called a function taking more stack
+	   arguments */
+
+	/* push %rbp */
+	OUTS("\x55");
+	/* mov %rsp, %rbp */
+	OUTS("\x48\x89\xe5");
+	/* push %rbx */
+	OUTS("\x53");
+
+	/* NB: stack arguments always get an even number of slots, plus
+	   one more to keep the stack aligned */
+	to_reserve = n_stack + n_stack % 2 + 1;
 
 	/* sub to_reserve*8, %rsp */
 	OUTS("\x48\x81\xec");
@@ -3233,12 +6556,6 @@ char *wasmjit_compile_invoker_offset(struct FuncType *type,
 	if (!output_buf(output, buf, sizeof(uint32_t)))
 		goto error;
 
-	/* mov %rbx, (to_reserve - 1) *8(%rsp), */
-	OUTS("\x48\x89\x9c\x24");
-	encode_le_uint32_t((to_reserve - 1) * 8, buf);
-	if (!output_buf(output, buf, sizeof(uint32_t)))
-		goto error;
-
 	/* mov %rdi, %rbx */
 	OUTS("\x48\x89\xfb");
 
@@ -3325,20 +6642,11 @@ char *wasmjit_compile_invoker_offset(struct FuncType *type,
 	if (!emit_indirect_call(output, flags))
 		goto error;
 
-	/* mov (to_reserve - 1) *8(%rsp), %rbx */
-	OUTS("\x48\x8b\x9c\x24");
-	encode_le_uint32_t((to_reserve - 1) * 8, buf);
-	if (!output_buf(output, buf, sizeof(uint32_t)))
-		goto error;
+	/* mov -8(%rbp), %rbx */
+	OUTS("\x48\x8b\x5d\xf8");
 
-	/* clean up stack */
-	if (to_reserve) {
-		/* add $const, %rsp */
-		OUTS("\x48\x81\xc4");
-		encode_le_uint32_t(to_reserve * 8, buf);
-		if (!output_buf(output, buf, sizeof(uint32_t)))
-			goto error;
-	}
+	/* leave */
+	OUTS("\xc9");
 
 	/* return */
 	OUTS("\xc3");
@@ -33,13 +33,30 @@
 extern "C" {
 #endif
 
+/* how compiled code finds a memory's base address and bound */
+enum {
+	/* load both from the MemInst on every access */
+	MEMORY_STRATEGY_RELOAD,
+	/* the base never moves so it's an immediate, the bound is loaded */
+	MEMORY_STRATEGY_FIXED_BASE,
+	/* the memory can't grow so both are immediates */
+	MEMORY_STRATEGY_FIXED,
+};
+
 struct ModuleTypes {
 	struct FuncType *functypes;
 	struct TableType *tabletypes;
 	struct MemoryType *memorytypes;
 	struct GlobalType *globaltypes;
+	/* per memory, NULL means all MEMORY_STRATEGY_RELOAD */
+	unsigned *memory_strategies;
+	size_t n_funcs;
+	size_t n_mems;
 };
 
+struct WasmJITFunctionProfile;
+struct WasmJITPcMap;
+
 struct MemoryReferences {
 	size_t n_elts;
 	struct MemoryReferenceElt {
@@ -48,10 +65,22 @@ struct MemoryReferences {
 			MEMREF_FUNC,
 			MEMREF_TABLE,
 			MEMREF_MEM,
+			MEMREF_MEM_DATA,
 			MEMREF_GLOBAL,
 			MEMREF_RESOLVE_INDIRECT_CALL,
 			MEMREF_TRAP,
 			MEMREF_STACK_TOP,
+			MEMREF_SELF,
+			MEMREF_TIER_UP,
+			MEMREF_PROFILE,
+			MEMREF_FUEL,
+			MEMREF_EPOCH,
+			MEMREF_EPOCH_DEADLINE,
+			MEMREF_EPOCH_DEADLINE_REACHED,
+			MEMREF_GROW_MEMORY,
+			MEMREF_ATOMIC_WAIT32,
+			MEMREF_ATOMIC_WAIT64,
+			MEMREF_ATOMIC_NOTIFY,
 		} type;
 		size_t code_offset;
 		size_t idx;
@@ -60,6 +89,24 @@ struct MemoryReferences {
 
 #define WASMJIT_COMPILE_FLAG_INTEL_RETPOLINE 1
 #define WASMJIT_COMPILE_FLAG_AMD_RETPOLINE 2
+/* count entries and loop iterations and call wasmjit_tier_up() when hot */
+#define WASMJIT_COMPILE_FLAG_TIER_COUNTERS 4
+/* count branches and call_indirect targets into MEMREF_PROFILE */
+#define WASMJIT_COMPILE_FLAG_PROFILE 8
+/* charge each straight-line run against the thread's fuel, MEMREF_FUEL
+   is the %fs relative offset of the counter */
+#define WASMJIT_COMPILE_FLAG_FUEL 16
+/* check the thread's epoch deadline on entry and at loop headers,
+   MEMREF_EPOCH_DEADLINE is the %fs relative offset of the deadline */
+#define WASMJIT_COMPILE_FLAG_EPOCH 32
+/* count calls into self->stats on entry */
+#define WASMJIT_COMPILE_FLAG_CALL_COUNTS 64
+/* also add the rdtsc delta between entry and exit to self->stats,
+   the start is kept in the frame slot below the locals */
+#define WASMJIT_COMPILE_FLAG_CYCLES 128
+/* tier 1: keep the hottest integer locals in %r12-%r15 and drop bounds
+   checks already done on the same local earlier in a straight-line run */
+#define WASMJIT_COMPILE_FLAG_OPTIMIZE 256
 
 unsigned wasmjit_detect_retpoline_flags(void);
 
@@ -68,10 +115,28 @@ char *wasmjit_compile_function(const struct FuncType *func_types,
 			       const struct FuncType *type,
 			       const struct CodeSectionCode *code,
 			       struct MemoryReferences *memrefs,
+			       struct WasmJITPcMap *pc_map,
 			       size_t *out_size,
 			       size_t *stack_usage,
+			       const struct WasmJITFunctionProfile *profile,
 			       unsigned flags);
 
+size_t wasmjit_profile_n_counters(const struct CodeSectionCode *code);
+/* counter offsets of call_indirect candidates, returns how many */
+size_t wasmjit_profile_targets(const struct CodeSectionCode *code,
+			       size_t *targets);
+/*
+ * Lays out counters recorded before inlining for code after it, blocks
+ * inlined from a callee take callees[codeidx]. out holds
+ * wasmjit_profile_n_counters(code) counters.
+ */
+int wasmjit_profile_inline_counters(const struct CodeSectionCode *code,
+				    const uint64_t *caller,
+				    size_t n_caller,
+				    const struct WasmJITFunctionProfile *callees,
+				    size_t n_callees,
+				    uint64_t *out);
+
 char *wasmjit_compile_hostfunc(struct FuncType *type,
 			       void *hostfunc,
 			       void *funcinst_ptr,
@@ -27,9 +27,15 @@
 #include <wasmjit/util.h>
 #include <wasmjit/compile.h>
 
+#ifndef __KERNEL__
+#include <wasmjit/perf.h>
+#include <wasmjit/gdb_jit.h>
+#endif
+
 #include <wasmjit/sys.h>
 
-static struct FuncInst *alloc_func(struct ModuleInst *module, void *_fptr,
+static struct FuncInst *alloc_func(struct ModuleInst *module,
+				   const char *name, void *_fptr,
 				   wasmjit_valtype_t _output, size_t n_inputs,
 				   wasmjit_valtype_t *inputs)
 {
@@ -74,6 +80,11 @@ static struct FuncInst *alloc_func(struct ModuleInst *module, void *_fptr,
 						  tmp_func->invoker_size))
 		goto error;
 
+#ifndef __KERNEL__
+	if (wasmjit_perf_enabled())
+		wasmjit_perf_load_host_func(name, tmp_func);
+#endif
+
 	if (0) {
 	error:
 		if (tmp_func)
@@ -87,10 +98,24 @@ static struct FuncInst *alloc_func(struct ModuleInst *module, void *_fptr,
 	return tmp_func;
 }
 
+static void register_debug_info(struct ModuleInst *module)
+{
+#ifndef __KERNEL__
+	/* best effort */
+	if (wasmjit_gdb_jit_enabled())
+		wasmjit_gdb_jit_register_module_inst(module, NULL);
+#else
+	(void)module;
+#endif
+}
+
 struct NamedModule *wasmjit_instantiate_emscripten_runtime(uint32_t static_bump,
 							   int has_table,
 							   size_t tablemin,
 							   size_t tablemax,
+							   size_t memorymin,
+							   size_t memorymax,
+							   unsigned memory_flags,
 							   size_t *amt)
 {
 	struct {
@@ -101,7 +126,6 @@ struct NamedModule *wasmjit_instantiate_emscripten_runtime(uint32_t static_bump,
 	struct FuncInst *start_func = NULL;
 	struct FuncInst **tmp_table_buf = NULL;
 	struct TableInst *tmp_table = NULL;
-	char *tmp_mem_buf = NULL;
 	struct MemInst *tmp_mem = NULL;
 	struct GlobalInst *tmp_global = NULL;
 	struct ModuleInst *module = NULL;
@@ -141,6 +165,7 @@ struct NamedModule *wasmjit_instantiate_emscripten_runtime(uint32_t static_bump,
 				goto error;				\
 			module->free_private_data = &free;		\
 		}							\
+		register_debug_info(module);				\
 		if (start_func) {					\
 			wasmjit_invoke_function(start_func, NULL, NULL); \
 		}							\
@@ -162,7 +187,7 @@ struct NamedModule *wasmjit_instantiate_emscripten_runtime(uint32_t static_bump,
 #define DEFINE_WASM_FUNCTION(_name, _fptr, _output, n, ...)	  \
 	{							  \
 		wasmjit_valtype_t inputs[] = { __VA_ARGS__ };		\
-		tmp_func = alloc_func(module, _fptr, _output, n, inputs); \
+		tmp_func = alloc_func(module, #_name, _fptr, _output, n, inputs); \
 		if (!tmp_func)						\
 			goto error;					\
 		LVECTOR_GROW(&module->funcs, 1);			\
@@ -177,7 +202,7 @@ struct NamedModule *wasmjit_instantiate_emscripten_runtime(uint32_t static_bump,
 
 #define DEFINE_WASM_START_FUNCTION(fptr)				\
 	do {								\
-		start_func = alloc_func(module, fptr, VALTYPE_NULL, 0, NULL); \
+		start_func = alloc_func(module, "start", fptr, VALTYPE_NULL, 0, NULL); \
 		if (!start_func)					\
 			goto error;					\
 	} while (0);
@@ -211,16 +236,19 @@ struct NamedModule *wasmjit_instantiate_emscripten_runtime(uint32_t static_bump,
 		module->exports.elts[module->exports.n_elts - 1].value.table = module->tables.elts[module->tables.n_elts - 1]; \
 	}
 
+#define DEFINE_EXTERNAL_WASM_MEMORY(name)				\
+	DEFINE_WASM_MEMORY(name, name ## min, name ## max)
+
 #define DEFINE_WASM_MEMORY(_name, _min, _max)	\
 	{						\
-		tmp_mem_buf = calloc((_min) * WASM_PAGE_SIZE, 1);	\
-		if ((_min) && !tmp_mem_buf)				\
-			goto error;				\
 		tmp_mem = calloc(1, sizeof(struct MemInst));	\
-		tmp_mem->data = tmp_mem_buf;			\
-		tmp_mem_buf = NULL;				\
-		tmp_mem->size = (_min) * WASM_PAGE_SIZE;	\
-		tmp_mem->max = (_max) * WASM_PAGE_SIZE;		\
+		if (!tmp_mem)					\
+			goto error;				\
+		if (!wasmjit_map_memory(tmp_mem,		\
+					(_min) * WASM_PAGE_SIZE, \
+					(_max) * WASM_PAGE_SIZE, \
+					memory_flags))		\
+			goto error;				\
 		LVECTOR_GROW(&module->mems, 1);			\
 		module->mems.elts[module->mems.n_elts - 1] = tmp_mem; \
 		tmp_mem = NULL;					\
@@ -290,10 +318,8 @@ struct NamedModule *wasmjit_instantiate_emscripten_runtime(uint32_t static_bump,
 		free(tmp_table->data);
 		free(tmp_table);
 	}
-	if (tmp_mem_buf)
-		free(tmp_mem_buf);
 	if (tmp_mem) {
-		free(tmp_mem->data);
+		wasmjit_unmap_memory(tmp_mem);
 		free(tmp_mem);
 	}
 	if (tmp_global)
@@ -35,6 +35,9 @@ struct NamedModule *wasmjit_instantiate_emscripten_runtime(uint32_t static_bump,
 							   int has_table,
 							   size_t tablemin,
 							   size_t tablemax,
+							   size_t memorymin,
+							   size_t memorymax,
+							   unsigned memory_flags,
 							   size_t *amt);
 
 #ifdef __cplusplus
@@ -55,6 +55,53 @@ int wasmjit_unmap_code_segment(void *code, size_t code_size)
 	return 1;
 }
 
+int wasmjit_map_memory(struct MemInst *meminst, size_t size, size_t max,
+		       unsigned flags)
+{
+	/* huge pages are a hint, but there are no threads to share with */
+	if (flags & WASMJIT_MEMORY_FLAG_SHARED)
+		return 0;
+	meminst->data = NULL;
+	if (size) {
+		meminst->data = calloc(size, 1);
+		if (!meminst->data)
+			return 0;
+	}
+	meminst->size = size;
+	meminst->max = max;
+	meminst->flags = 0;
+	return 1;
+}
+
+void wasmjit_unmap_memory(struct MemInst *meminst)
+{
+	free(meminst->data);
+}
+
+int wasmjit_extend_memory(struct MemInst *meminst, size_t new_size)
+{
+	/* calloc'd, can't grow without moving */
+	(void)meminst;
+	(void)new_size;
+	return 0;
+}
+
+int wasmjit_memory_huge_page_bytes(const struct MemInst *meminst,
+				   size_t *bytes)
+{
+	(void)meminst;
+	*bytes = 0;
+	return 1;
+}
+
+int wasmjit_memory_usage(const struct MemInst *meminst,
+			 size_t *reserved, size_t *committed,
+			 size_t *resident)
+{
+	*reserved = *committed = *resident = meminst->size;
+	return 1;
+}
+
 wasmjit_thread_state *wasmjit_get_jmp_buf(void)
 {
 	return wasmjit_get_ktls()->jmp_buf;
@@ -81,6 +128,26 @@ int wasmjit_set_stack_top(void *stack_top)
 
 #include <wasmjit/tls.h>
 
+#include <valgrind/valgrind.h>
+
+/* from valgrind's memcheck.h, which isn't vendored */
+#define MEMCHECK_MAKE_MEM_NOACCESS (VG_USERREQ_TOOL_BASE('M', 'C') + 0)
+#define MEMCHECK_MAKE_MEM_DEFINED (VG_USERREQ_TOOL_BASE('M', 'C') + 2)
+
+/* memcheck considers every mapping addressable whatever its
+   protection, so linear memory is marked by hand: only what is
+   committed may be touched */
+#define MEMCHECK_MARK(request, addr, len)				\
+	VALGRIND_DO_CLIENT_REQUEST_STMT(request, addr, len, 0, 0, 0)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
 #include <sys/mman.h>
 
 void *wasmjit_map_code_segment(size_t code_size)
@@ -95,15 +162,447 @@ void *wasmjit_map_code_segment(size_t code_size)
 
 int wasmjit_mark_code_segment_executable(void *code, size_t code_size)
 {
+	/* the range may have held other code before, and it was
+	   patched since being mapped */
+	VALGRIND_DISCARD_TRANSLATIONS(code, code_size);
 	return !mprotect(code, code_size, PROT_READ | PROT_EXEC);
 }
 
 
 int wasmjit_unmap_code_segment(void *code, size_t code_size)
 {
+	VALGRIND_DISCARD_TRANSLATIONS(code, code_size);
 	return !munmap(code, code_size);
 }
 
+#define WASMJIT_MEMORY_RESERVATION (WASM_MAX_PAGES * WASM_PAGE_SIZE)
+#define WASMJIT_HUGE_PAGE_SIZE ((size_t) 2 * 1024 * 1024)
+
+#define ROUND_UP(n, to) (((n) + (to) - 1) / (to) * (to))
+#define MEMORY_FLAGS_HUGE \
+	(WASMJIT_MEMORY_FLAG_HUGE_PAGES | WASMJIT_MEMORY_FLAG_HUGETLB)
+
+static size_t memory_reservation(size_t max, unsigned flags)
+{
+	size_t reserved = WASMJIT_MEMORY_RESERVATION;
+
+	if (max && max < WASMJIT_MEMORY_RESERVATION)
+		reserved = max;
+	if (flags & MEMORY_FLAGS_HUGE)
+		reserved = ROUND_UP(reserved, WASMJIT_HUGE_PAGE_SIZE);
+	return reserved;
+}
+
+/* huge pages are committed whole, the tail past size is unreachable
+   from wasm since accesses are checked against size */
+static size_t memory_committed(size_t size, unsigned flags)
+{
+	return (flags & MEMORY_FLAGS_HUGE)
+		? ROUND_UP(size, WASMJIT_HUGE_PAGE_SIZE)
+		: size;
+}
+
+static int commit_memory(char *data, size_t offset, size_t end,
+			 unsigned flags)
+{
+	void *ret;
+
+	if (offset == end)
+		return 1;
+
+	if (!(flags & WASMJIT_MEMORY_FLAG_HUGETLB)) {
+		if (mprotect(data + offset, end - offset,
+			     PROT_READ | PROT_WRITE))
+			return 0;
+		/* zero filled */
+		MEMCHECK_MARK(MEMCHECK_MAKE_MEM_DEFINED, data + offset,
+			      end - offset);
+		return 1;
+	}
+
+	/* hugetlb pages can't be reserved lazily, so each commit maps
+	   its own range and fails here rather than with SIGBUS later */
+	ret = mmap(data + offset, end - offset, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB,
+		   -1, 0);
+	if (ret != MAP_FAILED) {
+		MEMCHECK_MARK(MEMCHECK_MAKE_MEM_DEFINED, data + offset,
+			      end - offset);
+		return 1;
+	}
+
+	/* don't leave a hole in the reservation */
+	mmap(data + offset, end - offset, PROT_NONE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+	return 0;
+}
+
+struct PooledMemory {
+	char *data;
+	size_t reserved;
+	unsigned flags;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	size_t n_free;
+	struct PooledMemory *free;
+	struct WasmJITMemoryPoolStats stats;
+} memory_pool = { PTHREAD_MUTEX_INITIALIZER, 0, NULL, { 0, 0, 0, 0, 0, 0 } };
+
+int wasmjit_memory_pool_init(size_t capacity)
+{
+	struct PooledMemory *new_free = NULL;
+	size_t i;
+
+	if (capacity) {
+		new_free = calloc(capacity, sizeof(new_free[0]));
+		if (!new_free)
+			return 0;
+	}
+
+	pthread_mutex_lock(&memory_pool.lock);
+
+	for (i = 0; i < memory_pool.n_free; ++i) {
+		if (i < capacity)
+			new_free[i] = memory_pool.free[i];
+		else
+			munmap(memory_pool.free[i].data,
+			       memory_pool.free[i].reserved);
+	}
+
+	free(memory_pool.free);
+	memory_pool.free = new_free;
+	if (memory_pool.n_free > capacity)
+		memory_pool.n_free = capacity;
+	memory_pool.stats.capacity = capacity;
+
+	pthread_mutex_unlock(&memory_pool.lock);
+
+	return 1;
+}
+
+void wasmjit_memory_pool_stats(struct WasmJITMemoryPoolStats *stats)
+{
+	pthread_mutex_lock(&memory_pool.lock);
+	*stats = memory_pool.stats;
+	stats->n_free = memory_pool.n_free;
+	pthread_mutex_unlock(&memory_pool.lock);
+}
+
+static char *memory_pool_acquire(size_t reserved, unsigned flags)
+{
+	char *data = NULL;
+	size_t i;
+
+	pthread_mutex_lock(&memory_pool.lock);
+
+	if (memory_pool.stats.capacity) {
+		for (i = memory_pool.n_free; i-- > 0;) {
+			if (memory_pool.free[i].reserved == reserved &&
+			    memory_pool.free[i].flags == flags) {
+				data = memory_pool.free[i].data;
+				memory_pool.free[i] =
+					memory_pool.free[--memory_pool.n_free];
+				break;
+			}
+		}
+
+		if (data)
+			memory_pool.stats.hits++;
+		else
+			memory_pool.stats.misses++;
+	}
+
+	pthread_mutex_unlock(&memory_pool.lock);
+
+	return data;
+}
+
+static int memory_pool_release(char *data, size_t reserved,
+			       size_t committed, unsigned flags)
+{
+	struct timespec start, end;
+	int ret = 0;
+
+	if (!__atomic_load_n(&memory_pool.stats.capacity, __ATOMIC_RELAXED))
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* drops anonymous and snapshot pages alike, leaving the
+	   reservation as wasmjit_map_memory() made it */
+	if (committed &&
+	    (mmap(data, committed, PROT_NONE,
+		  MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE,
+		  -1, 0) == MAP_FAILED ||
+	     ((flags & WASMJIT_MEMORY_FLAG_HUGE_PAGES) &&
+	      madvise(data, committed, MADV_HUGEPAGE))))
+		return 0;
+	MEMCHECK_MARK(MEMCHECK_MAKE_MEM_NOACCESS, data, committed);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	pthread_mutex_lock(&memory_pool.lock);
+
+	if (memory_pool.n_free < memory_pool.stats.capacity) {
+		memory_pool.free[memory_pool.n_free].data = data;
+		memory_pool.free[memory_pool.n_free].reserved = reserved;
+		memory_pool.free[memory_pool.n_free].flags = flags;
+		memory_pool.n_free++;
+		memory_pool.stats.resets++;
+		memory_pool.stats.reset_ns +=
+			(end.tv_sec - start.tv_sec) * UINT64_C(1000000000) +
+			end.tv_nsec - start.tv_nsec;
+		ret = 1;
+	}
+
+	pthread_mutex_unlock(&memory_pool.lock);
+
+	return ret;
+}
+
+int wasmjit_map_memory(struct MemInst *meminst, size_t size, size_t max,
+		       unsigned flags)
+{
+	size_t reserved = memory_reservation(max, flags);
+	size_t mapped = reserved;
+	char *data;
+
+	if (size > reserved)
+		return 0;
+
+	data = memory_pool_acquire(reserved, flags);
+	if (data)
+		goto commit;
+
+	/* huge pages need 2MiB aligned virtual addresses */
+	if (flags & MEMORY_FLAGS_HUGE)
+		mapped += WASMJIT_HUGE_PAGE_SIZE;
+
+	/* only address space until it's committed, and committed
+	   pages cost nothing until they're touched */
+	data = mmap(NULL, mapped, PROT_NONE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (data == MAP_FAILED)
+		return 0;
+
+	if (flags & MEMORY_FLAGS_HUGE) {
+		char *aligned = (char *) ROUND_UP((uintptr_t) data,
+						  WASMJIT_HUGE_PAGE_SIZE);
+
+		if (aligned != data)
+			munmap(data, aligned - data);
+		if (aligned + reserved != data + mapped)
+			munmap(aligned + reserved,
+			       data + mapped - (aligned + reserved));
+		data = aligned;
+	}
+
+	MEMCHECK_MARK(MEMCHECK_MAKE_MEM_NOACCESS, data, reserved);
+
+	if ((flags & WASMJIT_MEMORY_FLAG_HUGE_PAGES) &&
+	    madvise(data, reserved, MADV_HUGEPAGE)) {
+		/* not available, fall back to normal pages */
+		munmap(data, reserved);
+		return wasmjit_map_memory(meminst, size, max,
+					  flags & ~WASMJIT_MEMORY_FLAG_HUGE_PAGES);
+	}
+
+commit:
+	if (!commit_memory(data, 0, memory_committed(size, flags), flags)) {
+		munmap(data, reserved);
+		return 0;
+	}
+
+	meminst->data = data;
+	meminst->size = size;
+	meminst->max = max;
+	meminst->flags = flags;
+	return 1;
+}
+
+void wasmjit_unmap_memory(struct MemInst *meminst)
+{
+	size_t reserved;
+
+	if (!meminst->data)
+		return;
+
+	reserved = memory_reservation(meminst->max, meminst->flags);
+	if (!memory_pool_release(meminst->data, reserved,
+				 memory_committed(meminst->size, meminst->flags),
+				 meminst->flags))
+		munmap(meminst->data, reserved);
+}
+
+int wasmjit_extend_memory(struct MemInst *meminst, size_t new_size)
+{
+	assert(new_size >= meminst->size);
+
+	if (new_size > memory_reservation(meminst->max, meminst->flags))
+		return 0;
+
+	if (!commit_memory(meminst->data,
+			   memory_committed(meminst->size, meminst->flags),
+			   memory_committed(new_size, meminst->flags),
+			   meminst->flags))
+		return 0;
+
+	/* read without a lock by code running on other threads */
+	__atomic_store_n(&meminst->size, new_size, __ATOMIC_RELEASE);
+	return 1;
+}
+
+int wasmjit_memory_map_image(struct MemInst *meminst, int fd,
+			     size_t offset, size_t size)
+{
+	size_t done;
+
+	assert(size <= meminst->size);
+
+	if (!size)
+		return 1;
+
+	if (!(meminst->flags & WASMJIT_MEMORY_FLAG_HUGETLB))
+		return mmap(meminst->data, size, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_FIXED, fd, offset) != MAP_FAILED;
+
+	/* can't put small pages inside a hugetlb mapping */
+	for (done = 0; done < size;) {
+		ssize_t ret = pread(fd, meminst->data + done, size - done,
+				    offset + done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return 0;
+		done += ret;
+	}
+
+	return 1;
+}
+
+int wasmjit_memory_is_zero(const struct MemInst *meminst, size_t size)
+{
+	const uint64_t *words = (const uint64_t *) meminst->data;
+	size_t i;
+
+	assert(size <= meminst->size && !(size % sizeof(words[0])));
+
+	/* untouched pages read as the shared zero page, nothing is
+	   allocated. mincore() would miss pages that were swapped out */
+	for (i = 0; i < size / sizeof(words[0]); ++i) {
+		if (words[i])
+			return 0;
+	}
+
+	return 1;
+}
+
+/* /proc/self/pagemap entry bits */
+#define PAGEMAP_PRESENT (UINT64_C(1) << 63)
+#define PAGEMAP_FILE_OR_SHARED (UINT64_C(1) << 61)
+
+int wasmjit_memory_usage(const struct MemInst *meminst,
+			 size_t *reserved, size_t *committed,
+			 size_t *resident)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE), i, n_pages;
+	uint64_t entries[512];
+	int fd;
+
+	*reserved = *committed = *resident = 0;
+	if (!meminst->data)
+		return 1;
+
+	*reserved = memory_reservation(meminst->max, meminst->flags);
+	*committed = memory_committed(meminst->size, meminst->flags);
+
+	n_pages = (*committed + page_size - 1) / page_size;
+	if (!n_pages)
+		return 1;
+
+	fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	/* mincore() would also count page cache pages of a data image
+	   or snapshot mapped into every instance, only count the pages
+	   this instance has its own copy of */
+	for (i = 0; i < n_pages;) {
+		size_t n = n_pages - i, j;
+		ssize_t ret;
+
+		if (n > sizeof(entries) / sizeof(entries[0]))
+			n = sizeof(entries) / sizeof(entries[0]);
+
+		ret = pread(fd, entries, n * sizeof(entries[0]),
+			    ((uintptr_t) meminst->data / page_size + i) *
+			    sizeof(entries[0]));
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0 || ret % sizeof(entries[0])) {
+			close(fd);
+			return 0;
+		}
+		n = ret / sizeof(entries[0]);
+
+		for (j = 0; j < n; ++j) {
+			if ((entries[j] & PAGEMAP_PRESENT) &&
+			    !(entries[j] & PAGEMAP_FILE_OR_SHARED))
+				*resident += page_size;
+		}
+		i += n;
+	}
+
+	close(fd);
+
+	return 1;
+}
+
+int wasmjit_memory_huge_page_bytes(const struct MemInst *meminst,
+				   size_t *bytes)
+{
+	uintptr_t start, end;
+	int in_memory = 0;
+	char line[256];
+	FILE *stream;
+
+	*bytes = 0;
+	if (!meminst->data)
+		return 1;
+
+	start = (uintptr_t) meminst->data;
+	end = start + memory_reservation(meminst->max, meminst->flags);
+
+	stream = fopen("/proc/self/smaps", "r");
+	if (!stream)
+		return 0;
+
+	/* the reservation is split into several vmas once committed */
+	while (fgets(line, sizeof(line), stream)) {
+		uintptr_t vma_start, vma_end;
+		unsigned long kb;
+
+		if (sscanf(line, "%" SCNxPTR "-%" SCNxPTR " ",
+			   &vma_start, &vma_end) == 2) {
+			in_memory = vma_start >= start && vma_end <= end;
+			continue;
+		}
+
+		if (!in_memory)
+			continue;
+
+		if (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1 ||
+		    sscanf(line, "Private_Hugetlb: %lu kB", &kb) == 1)
+			*bytes += kb * 1024;
+	}
+
+	fclose(stream);
+
+	return 1;
+}
+
 wasmjit_tls_key_t jmp_buf_key;
 
 __attribute__((constructor))
@@ -148,6 +647,85 @@ int wasmjit_set_stack_top(void *stack_top)
 	return wasmjit_set_tls_key(stack_top_key, stack_top);
 }
 
+/* in the static TLS block so its %fs offset is the same on every thread */
+static __thread int64_t fuel __attribute__((tls_model("initial-exec")));
+
+void wasmjit_set_fuel(int64_t new_fuel)
+{
+	fuel = new_fuel;
+}
+
+int64_t wasmjit_get_fuel(void)
+{
+	return fuel;
+}
+
+static uintptr_t thread_pointer(void)
+{
+	uintptr_t tp;
+
+	/* %fs:0 holds the thread pointer on x86_64 */
+	__asm__ ("mov %%fs:0, %0" : "=r" (tp));
+	return tp;
+}
+
+uintptr_t wasmjit_fuel_tls_offset(void)
+{
+	return (uintptr_t) &fuel - thread_pointer();
+}
+
+static uint64_t epoch;
+static __thread uint64_t epoch_deadline
+__attribute__((tls_model("initial-exec"))) = UINT64_MAX;
+static __thread wasmjit_epoch_callback_t epoch_callback;
+static __thread void *epoch_callback_data;
+
+uint64_t wasmjit_increment_epoch(void)
+{
+	return __atomic_add_fetch(&epoch, 1, __ATOMIC_RELAXED);
+}
+
+void wasmjit_set_epoch_deadline(uint64_t delta)
+{
+	uint64_t now = __atomic_load_n(&epoch, __ATOMIC_RELAXED);
+
+	epoch_deadline = delta > UINT64_MAX - now ? UINT64_MAX : now + delta;
+}
+
+void wasmjit_clear_epoch_deadline(void)
+{
+	epoch_deadline = UINT64_MAX;
+}
+
+void wasmjit_set_epoch_callback(wasmjit_epoch_callback_t callback,
+				void *data)
+{
+	epoch_callback = callback;
+	epoch_callback_data = data;
+}
+
+/* called from JIT code */
+void wasmjit_epoch_deadline_reached(void)
+{
+	uint64_t delta;
+
+	delta = epoch_callback ? epoch_callback(epoch_callback_data) : 0;
+	if (!delta)
+		wasmjit_trap(WASMJIT_TRAP_INTERRUPTED);
+
+	wasmjit_set_epoch_deadline(delta);
+}
+
+uint64_t *wasmjit_epoch_address(void)
+{
+	return &epoch;
+}
+
+uintptr_t wasmjit_epoch_deadline_tls_offset(void)
+{
+	return (uintptr_t) &epoch_deadline - thread_pointer();
+}
+
 #endif
 
 __attribute__((noreturn))
@@ -22,6 +22,8 @@
   SOFTWARE.
  */
 
+#include <wasmjit/elf_relocatable.h>
+
 #include <wasmjit/compile.h>
 #include <wasmjit/vector.h>
 #include <wasmjit/util.h>
@@ -227,6 +229,10 @@ void *wasmjit_output_elf_relocatable(const char *module_name,
 		init_static_module_symbol,
 		resolve_indirect_call_symbol,
 		trap_symbol,
+		grow_memory_symbol,
+		atomic_wait32_symbol,
+		atomic_wait64_symbol,
+		atomic_notify_symbol,
 		func_code_start,
 		n_imported_funcs, n_imported_tables,
 		n_imported_mems, n_imported_globals,
@@ -836,6 +842,7 @@ void *wasmjit_output_elf_relocatable(const char *module_name,
 	for (i = 0; i < module_mems.n_elts; ++i) {
 		module_types.memorytypes[i] = module_mems.elts[i].type;
 	}
+	module_types.n_mems = module_mems.n_elts;
 	for (i = 0; i < module_globals.n_elts; ++i) {
 		module_types.globaltypes[i] = module_globals.elts[i].type;
 	}
@@ -862,8 +869,10 @@ void *wasmjit_output_elf_relocatable(const char *module_name,
 						ft,
 						&module->code_section.codes[i],
 						memrefs,
+						NULL,
 						&code_size,
 						NULL,
+						NULL,
 						0);
 		if (!code)
 			goto error;
@@ -1009,6 +1018,54 @@ void *wasmjit_output_elf_relocatable(const char *module_name,
 			goto error;
 	}
 
+	grow_memory_symbol = symbols->n_elts;
+	{
+		size_t string_offset;
+		string_offset = strtab->n_elts;
+		if (!output_buf(strtab, "wasmjit_grow_memory",
+				strlen("wasmjit_grow_memory") + 1))
+			goto error;
+		if (!add_symbol(symbols, string_offset, 0, STB_GLOBAL,
+				0, 0, 0, 0))
+			goto error;
+	}
+
+	atomic_wait32_symbol = symbols->n_elts;
+	{
+		size_t string_offset;
+		string_offset = strtab->n_elts;
+		if (!output_buf(strtab, "wasmjit_atomic_wait32",
+				strlen("wasmjit_atomic_wait32") + 1))
+			goto error;
+		if (!add_symbol(symbols, string_offset, 0, STB_GLOBAL,
+				0, 0, 0, 0))
+			goto error;
+	}
+
+	atomic_wait64_symbol = symbols->n_elts;
+	{
+		size_t string_offset;
+		string_offset = strtab->n_elts;
+		if (!output_buf(strtab, "wasmjit_atomic_wait64",
+				strlen("wasmjit_atomic_wait64") + 1))
+			goto error;
+		if (!add_symbol(symbols, string_offset, 0, STB_GLOBAL,
+				0, 0, 0, 0))
+			goto error;
+	}
+
+	atomic_notify_symbol = symbols->n_elts;
+	{
+		size_t string_offset;
+		string_offset = strtab->n_elts;
+		if (!output_buf(strtab, "wasmjit_atomic_notify",
+				strlen("wasmjit_atomic_notify") + 1))
+			goto error;
+		if (!add_symbol(symbols, string_offset, 0, STB_GLOBAL,
+				0, 0, 0, 0))
+			goto error;
+	}
+
 	/* add imported symbols */
 #define ADD_IMPORTED_SYMBOLS(_name)		\
 	do {							\
@@ -1181,6 +1238,18 @@ void *wasmjit_output_elf_relocatable(const char *module_name,
 			case MEMREF_TRAP:
 				symidx = trap_symbol;
 				break;
+			case MEMREF_GROW_MEMORY:
+				symidx = grow_memory_symbol;
+				break;
+			case MEMREF_ATOMIC_WAIT32:
+				symidx = atomic_wait32_symbol;
+				break;
+			case MEMREF_ATOMIC_WAIT64:
+				symidx = atomic_wait64_symbol;
+				break;
+			case MEMREF_ATOMIC_NOTIFY:
+				symidx = atomic_notify_symbol;
+				break;
 			default:
 				assert(0);
 				__builtin_unreachable();
@@ -1555,6 +1624,138 @@ void *wasmjit_output_elf_relocatable(const char *module_name,
 	return NULL;
 }
 
+void *wasmjit_output_elf_symbol_file(const struct WasmJITElfSymbol *syms,
+				     size_t n_syms,
+				     size_t *outsize)
+{
+	enum {
+		NULL_SECTION_IDX,
+		TEXT_SECTION_IDX,
+		SYMTAB_SECTION_IDX,
+		STRTAB_SECTION_IDX,
+		SHSTRTAB_SECTION_IDX,
+		NSECTIONS,
+	};
+	static const char shstrtab[] = "\0.text\0.symtab\0.strtab\0.shstrtab";
+	struct SizedBuffer outputv = { 0, NULL };
+	struct SizedBuffer *output = &outputv;
+	struct SizedBuffer strtabv = { 0, NULL };
+	struct SizedBuffer *strtab = &strtabv;
+	struct Symbols symbolsv = { 0, NULL };
+	struct Symbols *symbols = &symbolsv;
+	Elf64_Ehdr hdr;
+	Elf64_Shdr secs[NSECTIONS];
+	uintptr_t text_start = UINTPTR_MAX, text_end = 0;
+	size_t i, section_header_start, symtab_section_start,
+		strtab_section_start, shstrtab_section_start;
+
+	for (i = 0; i < n_syms; ++i) {
+		if (syms[i].addr < text_start)
+			text_start = syms[i].addr;
+		if (syms[i].addr + syms[i].size > text_end)
+			text_end = syms[i].addr + syms[i].size;
+	}
+	if (!n_syms)
+		text_start = 0;
+
+	/* symbol values are relative to .text, which is placed at the code */
+	if (!output_buf(strtab, "", 1))
+		goto error;
+	if (!add_symbol(symbols, 0, 0, 0, 0, 0, 0, 0))
+		goto error;
+	for (i = 0; i < n_syms; ++i) {
+		uint32_t string_offset = strtab->n_elts;
+
+		if (!output_buf(strtab, syms[i].name, strlen(syms[i].name) + 1))
+			goto error;
+		if (!add_symbol(symbols, string_offset, STT_FUNC, STB_GLOBAL,
+				STV_DEFAULT, TEXT_SECTION_IDX,
+				syms[i].addr - text_start, syms[i].size))
+			goto error;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.e_ident, ELFMAG, SELFMAG);
+	hdr.e_ident[EI_CLASS] = ELFCLASS64;
+	hdr.e_ident[EI_DATA] = ELFDATA2LSB;
+	hdr.e_ident[EI_VERSION] = EV_CURRENT;
+	hdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+	hdr.e_type = ET_REL;
+	hdr.e_machine = EM_X86_64;
+	hdr.e_version = EV_CURRENT;
+	hdr.e_shoff = sizeof(hdr);
+	hdr.e_ehsize = sizeof(Elf64_Ehdr);
+	hdr.e_shentsize = sizeof(Elf64_Shdr);
+	hdr.e_shnum = NSECTIONS;
+	hdr.e_shstrndx = SHSTRTAB_SECTION_IDX;
+
+	memset(secs, 0, sizeof(secs));
+
+	OUT(&hdr, sizeof(hdr));
+	section_header_start = output->n_elts;
+	OUT(secs, sizeof(secs));
+
+	symtab_section_start = output->n_elts;
+	OUTE(symbols->elts, symbols->n_elts, sizeof(symbols->elts[0]));
+
+	strtab_section_start = output->n_elts;
+	OUT(strtab->elts, strtab->n_elts);
+
+	shstrtab_section_start = output->n_elts;
+	OUT(shstrtab, sizeof(shstrtab));
+
+	/* the code isn't part of the file, gdb only needs the addresses */
+	secs[TEXT_SECTION_IDX].sh_name = 1;
+	secs[TEXT_SECTION_IDX].sh_type = SHT_NOBITS;
+	secs[TEXT_SECTION_IDX].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+	secs[TEXT_SECTION_IDX].sh_addr = text_start;
+	secs[TEXT_SECTION_IDX].sh_offset = symtab_section_start;
+	secs[TEXT_SECTION_IDX].sh_size = text_end - text_start;
+	secs[TEXT_SECTION_IDX].sh_addralign = 1;
+
+	secs[SYMTAB_SECTION_IDX].sh_name = sizeof(".text") + 1;
+	secs[SYMTAB_SECTION_IDX].sh_type = SHT_SYMTAB;
+	secs[SYMTAB_SECTION_IDX].sh_offset = symtab_section_start;
+	secs[SYMTAB_SECTION_IDX].sh_size =
+		strtab_section_start - symtab_section_start;
+	secs[SYMTAB_SECTION_IDX].sh_link = STRTAB_SECTION_IDX;
+	secs[SYMTAB_SECTION_IDX].sh_info = 1;
+	secs[SYMTAB_SECTION_IDX].sh_addralign = 8;
+	secs[SYMTAB_SECTION_IDX].sh_entsize = sizeof(symbols->elts[0]);
+
+	secs[STRTAB_SECTION_IDX].sh_name =
+		secs[SYMTAB_SECTION_IDX].sh_name + sizeof(".symtab");
+	secs[STRTAB_SECTION_IDX].sh_type = SHT_STRTAB;
+	secs[STRTAB_SECTION_IDX].sh_offset = strtab_section_start;
+	secs[STRTAB_SECTION_IDX].sh_size =
+		shstrtab_section_start - strtab_section_start;
+	secs[STRTAB_SECTION_IDX].sh_addralign = 1;
+
+	secs[SHSTRTAB_SECTION_IDX].sh_name =
+		secs[STRTAB_SECTION_IDX].sh_name + sizeof(".strtab");
+	secs[SHSTRTAB_SECTION_IDX].sh_type = SHT_STRTAB;
+	secs[SHSTRTAB_SECTION_IDX].sh_offset = shstrtab_section_start;
+	secs[SHSTRTAB_SECTION_IDX].sh_size = sizeof(shstrtab);
+	secs[SHSTRTAB_SECTION_IDX].sh_addralign = 1;
+
+	memcpy(&output->elts[section_header_start], secs, sizeof(secs));
+
+	free(strtab->elts);
+	free(symbols->elts);
+
+	if (outsize)
+		*outsize = output->n_elts;
+
+	return output->elts;
+
+ error:
+	free(strtab->elts);
+	free(symbols->elts);
+	free(output->elts);
+
+	return NULL;
+}
+
 #else
 
 void *wasmjit_output_elf_relocatable(const char *module_name,
@@ -1566,4 +1767,14 @@ void *wasmjit_output_elf_relocatable(const char *module_name,
 	return NULL;
 }
 
+void *wasmjit_output_elf_symbol_file(const struct WasmJITElfSymbol *syms,
+				     size_t n_syms,
+				     size_t *outsize)
+{
+	(void)syms;
+	(void)n_syms;
+	(void)outsize;
+	return NULL;
+}
+
 #endif
@@ -35,6 +35,17 @@ void *wasmjit_output_elf_relocatable(const char *module_name,
                                      const struct Module *module,
                                      size_t *outsize);
 
+struct WasmJITElfSymbol {
+	const char *name;
+	uintptr_t addr;
+	size_t size;
+};
+
+/* a symbol-only ELF for code already mapped at syms[].addr */
+void *wasmjit_output_elf_symbol_file(const struct WasmJITElfSymbol *syms,
+				     size_t n_syms,
+				     size_t *outsize);
+
 #ifdef __cplusplus
 }
 #endif
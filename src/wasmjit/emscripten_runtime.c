@@ -34,6 +34,8 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
+
+#include <wasmjit/instantiate.h>
 #endif
 
 #include <wasmjit/posix_sys.h>
@@ -335,6 +337,43 @@ static struct EmscriptenContext *_wasmjit_emscripten_get_context(struct FuncInst
 	return wasmjit_emscripten_get_context(funcinst->module_inst);
 }
 
+#ifndef __KERNEL__
+
+struct EmThread {
+	struct EmscriptenContext *ctx;
+	uint32_t handle;
+	pthread_t thread;
+	/* env with a private table, see thread_env() */
+	struct ModuleInst *env;
+	/* used on this thread instead of the same context fields */
+	struct ModuleInst *asm_;
+	struct FuncInst *errno_location_inst;
+	struct FuncInst *malloc_inst;
+	struct FuncInst *free_inst;
+	struct FuncInst *establish_stack_space_inst;
+	struct FuncInst *start_routine;
+	uint32_t arg;
+	uint32_t stack;
+	uint32_t stack_size;
+	uint32_t retval;
+	int exited;
+	int detached;
+	int joining;
+	int finished;
+};
+
+/* NULL on the thread that runs main() */
+static __thread struct EmThread *current_thread;
+
+#define PER_THREAD(ctx, field) \
+	(current_thread ? current_thread->field : (ctx)->field)
+
+#else
+
+#define PER_THREAD(ctx, field) ((ctx)->field)
+
+#endif
+
 static struct EmscriptenContext *_g_handler_ctx;
 static sig_atomic_t _g_handler_setting;
 
@@ -522,6 +561,16 @@ int wasmjit_emscripten_init(struct EmscriptenContext *ctx,
 	ctx->tmtm_buffer = 0;
 	ctx->sem_table.n_elts = 0;
 	ctx->unfreed_pointers.n_elts = 0;
+#ifndef __KERNEL__
+	ctx->thread_module = NULL;
+	ctx->n_thread_imports = 0;
+	ctx->thread_imports = NULL;
+	ctx->thread_instantiate_flags = 0;
+	ctx->threads.n_elts = 0;
+	ctx->threads.elts = NULL;
+	if (pthread_mutex_init(&ctx->threads_lock, NULL))
+		return -1;
+#endif
 
 	/* EM_SIG_DFL == 0 */
 	memset(ctx->sig_handlers, 0, sizeof(ctx->sig_handlers));
@@ -531,6 +580,32 @@ int wasmjit_emscripten_init(struct EmscriptenContext *ctx,
 	return 0;
 }
 
+#ifndef __KERNEL__
+
+int wasmjit_emscripten_init_pthreads(struct EmscriptenContext *ctx,
+				     const struct Module *module,
+				     size_t n_imports,
+				     const struct NamedModule *imports,
+				     unsigned instantiate_flags)
+{
+	struct NamedModule *thread_imports;
+
+	thread_imports = calloc(n_imports, sizeof(thread_imports[0]));
+	if (n_imports && !thread_imports)
+		return -1;
+	memcpy(thread_imports, imports, n_imports * sizeof(imports[0]));
+
+	free(ctx->thread_imports);
+	ctx->thread_module = module;
+	ctx->n_thread_imports = n_imports;
+	ctx->thread_imports = thread_imports;
+	ctx->thread_instantiate_flags = instantiate_flags;
+
+	return 0;
+}
+
+#endif
+
 int wasmjit_emscripten_build_environment(struct FuncInst *environ_constructor)
 {
 	int ret;
@@ -646,16 +721,54 @@ uint32_t wasmjit_emscripten_abortOnCannotGrowMemory(struct FuncInst *funcinst)
 	return 0;
 }
 
+/* the largest heap emscripten's sbrk() can handle */
+#define EMSCRIPTEN_MEMORY_LIMIT (((size_t) 1 << 31) - WASM_PAGE_SIZE)
+
+#define alignPage(size) \
+	(((size) + WASM_PAGE_SIZE - 1) & ~(WASM_PAGE_SIZE - 1))
+
 uint32_t wasmjit_emscripten_enlargeMemory(struct FuncInst *funcinst)
 {
-	(void)funcinst;
-	return 0;
+	struct MemInst *meminst = wasmjit_emscripten_get_mem_inst(funcinst);
+	struct GlobalInst *DYNAMICTOP_PTR;
+	uint32_t dynamic_top;
+	size_t total;
+
+	DYNAMICTOP_PTR =
+		wasmjit_get_export(funcinst->module_inst, "DYNAMICTOP_PTR",
+				   IMPORT_DESC_TYPE_GLOBAL).global;
+	assert(DYNAMICTOP_PTR && DYNAMICTOP_PTR->value.type == VALTYPE_I32);
+
+	if (wasmjit_emscripten_copy_from_user(meminst, &dynamic_top,
+					      DYNAMICTOP_PTR->value.data.i32,
+					      sizeof(dynamic_top)))
+		return 0;
+	dynamic_top = uint32_t_swap_bytes(dynamic_top);
+
+	if (dynamic_top > EMSCRIPTEN_MEMORY_LIMIT)
+		return 0;
+
+	/* same growth policy as emscripten's enlargeMemory() */
+	total = MMAX(meminst->size, WASM_PAGE_SIZE);
+	while (total < dynamic_top) {
+		if (total <= ((size_t) 1 << 29))
+			total = alignPage(2 * total);
+		else
+			total = MMIN(alignPage((3 * total + ((size_t) 1 << 31)) / 4),
+				     EMSCRIPTEN_MEMORY_LIMIT);
+	}
+
+	if (total > meminst->size &&
+	    wasmjit_grow_memory(meminst, (total - meminst->size) / WASM_PAGE_SIZE) ==
+	    (uint32_t) -1)
+		return 0;
+
+	return 1;
 }
 
 uint32_t wasmjit_emscripten_getTotalMemory(struct FuncInst *funcinst)
 {
-	(void)funcinst;
-	return WASMJIT_EMSCRIPTEN_TOTAL_MEMORY;
+	return wasmjit_emscripten_get_mem_inst(funcinst)->size;
 }
 
 void wasmjit_emscripten_nullFunc_ii(uint32_t x, struct FuncInst *funcinst)
@@ -733,8 +846,9 @@ void wasmjit_emscripten____setErrNo(uint32_t value, struct FuncInst *funcinst)
 	struct EmscriptenContext *ctx =
 		_wasmjit_emscripten_get_context(funcinst);
 
-	if (ctx->errno_location_inst &&
-	    !wasmjit_invoke_function(ctx->errno_location_inst, NULL, &out)) {
+	if (PER_THREAD(ctx, errno_location_inst) &&
+	    !wasmjit_invoke_function(PER_THREAD(ctx, errno_location_inst),
+				     NULL, &out)) {
 		value = uint32_t_swap_bytes(value);
 		if (!_wasmjit_emscripten_copy_to_user(funcinst, out.i32, &value, sizeof(value)))
 			return;
@@ -1172,9 +1286,10 @@ static uint32_t getMemory(struct FuncInst *funcinst,
 	input.i32 = amount;
 
 	ctx = _wasmjit_emscripten_get_context(funcinst);
-	if (!ctx->malloc_inst)
+	if (!PER_THREAD(ctx, malloc_inst))
 		return 0;
-	if (wasmjit_invoke_function(ctx->malloc_inst, &input, &output))
+	if (wasmjit_invoke_function(PER_THREAD(ctx, malloc_inst),
+				    &input, &output))
 		return 0;
 
 	/* check if userspace is malicious */
@@ -1192,9 +1307,9 @@ static void freeMemory(struct EmscriptenContext *ctx,
 {
 	union ValueUnion input;
 	input.i32 = ptr;
-	if (!ctx->free_inst)
+	if (!PER_THREAD(ctx, free_inst))
 		wasmjit_emscripten_internal_abort("Failed to invoke deallocator");
-	if (wasmjit_invoke_function(ctx->free_inst, &input, NULL))
+	if (wasmjit_invoke_function(PER_THREAD(ctx, free_inst), &input, NULL))
 		wasmjit_emscripten_internal_abort("Failed to invoke deallocator");
 }
 
@@ -4839,7 +4954,7 @@ static uint32_t _memalign(struct FuncInst *funcinst,
 	struct EmscriptenContext *ctx =
 		_wasmjit_emscripten_get_context(funcinst);
 
-	callfuncinst = wasmjit_get_export(ctx->asm_, "_memalign",
+	callfuncinst = wasmjit_get_export(PER_THREAD(ctx, asm_), "_memalign",
 					       IMPORT_DESC_TYPE_FUNC).func;
 	if (!callfuncinst)
 		return 0;
@@ -7595,7 +7710,7 @@ static void _stackRestore(struct FuncInst *funcinst, uint32_t foo) {
 	struct EmscriptenContext *ctx =
 		_wasmjit_emscripten_get_context(funcinst);
 
-	callfuncinst = wasmjit_get_export(ctx->asm_, "stackRestore",
+	callfuncinst = wasmjit_get_export(PER_THREAD(ctx, asm_), "stackRestore",
 					       IMPORT_DESC_TYPE_FUNC).func;
 	if (!callfuncinst)
 		wasmjit_emscripten_internal_abort("stackRestore not available");
@@ -7625,7 +7740,7 @@ static uint32_t _stackSave(struct FuncInst *funcinst) {
 	struct EmscriptenContext *ctx =
 		_wasmjit_emscripten_get_context(funcinst);
 
-	callfuncinst = wasmjit_get_export(ctx->asm_, "stackSave",
+	callfuncinst = wasmjit_get_export(PER_THREAD(ctx, asm_), "stackSave",
 					       IMPORT_DESC_TYPE_FUNC).func;
 	if (!callfuncinst)
 		wasmjit_emscripten_internal_abort("stackSave not available");
@@ -7953,6 +8068,561 @@ uint32_t wasmjit_emscripten__sem_wait(uint32_t sem,
 	return wasmjit_emscripten_sem_op(sem, funcinst, &sem_wait);
 }
 
+#ifndef __KERNEL__
+
+/* the wasm stack of a thread, allocated from the heap like
+   emscripten's DEFAULT_PTHREAD_STACK_SIZE */
+#define EM_THREAD_STACK_SIZE ((uint32_t) 2 * 1024 * 1024)
+/* the host stack the thread's code runs on */
+#define EM_THREAD_HOST_STACK_SIZE ((size_t) 8 * 1024 * 1024)
+/* room left for host functions once the JIT reports a stack overflow */
+#define EM_THREAD_HOST_STACK_SLACK ((size_t) 256 * 1024)
+
+/* musl's pthread_attr_t, _a_stacksize and _a_detach */
+struct em_pthread_attr_t {
+	uint32_t stacksize;
+	uint32_t unused[2];
+	uint32_t detach;
+};
+
+/* a view of env whose table is private to the thread, element
+   segments fill it with the thread's own instances of the functions */
+static struct ModuleInst *thread_env(struct ModuleInst *env)
+{
+	struct ModuleInst *view;
+	size_t i;
+
+	view = calloc(1, sizeof(*view));
+	if (!view)
+		goto error;
+
+	for (i = 0; i < env->exports.n_elts; ++i) {
+		struct Export *export = &env->exports.elts[i];
+		struct Export *view_export;
+
+		if (!VECTOR_GROW(&view->exports, 1))
+			goto error;
+		view_export = &view->exports.elts[view->exports.n_elts - 1];
+		*view_export = *export;
+		view_export->name = strdup(export->name);
+		if (!view_export->name)
+			goto error;
+
+		if (export->type == IMPORT_DESC_TYPE_TABLE) {
+			struct TableInst *table;
+
+			if (!VECTOR_GROW(&view->tables, 1))
+				goto error;
+			table = calloc(1, sizeof(*table));
+			view->tables.elts[view->tables.n_elts - 1] = table;
+			if (!table)
+				goto error;
+			table->elemtype = export->value.table->elemtype;
+			table->length = export->value.table->length;
+			table->max = export->value.table->max;
+			table->data = calloc(table->length,
+					     sizeof(table->data[0]));
+			if (table->length && !table->data)
+				goto error;
+			view_export->value.table = table;
+		}
+	}
+
+	if (0) {
+	error:
+		if (view)
+			wasmjit_free_module_inst(view);
+		view = NULL;
+	}
+
+	return view;
+}
+
+static void free_thread(struct EmThread *thread)
+{
+	if (thread->asm_)
+		wasmjit_free_module_inst(thread->asm_);
+	if (thread->env)
+		wasmjit_free_module_inst(thread->env);
+	free(thread);
+}
+
+static int instantiate_thread(struct EmscriptenContext *ctx,
+			      struct EmThread *thread)
+{
+	struct NamedModule *imports;
+	size_t i;
+	int ret;
+
+	imports = calloc(ctx->n_thread_imports, sizeof(imports[0]));
+	if (!imports)
+		goto error;
+
+	for (i = 0; i < ctx->n_thread_imports; ++i) {
+		imports[i] = ctx->thread_imports[i];
+		if (strcmp(imports[i].name, "env"))
+			continue;
+		thread->env = thread_env(imports[i].module);
+		if (!thread->env)
+			goto error;
+		imports[i].module = thread->env;
+	}
+
+	thread->asm_ = wasmjit_instantiate(ctx->thread_module,
+					   ctx->n_thread_imports, imports,
+					   ctx->thread_instantiate_flags |
+					   WASMJIT_INSTANTIATE_FLAG_NO_DATA,
+					   NULL, NULL, 0);
+	if (!thread->asm_)
+		goto error;
+
+	/* wasmjit_emscripten_init() checked the types on the first
+	   instance */
+	thread->errno_location_inst =
+		wasmjit_get_export(thread->asm_, "___errno_location",
+				   IMPORT_DESC_TYPE_FUNC).func;
+	thread->malloc_inst =
+		wasmjit_get_export(thread->asm_, "_malloc",
+				   IMPORT_DESC_TYPE_FUNC).func;
+	thread->free_inst =
+		wasmjit_get_export(thread->asm_, "_free",
+				   IMPORT_DESC_TYPE_FUNC).func;
+	thread->establish_stack_space_inst =
+		wasmjit_get_export(thread->asm_, "establishStackSpace",
+				   IMPORT_DESC_TYPE_FUNC).func;
+
+	{
+		struct FuncType functype;
+		wasmjit_valtype_t input_types[] = {VALTYPE_I32, VALTYPE_I32};
+
+		_wasmjit_create_func_type(&functype,
+					  ARRAY_LEN(input_types), input_types,
+					  0, NULL);
+
+		/* without it the thread would share STACKTOP */
+		if (!thread->establish_stack_space_inst ||
+		    !wasmjit_typecheck_func(&functype,
+					    thread->establish_stack_space_inst))
+			goto error;
+	}
+
+	ret = 1;
+
+	if (0) {
+	error:
+		ret = 0;
+	}
+
+	free(imports);
+
+	return ret;
+}
+
+static struct FuncInst *thread_start_routine(struct EmThread *thread,
+					     uint32_t start_routine)
+{
+	struct TableInst *table;
+	struct FuncInst *funcinst;
+	struct FuncType functype;
+	wasmjit_valtype_t input_types[] = {VALTYPE_I32};
+	wasmjit_valtype_t return_types[] = {VALTYPE_I32};
+
+	if (thread->asm_->tables.n_elts < 1)
+		return NULL;
+
+	table = thread->asm_->tables.elts[0];
+	if (start_routine >= table->length)
+		return NULL;
+
+	start_routine = wasmjit_array_index_nospec(start_routine, 1,
+						   table->length);
+	funcinst = table->data[start_routine];
+	if (!funcinst)
+		return NULL;
+
+	_wasmjit_create_func_type(&functype,
+				  ARRAY_LEN(input_types), input_types,
+				  ARRAY_LEN(return_types), return_types);
+
+	if (!wasmjit_typecheck_func(&functype, funcinst))
+		return NULL;
+
+	return funcinst;
+}
+
+static void *thread_main(void *arg)
+{
+	struct EmThread *thread = arg;
+	struct EmscriptenContext *ctx = thread->ctx;
+	union ValueUnion args[2], out;
+	pthread_attr_t attr;
+	void *stack_addr;
+	size_t stack_size;
+	int ret;
+
+	current_thread = thread;
+
+	/* the JIT's stack checks need the real bottom of this stack */
+	ret = pthread_getattr_np(pthread_self(), &attr);
+	if (!ret) {
+		ret = pthread_attr_getstack(&attr, &stack_addr, &stack_size);
+		pthread_attr_destroy(&attr);
+	}
+	if (ret || stack_size <= EM_THREAD_HOST_STACK_SLACK) {
+		fprintf(stderr, "thread %" PRIu32 ": can't find its stack\n",
+			thread->handle);
+		exit(EXIT_FAILURE);
+	}
+	wasmjit_set_stack_top((char *) stack_addr + EM_THREAD_HOST_STACK_SLACK);
+
+	args[0].i32 = thread->stack;
+	args[1].i32 = thread->stack + thread->stack_size;
+	ret = wasmjit_invoke_function(thread->establish_stack_space_inst,
+				      args, NULL);
+	if (!ret) {
+		args[0].i32 = thread->arg;
+		ret = wasmjit_invoke_function(thread->start_routine,
+					      args, &out);
+		if (!ret)
+			thread->retval = out.i32;
+	}
+
+	if (ret && !thread->exited) {
+		/* like an uncaught exception in a worker, this takes
+		   down the whole program */
+		if (WASMJIT_DECODE_TRAP_ERROR(ret) == WASMJIT_TRAP_EXIT)
+			exit(ret & 0xff);
+		fprintf(stderr, "TRAP in thread %" PRIu32 ": %s\n",
+			thread->handle,
+			wasmjit_trap_reason_to_string(WASMJIT_DECODE_TRAP_ERROR(ret)));
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_mutex_lock(&ctx->threads_lock);
+	thread->finished = 1;
+	pthread_mutex_unlock(&ctx->threads_lock);
+
+	return NULL;
+}
+
+/* called with threads_lock held */
+static void release_thread_handle(struct EmscriptenContext *ctx,
+				  struct EmThread *thread)
+{
+	ctx->threads.elts[thread->handle - 1] = NULL;
+}
+
+/* called with threads_lock held */
+static struct EmThread *lookup_thread(struct EmscriptenContext *ctx,
+				      uint32_t handle)
+{
+	if (!handle || handle > ctx->threads.n_elts)
+		return NULL;
+	handle = wasmjit_array_index_nospec(handle - 1, 1,
+					    ctx->threads.n_elts);
+	return ctx->threads.elts[handle];
+}
+
+/* free detached threads that have finished, their stacks go back to
+   the heap through the calling thread's _free */
+static void reap_threads(struct EmscriptenContext *ctx)
+{
+	size_t i;
+
+	for (;;) {
+		struct EmThread *thread = NULL;
+
+		pthread_mutex_lock(&ctx->threads_lock);
+		for (i = 0; i < ctx->threads.n_elts; ++i) {
+			struct EmThread *candidate = ctx->threads.elts[i];
+			if (candidate && candidate->detached &&
+			    candidate->finished) {
+				thread = candidate;
+				release_thread_handle(ctx, thread);
+				break;
+			}
+		}
+		pthread_mutex_unlock(&ctx->threads_lock);
+
+		if (!thread)
+			break;
+
+		freeMemory(ctx, thread->stack);
+		free_thread(thread);
+	}
+}
+
+uint32_t wasmjit_emscripten__pthread_create(uint32_t thread_ptr,
+					    uint32_t attr,
+					    uint32_t start_routine,
+					    uint32_t arg,
+					    struct FuncInst *funcinst)
+{
+	struct EmscriptenContext *ctx = _wasmjit_emscripten_get_context(funcinst);
+	struct EmThread *thread = NULL;
+	struct em_pthread_attr_t em_attr;
+	pthread_attr_t host_attr;
+	sigset_t all_signals, old_signals;
+	size_t idx;
+	uint32_t handle;
+	int ret, has_host_attr = 0;
+
+	if (!ctx->thread_module)
+		return EM_EAGAIN;
+
+	if (!_wasmjit_emscripten_check_range(funcinst, thread_ptr,
+					     sizeof(handle)))
+		return EM_EINVAL;
+
+	memset(&em_attr, 0, sizeof(em_attr));
+	if (attr &&
+	    _wasmjit_emscripten_copy_from_user(funcinst, &em_attr, attr,
+					       sizeof(em_attr)))
+		return EM_EINVAL;
+
+	reap_threads(ctx);
+
+	thread = calloc(1, sizeof(*thread));
+	if (!thread) {
+		ret = EM_EAGAIN;
+		goto error;
+	}
+	thread->ctx = ctx;
+	thread->arg = arg;
+	thread->detached = !!uint32_t_swap_bytes(em_attr.detach);
+	thread->stack_size = uint32_t_swap_bytes(em_attr.stacksize);
+	if (!thread->stack_size)
+		thread->stack_size = EM_THREAD_STACK_SIZE;
+
+	if (!instantiate_thread(ctx, thread)) {
+		ret = EM_EAGAIN;
+		goto error;
+	}
+
+	thread->start_routine = thread_start_routine(thread, start_routine);
+	if (!thread->start_routine) {
+		ret = EM_EINVAL;
+		goto error;
+	}
+
+	thread->stack = getMemory(funcinst, thread->stack_size);
+	if (!thread->stack) {
+		ret = EM_EAGAIN;
+		goto error;
+	}
+
+	pthread_mutex_lock(&ctx->threads_lock);
+	for (idx = 0; idx < ctx->threads.n_elts; ++idx) {
+		if (!ctx->threads.elts[idx])
+			break;
+	}
+	if (idx == ctx->threads.n_elts &&
+	    (idx == UINT32_MAX || !VECTOR_GROW(&ctx->threads, 1))) {
+		pthread_mutex_unlock(&ctx->threads_lock);
+		ret = EM_EAGAIN;
+		goto error;
+	}
+	ctx->threads.elts[idx] = thread;
+	thread->handle = idx + 1;
+	pthread_mutex_unlock(&ctx->threads_lock);
+
+	/* a detached thread can be reaped as soon as it starts */
+	handle = uint32_t_swap_bytes(thread->handle);
+
+	if (pthread_attr_init(&host_attr)) {
+		ret = EM_EAGAIN;
+		goto error_handle;
+	}
+	has_host_attr = 1;
+
+	if (pthread_attr_setstacksize(&host_attr, EM_THREAD_HOST_STACK_SIZE) ||
+	    (thread->detached &&
+	     pthread_attr_setdetachstate(&host_attr,
+					 PTHREAD_CREATE_DETACHED))) {
+		ret = EM_EAGAIN;
+		goto error_handle;
+	}
+
+	/* signal handlers run on the main thread's instance, keep
+	   delivery there */
+	sigfillset(&all_signals);
+	pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+	ret = pthread_create(&thread->thread, &host_attr, thread_main, thread);
+	pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+	if (ret) {
+		ret = convert_errno(ret);
+		goto error_handle;
+	}
+
+	pthread_attr_destroy(&host_attr);
+
+	_wasmjit_emscripten_copy_to_user(funcinst, thread_ptr,
+					 &handle, sizeof(handle));
+
+	return 0;
+
+ error_handle:
+	pthread_mutex_lock(&ctx->threads_lock);
+	release_thread_handle(ctx, thread);
+	pthread_mutex_unlock(&ctx->threads_lock);
+
+ error:
+	if (has_host_attr)
+		pthread_attr_destroy(&host_attr);
+	if (thread) {
+		if (thread->stack)
+			freeMemory(ctx, thread->stack);
+		free_thread(thread);
+	}
+
+	return ret;
+}
+
+uint32_t wasmjit_emscripten__pthread_join(uint32_t handle,
+					  uint32_t retval_ptr,
+					  struct FuncInst *funcinst)
+{
+	struct EmscriptenContext *ctx = _wasmjit_emscripten_get_context(funcinst);
+	struct EmThread *thread;
+	uint32_t retval;
+	int ret;
+
+	pthread_mutex_lock(&ctx->threads_lock);
+	thread = lookup_thread(ctx, handle);
+	if (!thread)
+		ret = EM_ESRCH;
+	else if (thread == current_thread)
+		ret = EM_EDEADLK;
+	else if (thread->detached || thread->joining)
+		ret = EM_EINVAL;
+	else
+		ret = 0;
+	if (!ret)
+		thread->joining = 1;
+	pthread_mutex_unlock(&ctx->threads_lock);
+
+	if (ret)
+		return ret;
+
+	/* joining isn't a cancellation point in emscripten either */
+	pthread_join(thread->thread, NULL);
+
+	pthread_mutex_lock(&ctx->threads_lock);
+	release_thread_handle(ctx, thread);
+	pthread_mutex_unlock(&ctx->threads_lock);
+
+	retval = uint32_t_swap_bytes(thread->retval);
+	if (retval_ptr &&
+	    _wasmjit_emscripten_copy_to_user(funcinst, retval_ptr,
+					     &retval, sizeof(retval)))
+		ret = EM_EINVAL;
+
+	freeMemory(ctx, thread->stack);
+	free_thread(thread);
+
+	return ret;
+}
+
+uint32_t wasmjit_emscripten__pthread_detach(uint32_t handle,
+					    struct FuncInst *funcinst)
+{
+	struct EmscriptenContext *ctx = _wasmjit_emscripten_get_context(funcinst);
+	struct EmThread *thread;
+	int ret;
+
+	pthread_mutex_lock(&ctx->threads_lock);
+	thread = lookup_thread(ctx, handle);
+	if (!thread) {
+		ret = EM_ESRCH;
+	} else if (thread->detached || thread->joining) {
+		ret = EM_EINVAL;
+	} else {
+		pthread_detach(thread->thread);
+		thread->detached = 1;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&ctx->threads_lock);
+
+	if (!ret)
+		reap_threads(ctx);
+
+	return ret;
+}
+
+void wasmjit_emscripten__pthread_exit(uint32_t retval,
+				      struct FuncInst *funcinst)
+{
+	(void)funcinst;
+
+	/* the main thread exits the program like returning from main() */
+	if (current_thread) {
+		current_thread->retval = retval;
+		current_thread->exited = 1;
+	}
+	wasmjit_exit(0);
+}
+
+uint32_t wasmjit_emscripten__emscripten_futex_wait(uint32_t addr,
+						   uint32_t val,
+						   double timeout,
+						   struct FuncInst *funcinst)
+{
+	struct MemInst *meminst = wasmjit_emscripten_get_mem_inst(funcinst);
+	int64_t timeout_ns;
+
+	if ((addr & 3) ||
+	    !_wasmjit_emscripten_check_range(funcinst, addr, sizeof(uint32_t)))
+		return -EM_EINVAL;
+	addr = wasmjit_array_index_nospec(addr, sizeof(uint32_t),
+					  meminst->size);
+
+	/* in milliseconds, infinity and NaN wait forever */
+	if (!(timeout < (double) (INT64_MAX / 1000000)))
+		timeout_ns = -1;
+	else if (timeout > 0)
+		timeout_ns = timeout * 1000000;
+	else
+		timeout_ns = 0;
+
+	switch (wasmjit_atomic_wait32((uint32_t *) (meminst->data + addr),
+				      val, timeout_ns)) {
+	case 1:
+		return -EM_EAGAIN;
+	case 2:
+		return -EM_ETIMEDOUT;
+	default:
+		return 0;
+	}
+}
+
+uint32_t wasmjit_emscripten__emscripten_futex_wake(uint32_t addr,
+						   uint32_t count,
+						   struct FuncInst *funcinst)
+{
+	struct MemInst *meminst = wasmjit_emscripten_get_mem_inst(funcinst);
+
+	if ((addr & 3) ||
+	    (int32_t) count < 0 ||
+	    !_wasmjit_emscripten_check_range(funcinst, addr, sizeof(uint32_t)))
+		return -EM_EINVAL;
+	addr = wasmjit_array_index_nospec(addr, sizeof(uint32_t),
+					  meminst->size);
+
+	return wasmjit_atomic_notify(meminst->data + addr, count);
+}
+
+uint32_t wasmjit_emscripten__emscripten_num_logical_cores(struct FuncInst *funcinst)
+{
+	long ret;
+
+	(void)funcinst;
+
+	ret = sysconf(_SC_NPROCESSORS_ONLN);
+	return ret < 1 ? 1 : ret > INT32_MAX ? INT32_MAX : ret;
+}
+
+#endif
+
 void wasmjit_emscripten__setgrent(struct FuncInst *funcinst)
 {
 	wasmjit_signal_block_ctx set;
@@ -9020,10 +9690,42 @@ uint32_t wasmjit_emscripten__waitpid(uint32_t pid, uint32_t status, uint32_t opt
 	return ret;
 }
 
-void wasmjit_emscripten_cleanup(struct ModuleInst *moduleinst) {
+int wasmjit_emscripten_cleanup(struct ModuleInst *moduleinst) {
+	int running = 0;
+#ifndef __KERNEL__
+	struct EmscriptenContext *ctx = wasmjit_emscripten_get_context(moduleinst);
+	size_t i;
+
+	/* the memory is going away, no need to free the stacks */
+	pthread_mutex_lock(&ctx->threads_lock);
+	for (i = 0; i < ctx->threads.n_elts; ++i) {
+		struct EmThread *thread = ctx->threads.elts[i];
+		if (!thread)
+			continue;
+		if (!thread->finished || thread->joining) {
+			running = 1;
+			continue;
+		}
+		if (!thread->detached)
+			pthread_join(thread->thread, NULL);
+		ctx->threads.elts[i] = NULL;
+		free_thread(thread);
+	}
+	pthread_mutex_unlock(&ctx->threads_lock);
+
+	if (running)
+		return running;
+
+	free(ctx->thread_imports);
+	ctx->thread_imports = NULL;
+	ctx->n_thread_imports = 0;
+	ctx->thread_module = NULL;
+#else
 	(void)moduleinst;
+#endif
 	/* TODO: implement */
 	remove_signal_context();
+	return running;
 }
 
 struct EmscriptenContext *wasmjit_emscripten_get_context(struct ModuleInst *module_inst)
@@ -31,6 +31,10 @@
 #include <wasmjit/vector.h>
 #include <wasmjit/posix_sys.h>
 
+#ifndef __KERNEL__
+#include <pthread.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -70,6 +74,8 @@ struct EmSem {
 	sem_t *real_sem;
 };
 
+struct EmThread;
+
 struct EmscriptenContext {
 	struct ModuleInst *asm_;
 	struct FuncInst *errno_location_inst;
@@ -93,9 +99,20 @@ struct EmscriptenContext {
 		union em_sigaction_handler handler;
 	} sig_handlers[sizeof(em_sigset_t) * CHAR_BIT];
 	DEFINE_ANON_VECTOR(void *) unfreed_pointers;
+#ifndef __KERNEL__
+	/* -s USE_PTHREADS, see wasmjit_emscripten_init_pthreads() */
+	const struct Module *thread_module;
+	size_t n_thread_imports;
+	struct NamedModule *thread_imports;
+	unsigned thread_instantiate_flags;
+	pthread_mutex_t threads_lock;
+	/* indexed by pthread_t - 1 */
+	DEFINE_ANON_VECTOR(struct EmThread *) threads;
+#endif
 };
 
 #define CTYPE_VALTYPE_I32 uint32_t
+#define CTYPE_VALTYPE_F64 double
 #define CTYPE_VALTYPE_NULL void
 #define CTYPE(val) CTYPE_ ## val
 
@@ -129,6 +146,7 @@ struct EmscriptenContext {
 #define DEFINE_WASM_MEMORY(...)
 #define DEFINE_EXTERNAL_WASM_GLOBAL(...)
 #define DEFINE_EXTERNAL_WASM_TABLE(...)
+#define DEFINE_EXTERNAL_WASM_MEMORY(...)
 
 #include <wasmjit/emscripten_runtime_def.h>
 
@@ -153,15 +171,19 @@ struct EmscriptenContext {
 #undef END_FUNCTION_DEFS
 #undef DEFINE_WASM_START_FUNCTION
 #undef DEFINE_EXTERNAL_WASM_TABLE
+#undef DEFINE_EXTERNAL_WASM_MEMORY
 #undef DEFINE_EXTERNAL_WASM_GLOBAL
 
 #undef __PARAM
 #undef CTYPE
 #undef CTYPE_VALTYPE_I32
+#undef CTYPE_VALTYPE_F64
 #undef CTYPE_VALTYPE_NULL
 
 struct EmscriptenContext *wasmjit_emscripten_get_context(struct ModuleInst *);
-void wasmjit_emscripten_cleanup(struct ModuleInst *);
+/* nonzero if threads from _pthread_create() are still running, their
+   instances and the modules they import must then stay around */
+int wasmjit_emscripten_cleanup(struct ModuleInst *);
 
 void wasmjit_emscripten_internal_abort(const char *msg) __attribute__((noreturn));
 struct MemInst *wasmjit_emscripten_get_mem_inst(struct FuncInst *funcinst);
@@ -174,6 +196,19 @@ int wasmjit_emscripten_init(struct EmscriptenContext *ctx,
 			    struct FuncInst *free_inst,
 			    char *envp[]);
 
+#ifndef __KERNEL__
+struct Module;
+
+/* each thread from _pthread_create() runs its own instance of module,
+   instantiated against imports with env's table replaced by a
+   private one, module must outlive ctx */
+int wasmjit_emscripten_init_pthreads(struct EmscriptenContext *ctx,
+				     const struct Module *module,
+				     size_t n_imports,
+				     const struct NamedModule *imports,
+				     unsigned instantiate_flags);
+#endif
+
 int wasmjit_emscripten_build_environment(struct FuncInst *environ_constructor);
 
 int wasmjit_emscripten_invoke_main(struct MemInst *meminst,
@@ -58,7 +58,7 @@ DEFINE_EXTERNAL_WASM_TABLE(table)
 END_TABLE_DEFS()
 
 START_MEMORY_DEFS()
-DEFINE_WASM_MEMORY(memory, 256, 256)
+DEFINE_EXTERNAL_WASM_MEMORY(memory)
 END_MEMORY_DEFS()
 
 START_GLOBAL_DEFS()
@@ -171,6 +171,16 @@ DEFINE_EMSCRIPTEN_FUNCTION(_sched_yield, VALTYPE_I32, 0)
 DEFINE_EMSCRIPTEN_FUNCTION(_sem_init, VALTYPE_I32, 3, VALTYPE_I32, VALTYPE_I32, VALTYPE_I32)
 DEFINE_EMSCRIPTEN_FUNCTION(_sem_post, VALTYPE_I32, 1, VALTYPE_I32)
 DEFINE_EMSCRIPTEN_FUNCTION(_sem_wait, VALTYPE_I32, 1, VALTYPE_I32)
+#ifndef __KERNEL__
+/* -s USE_PTHREADS, there are no shared memories in the kernel */
+DEFINE_EMSCRIPTEN_FUNCTION(_emscripten_futex_wait, VALTYPE_I32, 3, VALTYPE_I32, VALTYPE_I32, VALTYPE_F64)
+DEFINE_EMSCRIPTEN_FUNCTION(_emscripten_futex_wake, VALTYPE_I32, 2, VALTYPE_I32, VALTYPE_I32)
+DEFINE_EMSCRIPTEN_FUNCTION(_emscripten_num_logical_cores, VALTYPE_I32, 0)
+DEFINE_EMSCRIPTEN_FUNCTION(_pthread_create, VALTYPE_I32, 4, VALTYPE_I32, VALTYPE_I32, VALTYPE_I32, VALTYPE_I32)
+DEFINE_EMSCRIPTEN_FUNCTION(_pthread_detach, VALTYPE_I32, 1, VALTYPE_I32)
+DEFINE_EMSCRIPTEN_FUNCTION(_pthread_exit, VALTYPE_NULL, 1, VALTYPE_I32)
+DEFINE_EMSCRIPTEN_FUNCTION(_pthread_join, VALTYPE_I32, 2, VALTYPE_I32, VALTYPE_I32)
+#endif
 DEFINE_EMSCRIPTEN_FUNCTION(_setgrent, VALTYPE_NULL, 0)
 DEFINE_EMSCRIPTEN_FUNCTION(_setgroups, VALTYPE_I32, 2, VALTYPE_I32, VALTYPE_I32)
 DEFINE_EMSCRIPTEN_FUNCTION(_setitimer, VALTYPE_I32, 3, VALTYPE_I32, VALTYPE_I32, VALTYPE_I32)
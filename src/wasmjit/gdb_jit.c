@@ -0,0 +1,290 @@
+/* -*-mode:c; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+  Copyright (c) 2018 Rian Hunter et. al, see AUTHORS file.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+
+#include <wasmjit/gdb_jit.h>
+
+#include <wasmjit/elf_relocatable.h>
+
+#include <wasmjit/sys.h>
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+
+/*
+  see "JIT Compilation Interface" in the gdb manual, gdb looks these
+  symbols up by name
+ */
+
+enum {
+	JIT_NOACTION = 0,
+	JIT_REGISTER_FN,
+	JIT_UNREGISTER_FN,
+};
+
+struct jit_code_entry {
+	struct jit_code_entry *next_entry;
+	struct jit_code_entry *prev_entry;
+	const char *symfile_addr;
+	uint64_t symfile_size;
+};
+
+struct jit_descriptor {
+	uint32_t version;
+	uint32_t action_flag;
+	struct jit_code_entry *relevant_entry;
+	struct jit_code_entry *first_entry;
+};
+
+void __attribute__((noinline)) __jit_debug_register_code(void);
+void __attribute__((noinline)) __jit_debug_register_code(void)
+{
+	/* gdb puts a breakpoint here, keep the call */
+	__asm__ __volatile__("");
+}
+
+struct jit_descriptor __jit_debug_descriptor = {
+	1, JIT_NOACTION, NULL, NULL,
+};
+
+#define GDB_JIT_NAME_MAX 256
+
+struct GdbJITEntry {
+	struct jit_code_entry entry;
+	struct GdbJITEntry *module_next;
+};
+
+struct GdbJITModule {
+	struct GdbJITEntry *entries;
+};
+
+static pthread_mutex_t gdb_jit_lock = PTHREAD_MUTEX_INITIALIZER;
+static int gdb_jit_enabled;
+
+void wasmjit_gdb_jit_enable(void)
+{
+	__atomic_store_n(&gdb_jit_enabled, 1, __ATOMIC_RELEASE);
+}
+
+int wasmjit_gdb_jit_enabled(void)
+{
+	return __atomic_load_n(&gdb_jit_enabled, __ATOMIC_ACQUIRE);
+}
+
+/* called with gdb_jit_lock held */
+static void register_entry(struct jit_code_entry *entry)
+{
+	entry->prev_entry = NULL;
+	entry->next_entry = __jit_debug_descriptor.first_entry;
+	if (entry->next_entry)
+		entry->next_entry->prev_entry = entry;
+	__jit_debug_descriptor.first_entry = entry;
+
+	__jit_debug_descriptor.relevant_entry = entry;
+	__jit_debug_descriptor.action_flag = JIT_REGISTER_FN;
+	__jit_debug_register_code();
+}
+
+/* called with gdb_jit_lock held */
+static void unregister_entry(struct jit_code_entry *entry)
+{
+	if (entry->prev_entry)
+		entry->prev_entry->next_entry = entry->next_entry;
+	else
+		__jit_debug_descriptor.first_entry = entry->next_entry;
+	if (entry->next_entry)
+		entry->next_entry->prev_entry = entry->prev_entry;
+
+	__jit_debug_descriptor.relevant_entry = entry;
+	__jit_debug_descriptor.action_flag = JIT_UNREGISTER_FN;
+	__jit_debug_register_code();
+}
+
+static void free_gdb_jit_module(void *arg)
+{
+	struct GdbJITModule *gmodule = arg;
+
+	pthread_mutex_lock(&gdb_jit_lock);
+	while (gmodule->entries) {
+		struct GdbJITEntry *gentry = gmodule->entries;
+
+		gmodule->entries = gentry->module_next;
+		unregister_entry(&gentry->entry);
+		free((void *) gentry->entry.symfile_addr);
+		free(gentry);
+	}
+	pthread_mutex_unlock(&gdb_jit_lock);
+
+	free(gmodule);
+}
+
+static int register_symbols(struct ModuleInst *module_inst,
+			    const struct WasmJITElfSymbol *syms,
+			    size_t n_syms)
+{
+	struct GdbJITEntry *gentry = NULL;
+	struct GdbJITModule *gmodule;
+	void *symfile = NULL;
+	size_t symfile_size;
+	int ret;
+
+	symfile = wasmjit_output_elf_symbol_file(syms, n_syms, &symfile_size);
+	if (!symfile)
+		goto error;
+
+	gentry = calloc(1, sizeof(*gentry));
+	if (!gentry)
+		goto error;
+
+	pthread_mutex_lock(&gdb_jit_lock);
+
+	if (!module_inst->debug_info) {
+		gmodule = calloc(1, sizeof(*gmodule));
+		if (!gmodule) {
+			pthread_mutex_unlock(&gdb_jit_lock);
+			goto error;
+		}
+		module_inst->debug_info = gmodule;
+		module_inst->free_debug_info = free_gdb_jit_module;
+	}
+	gmodule = module_inst->debug_info;
+
+	gentry->entry.symfile_addr = symfile;
+	gentry->entry.symfile_size = symfile_size;
+	gentry->module_next = gmodule->entries;
+	gmodule->entries = gentry;
+	register_entry(&gentry->entry);
+	symfile = NULL;
+	gentry = NULL;
+
+	pthread_mutex_unlock(&gdb_jit_lock);
+
+	ret = 1;
+
+	if (0) {
+	error:
+		ret = 0;
+	}
+
+	free(gentry);
+	free(symfile);
+
+	return ret;
+}
+
+static const char *export_name(const struct ModuleInst *module_inst,
+			       const struct FuncInst *funcinst)
+{
+	size_t i;
+
+	for (i = 0; i < module_inst->exports.n_elts; ++i) {
+		if (module_inst->exports.elts[i].type == IMPORT_DESC_TYPE_FUNC &&
+		    module_inst->exports.elts[i].value.func == funcinst)
+			return module_inst->exports.elts[i].name;
+	}
+
+	return NULL;
+}
+
+static void func_symbols(struct WasmJITElfSymbol *syms,
+			 char (*names)[GDB_JIT_NAME_MAX],
+			 const char *name, uint32_t funcidx,
+			 const struct FuncInst *funcinst)
+{
+	if (name) {
+		snprintf(names[0], GDB_JIT_NAME_MAX, "%s", name);
+		snprintf(names[1], GDB_JIT_NAME_MAX, "invoker:%s", name);
+	} else {
+		snprintf(names[0], GDB_JIT_NAME_MAX,
+			 "wasm-function[%" PRIu32 "]", funcidx);
+		snprintf(names[1], GDB_JIT_NAME_MAX,
+			 "invoker:wasm-function[%" PRIu32 "]", funcidx);
+	}
+
+	syms[0].name = names[0];
+	syms[0].addr = (uintptr_t) funcinst->compiled_code;
+	syms[0].size = funcinst->compiled_code_size;
+	syms[1].name = names[1];
+	syms[1].addr = (uintptr_t) funcinst->invoker;
+	syms[1].size = funcinst->invoker_size;
+}
+
+int wasmjit_gdb_jit_register_module_inst(struct ModuleInst *module_inst,
+					 const struct Module *module)
+{
+	struct WasmJITElfSymbol *syms = NULL;
+	char (*names)[GDB_JIT_NAME_MAX] = NULL;
+	size_t i, n_funcs;
+	int ret;
+
+	n_funcs = module_inst->funcs.n_elts - module_inst->n_imported_funcs;
+	if (!n_funcs)
+		return 1;
+
+	syms = calloc(2 * n_funcs, sizeof(syms[0]));
+	if (!syms)
+		goto error;
+
+	names = calloc(2 * n_funcs, sizeof(names[0]));
+	if (!names)
+		goto error;
+
+	for (i = 0; i < n_funcs; ++i) {
+		uint32_t funcidx = i + module_inst->n_imported_funcs;
+		struct FuncInst *funcinst = module_inst->funcs.elts[funcidx];
+		const char *name;
+
+		name = module ? wasmjit_module_func_name(module, funcidx) : NULL;
+		if (!name)
+			name = export_name(module_inst, funcinst);
+
+		func_symbols(&syms[2 * i], &names[2 * i],
+			     name, funcidx, funcinst);
+	}
+
+	ret = register_symbols(module_inst, syms, 2 * n_funcs);
+
+	if (0) {
+	error:
+		ret = 0;
+	}
+
+	free(names);
+	free(syms);
+
+	return ret;
+}
+
+int wasmjit_gdb_jit_register_func(struct ModuleInst *module_inst,
+				  const char *name, uint32_t funcidx,
+				  const struct FuncInst *funcinst)
+{
+	struct WasmJITElfSymbol syms[2];
+	char names[2][GDB_JIT_NAME_MAX];
+
+	func_symbols(syms, names, name, funcidx, funcinst);
+
+	return register_symbols(module_inst, syms, 2);
+}
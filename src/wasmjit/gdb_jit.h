@@ -0,0 +1,60 @@
+/* -*-mode:c; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+  Copyright (c) 2018 Rian Hunter et. al, see AUTHORS file.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+
+#ifndef __WASMJIT__GDB_JIT_H__
+#define __WASMJIT__GDB_JIT_H__
+
+#include <wasmjit/ast.h>
+#include <wasmjit/runtime.h>
+
+#include <wasmjit/sys.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+  Implements the GDB JIT compilation interface. Once enabled, each
+  instantiated module registers an in-memory symbol file naming its
+  compiled functions and invokers, so backtraces through JIT code
+  resolve. The symbol files are unregistered when the module instance
+  is freed.
+ */
+
+void wasmjit_gdb_jit_enable(void);
+int wasmjit_gdb_jit_enabled(void);
+
+/* module is only used for names and may be NULL */
+int wasmjit_gdb_jit_register_module_inst(struct ModuleInst *module_inst,
+					 const struct Module *module);
+int wasmjit_gdb_jit_register_func(struct ModuleInst *module_inst,
+				  const char *name, uint32_t funcidx,
+				  const struct FuncInst *funcinst);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -25,12 +25,20 @@
 #include <wasmjit/high_level.h>
 
 #include <wasmjit/parse.h>
+#include <wasmjit/inline.h>
 #include <wasmjit/instantiate.h>
 #include <wasmjit/dynamic_emscripten_runtime.h>
 #include <wasmjit/emscripten_runtime.h>
 #include <wasmjit/sys.h>
 #include <wasmjit/util.h>
 
+#ifndef __KERNEL__
+#include <wasmjit/profile.h>
+#include <wasmjit/sampler.h>
+#include <wasmjit/stats.h>
+#include <wasmjit/tier.h>
+#endif
+
 #ifdef WASMJIT_CAN_USE_DEVICE
 #include <wasmjit/kwasmjit.h>
 
@@ -101,10 +109,33 @@ int wasmjit_high_init(struct WasmJITHigh *self)
 	self->modules = NULL;
 	self->emscripten_asm_module = NULL;
 	self->emscripten_env_module = NULL;
+	self->profile = NULL;
+	self->emscripten_thread_module = NULL;
+	self->emscripten_thread_module_inst = NULL;
+	self->emscripten_thread_flags = 0;
 	memset(self->error_buffer, 0, sizeof(self->error_buffer));
 	return 0;
 }
 
+#ifndef __KERNEL__
+
+static int imports_shared_memory(const struct Module *module)
+{
+	size_t i;
+
+	for (i = 0; i < module->import_section.n_imports; ++i) {
+		const struct ImportSectionImport *import =
+			&module->import_section.imports[i];
+		if (import->desc_type == IMPORT_DESC_TYPE_MEM &&
+		    import->desc.memtype.limits.shared)
+			return 1;
+	}
+
+	return 0;
+}
+
+#endif
+
 static int wasmjit_high_instantiate_buf(struct WasmJITHigh *self,
 					const char *buf, size_t size,
 					const char *module_name, uint32_t flags)
@@ -113,6 +144,9 @@ static int wasmjit_high_instantiate_buf(struct WasmJITHigh *self,
 	struct ParseState pstate;
 	struct Module module;
 	struct ModuleInst *module_inst = NULL;
+	unsigned instantiate_flags = 0;
+	const struct WasmJITProfile *profile = NULL;
+	int no_inline = 0, keep_module = 0;
 
 #ifdef WASMJIT_CAN_USE_DEVICE
 	/* should not be using this if we are backending to kernel */
@@ -121,22 +155,145 @@ static int wasmjit_high_instantiate_buf(struct WasmJITHigh *self,
 
 	(void)flags;
 
+#ifndef __KERNEL__
+	if (flags & WASMJIT_HIGH_INSTANTIATE_FLAGS_PROFILE) {
+		instantiate_flags |= WASMJIT_INSTANTIATE_FLAG_PROFILE;
+		/* tier 1 code doesn't record */
+		flags &= ~WASMJIT_HIGH_INSTANTIATE_FLAGS_TIERED;
+	}
+
+	if (flags & WASMJIT_HIGH_INSTANTIATE_FLAGS_FUEL) {
+		instantiate_flags |= WASMJIT_INSTANTIATE_FLAG_FUEL;
+		/* inlined code is charged differently and tier-up is
+		   asynchronous, usage would vary from run to run */
+		flags &= ~WASMJIT_HIGH_INSTANTIATE_FLAGS_TIERED;
+	}
+
+	if (flags & WASMJIT_HIGH_INSTANTIATE_FLAGS_EPOCH)
+		instantiate_flags |= WASMJIT_INSTANTIATE_FLAG_EPOCH;
+
+	if (flags & (WASMJIT_HIGH_INSTANTIATE_FLAGS_CALL_STATS |
+		     WASMJIT_HIGH_INSTANTIATE_FLAGS_CYCLE_STATS)) {
+		if (flags & WASMJIT_HIGH_INSTANTIATE_FLAGS_CYCLE_STATS)
+			instantiate_flags |= WASMJIT_INSTANTIATE_FLAG_CYCLE_STATS;
+		else
+			instantiate_flags |= WASMJIT_INSTANTIATE_FLAG_CALL_STATS;
+		/* inlined calls aren't counted, keep every call */
+		flags &= ~WASMJIT_HIGH_INSTANTIATE_FLAGS_TIERED;
+		no_inline = 1;
+	}
+
+	if (flags & WASMJIT_HIGH_INSTANTIATE_FLAGS_HUGE_PAGES)
+		instantiate_flags |= WASMJIT_INSTANTIATE_FLAG_HUGE_PAGES;
+	if (flags & WASMJIT_HIGH_INSTANTIATE_FLAGS_HUGETLB)
+		instantiate_flags |= WASMJIT_INSTANTIATE_FLAG_HUGETLB;
+#endif
+
 	wasmjit_init_module(&module);
 
 	if (!init_pstate(&pstate, buf, size)) {
 		goto error;
 	}
 
+#ifndef __KERNEL__
+	/* instances map the data instead of copying it */
+	pstate.flags |= WASMJIT_PARSE_FLAG_DATA_IMAGE;
+#endif
+
 	if (!read_module(&pstate, &module, NULL, 0)) {
 		goto error;
 	}
 
 	/* TODO: validate module */
 
-	module_inst = wasmjit_instantiate(&module, self->n_modules, self->modules,
-					  self->error_buffer, sizeof(self->error_buffer));
-	if (!module_inst) {
-		goto error;
+#ifndef __KERNEL__
+	if (!self->emscripten_thread_module &&
+	    imports_shared_memory(&module)) {
+		keep_module = 1;
+		/* the tier takes the module it recompiles, threads need
+		   it to instantiate their own copies */
+		flags &= ~WASMJIT_HIGH_INSTANTIATE_FLAGS_TIERED;
+	}
+
+	if (!(flags & WASMJIT_HIGH_INSTANTIATE_FLAGS_PROFILE) &&
+	    self->profile &&
+	    self->profile->module_hash == wasmjit_profile_hash(buf, size)) {
+		/* the tier lays either kind out for inlined code */
+		if ((flags & WASMJIT_HIGH_INSTANTIATE_FLAGS_TIERED) ||
+		    self->profile->inlined == !no_inline) {
+			profile = self->profile;
+		} else {
+			fprintf(stderr,
+				"wasmjit: profile for %s was recorded %s inlining, not using it\n",
+				module_name,
+				self->profile->inlined ? "with" : "without");
+		}
+	}
+
+	if (flags & WASMJIT_HIGH_INSTANTIATE_FLAGS_TIERED) {
+		/* callees are inlined per function once they get hot */
+		module_inst = wasmjit_instantiate(&module, self->n_modules, self->modules,
+						  instantiate_flags |
+						  WASMJIT_INSTANTIATE_FLAG_TIERED,
+						  profile,
+						  self->error_buffer, sizeof(self->error_buffer));
+		if (!module_inst) {
+			goto error;
+		}
+
+		/* before the tier takes the module */
+		if (wasmjit_sampler_enabled() &&
+		    !wasmjit_sampler_add_module(module_inst, &module)) {
+			goto error;
+		}
+
+		if (!wasmjit_tier_attach(module_inst, &module, profile)) {
+			goto error;
+		}
+	} else
+#endif
+	{
+		if (!no_inline && !wasmjit_inline_module(&module)) {
+			goto error;
+		}
+
+		module_inst = wasmjit_instantiate(&module, self->n_modules, self->modules,
+						  instantiate_flags,
+						  profile,
+						  self->error_buffer, sizeof(self->error_buffer));
+		if (!module_inst) {
+			goto error;
+		}
+
+#ifndef __KERNEL__
+		if (wasmjit_sampler_enabled() &&
+		    !wasmjit_sampler_add_module(module_inst, &module)) {
+			goto error;
+		}
+#endif
+	}
+
+#ifndef __KERNEL__
+	if (module_inst->profile) {
+		module_inst->profile->module_hash = wasmjit_profile_hash(buf, size);
+		/* tier 0 records without inlining */
+		module_inst->profile->inlined =
+			!no_inline && !(flags & WASMJIT_HIGH_INSTANTIATE_FLAGS_TIERED);
+	}
+#endif
+
+	if (keep_module) {
+		self->emscripten_thread_module = malloc(sizeof(struct Module));
+		if (!self->emscripten_thread_module)
+			goto error;
+		*self->emscripten_thread_module = module;
+		wasmjit_init_module(&module);
+		self->emscripten_thread_module_inst = module_inst;
+		/* fuel and profiles are per thread, other threads run
+		   unmetered and unrecorded */
+		self->emscripten_thread_flags = instantiate_flags &
+			~(WASMJIT_INSTANTIATE_FLAG_FUEL |
+			  WASMJIT_INSTANTIATE_FLAG_PROFILE);
 	}
 
 	if (!add_named_module(self, module_name, module_inst)) {
@@ -154,6 +311,16 @@ static int wasmjit_high_instantiate_buf(struct WasmJITHigh *self,
 	wasmjit_free_module(&module);
 
 	if (module_inst) {
+		if (self->emscripten_thread_module_inst == module_inst) {
+			wasmjit_free_module(self->emscripten_thread_module);
+			free(self->emscripten_thread_module);
+			self->emscripten_thread_module = NULL;
+			self->emscripten_thread_module_inst = NULL;
+		}
+#ifndef __KERNEL__
+		if (wasmjit_sampler_enabled())
+			wasmjit_sampler_remove_module(module_inst);
+#endif
 		wasmjit_free_module_inst(module_inst);
 	}
 
@@ -203,9 +370,12 @@ int wasmjit_high_instantiate_emscripten_runtime(struct WasmJITHigh *self,
 						uint32_t static_bump,
 						size_t tablemin,
 						size_t tablemax,
+						size_t memorymin,
+						size_t memorymax,
 						uint32_t flags)
 {
 	int ret, has_table;
+	unsigned memory_flags = 0;
 	size_t n_modules, i;
 	struct NamedModule *modules = NULL;
 
@@ -217,6 +387,8 @@ int wasmjit_high_instantiate_emscripten_runtime(struct WasmJITHigh *self,
 		arg.static_bump = static_bump;
 		arg.tablemin = tablemin;
 		arg.tablemax = tablemax;
+		arg.memorymin = memorymin;
+		arg.memorymax = memorymax;
 		arg.flags = flags;
 
 		if (ioctl(self->fd, KWASMJIT_INSTANTIATE_EMSCRIPTEN_RUNTIME, &arg) < 0)
@@ -230,10 +402,20 @@ int wasmjit_high_instantiate_emscripten_runtime(struct WasmJITHigh *self,
 
 	has_table = !(flags & WASMJIT_HIGH_INSTANTIATE_EMSCRIPTEN_RUNTIME_FLAGS_NO_TABLE);
 
+	if (flags & WASMJIT_HIGH_INSTANTIATE_EMSCRIPTEN_RUNTIME_FLAGS_HUGE_PAGES)
+		memory_flags |= WASMJIT_MEMORY_FLAG_HUGE_PAGES;
+	if (flags & WASMJIT_HIGH_INSTANTIATE_EMSCRIPTEN_RUNTIME_FLAGS_HUGETLB)
+		memory_flags |= WASMJIT_MEMORY_FLAG_HUGETLB;
+	if (flags & WASMJIT_HIGH_INSTANTIATE_EMSCRIPTEN_RUNTIME_FLAGS_SHARED_MEMORY)
+		memory_flags |= WASMJIT_MEMORY_FLAG_SHARED;
+
 	modules = wasmjit_instantiate_emscripten_runtime(static_bump,
 							 has_table,
 							 tablemin,
 							 tablemax,
+							 memorymin,
+							 memorymax,
+							 memory_flags,
 							 &n_modules);
 	if (!modules) {
 		goto error;
@@ -369,6 +551,16 @@ int wasmjit_high_emscripten_invoke_main(struct WasmJITHigh *self,
 						    envp))
 				return -1;
 
+#ifndef __KERNEL__
+			if (self->emscripten_thread_module_inst == module_inst &&
+			    wasmjit_emscripten_init_pthreads(wasmjit_emscripten_get_context(env_module_inst),
+							     self->emscripten_thread_module,
+							     self->n_modules,
+							     self->modules,
+							     self->emscripten_thread_flags))
+				return -1;
+#endif
+
 			self->emscripten_asm_module = module_inst;
 		}
 
@@ -406,8 +598,12 @@ void wasmjit_high_close(struct WasmJITHigh *self)
 	}
 #endif
 
-	if (self->emscripten_env_module)
-		wasmjit_emscripten_cleanup(self->emscripten_env_module);
+	/* like returning from main(), threads still running are left
+	   to the exit() that is about to follow, along with everything
+	   they use */
+	if (self->emscripten_env_module &&
+	    wasmjit_emscripten_cleanup(self->emscripten_env_module))
+		return;
 
 	self->error_buffer[0] = '\0';
 
@@ -418,8 +614,78 @@ void wasmjit_high_close(struct WasmJITHigh *self)
 	if (self->modules)
 		free(self->modules);
 
+	if (self->emscripten_thread_module) {
+		wasmjit_free_module(self->emscripten_thread_module);
+		free(self->emscripten_thread_module);
+	}
+
+	if (self->profile)
+		wasmjit_free_profile(self->profile);
+}
+
+#ifndef __KERNEL__
+
+int wasmjit_high_load_profile(struct WasmJITHigh *self, const char *filename)
+{
+#ifdef WASMJIT_CAN_USE_DEVICE
+	if (self->fd >= 0)
+		return -1;
+#endif
+
+	if (self->profile)
+		wasmjit_free_profile(self->profile);
+
+	self->profile = wasmjit_profile_load(filename);
+	return self->profile ? 0 : -1;
 }
 
+int wasmjit_high_save_profile(struct WasmJITHigh *self,
+			      const char *module_name,
+			      const char *filename)
+{
+	size_t i;
+
+#ifdef WASMJIT_CAN_USE_DEVICE
+	if (self->fd >= 0)
+		return -1;
+#endif
+
+	for (i = 0; i < self->n_modules; ++i) {
+		if (!strcmp(self->modules[i].name, module_name))
+			break;
+	}
+
+	if (i == self->n_modules)
+		return -1;
+
+	return wasmjit_profile_save(filename, self->modules[i].module) ? 0 : -1;
+}
+
+int wasmjit_high_dump_function_stats(struct WasmJITHigh *self,
+				     FILE *stream, size_t top_n)
+{
+#ifdef WASMJIT_CAN_USE_DEVICE
+	if (self->fd >= 0)
+		return -1;
+#endif
+
+	return wasmjit_dump_function_stats(stream, self->n_modules,
+					   self->modules, top_n);
+}
+
+int wasmjit_high_dump_memory_stats(struct WasmJITHigh *self, FILE *stream)
+{
+#ifdef WASMJIT_CAN_USE_DEVICE
+	if (self->fd >= 0)
+		return -1;
+#endif
+
+	return wasmjit_dump_memory_stats(stream, self->n_modules,
+					 self->modules);
+}
+
+#endif
+
 int wasmjit_high_error_message(struct WasmJITHigh *self,
 			      char *buf, size_t buf_size)
 {
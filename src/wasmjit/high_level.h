@@ -38,6 +38,8 @@ extern "C" {
 #define WASMJIT_CAN_USE_DEVICE
 #endif
 
+struct Module;
+
 struct WasmJITHigh {
 #ifdef WASMJIT_CAN_USE_DEVICE
 	int fd;
@@ -47,9 +49,37 @@ struct WasmJITHigh {
 	char error_buffer[256];
 	struct ModuleInst *emscripten_asm_module;
 	struct ModuleInst *emscripten_env_module;
+	/* used by instantiations of the module it was recorded for */
+	struct WasmJITProfile *profile;
+	/* a module importing a shared memory, -s USE_PTHREADS, kept
+	   so every thread it starts can instantiate it again */
+	struct Module *emscripten_thread_module;
+	struct ModuleInst *emscripten_thread_module_inst;
+	unsigned emscripten_thread_flags;
 };
 
+#define WASMJIT_HIGH_INSTANTIATE_FLAGS_TIERED 1
+/* record a branch profile, see wasmjit_high_save_profile() */
+#define WASMJIT_HIGH_INSTANTIATE_FLAGS_PROFILE 2
+/* meter execution, see wasmjit_set_fuel() */
+#define WASMJIT_HIGH_INSTANTIATE_FLAGS_FUEL 4
+/* allow interruption, see wasmjit_set_epoch_deadline() */
+#define WASMJIT_HIGH_INSTANTIATE_FLAGS_EPOCH 8
+/* count calls per function, see wasmjit_high_dump_function_stats() */
+#define WASMJIT_HIGH_INSTANTIATE_FLAGS_CALL_STATS 16
+/* also count the cycles spent in each function */
+#define WASMJIT_HIGH_INSTANTIATE_FLAGS_CYCLE_STATS 32
+/* back the module's own memories with huge pages */
+#define WASMJIT_HIGH_INSTANTIATE_FLAGS_HUGE_PAGES 64
+#define WASMJIT_HIGH_INSTANTIATE_FLAGS_HUGETLB 128
+
 #define WASMJIT_HIGH_INSTANTIATE_EMSCRIPTEN_RUNTIME_FLAGS_NO_TABLE 1
+/* back env.memory with transparent huge pages */
+#define WASMJIT_HIGH_INSTANTIATE_EMSCRIPTEN_RUNTIME_FLAGS_HUGE_PAGES 2
+/* back env.memory with hugetlbfs pages */
+#define WASMJIT_HIGH_INSTANTIATE_EMSCRIPTEN_RUNTIME_FLAGS_HUGETLB 4
+/* make env.memory a shared memory, for -s USE_PTHREADS */
+#define WASMJIT_HIGH_INSTANTIATE_EMSCRIPTEN_RUNTIME_FLAGS_SHARED_MEMORY 8
 
 int wasmjit_high_init(struct WasmJITHigh *self);
 int wasmjit_high_instantiate(struct WasmJITHigh *self,
@@ -60,12 +90,23 @@ int wasmjit_high_instantiate_emscripten_runtime(struct WasmJITHigh *self,
 						uint32_t static_bump,
 						size_t tablemin,
 						size_t tablemax,
+						size_t memorymin,
+						size_t memorymax,
 						uint32_t flags);
 int wasmjit_high_emscripten_invoke_main(struct WasmJITHigh *self,
 					const char *module_name,
 					int argc, char **argv, char **envp,
 					uint32_t flags);
 void wasmjit_high_close(struct WasmJITHigh *self);
+#ifndef __KERNEL__
+int wasmjit_high_load_profile(struct WasmJITHigh *self, const char *filename);
+int wasmjit_high_save_profile(struct WasmJITHigh *self,
+			      const char *module_name,
+			      const char *filename);
+int wasmjit_high_dump_function_stats(struct WasmJITHigh *self,
+				     FILE *stream, size_t top_n);
+int wasmjit_high_dump_memory_stats(struct WasmJITHigh *self, FILE *stream);
+#endif
 int wasmjit_high_error_message(struct WasmJITHigh *self, char *buf, size_t buf_size);
 
 #ifdef __cplusplus
@@ -0,0 +1,658 @@
+/* -*-mode:c; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+  Copyright (c) 2018 Rian Hunter et. al, see AUTHORS file.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+#include <wasmjit/inline.h>
+
+#include <wasmjit/ast.h>
+#include <wasmjit/vector.h>
+
+#include <wasmjit/sys.h>
+
+/*
+  Inlining is done on the AST before compilation. A call site to an
+  eligible callee is rewritten as:
+
+    set_local $base+n-1 ... set_local $base   ;; pop args into locals
+    <type>.const 0 set_local $base+n+k        ;; reset callee locals
+    block <result type>
+      <callee body, locals offset by $base, return -> br to this block>
+    end
+
+  Only leaf callees (no call or call_indirect) are eligible, this
+  guarantees we never inline recursively and keeps the transform a
+  single pass over each caller.
+ */
+
+struct InlineCallee {
+	int eligible;
+	size_t n_instructions;
+	size_t n_locals;
+};
+
+struct InlineSlots {
+	size_t n_elts;
+	struct InlineSlot {
+		uint32_t codeidx;
+		uint32_t local_base;
+	} *elts;
+};
+
+struct InlineSites {
+	size_t n_elts;
+	struct InlineSite {
+		size_t instruction_idx;
+		uint32_t codeidx;
+		uint32_t local_base;
+	} *elts;
+};
+
+struct InstructionList {
+	size_t *n_instructions;
+	struct Instr **instructions;
+};
+
+/* returns a value greater than limit if the body is too big or calls
+   other functions */
+static size_t callee_size(const struct Instr *instructions,
+			  size_t n_instructions,
+			  size_t limit)
+{
+	size_t i, total = 0;
+
+	for (i = 0; i < n_instructions; ++i) {
+		const struct Instr *instr = &instructions[i];
+
+		total += 1;
+		if (total > limit)
+			return total;
+
+		switch (instr->opcode) {
+		case OPCODE_CALL:
+		case OPCODE_CALL_INDIRECT:
+		case OPCODE_RETURN_CALL:
+		case OPCODE_RETURN_CALL_INDIRECT:
+			return limit + 1;
+		case OPCODE_BLOCK:
+		case OPCODE_LOOP:
+			total += callee_size(instr->data.block.instructions,
+					     instr->data.block.n_instructions,
+					     limit - total);
+			break;
+		case OPCODE_IF:
+			total += callee_size(instr->data.if_.instructions_then,
+					     instr->data.if_.n_instructions_then,
+					     limit - total);
+			if (total > limit)
+				return total;
+			total += callee_size(instr->data.if_.instructions_else,
+					     instr->data.if_.n_instructions_else,
+					     limit - total);
+			break;
+		default:
+			break;
+		}
+
+		if (total > limit)
+			return total;
+	}
+
+	return total;
+}
+
+static int copy_callee_body(struct Instr **out,
+			    const struct Instr *src,
+			    size_t n_instructions,
+			    uint32_t local_base,
+			    uint32_t depth)
+{
+	size_t i;
+	struct Instr *dst;
+
+	*out = NULL;
+
+	if (!n_instructions)
+		return 1;
+
+	/* NB: calloc() so that free_instructions() on a partial copy is safe */
+	dst = calloc(n_instructions, sizeof(dst[0]));
+	if (!dst)
+		goto error;
+
+	for (i = 0; i < n_instructions; ++i) {
+		dst[i] = src[i];
+
+		switch (src[i].opcode) {
+		case OPCODE_BLOCK:
+		case OPCODE_LOOP:
+			dst[i].data.block.instructions = NULL;
+			if (!copy_callee_body(&dst[i].data.block.instructions,
+					      src[i].data.block.instructions,
+					      src[i].data.block.n_instructions,
+					      local_base, depth + 1))
+				goto error;
+			break;
+		case OPCODE_IF:
+			dst[i].data.if_.instructions_then = NULL;
+			dst[i].data.if_.instructions_else = NULL;
+			if (!copy_callee_body(&dst[i].data.if_.instructions_then,
+					      src[i].data.if_.instructions_then,
+					      src[i].data.if_.n_instructions_then,
+					      local_base, depth + 1))
+				goto error;
+			if (!copy_callee_body(&dst[i].data.if_.instructions_else,
+					      src[i].data.if_.instructions_else,
+					      src[i].data.if_.n_instructions_else,
+					      local_base, depth + 1))
+				goto error;
+			break;
+		case OPCODE_BR_TABLE:
+			dst[i].data.br_table.labelidxs = NULL;
+			if (src[i].data.br_table.n_labelidxs) {
+				size_t size = src[i].data.br_table.n_labelidxs *
+					sizeof(src[i].data.br_table.labelidxs[0]);
+				dst[i].data.br_table.labelidxs = malloc(size);
+				if (!dst[i].data.br_table.labelidxs)
+					goto error;
+				memcpy(dst[i].data.br_table.labelidxs,
+				       src[i].data.br_table.labelidxs, size);
+			}
+			break;
+		case OPCODE_RETURN:
+			/* the wrapping block is the callee's function label */
+			init_instruction(&dst[i]);
+			dst[i].opcode = OPCODE_BR;
+			dst[i].offset = src[i].offset;
+			dst[i].data.br.labelidx = depth;
+			break;
+		case OPCODE_GET_LOCAL:
+			dst[i].data.get_local.localidx += local_base;
+			break;
+		case OPCODE_SET_LOCAL:
+			dst[i].data.set_local.localidx += local_base;
+			break;
+		case OPCODE_TEE_LOCAL:
+			dst[i].data.tee_local.localidx += local_base;
+			break;
+		default:
+			break;
+		}
+	}
+
+	*out = dst;
+
+	return 1;
+
+ error:
+	if (dst)
+		free_instructions(dst, n_instructions);
+	return 0;
+}
+
+static const struct InlineCallee *
+site_callee(const struct Module *module,
+	    const struct InlineCallee *callees,
+	    uint32_t n_imported_funcs,
+	    const struct Instr *instr)
+{
+	uint32_t codeidx;
+
+	if (instr->opcode != OPCODE_CALL)
+		return NULL;
+
+	if (instr->data.call.funcidx < n_imported_funcs)
+		return NULL;
+
+	codeidx = instr->data.call.funcidx - n_imported_funcs;
+	if (codeidx >= module->code_section.n_codes)
+		return NULL;
+
+	if (!callees[codeidx].eligible)
+		return NULL;
+
+	return &callees[codeidx];
+}
+
+static const struct FuncType *code_type(const struct Module *module,
+					uint32_t codeidx)
+{
+	return &module->type_section.types[module->function_section.typeidxs[codeidx]];
+}
+
+static int add_locals(struct CodeSectionCode *code,
+		      const struct CodeSectionCodeLocal *locals,
+		      size_t n_locals)
+{
+	struct CodeSectionCodeLocal *new_locals;
+
+	if (code->n_locals > UINT32_MAX - n_locals)
+		return 0;
+
+	new_locals = realloc(code->locals,
+			     (code->n_locals + n_locals) * sizeof(code->locals[0]));
+	if (!new_locals)
+		return 0;
+
+	memcpy(&new_locals[code->n_locals], locals,
+	       n_locals * sizeof(locals[0]));
+	code->locals = new_locals;
+	code->n_locals += n_locals;
+
+	return 1;
+}
+
+/* callee locals are allocated once per caller, since callees are leaf
+   functions two inlined bodies are never live at the same time */
+static int get_local_base(struct Module *module,
+			  struct CodeSectionCode *code,
+			  size_t *n_caller_locals,
+			  struct InlineSlots *slots,
+			  uint32_t codeidx,
+			  uint32_t *local_base)
+{
+	const struct FuncType *ft = code_type(module, codeidx);
+	const struct CodeSectionCode *callee = &module->code_section.codes[codeidx];
+	size_t i, n_new;
+
+	for (i = 0; i < slots->n_elts; ++i) {
+		if (slots->elts[i].codeidx == codeidx) {
+			*local_base = slots->elts[i].local_base;
+			return 1;
+		}
+	}
+
+	n_new = ft->n_inputs;
+	for (i = 0; i < callee->n_locals; ++i) {
+		n_new += callee->locals[i].count;
+	}
+
+	if (*n_caller_locals + n_new > UINT32_MAX)
+		return 0;
+
+	for (i = 0; i < ft->n_inputs; ++i) {
+		struct CodeSectionCodeLocal param;
+		param.count = 1;
+		param.valtype = ft->input_types[i];
+		if (!add_locals(code, &param, 1))
+			return 0;
+	}
+
+	if (!add_locals(code, callee->locals, callee->n_locals))
+		return 0;
+
+	if (!VECTOR_GROW(slots, 1))
+		return 0;
+
+	slots->elts[slots->n_elts - 1].codeidx = codeidx;
+	slots->elts[slots->n_elts - 1].local_base = *n_caller_locals;
+
+	*local_base = *n_caller_locals;
+	*n_caller_locals += n_new;
+
+	return 1;
+}
+
+static int inline_code(struct Module *module,
+		       const struct InlineCallee *callees,
+		       uint32_t n_imported_funcs,
+		       uint32_t caller_codeidx)
+{
+	struct CodeSectionCode *code = &module->code_section.codes[caller_codeidx];
+	size_t i, budget, n_caller_locals;
+	int ret;
+	struct InlineSlots slots = {0, NULL};
+	struct InlineSites sites = {0, NULL};
+	DEFINE_ANON_VECTOR(struct InstructionList) worklist = {0, NULL};
+	struct Instr *blocks = NULL, *new_instructions = NULL;
+
+	n_caller_locals = code_type(module, caller_codeidx)->n_inputs;
+	for (i = 0; i < code->n_locals; ++i) {
+		n_caller_locals += code->locals[i].count;
+	}
+
+	budget = WASMJIT_INLINE_MAX_CALLER_GROWTH;
+
+	if (!VECTOR_GROW(&worklist, 1))
+		goto error;
+	worklist.elts[0].n_instructions = &code->n_instructions;
+	worklist.elts[0].instructions = &code->instructions;
+
+	while (worklist.n_elts) {
+		struct InstructionList list = worklist.elts[--worklist.n_elts];
+		size_t n_instructions = *list.n_instructions;
+		struct Instr *instructions = *list.instructions;
+		size_t new_n_instructions, k, j;
+
+		/* find call sites in this instruction list */
+		sites.n_elts = 0;
+		new_n_instructions = n_instructions;
+		for (i = 0; i < n_instructions; ++i) {
+			const struct InlineCallee *callee =
+				site_callee(module, callees, n_imported_funcs,
+					    &instructions[i]);
+			const struct FuncType *ft;
+
+			if (!callee || callee->n_instructions > budget)
+				continue;
+
+			budget -= callee->n_instructions;
+
+			if (!VECTOR_GROW(&sites, 1))
+				goto error;
+			sites.elts[sites.n_elts - 1].instruction_idx = i;
+			sites.elts[sites.n_elts - 1].codeidx = callee - callees;
+
+			ft = code_type(module, callee - callees);
+			new_n_instructions += ft->n_inputs + 2 * callee->n_locals;
+		}
+
+		if (sites.n_elts) {
+			/* NB: all allocations happen before we start moving
+			   instructions so the code stays intact on failure */
+			blocks = calloc(sites.n_elts, sizeof(blocks[0]));
+			if (!blocks)
+				goto error;
+
+			new_instructions = calloc(new_n_instructions,
+						  sizeof(new_instructions[0]));
+			if (!new_instructions)
+				goto error;
+
+			for (k = 0; k < sites.n_elts; ++k) {
+				struct InlineSite *site = &sites.elts[k];
+				uint32_t codeidx = site->codeidx;
+				const struct CodeSectionCode *callee =
+					&module->code_section.codes[codeidx];
+
+				if (!get_local_base(module, code, &n_caller_locals,
+						    &slots, codeidx, &site->local_base))
+					goto error;
+
+				/* the wrapping block and argument moves map to the call */
+				blocks[k].opcode = OPCODE_BLOCK;
+				blocks[k].offset =
+					instructions[site->instruction_idx].offset;
+				blocks[k].data.block.blocktype =
+					code_type(module, codeidx)->output_type;
+				blocks[k].data.block.n_instructions =
+					callee->n_instructions;
+				blocks[k].data.block.inlined = codeidx + 1;
+				if (!copy_callee_body(&blocks[k].data.block.instructions,
+						      callee->instructions,
+						      callee->n_instructions,
+						      site->local_base, 0))
+					goto error;
+			}
+
+			for (i = 0, j = 0, k = 0; i < n_instructions; ++i) {
+				uint32_t local_base, l, m, offset;
+				const struct FuncType *ft;
+				const struct CodeSectionCode *callee;
+
+				if (k == sites.n_elts ||
+				    sites.elts[k].instruction_idx != i) {
+					new_instructions[j++] = instructions[i];
+					continue;
+				}
+
+				ft = code_type(module, sites.elts[k].codeidx);
+				callee = &module->code_section.codes[sites.elts[k].codeidx];
+				local_base = sites.elts[k].local_base;
+				offset = instructions[i].offset;
+
+				/* pop arguments */
+				for (l = ft->n_inputs; l--;) {
+					new_instructions[j].opcode = OPCODE_SET_LOCAL;
+					new_instructions[j].offset = offset;
+					new_instructions[j].data.set_local.localidx =
+						local_base + l;
+					j++;
+				}
+
+				/* callee locals must start out zeroed */
+				local_base += ft->n_inputs;
+				for (l = 0; l < callee->n_locals; ++l) {
+					for (m = 0; m < callee->locals[l].count; ++m) {
+						switch (callee->locals[l].valtype) {
+						case VALTYPE_I32:
+							new_instructions[j].opcode = OPCODE_I32_CONST;
+							break;
+						case VALTYPE_I64:
+							new_instructions[j].opcode = OPCODE_I64_CONST;
+							break;
+						case VALTYPE_F32:
+							new_instructions[j].opcode = OPCODE_F32_CONST;
+							break;
+						case VALTYPE_F64:
+							new_instructions[j].opcode = OPCODE_F64_CONST;
+							break;
+						default:
+							assert(0);
+							break;
+						}
+						/* NB: calloc() already zeroed the constant */
+						new_instructions[j].offset = offset;
+						j++;
+
+						new_instructions[j].opcode = OPCODE_SET_LOCAL;
+						new_instructions[j].offset = offset;
+						new_instructions[j].data.set_local.localidx =
+							local_base++;
+						j++;
+					}
+				}
+
+				new_instructions[j++] = blocks[k++];
+			}
+
+			assert(j == new_n_instructions);
+
+			/* instructions were moved, only free the arrays */
+			free(blocks);
+			blocks = NULL;
+			free(instructions);
+
+			instructions = new_instructions;
+			n_instructions = new_n_instructions;
+			new_instructions = NULL;
+
+			*list.instructions = instructions;
+			*list.n_instructions = n_instructions;
+		}
+
+		/* descend into nested blocks */
+		for (i = 0; i < n_instructions; ++i) {
+			struct Instr *instr = &instructions[i];
+			size_t n_lists = 0;
+			struct InstructionList lists[2];
+
+			switch (instr->opcode) {
+			case OPCODE_BLOCK:
+			case OPCODE_LOOP:
+				lists[n_lists].n_instructions = &instr->data.block.n_instructions;
+				lists[n_lists].instructions = &instr->data.block.instructions;
+				n_lists++;
+				break;
+			case OPCODE_IF:
+				lists[n_lists].n_instructions = &instr->data.if_.n_instructions_then;
+				lists[n_lists].instructions = &instr->data.if_.instructions_then;
+				n_lists++;
+				lists[n_lists].n_instructions = &instr->data.if_.n_instructions_else;
+				lists[n_lists].instructions = &instr->data.if_.instructions_else;
+				n_lists++;
+				break;
+			default:
+				break;
+			}
+
+			if (!n_lists)
+				continue;
+
+			if (!VECTOR_GROW(&worklist, n_lists))
+				goto error;
+			memcpy(&worklist.elts[worklist.n_elts - n_lists], lists,
+			       n_lists * sizeof(lists[0]));
+		}
+	}
+
+	ret = 1;
+
+	if (0) {
+	error:
+		ret = 0;
+	}
+
+	if (blocks)
+		free_instructions(blocks, sites.n_elts);
+	if (new_instructions)
+		free(new_instructions);
+	if (slots.elts)
+		free(slots.elts);
+	if (worklist.elts)
+		free(worklist.elts);
+	if (sites.elts)
+		free(sites.elts);
+
+	return ret;
+}
+
+static int analyze_callees(const struct Module *module,
+			   struct InlineCallee **out,
+			   uint32_t *out_n_imported_funcs)
+{
+	uint32_t i, n_imported_funcs = 0;
+	struct InlineCallee *callees;
+
+	for (i = 0; i < module->import_section.n_imports; ++i) {
+		if (module->import_section.imports[i].desc_type ==
+		    IMPORT_DESC_TYPE_FUNC)
+			n_imported_funcs++;
+	}
+
+	callees = calloc(module->code_section.n_codes, sizeof(callees[0]));
+	if (!callees)
+		return 0;
+
+	for (i = 0; i < module->code_section.n_codes; ++i) {
+		struct CodeSectionCode *code = &module->code_section.codes[i];
+		struct InlineCallee *callee = &callees[i];
+		uint32_t j;
+
+		if (module->function_section.typeidxs[i] >=
+		    module->type_section.n_types)
+			continue;
+
+		for (j = 0; j < code->n_locals; ++j) {
+			callee->n_locals += code->locals[j].count;
+		}
+
+		callee->n_instructions =
+			callee_size(code->instructions, code->n_instructions,
+				    WASMJIT_INLINE_MAX_CALLEE_INSTRUCTIONS);
+
+		callee->eligible =
+			callee->n_instructions <=
+			WASMJIT_INLINE_MAX_CALLEE_INSTRUCTIONS &&
+			code_type(module, i)->n_inputs + callee->n_locals <=
+			WASMJIT_INLINE_MAX_CALLEE_LOCALS;
+	}
+
+	*out = callees;
+	*out_n_imported_funcs = n_imported_funcs;
+	return 1;
+}
+
+int wasmjit_inline_module(struct Module *module)
+{
+	uint32_t i, n_imported_funcs;
+	struct InlineCallee *callees = NULL;
+	int ret;
+
+	if (module->function_section.n_typeidxs != module->code_section.n_codes)
+		/* malformed, let instantiation report the error */
+		return 1;
+
+	if (!module->code_section.n_codes)
+		return 1;
+
+	if (!analyze_callees(module, &callees, &n_imported_funcs))
+		goto error;
+
+	for (i = 0; i < module->code_section.n_codes; ++i) {
+		/* eligible callees have no call sites */
+		if (callees[i].eligible)
+			continue;
+
+		if (module->function_section.typeidxs[i] >=
+		    module->type_section.n_types)
+			continue;
+
+		if (!inline_code(module, callees, n_imported_funcs, i))
+			goto error;
+	}
+
+	ret = 1;
+
+	if (0) {
+	error:
+		ret = 0;
+	}
+
+	if (callees)
+		free(callees);
+
+	return ret;
+}
+
+/* inline eligible callees into a single function, e.g. when it gets hot */
+int wasmjit_inline_function(struct Module *module, uint32_t codeidx)
+{
+	uint32_t n_imported_funcs;
+	struct InlineCallee *callees = NULL;
+	int ret;
+
+	if (module->function_section.n_typeidxs != module->code_section.n_codes ||
+	    codeidx >= module->code_section.n_codes ||
+	    module->function_section.typeidxs[codeidx] >=
+	    module->type_section.n_types)
+		return 1;
+
+	if (!analyze_callees(module, &callees, &n_imported_funcs))
+		goto error;
+
+	if (!callees[codeidx].eligible &&
+	    !inline_code(module, callees, n_imported_funcs, codeidx))
+		goto error;
+
+	ret = 1;
+
+	if (0) {
+	error:
+		ret = 0;
+	}
+
+	if (callees)
+		free(callees);
+
+	return ret;
+}
@@ -0,0 +1,48 @@
+/* -*-mode:c; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+  Copyright (c) 2018 Rian Hunter et. al, see AUTHORS file.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+#ifndef __WASMJIT__INLINE_H__
+#define __WASMJIT__INLINE_H__
+
+#include <wasmjit/ast.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* callees larger than this (in instructions, recursively) are never inlined */
+#define WASMJIT_INLINE_MAX_CALLEE_INSTRUCTIONS 32
+/* callees with more locals (including params) than this are never inlined */
+#define WASMJIT_INLINE_MAX_CALLEE_LOCALS 16
+/* max number of instructions inlined into a single caller */
+#define WASMJIT_INLINE_MAX_CALLER_GROWTH 2048
+
+int wasmjit_inline_module(struct Module *module);
+int wasmjit_inline_function(struct Module *module, uint32_t codeidx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -29,8 +29,18 @@
 #include <wasmjit/compile.h>
 #include <wasmjit/util.h>
 
+#ifndef __KERNEL__
+#include <wasmjit/perf.h>
+#include <wasmjit/gdb_jit.h>
+#endif
+
 #include <wasmjit/sys.h>
 
+#ifndef __KERNEL__
+#include <errno.h>
+#include <unistd.h>
+#endif
+
 static int func_sig_repr(char *why, size_t why_size, struct FuncType *type)
 {
 	int ret ;
@@ -135,10 +145,17 @@ static int fill_module_types(struct ModuleInst *module_inst,
 	if (module_inst->globals.n_elts && !module_types->globaltypes)
 		goto error;
 
+	module_types->memory_strategies =
+		calloc(module_inst->mems.n_elts,
+		       sizeof(module_types->memory_strategies[0]));
+	if (module_inst->mems.n_elts && !module_types->memory_strategies)
+		goto error;
+
 
 	for (i = 0; i < module_inst->funcs.n_elts; ++i) {
 		module_types->functypes[i] = module_inst->funcs.elts[i]->type;
 	}
+	module_types->n_funcs = module_inst->funcs.n_elts;
 
 	for (i = 0; i < module_inst->tables.n_elts; ++i) {
 		module_types->tabletypes[i].elemtype =
@@ -154,7 +171,19 @@ static int fill_module_types(struct ModuleInst *module_inst,
 			module_inst->mems.elts[i]->size / WASM_PAGE_SIZE;
 		module_types->memorytypes[i].limits.max =
 			module_inst->mems.elts[i]->max / WASM_PAGE_SIZE;
+		module_types->memorytypes[i].limits.shared =
+			!!(module_inst->mems.elts[i]->flags &
+			   WASMJIT_MEMORY_FLAG_SHARED);
+
+		/* a MemInst's data never moves, only its size changes */
+		module_types->memory_strategies[i] =
+			module_inst->mems.elts[i]->max &&
+			module_inst->mems.elts[i]->size ==
+			module_inst->mems.elts[i]->max
+			? MEMORY_STRATEGY_FIXED
+			: MEMORY_STRATEGY_FIXED_BASE;
 	}
+	module_types->n_mems = module_inst->mems.n_elts;
 
 	for (i = 0; i < module_inst->globals.n_elts; ++i) {
 		module_types->globaltypes[i].valtype =
@@ -169,9 +198,236 @@ static int fill_module_types(struct ModuleInst *module_inst,
 	return 0;
 }
 
+static void free_module_types(struct ModuleTypes *module_types)
+{
+	if (module_types->functypes)
+		free(module_types->functypes);
+	if (module_types->tabletypes)
+		free(module_types->tabletypes);
+	if (module_types->memorytypes)
+		free(module_types->memorytypes);
+	if (module_types->globaltypes)
+		free(module_types->globaltypes);
+	if (module_types->memory_strategies)
+		free(module_types->memory_strategies);
+}
+
+/*
+  compiles code, maps it and its invoker and resolves code references
+  against module_inst. funcinst is the function being compiled, the
+  results are written to out, which may be funcinst itself.
+ */
+static int link_function(struct ModuleInst *module_inst,
+			 const struct ModuleTypes *module_types,
+			 const struct CodeSectionCode *code,
+			 struct FuncInst *funcinst,
+			 const struct WasmJITFunctionProfile *profile,
+			 unsigned flags,
+			 struct FuncInst *out)
+{
+	void *unmapped = NULL, *mapped = NULL, *mapped_invoker = NULL;
+	struct MemoryReferences memrefs = {0, NULL};
+	struct WasmJITPcMap *pc_map = NULL;
+	size_t code_size, invoker_size, stack_usage, j;
+	int ret;
+
+	pc_map = calloc(1, sizeof(*pc_map));
+	if (!pc_map)
+		goto error;
+
+	unmapped = wasmjit_compile_function(module_inst->types.elts,
+					    module_types,
+					    &funcinst->type,
+					    code,
+					    &memrefs,
+					    pc_map,
+					    &code_size,
+					    &stack_usage,
+					    profile,
+					    flags);
+	if (!unmapped)
+		goto error;
+
+	mapped = wasmjit_map_code_segment(code_size);
+	if (!mapped)
+		goto error;
+
+	memcpy(mapped, unmapped, code_size);
+
+	pc_map->code = mapped;
+	pc_map->code_size = code_size;
+
+	/* resolve code references */
+	for (j = 0; j < memrefs.n_elts; ++j) {
+		uint64_t val;
+
+		switch (memrefs.elts[j].type) {
+		case MEMREF_TYPE:
+			val = (uintptr_t) &module_inst->types.elts[memrefs.elts[j].idx];
+			break;
+		case MEMREF_FUNC:
+			val = (uintptr_t) module_inst->funcs.elts[memrefs.elts[j].idx];
+			break;
+		case MEMREF_TABLE:
+			val = (uintptr_t) module_inst->tables.elts[memrefs.elts[j].idx];
+			break;
+		case MEMREF_MEM:
+			val = (uintptr_t) module_inst->mems.elts[memrefs.elts[j].idx];
+			break;
+		case MEMREF_MEM_DATA:
+			val = (uintptr_t) module_inst->mems.elts[memrefs.elts[j].idx]->data;
+			break;
+		case MEMREF_GLOBAL:
+			val = (uintptr_t) module_inst->globals.elts[memrefs.elts[j].idx];
+			break;
+		case MEMREF_RESOLVE_INDIRECT_CALL:
+			val = (uintptr_t) &wasmjit_resolve_indirect_call;
+			break;
+		case MEMREF_TRAP:
+			val = (uintptr_t) &wasmjit_trap;
+			break;
+		case MEMREF_STACK_TOP:
+			val = (uintptr_t) &wasmjit_stack_top;
+			break;
+		case MEMREF_SELF:
+			val = (uintptr_t) funcinst;
+			break;
+		case MEMREF_TIER_UP:
+			val = (uintptr_t) &wasmjit_tier_up;
+			break;
+		case MEMREF_PROFILE:
+			val = (uintptr_t) profile->counters;
+			break;
+		case MEMREF_GROW_MEMORY:
+			val = (uintptr_t) &wasmjit_grow_memory;
+			break;
+		case MEMREF_ATOMIC_WAIT32:
+			val = (uintptr_t) &wasmjit_atomic_wait32;
+			break;
+		case MEMREF_ATOMIC_WAIT64:
+			val = (uintptr_t) &wasmjit_atomic_wait64;
+			break;
+		case MEMREF_ATOMIC_NOTIFY:
+			val = (uintptr_t) &wasmjit_atomic_notify;
+			break;
+#ifndef __KERNEL__
+		case MEMREF_FUEL:
+			val = wasmjit_fuel_tls_offset();
+			break;
+		case MEMREF_EPOCH:
+			val = (uintptr_t) wasmjit_epoch_address();
+			break;
+		case MEMREF_EPOCH_DEADLINE:
+			val = wasmjit_epoch_deadline_tls_offset();
+			break;
+		case MEMREF_EPOCH_DEADLINE_REACHED:
+			val = (uintptr_t) &wasmjit_epoch_deadline_reached;
+			break;
+#endif
+		default:
+			assert(0);
+			val = 0;
+			break;
+		}
+
+		encode_le_uint64_t(val, &((char *) mapped)[memrefs.elts[j].code_offset]);
+	}
+
+	if (!wasmjit_mark_code_segment_executable(mapped, code_size))
+		goto error;
+
+	/* also need an invoker */
+	free(unmapped);
+	unmapped = wasmjit_compile_invoker(&funcinst->type,
+					   mapped,
+					   &invoker_size,
+					   flags);
+	if (!unmapped)
+		goto error;
+
+	mapped_invoker = wasmjit_map_code_segment(invoker_size);
+	if (!mapped_invoker)
+		goto error;
+
+	memcpy(mapped_invoker, unmapped, invoker_size);
+
+	if (!wasmjit_mark_code_segment_executable(mapped_invoker, invoker_size))
+		goto error;
+
+	out->compiled_code = mapped;
+	out->compiled_code_size = code_size;
+	out->stack_usage = stack_usage;
+	out->invoker = mapped_invoker;
+	out->invoker_size = invoker_size;
+	out->pc_map = pc_map;
+	mapped = NULL;
+	mapped_invoker = NULL;
+	pc_map = NULL;
+
+	ret = 1;
+
+	if (0) {
+	error:
+		ret = 0;
+	}
+
+	if (mapped_invoker)
+		wasmjit_unmap_code_segment(mapped_invoker, invoker_size);
+	if (mapped)
+		wasmjit_unmap_code_segment(mapped, code_size);
+	if (unmapped)
+		free(unmapped);
+	if (memrefs.elts)
+		free(memrefs.elts);
+	if (pc_map)
+		wasmjit_free_pc_map(pc_map);
+
+	return ret;
+}
+
+#ifndef __KERNEL__
+
+/* the segments were bounds checked, so the image fits in memory 0 */
+static int init_memory_from_image(struct ModuleInst *module_inst,
+				  const struct DataSection *data_section)
+{
+	struct MemInst *meminst = module_inst->mems.elts[0];
+	uint32_t i;
+
+	if (!module_inst->n_imported_mems ||
+	    wasmjit_memory_is_zero(meminst, data_section->image_size))
+		return wasmjit_memory_map_image(meminst, data_section->image_fd,
+						0, data_section->image_size);
+
+	/* an imported memory may hold data outside the segments */
+	for (i = 0; i < data_section->n_datas; ++i) {
+		const struct DataSectionData *data = &data_section->datas[i];
+		size_t offset = (uint32_t) data->instructions[0].data.i32_const.value;
+		size_t done = 0;
+
+		while (done < data->buf_size) {
+			ssize_t ret = pread(data_section->image_fd,
+					    meminst->data + offset + done,
+					    data->buf_size - done,
+					    offset + done);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0)
+				return 0;
+			done += ret;
+		}
+	}
+
+	return 1;
+}
+
+#endif
+
 struct ModuleInst *wasmjit_instantiate(const struct Module *module,
 				       size_t n_imports,
 				       const struct NamedModule *imports,
+				       unsigned flags,
+				       const struct WasmJITProfile *profile,
 				       char *why, size_t why_size)
 {
 	uint32_t i;
@@ -181,10 +437,7 @@ struct ModuleInst *wasmjit_instantiate(const struct Module *module,
 	struct TableInst *tmp_table = NULL;
 	struct MemInst *tmp_mem = NULL;
 	struct GlobalInst *tmp_global = NULL;
-	void *unmapped = NULL, *mapped = NULL;
-	struct MemoryReferences memrefs = {0, NULL};
-	size_t code_size;
-	unsigned global_compile_flags;
+	unsigned global_compile_flags, mem_flags = 0;
 
 	global_compile_flags = wasmjit_detect_retpoline_flags();
 
@@ -302,13 +555,17 @@ struct ModuleInst *wasmjit_instantiate(const struct Module *module,
 							      meminst)) {
 					if (why)
 						snprintf(why, why_size,
-							 "Mismatched memory size for import "
-							 "%s.%s: {%zu,%zu} vs {%" PRIu32 ",%" PRIu32 "}",
+							 "Mismatched memory type for import "
+							 "%s.%s: {%zu,%zu%s} vs {%" PRIu32 ",%" PRIu32 "%s}",
 							 import->module, import->name,
 							 meminst->size / WASM_PAGE_SIZE,
 							 meminst->max / WASM_PAGE_SIZE,
+							 (meminst->flags & WASMJIT_MEMORY_FLAG_SHARED)
+							 ? ",shared" : "",
 							 import->desc.memtype.limits.min,
-							 import->desc.memtype.limits.max);
+							 import->desc.memtype.limits.max,
+							 import->desc.memtype.limits.shared
+							 ? ",shared" : "");
 					goto error;
 				}
 
@@ -446,6 +703,11 @@ struct ModuleInst *wasmjit_instantiate(const struct Module *module,
 		tmp_table = NULL;
 	}
 
+	if (flags & WASMJIT_INSTANTIATE_FLAG_HUGE_PAGES)
+		mem_flags |= WASMJIT_MEMORY_FLAG_HUGE_PAGES;
+	if (flags & WASMJIT_INSTANTIATE_FLAG_HUGETLB)
+		mem_flags |= WASMJIT_MEMORY_FLAG_HUGETLB;
+
 	for (i = 0; i < module->memory_section.n_memories; ++i) {
 		struct MemorySectionMemory *memory =
 		    &module->memory_section.memories[i];
@@ -469,16 +731,11 @@ struct ModuleInst *wasmjit_instantiate(const struct Module *module,
 		if (!tmp_mem)
 			goto error;
 
-		if (size) {
-			tmp_mem->data = calloc(size, 1);
-			if (!tmp_mem->data) {
-				free(tmp_mem);
-				goto error;
-			}
-		}
-
-		tmp_mem->size = size;
-		tmp_mem->max = max;
+		if (!wasmjit_map_memory(tmp_mem, size, max,
+					mem_flags |
+					(memory->memtype.limits.shared
+					 ? WASMJIT_MEMORY_FLAG_SHARED : 0)))
+			goto error;
 
 		LVECTOR_GROW(&module_inst->mems, 1);
 		module_inst->mems.elts[module_inst->mems.n_elts - 1] = tmp_mem;
@@ -549,7 +806,8 @@ struct ModuleInst *wasmjit_instantiate(const struct Module *module,
 		}
 	}
 
-	for (i = 0; i < module->element_section.n_elements; ++i) {
+	for (i = 0; !(flags & WASMJIT_INSTANTIATE_FLAG_NO_INIT) &&
+		     i < module->element_section.n_elements; ++i) {
 		struct ElementSectionElement *element = &module->element_section.elements[i];
 		struct TableInst *tableinst;
 		int rrr;
@@ -578,124 +836,136 @@ struct ModuleInst *wasmjit_instantiate(const struct Module *module,
 	if (!fill_module_types(module_inst, &module_types))
 		goto error;
 
-	for (i = 0; i < module->code_section.n_codes; ++i) {
-		struct CodeSectionCode *code = &module->code_section.codes[i];
-		struct FuncInst *funcinst;
-		size_t j;
-
-		funcinst = module_inst->funcs.elts[i + module_inst->n_imported_funcs];
+	if (flags & WASMJIT_INSTANTIATE_FLAG_TIERED)
+		global_compile_flags |= WASMJIT_COMPILE_FLAG_TIER_COUNTERS;
+
+#ifndef __KERNEL__
+	if (flags & WASMJIT_INSTANTIATE_FLAG_FUEL)
+		module_inst->compile_flags |= WASMJIT_COMPILE_FLAG_FUEL;
+	if (flags & WASMJIT_INSTANTIATE_FLAG_EPOCH)
+		module_inst->compile_flags |= WASMJIT_COMPILE_FLAG_EPOCH;
+	if (flags & WASMJIT_INSTANTIATE_FLAG_CALL_STATS)
+		module_inst->compile_flags |= WASMJIT_COMPILE_FLAG_CALL_COUNTS;
+	if (flags & WASMJIT_INSTANTIATE_FLAG_CYCLE_STATS)
+		module_inst->compile_flags |= WASMJIT_COMPILE_FLAG_CALL_COUNTS |
+			WASMJIT_COMPILE_FLAG_CYCLES;
+
+	/* the module is gone by the time stats are reported */
+	if (module_inst->compile_flags & WASMJIT_COMPILE_FLAG_CALL_COUNTS) {
+		module_inst->func_names = calloc(module_inst->funcs.n_elts,
+						 sizeof(module_inst->func_names[0]));
+		if (module_inst->funcs.n_elts && !module_inst->func_names)
+			goto error;
+	}
+#endif
+	global_compile_flags |= module_inst->compile_flags;
 
-		if (memrefs.elts) {
-			free(memrefs.elts);
-			memrefs.n_elts = 0;
-			memrefs.elts = NULL;
-		}
+	/* tier 0 records for tier 1 to lay out for, unless it was
+	   given a profile */
+	if ((flags & WASMJIT_INSTANTIATE_FLAG_PROFILE) ||
+	    ((flags & WASMJIT_INSTANTIATE_FLAG_TIERED) && !profile)) {
+		global_compile_flags |= WASMJIT_COMPILE_FLAG_PROFILE;
 
-		if (unmapped)
-			free(unmapped);
-
-		assert(mapped == NULL);
-		unmapped = wasmjit_compile_function(module_inst->types.elts,
-						    &module_types,
-						    &funcinst->type,
-						    code,
-						    &memrefs,
-						    &code_size,
-						    &funcinst->stack_usage,
-						    global_compile_flags);
-		if (!unmapped)
+		module_inst->profile = calloc(1, sizeof(*module_inst->profile));
+		if (!module_inst->profile)
 			goto error;
 
-		mapped = wasmjit_map_code_segment(code_size);
-		if (!mapped)
+		module_inst->profile->funcs =
+			calloc(module->code_section.n_codes,
+			       sizeof(module_inst->profile->funcs[0]));
+		if (module->code_section.n_codes &&
+		    !module_inst->profile->funcs)
 			goto error;
+		module_inst->profile->n_funcs = module->code_section.n_codes;
 
-		memcpy(mapped, unmapped, code_size);
+		for (i = 0; i < module->code_section.n_codes; ++i) {
+			struct WasmJITFunctionProfile *fprofile =
+				&module_inst->profile->funcs[i];
 
-		/* resolve code references */
-		for (j = 0; j < memrefs.n_elts; ++j) {
-			uint64_t val;
-
-			switch (memrefs.elts[j].type) {
-			case MEMREF_TYPE:
-				val = (uintptr_t) &module_inst->types.elts[memrefs.elts[j].idx];
-				break;
-			case MEMREF_FUNC:
-				val = (uintptr_t) module_inst->funcs.elts[memrefs.elts[j].idx];
-				break;
-			case MEMREF_TABLE:
-				val = (uintptr_t) module_inst->tables.elts[memrefs.elts[j].idx];
-				break;
-			case MEMREF_MEM:
-				val = (uintptr_t) module_inst->mems.elts[memrefs.elts[j].idx];
-				break;
-			case MEMREF_GLOBAL:
-				val = (uintptr_t) module_inst->globals.elts[memrefs.elts[j].idx];
-				break;
-			case MEMREF_RESOLVE_INDIRECT_CALL:
-				val = (uintptr_t) &wasmjit_resolve_indirect_call;
-				break;
-			case MEMREF_TRAP:
-				val = (uintptr_t) &wasmjit_trap;
-				break;
-			case MEMREF_STACK_TOP:
-				val = (uintptr_t) &wasmjit_stack_top;
-				break;
-			default:
-				assert(0);
-				val = 0;
-				break;
-			}
+			fprofile->n_counters =
+				wasmjit_profile_n_counters(&module->code_section.codes[i]);
+			fprofile->counters = calloc(fprofile->n_counters,
+						    sizeof(fprofile->counters[0]));
+			if (fprofile->n_counters && !fprofile->counters)
+				goto error;
 
-			encode_le_uint64_t(val, &((char *) mapped)[memrefs.elts[j].code_offset]);
+			fprofile->n_targets =
+				wasmjit_profile_targets(&module->code_section.codes[i], NULL);
+			fprofile->targets = calloc(fprofile->n_targets,
+						   sizeof(fprofile->targets[0]));
+			if (fprofile->n_targets && !fprofile->targets)
+				goto error;
+			wasmjit_profile_targets(&module->code_section.codes[i],
+						fprofile->targets);
 		}
 
+		profile = module_inst->profile;
+	} else if (profile &&
+		   profile->n_funcs != module->code_section.n_codes) {
+		/* not from this module */
+		profile = NULL;
+	}
 
-		if (!wasmjit_mark_code_segment_executable(mapped, code_size)) {
-			goto error;
-		}
-
-		funcinst->compiled_code = mapped;
-		funcinst->compiled_code_size = code_size;
-		mapped = NULL;
+	for (i = 0; i < module->code_section.n_codes; ++i) {
+		struct CodeSectionCode *code = &module->code_section.codes[i];
+		struct FuncInst *funcinst;
 
-		/* also need an invoker */
-		{
-			size_t invoker_size;
+		funcinst = module_inst->funcs.elts[i + module_inst->n_imported_funcs];
 
-			if (unmapped)
-				free(unmapped);
+		if (!link_function(module_inst, &module_types, code, funcinst,
+				   profile ? &profile->funcs[i] : NULL,
+				   global_compile_flags, funcinst))
+			goto error;
 
-			assert(mapped == NULL);
-			unmapped = wasmjit_compile_invoker(&funcinst->type,
-							   funcinst->compiled_code,
-							   &invoker_size,
-							   global_compile_flags);
-			if (!unmapped)
-				goto error;
+		if (flags & WASMJIT_INSTANTIATE_FLAG_TIERED)
+			funcinst->tier_countdown = WASMJIT_TIER_UP_THRESHOLD;
 
-			mapped = wasmjit_map_code_segment(code_size);
-			if (!mapped)
-				goto error;
+#ifndef __KERNEL__
+		if (wasmjit_perf_enabled()) {
+			uint32_t funcidx = i + module_inst->n_imported_funcs;
 
-			memcpy(mapped, unmapped, invoker_size);
+			wasmjit_perf_load_func(wasmjit_module_func_name(module,
+									funcidx),
+					       funcidx, funcinst);
+		}
 
-			if (!wasmjit_mark_code_segment_executable(mapped, code_size))
-				goto error;
+		if (module_inst->func_names) {
+			const char *name;
 
-			funcinst->invoker = mapped;
-			funcinst->invoker_size = invoker_size;
-			mapped = NULL;
+			name = wasmjit_module_func_name(module,
+							i + module_inst->n_imported_funcs);
+			if (name) {
+				name = strdup(name);
+				if (!name)
+					goto error;
+				module_inst->func_names[i + module_inst->n_imported_funcs] =
+					(char *) name;
+			}
 		}
+#endif
 	}
 
-	for (i = 0; i < module->data_section.n_datas; ++i) {
+#ifndef __KERNEL__
+	if (!wasmjit_update_code_map(module_inst))
+		goto error;
+
+	/* best effort, before anything can trap */
+	if (wasmjit_gdb_jit_enabled())
+		wasmjit_gdb_jit_register_module_inst(module_inst, module);
+#endif
+
+	for (i = 0; !(flags & (WASMJIT_INSTANTIATE_FLAG_NO_INIT |
+			       WASMJIT_INSTANTIATE_FLAG_NO_DATA)) &&
+		     i < module->data_section.n_datas; ++i) {
 		struct DataSectionData *data = &module->data_section.datas[i];
-		struct MemInst *meminst =
-		    module_inst->mems.elts[data->memidx];
+		struct MemInst *meminst;
 		struct Value value;
 		int rrr;
 
+		if (data->memidx >= module_inst->mems.n_elts)
+			goto error;
+		meminst = module_inst->mems.elts[data->memidx];
+
 		rrr = read_constant_expression(module_inst,
 					       VALTYPE_I32, &value,
 					       data->n_instructions,
@@ -709,13 +979,25 @@ struct ModuleInst *wasmjit_instantiate(const struct Module *module,
 		if (value.data.i32 > meminst->size - data->buf_size)
 			goto error;
 
+		if (module->data_section.image_size)
+			continue;
+
 		memcpy(meminst->data +
 		       value.data.i32, data->buf,
 		       data->buf_size);
 	}
 
+#ifndef __KERNEL__
+	if (module->data_section.image_size &&
+	    !(flags & (WASMJIT_INSTANTIATE_FLAG_NO_INIT |
+		       WASMJIT_INSTANTIATE_FLAG_NO_DATA)) &&
+	    !init_memory_from_image(module_inst, &module->data_section))
+		goto error;
+#endif
+
 	/* add start function */
-	if (module->start_section.has_start) {
+	if (module->start_section.has_start &&
+	    !(flags & WASMJIT_INSTANTIATE_FLAG_NO_INIT)) {
 		wasmjit_invoke_function(module_inst->funcs.elts[module->start_section.funcidx],
 					NULL, NULL);
 	}
@@ -735,27 +1017,36 @@ struct ModuleInst *wasmjit_instantiate(const struct Module *module,
 		free(tmp_table);
 	}
 	if (tmp_mem) {
-		if (tmp_mem->data)
-			free(tmp_mem->data);
+		wasmjit_unmap_memory(tmp_mem);
 		free(tmp_mem);
 	}
 	if (tmp_global)
 		free(tmp_global);
-	if (mapped)
-		wasmjit_unmap_code_segment(mapped, code_size);
-	if (unmapped)
-		free(unmapped);
-	if (memrefs.elts)
-		free(memrefs.elts);
-	if (module_types.functypes)
-		free(module_types.functypes);
-	if (module_types.tabletypes)
-		free(module_types.tabletypes);
-	if (module_types.memorytypes)
-		free(module_types.memorytypes);
-	if (module_types.globaltypes)
-		free(module_types.globaltypes);
-
+	free_module_types(&module_types);
 
 	return module_inst;
 }
+
+int wasmjit_instantiate_recompile(struct ModuleInst *module_inst,
+				  const struct CodeSectionCode *code,
+				  struct FuncInst *funcinst,
+				  const struct WasmJITFunctionProfile *profile,
+				  struct FuncInst *out)
+{
+	struct ModuleTypes module_types;
+	int ret;
+
+	memset(&module_types, 0, sizeof(module_types));
+
+	ret = fill_module_types(module_inst, &module_types) &&
+		link_function(module_inst, &module_types, code, funcinst,
+			      profile,
+			      wasmjit_detect_retpoline_flags() |
+			      module_inst->compile_flags |
+			      WASMJIT_COMPILE_FLAG_OPTIMIZE,
+			      out);
+
+	free_module_types(&module_types);
+
+	return ret;
+}
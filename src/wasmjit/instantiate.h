@@ -32,11 +32,45 @@
 extern "C" {
 #endif
 
+/* compile with tier-up counters, see tier.h */
+#define WASMJIT_INSTANTIATE_FLAG_TIERED 1
+/* record a profile into module_inst->profile */
+#define WASMJIT_INSTANTIATE_FLAG_PROFILE 2
+/* meter execution against wasmjit_set_fuel() */
+#define WASMJIT_INSTANTIATE_FLAG_FUEL 4
+/* check wasmjit_set_epoch_deadline() on entry and in loops */
+#define WASMJIT_INSTANTIATE_FLAG_EPOCH 8
+/* count calls into funcinst->stats, see wasmjit_dump_function_stats() */
+#define WASMJIT_INSTANTIATE_FLAG_CALL_STATS 16
+/* also count rdtsc cycles spent in each function */
+#define WASMJIT_INSTANTIATE_FLAG_CYCLE_STATS 32
+/* back defined memories with transparent huge pages */
+#define WASMJIT_INSTANTIATE_FLAG_HUGE_PAGES 64
+/* back defined memories with hugetlbfs pages */
+#define WASMJIT_INSTANTIATE_FLAG_HUGETLB 128
+/* skip element and data segments and the start function, the state
+   comes from wasmjit_snapshot_restore() instead */
+#define WASMJIT_INSTANTIATE_FLAG_NO_INIT 256
+/* skip data segments, the memory is shared with an instance that
+   already initialized it */
+#define WASMJIT_INSTANTIATE_FLAG_NO_DATA 512
+
+/* tier 0 entries plus loop iterations before a function is recompiled */
+#define WASMJIT_TIER_UP_THRESHOLD 10000
+
 struct ModuleInst *wasmjit_instantiate(const struct Module *module,
 				       size_t n_imports,
 				       const struct NamedModule *imports,
+				       unsigned flags,
+				       const struct WasmJITProfile *profile,
 				       char *why, size_t why_size);
 
+int wasmjit_instantiate_recompile(struct ModuleInst *module_inst,
+				  const struct CodeSectionCode *code,
+				  struct FuncInst *funcinst,
+				  const struct WasmJITFunctionProfile *profile,
+				  struct FuncInst *out);
+
 #ifdef __cplusplus
 }
 #endif
@@ -58,6 +58,7 @@ struct kwasmjit_instantiate_emscripten_runtime_args {
 	uint32_t version;
 	uint32_t static_bump;
 	size_t tablemin, tablemax;
+	size_t memorymin, memorymax;
 	uint32_t flags;
 };
 
@@ -156,7 +156,9 @@ static int kwasmjit_instantiate_emscripten_runtime(struct kwasmjit_private *self
 	if (wasmjit_high_instantiate_emscripten_runtime(&self->high,
 							args->static_bump,
 							args->tablemin,
-							args->tablemax, args->flags)) {
+							args->tablemax,
+							args->memorymin,
+							args->memorymax, args->flags)) {
 		retval = -EINVAL;
 		goto error;
 	}
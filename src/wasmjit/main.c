@@ -26,6 +26,7 @@
 #include <wasmjit/compile.h>
 #include <wasmjit/ast_dump.h>
 #include <wasmjit/parse.h>
+#include <wasmjit/inline.h>
 #include <wasmjit/runtime.h>
 #include <wasmjit/instantiate.h>
 #include <wasmjit/emscripten_runtime.h>
@@ -33,6 +34,9 @@
 #include <wasmjit/elf_relocatable.h>
 #include <wasmjit/util.h>
 #include <wasmjit/high_level.h>
+#include <wasmjit/perf.h>
+#include <wasmjit/gdb_jit.h>
+#include <wasmjit/sampler.h>
 
 #include <assert.h>
 #include <inttypes.h>
@@ -43,7 +47,10 @@
 #include <string.h>
 
 #include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <regex.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/types.h>
@@ -335,7 +342,9 @@ static int get_static_bump(const char *filename, uint32_t *static_bump)
 static int get_emscripten_runtime_parameters(const char *filename,
 					     uint32_t *static_bump,
 					     int *has_table,
-					     size_t *tablemin, size_t *tablemax)
+					     size_t *tablemin, size_t *tablemax,
+					     size_t *memorymin, size_t *memorymax,
+					     int *shared_memory)
 {
 	size_t i;
 	int ret;
@@ -362,6 +371,24 @@ static int get_emscripten_runtime_parameters(const char *filename,
 
 	*has_table = i != module.import_section.n_imports;
 
+	/* and the memory, which can only grow as far as its max */
+	*memorymin = *memorymax = WASMJIT_EMSCRIPTEN_TOTAL_MEMORY / WASM_PAGE_SIZE;
+	*shared_memory = 0;
+	for (i = 0; i < module.import_section.n_imports; ++i) {
+		struct ImportSectionImport *import;
+		import = &module.import_section.imports[i];
+		if (strcmp(import->module, "env") ||
+		    strcmp(import->name, "memory") ||
+		    import->desc_type != IMPORT_DESC_TYPE_MEM)
+			continue;
+
+		*memorymin = import->desc.memtype.limits.min;
+		*memorymax = import->desc.memtype.limits.max;
+		/* -s USE_PTHREADS */
+		*shared_memory = import->desc.memtype.limits.shared;
+		break;
+	}
+
 	ret = get_static_bump(filename, static_bump);
 	if (ret) {
 		fprintf(stderr, "Couldn't get static bump!\n");
@@ -378,18 +405,50 @@ static int get_emscripten_runtime_parameters(const char *filename,
 	return ret;
 }
 
+#define SAMPLE_INTERVAL_US 1000
+#define SAMPLE_OUT_DEFAULT "wasmjit.folded"
+#define STATS_TOP_N_DEFAULT 20
+
+static int epoch_ticker_stop;
+
+/* one epoch per millisecond */
+static void *epoch_ticker(void *arg)
+{
+	(void)arg;
+
+	while (!__atomic_load_n(&epoch_ticker_stop, __ATOMIC_RELAXED)) {
+		struct timespec ts = { 0, 1000000 };
+
+		nanosleep(&ts, NULL);
+		wasmjit_increment_epoch();
+	}
+
+	return NULL;
+}
+
 static int run_emscripten_file(const char *filename,
 			       uint32_t static_bump,
 			       int has_table,
 			       size_t tablemin, size_t tablemax,
+			       size_t memorymin, size_t memorymax,
+			       uint32_t instantiate_flags,
+			       uint32_t runtime_flags,
+			       const char *profile_in,
+			       const char *profile_out,
+			       const char *sample_out,
+			       int64_t fuel,
+			       uint64_t timeout_ms,
+			       size_t stats_top_n,
+			       int memory_stats,
 			       int argc, char **argv, char **envp)
 {
 	struct WasmJITHigh high;
 	int ret;
 	void *stack_top;
-	int high_init = 0;
+	int high_init = 0, has_ticker = 0;
+	pthread_t ticker;
 	const char *msg;
-	uint32_t flags = 0;
+	uint32_t flags = runtime_flags;
 
 	stack_top = get_stack_top();
 
@@ -412,19 +471,65 @@ static int run_emscripten_file(const char *filename,
 
 	if (wasmjit_high_instantiate_emscripten_runtime(&high,
 							static_bump,
-							tablemin, tablemax, flags)) {
+							tablemin, tablemax,
+							memorymin, memorymax,
+							flags)) {
 		msg = "failed to instantiate emscripten runtime";
 		goto error;
 	}
 
-	if (wasmjit_high_instantiate(&high, filename, "asm", 0)) {
+	if (profile_in && wasmjit_high_load_profile(&high, profile_in)) {
+		msg = "failed to load profile";
+		goto error;
+	}
+
+	if (profile_out)
+		instantiate_flags |= WASMJIT_HIGH_INSTANTIATE_FLAGS_PROFILE;
+
+	if (sample_out && !wasmjit_sampler_enable(SAMPLE_INTERVAL_US)) {
+		msg = "failed to enable sampler";
+		goto error;
+	}
+
+	if (wasmjit_high_instantiate(&high, filename, "asm", instantiate_flags)) {
 		msg = "failed to instantiate module";
 		goto error;
 	}
 
+	if (sample_out && !wasmjit_sampler_start()) {
+		msg = "failed to start sampler";
+		goto error;
+	}
+
+	if (instantiate_flags & WASMJIT_HIGH_INSTANTIATE_FLAGS_FUEL)
+		wasmjit_set_fuel(fuel);
+
+	if (instantiate_flags & WASMJIT_HIGH_INSTANTIATE_FLAGS_EPOCH) {
+		if (pthread_create(&ticker, NULL, epoch_ticker, NULL)) {
+			msg = "failed to start epoch thread";
+			goto error;
+		}
+		has_ticker = 1;
+		wasmjit_set_epoch_deadline(timeout_ms);
+	}
+
 	ret = wasmjit_high_emscripten_invoke_main(&high, "asm",
 						  argc, argv, envp, 0);
 
+	if (sample_out && !wasmjit_sampler_stop(sample_out)) {
+		fprintf(stderr, "failed to write samples to %s\n", sample_out);
+	}
+
+	if (stats_top_n &&
+	    wasmjit_high_dump_function_stats(&high, stderr, stats_top_n)) {
+		fprintf(stderr, "failed to dump function stats\n");
+	}
+
+	if (memory_stats &&
+	    wasmjit_high_dump_memory_stats(&high, stderr)) {
+		fprintf(stderr, "failed to dump memory stats\n");
+	}
+
 	if (WASMJIT_IS_TRAP_ERROR(ret)) {
 		fprintf(stderr, "TRAP: %s\n",
 			wasmjit_trap_reason_to_string(WASMJIT_DECODE_TRAP_ERROR(ret)));
@@ -433,6 +538,11 @@ static int run_emscripten_file(const char *filename,
 		goto error;
 	}
 
+	if (profile_out &&
+	    wasmjit_high_save_profile(&high, "asm", profile_out)) {
+		fprintf(stderr, "failed to save profile to %s\n", profile_out);
+	}
+
 	if (0) {
 		char error_buffer[256];
 
@@ -447,20 +557,80 @@ static int run_emscripten_file(const char *filename,
 		}
 	}
 
+	if (has_ticker) {
+		__atomic_store_n(&epoch_ticker_stop, 1, __ATOMIC_RELAXED);
+		pthread_join(ticker, NULL);
+	}
+
+	/* must not outlive the modules */
+	if (wasmjit_sampler_enabled())
+		wasmjit_sampler_stop(NULL);
+
 	if (high_init)
 		wasmjit_high_close(&high);
 
 	return ret;
 }
 
+static const struct option long_options[] = {
+	/* --profile[=FILE], folded stacks for flamegraph.pl */
+	{"profile", optional_argument, NULL, 'P'},
+	/* --fuel[=]N, trap after running N instructions */
+	{"fuel", required_argument, NULL, 'F'},
+	/* --timeout[=]MS, interrupt main after MS milliseconds */
+	{"timeout", required_argument, NULL, 'T'},
+	/* --stats[=N], print the N most called functions at exit */
+	{"stats", optional_argument, NULL, 'S'},
+	/* --stats-cycles[=N], the N functions with the most cycles */
+	{"stats-cycles", optional_argument, NULL, 'C'},
+	/* --huge-pages[=tlb], back linear memory with huge pages */
+	{"huge-pages", optional_argument, NULL, 'H'},
+	/* --memory-stats, print memory sizes at exit */
+	{"memory-stats", no_argument, NULL, 'M'},
+	{NULL, 0, NULL, 0},
+};
+
+/* whether arg is a long option that takes the next argument as its
+   value, getopt_long() also accepts unambiguous prefixes */
+static int takes_separate_argument(const char *arg)
+{
+	const struct option *option, *match = NULL;
+	size_t len;
+
+	if (strncmp(arg, "--", 2) || strchr(arg, '='))
+		return 0;
+	arg += 2;
+	len = strlen(arg);
+
+	for (option = long_options; option->name; ++option) {
+		if (!strcmp(arg, option->name)) {
+			match = option;
+			break;
+		}
+		if (!match && !strncmp(arg, option->name, len))
+			match = option;
+	}
+
+	return len && match && match->has_arg == required_argument;
+}
+
 extern char **environ;
 int main(int argc, char *argv[])
 {
 	int ret;
 	char *filename;
 	int dump_module, create_relocatable, create_relocatable_helper, opt;
-	int has_table;
+	uint32_t instantiate_flags = 0, runtime_flags = 0;
+	unsigned perf_flags = 0;
+	const char *profile_in = NULL, *profile_out = NULL;
+	const char *sample_out = NULL;
+	int64_t fuel = 0;
+	uint64_t timeout_ms = 0;
+	size_t stats_top_n = 0;
+	int memory_stats = 0;
+	int has_table, shared_memory;
 	size_t tablemin = 0, tablemax = 0;
+	size_t memorymin, memorymax;
 	uint32_t static_bump = 0;
 	int argc_options;
 
@@ -471,6 +641,12 @@ int main(int argc, char *argv[])
 			if (argv[i][0] != '-') {
 				break;
 			}
+			/* skip separate option arguments */
+			if ((!strcmp(argv[i], "-g") || !strcmp(argv[i], "-u") ||
+			     takes_separate_argument(argv[i])) &&
+			    i + 1 < argc) {
+				i += 1;
+			}
 		}
 
 		argc_options = i;
@@ -479,7 +655,8 @@ int main(int argc, char *argv[])
 	dump_module =  0;
 	create_relocatable =  0;
 	create_relocatable_helper =  0;
-	while ((opt = getopt(argc_options, argv, "dop")) != -1) {
+	while ((opt = getopt_long(argc_options, argv, "doptmjDg:u:",
+				  long_options, NULL)) != -1) {
 		switch (opt) {
 		case 'o':
 			create_relocatable = 1;
@@ -490,6 +667,85 @@ int main(int argc, char *argv[])
 		case 'd':
 			dump_module = 1;
 			break;
+		case 't':
+			instantiate_flags |= WASMJIT_HIGH_INSTANTIATE_FLAGS_TIERED;
+			break;
+		case 'm':
+			perf_flags |= WASMJIT_PERF_MAP;
+			break;
+		case 'j':
+			perf_flags |= WASMJIT_PERF_JITDUMP;
+			break;
+		case 'D':
+			wasmjit_gdb_jit_enable();
+			break;
+		case 'g':
+			profile_out = optarg;
+			break;
+		case 'u':
+			profile_in = optarg;
+			break;
+		case 'P':
+			sample_out = optarg ? optarg : SAMPLE_OUT_DEFAULT;
+			break;
+		case 'F': {
+			char *end;
+
+			errno = 0;
+			fuel = strtoll(optarg, &end, 0);
+			if (errno || *end || fuel < 0) {
+				fprintf(stderr, "Bad fuel: %s\n", optarg);
+				return -1;
+			}
+			instantiate_flags |= WASMJIT_HIGH_INSTANTIATE_FLAGS_FUEL;
+			break;
+		}
+		case 'T': {
+			char *end;
+
+			errno = 0;
+			timeout_ms = strtoull(optarg, &end, 0);
+			if (errno || *end || optarg[0] == '-') {
+				fprintf(stderr, "Bad timeout: %s\n", optarg);
+				return -1;
+			}
+			instantiate_flags |= WASMJIT_HIGH_INSTANTIATE_FLAGS_EPOCH;
+			break;
+		}
+		case 'S':
+		case 'C': {
+			char *end;
+
+			stats_top_n = STATS_TOP_N_DEFAULT;
+			if (optarg) {
+				errno = 0;
+				stats_top_n = strtoull(optarg, &end, 0);
+				if (errno || *end || optarg[0] == '-' ||
+				    !stats_top_n) {
+					fprintf(stderr, "Bad stats count: %s\n", optarg);
+					return -1;
+				}
+			}
+			instantiate_flags |= opt == 'C'
+				? WASMJIT_HIGH_INSTANTIATE_FLAGS_CYCLE_STATS
+				: WASMJIT_HIGH_INSTANTIATE_FLAGS_CALL_STATS;
+			break;
+		}
+		case 'H':
+			if (!optarg) {
+				instantiate_flags |= WASMJIT_HIGH_INSTANTIATE_FLAGS_HUGE_PAGES;
+				runtime_flags |= WASMJIT_HIGH_INSTANTIATE_EMSCRIPTEN_RUNTIME_FLAGS_HUGE_PAGES;
+			} else if (!strcmp(optarg, "tlb")) {
+				instantiate_flags |= WASMJIT_HIGH_INSTANTIATE_FLAGS_HUGETLB;
+				runtime_flags |= WASMJIT_HIGH_INSTANTIATE_EMSCRIPTEN_RUNTIME_FLAGS_HUGETLB;
+			} else {
+				fprintf(stderr, "Bad huge page type: %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'M':
+			memory_stats = 1;
+			break;
 		default:
 			return -1;
 		}
@@ -510,7 +766,8 @@ int main(int argc, char *argv[])
 
 		wasmjit_init_module(&module);
 
-		if (!parse_module(filename, &module)) {
+		if (!parse_module(filename, &module) &&
+		    wasmjit_inline_module(&module)) {
 			void *a_out;
 			size_t size;
 			a_out = wasmjit_output_elf_relocatable("asm", &module, &size);
@@ -526,10 +783,14 @@ int main(int argc, char *argv[])
 		return ret;
 	}
 
-	ret = get_emscripten_runtime_parameters(filename, &static_bump, &has_table, &tablemin, &tablemax);
+	ret = get_emscripten_runtime_parameters(filename, &static_bump, &has_table, &tablemin, &tablemax,
+						&memorymin, &memorymax, &shared_memory);
 	if (ret)
 		return -1;
 
+	if (shared_memory)
+		runtime_flags |= WASMJIT_HIGH_INSTANTIATE_EMSCRIPTEN_RUNTIME_FLAGS_SHARED_MEMORY;
+
 	if (create_relocatable_helper) {
 		struct WasmJITEmscriptenMemoryGlobals globals;
 
@@ -543,6 +804,9 @@ int main(int argc, char *argv[])
 			       tablemin, tablemax);
 		}
 
+		printf("DEFINE_WASM_MEMORY(memory, %zu, %zu)\n",
+		       memorymin, memorymax);
+
 		printf("DEFINE_WASM_GLOBAL(__memory_base, %" PRIu32 ", VALTYPE_I32, i32, 0)\n",
 		       globals.__memory_base);
 		printf("DEFINE_WASM_GLOBAL(__table_base, %" PRIu32 ", VALTYPE_I32, i32, 0)\n",
@@ -561,7 +825,22 @@ int main(int argc, char *argv[])
 		return 0;
 	}
 
-	return run_emscripten_file(filename,
-				   static_bump, has_table, tablemin, tablemax,
-				   argc - argc_options, &argv[argc_options], environ);
+	if (perf_flags && !wasmjit_perf_open(perf_flags)) {
+		fprintf(stderr, "failed to open perf output\n");
+		return -1;
+	}
+
+	ret = run_emscripten_file(filename,
+				  static_bump, has_table, tablemin, tablemax,
+				  memorymin, memorymax,
+				  instantiate_flags, runtime_flags,
+				  profile_in, profile_out,
+				  sample_out, fuel, timeout_ms, stats_top_n,
+				  memory_stats,
+				  argc - argc_options, &argv[argc_options], environ);
+
+	if (perf_flags)
+		wasmjit_perf_close();
+
+	return ret;
 }
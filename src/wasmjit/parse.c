@@ -22,11 +22,20 @@
   SOFTWARE.
  */
 
+#define _GNU_SOURCE
+
 #include <wasmjit/parse.h>
 #include <wasmjit/util.h>
 
 #include <wasmjit/sys.h>
 
+#ifndef __KERNEL__
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#endif
+
 #define BLOCK_TERMINAL 0x0B
 #define ELSE_TERMINAL 0x05
 #define WASM_MAGIC 0x6d736100
@@ -50,8 +59,10 @@ enum {
 int init_pstate(struct ParseState *pstate, const char *buf, size_t size)
 {
 	pstate->eof = 0;
+	pstate->start = buf;
 	pstate->input = buf;
 	pstate->amt_left = size;
+	pstate->flags = 0;
 	return pstate->input ? 1 : 0;
 }
 
@@ -218,11 +229,6 @@ char *read_string(struct ParseState *pstate)
 	return read_buf_internal(pstate, NULL, 1);
 }
 
-char *read_buffer(struct ParseState *pstate, uint32_t *buf_size)
-{
-	return read_buf_internal(pstate, buf_size, 0);
-}
-
 #define FUNCTION_TYPE_ID 0x60
 
 int read_type_section(struct ParseState *pstate,
@@ -350,6 +356,7 @@ int read_limits(struct ParseState *pstate, struct Limits *limits)
 
 		break;
 	case 0x1:
+	case 0x3:
 		ret = read_uleb_uint32_t(pstate, &limits->min);
 		if (!ret)
 			return ret;
@@ -363,6 +370,8 @@ int read_limits(struct ParseState *pstate, struct Limits *limits)
 		return 0;
 	}
 
+	limits->shared = byt == 0x3;
+
 	return 1;
 }
 
@@ -421,6 +430,8 @@ int read_import_section(struct ParseState *pstate,
 			ret = read_limits(pstate, &import->desc.tabletype.limits);
 			if (!ret)
 				goto error;
+			if (import->desc.tabletype.limits.shared)
+				goto error;
 
 			break;
 		case IMPORT_DESC_TYPE_MEM:
@@ -510,6 +521,8 @@ int read_table_section(struct ParseState *pstate,
 			ret = read_limits(pstate, &table->limits);
 			if (!ret)
 				goto error;
+			if (table->limits.shared)
+				goto error;
 		}
 	}
 
@@ -554,6 +567,36 @@ int read_memory_section(struct ParseState *pstate,
 	return 0;
 }
 
+/* leading flags of a data segment */
+#define DATA_SEGMENT_ACTIVE 0
+#define DATA_SEGMENT_ACTIVE_MEMIDX 2
+
+/* multi-memory: bit 6 of the alignment flags an explicit memory index */
+#define MEMARG_MEMIDX_BIT 0x40
+
+static int read_memarg(struct ParseState *pstate, uint32_t *align,
+		       uint32_t *memidx)
+{
+	int ret;
+
+	ret = read_uleb_uint32_t(pstate, align);
+	if (!ret)
+		goto error;
+
+	*memidx = 0;
+	if (*align & MEMARG_MEMIDX_BIT) {
+		*align &= ~MEMARG_MEMIDX_BIT;
+		ret = read_uleb_uint32_t(pstate, memidx);
+		if (!ret)
+			goto error;
+	}
+
+	return 1;
+
+ error:
+	return 0;
+}
+
 int read_instruction(struct ParseState *pstate, struct Instr *instr)
 {
 	int ret;
@@ -565,6 +608,8 @@ int read_instruction(struct ParseState *pstate, struct Instr *instr)
 
 	/* TODO: assert instruction is initted */
 
+	instr->offset = pstate->input - pstate->start;
+
 	ret = read_uint8_t(pstate, &instr->opcode);
 	if (!ret)
 		return ret;
@@ -633,12 +678,26 @@ int read_instruction(struct ParseState *pstate, struct Instr *instr)
 
 		break;
 	case OPCODE_CALL:
+	case OPCODE_RETURN_CALL:
 		ret = read_uleb_uint32_t(pstate, &instr->data.call.funcidx);
 		if (!ret)
 			goto error;
 
+		break;
+	case OPCODE_MEMORY_SIZE:
+		ret = read_uleb_uint32_t(pstate, &instr->data.memory_size.memidx);
+		if (!ret)
+			goto error;
+
+		break;
+	case OPCODE_MEMORY_GROW:
+		ret = read_uleb_uint32_t(pstate, &instr->data.memory_grow.memidx);
+		if (!ret)
+			goto error;
+
 		break;
 	case OPCODE_CALL_INDIRECT:
+	case OPCODE_RETURN_CALL_INDIRECT:
 		ret =
 		    read_uleb_uint32_t(pstate,
 				       &instr->data.call_indirect.typeidx);
@@ -788,7 +847,7 @@ int read_instruction(struct ParseState *pstate, struct Instr *instr)
 			break;
 		}
 
-		ret = read_uleb_uint32_t(pstate, &lsextra->align);
+		ret = read_memarg(pstate, &lsextra->align, &lsextra->memidx);
 		if (!ret)
 			goto error;
 
@@ -797,6 +856,44 @@ int read_instruction(struct ParseState *pstate, struct Instr *instr)
 			goto error;
 
 		break;
+	case OPCODE_ATOMIC_PREFIX: {
+		struct AtomicExtra *atomic = &instr->data.atomic;
+		unsigned size;
+
+		ret = read_uleb_uint32_t(pstate, &atomic->opcode);
+		if (!ret)
+			goto error;
+
+		if (atomic->opcode == ATOMIC_OPCODE_FENCE) {
+			uint8_t nullb;
+			ret = read_uint8_t(pstate, &nullb);
+			if (!ret)
+				goto error;
+
+			if (nullb)
+				goto error;
+
+			break;
+		}
+
+		size = wasmjit_atomic_access_size(atomic->opcode);
+		if (!size)
+			goto error;
+
+		ret = read_memarg(pstate, &atomic->align, &atomic->memidx);
+		if (!ret)
+			goto error;
+
+		/* atomics must be naturally aligned */
+		if (atomic->align > 3 || (1U << atomic->align) != size)
+			goto error;
+
+		ret = read_uleb_uint32_t(pstate, &atomic->offset);
+		if (!ret)
+			goto error;
+
+		break;
+	}
 	case OPCODE_I32_CONST:
 		ret = read_leb_uint32_t(pstate, &instr->data.i32_const.value);
 		if (!ret)
@@ -822,8 +919,6 @@ int read_instruction(struct ParseState *pstate, struct Instr *instr)
 	case OPCODE_RETURN:
 	case OPCODE_DROP:
 	case OPCODE_SELECT:
-	case OPCODE_MEMORY_SIZE:
-	case OPCODE_MEMORY_GROW:
 	case OPCODE_I32_EQZ:
 	case OPCODE_I32_EQ:
 	case OPCODE_I32_NE:
@@ -1305,6 +1400,8 @@ int read_code_section(struct ParseState *pstate,
 			if (!ret)
 				goto error;
 
+			code->offset = pstate->input - pstate->start;
+
 			ret = read_uleb_uint32_t(pstate, &code->n_locals);
 			if (!ret)
 				goto error;
@@ -1352,10 +1449,206 @@ int read_code_section(struct ParseState *pstate,
 	return 0;
 }
 
+int read_name_section(struct ParseState *pstate,
+		      struct NameSection *name_section)
+{
+	int ret;
+
+	while (pstate->amt_left) {
+		uint8_t id;
+		uint32_t size, n_func_names;
+		uint32_t i;
+		size_t amt_left;
+
+		ret = read_uint8_t(pstate, &id);
+		if (!ret)
+			goto error;
+
+		ret = read_uleb_uint32_t(pstate, &size);
+		if (!ret)
+			goto error;
+
+		if (pstate->amt_left < size) {
+			pstate->eof = 1;
+			goto error;
+		}
+		amt_left = pstate->amt_left;
+
+		/* only function names are used */
+		if (id != 1) {
+			ret = advance_parser(pstate, size);
+			if (!ret)
+				goto error;
+			continue;
+		}
+
+		/* at most one function name subsection */
+		if (name_section->func_names)
+			goto error;
+
+		ret = read_uleb_uint32_t(pstate, &n_func_names);
+		if (!ret)
+			goto error;
+
+		if (n_func_names) {
+			name_section->func_names =
+				calloc(n_func_names,
+				       sizeof(struct NameSectionFuncName));
+			if (!name_section->func_names)
+				goto error;
+			name_section->n_func_names = n_func_names;
+		}
+
+		for (i = 0; i < n_func_names; ++i) {
+			struct NameSectionFuncName *func_name =
+				&name_section->func_names[i];
+
+			ret = read_uleb_uint32_t(pstate, &func_name->funcidx);
+			if (!ret)
+				goto error;
+
+			func_name->name = read_string(pstate);
+			if (!func_name->name)
+				goto error;
+		}
+
+		if (amt_left - pstate->amt_left != size)
+			goto error;
+	}
+
+	return 1;
+
+ error:
+	return 0;
+}
+
+int read_custom_section(struct ParseState *pstate, uint32_t size,
+			struct NameSection *name_section)
+{
+	struct ParseState spstate;
+	char *name = NULL;
+	int ret;
+
+	if (pstate->amt_left < size) {
+		pstate->eof = 1;
+		goto error;
+	}
+
+	/* never read past the end of the custom section */
+	init_pstate(&spstate, pstate->input, size);
+
+	name = read_string(&spstate);
+	if (name && !strcmp(name, "name") && !name_section->func_names) {
+		/* custom sections are not validated, ignore bad names */
+		if (!read_name_section(&spstate, name_section)) {
+			uint32_t i;
+
+			if (name_section->func_names) {
+				for (i = 0; i < name_section->n_func_names; ++i)
+					free(name_section->func_names[i].name);
+				free(name_section->func_names);
+			}
+			name_section->func_names = NULL;
+			name_section->n_func_names = 0;
+		}
+	}
+
+	ret = advance_parser(pstate, size);
+	if (!ret)
+		goto error;
+
+	ret = 1;
+
+	if (0) {
+	error:
+		ret = 0;
+	}
+
+	free(name);
+
+	return ret;
+}
+
+#ifndef __KERNEL__
+
+/* smaller data isn't worth a memfd */
+#define DATA_IMAGE_MIN_SIZE (64 * 1024)
+/* the image replaces whole wasm pages of memory */
+#define DATA_IMAGE_ALIGN (64 * 1024)
+
+static int build_data_image(struct DataSection *data_section,
+			    const char **bufs)
+{
+	uint32_t i;
+	size_t image_size = 0, total_size = 0;
+	int fd;
+
+	for (i = 0; i < data_section->n_datas; ++i) {
+		struct DataSectionData *data = &data_section->datas[i];
+		size_t end;
+
+		/* offsets from imported globals aren't known yet */
+		if (data->memidx ||
+		    data->n_instructions != 1 ||
+		    data->instructions[0].opcode != OPCODE_I32_CONST)
+			return 1;
+
+		end = (size_t) (uint32_t) data->instructions[0].data.i32_const.value +
+			data->buf_size;
+		if (end > image_size)
+			image_size = end;
+		total_size += data->buf_size;
+	}
+
+	if (total_size < DATA_IMAGE_MIN_SIZE)
+		return 1;
+
+	image_size = (image_size + DATA_IMAGE_ALIGN - 1) / DATA_IMAGE_ALIGN *
+		DATA_IMAGE_ALIGN;
+
+	fd = memfd_create("wasmjit-data", MFD_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	if (ftruncate(fd, image_size))
+		goto error;
+
+	/* later segments overwrite earlier ones, as in memory */
+	for (i = 0; i < data_section->n_datas; ++i) {
+		struct DataSectionData *data = &data_section->datas[i];
+		const char *buf = bufs[i];
+		size_t left = data->buf_size;
+		off_t offset = (uint32_t) data->instructions[0].data.i32_const.value;
+
+		while (left) {
+			ssize_t ret = pwrite(fd, buf, left, offset);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0)
+				goto error;
+			buf += ret;
+			left -= ret;
+			offset += ret;
+		}
+	}
+
+	data_section->image_fd = fd;
+	data_section->image_size = image_size;
+
+	return 1;
+
+ error:
+	close(fd);
+	return 0;
+}
+
+#endif
+
 int read_data_section(struct ParseState *pstate,
 		      struct DataSection *data_section)
 {
 	int ret;
+	const char **bufs = NULL;
 
 	ret = read_uleb_uint32_t(pstate, &data_section->n_datas);
 	if (!ret)
@@ -1370,13 +1663,34 @@ int read_data_section(struct ParseState *pstate,
 		if (!data_section->datas)
 			goto error;
 
+		/* segments point into the input until we know where
+		   they go */
+		bufs = calloc(data_section->n_datas, sizeof(bufs[0]));
+		if (!bufs)
+			goto error;
+
 		for (i = 0; i < data_section->n_datas; ++i) {
 			struct DataSectionData *data = &data_section->datas[i];
+			uint32_t segment_flags;
 
-			ret = read_uleb_uint32_t(pstate, &data->memidx);
+			ret = read_uleb_uint32_t(pstate, &segment_flags);
 			if (!ret)
 				goto error;
 
+			switch (segment_flags) {
+			case DATA_SEGMENT_ACTIVE:
+				data->memidx = 0;
+				break;
+			case DATA_SEGMENT_ACTIVE_MEMIDX:
+				ret = read_uleb_uint32_t(pstate, &data->memidx);
+				if (!ret)
+					goto error;
+				break;
+			default:
+				/* passive segments aren't supported */
+				goto error;
+			}
+
 			ret =
 			    read_instructions(pstate,
 					      &data->instructions,
@@ -1384,15 +1698,44 @@ int read_data_section(struct ParseState *pstate,
 			if (!ret)
 				goto error;
 
-			data->buf = read_buffer(pstate, &data->buf_size);
-			if (!data->buf)
+			ret = read_uleb_uint32_t(pstate, &data->buf_size);
+			if (!ret)
+				goto error;
+
+			if (pstate->amt_left < data->buf_size) {
+				pstate->eof = 1;
 				goto error;
+			}
+
+			bufs[i] = pstate->input;
+			pstate->input += data->buf_size;
+			pstate->amt_left -= data->buf_size;
+		}
+
+#ifndef __KERNEL__
+		if ((pstate->flags & WASMJIT_PARSE_FLAG_DATA_IMAGE) &&
+		    !build_data_image(data_section, bufs))
+			goto error;
+#endif
+
+		for (i = 0; !data_section->image_size &&
+			     i < data_section->n_datas; ++i) {
+			struct DataSectionData *data = &data_section->datas[i];
+
+			data->buf = malloc(data->buf_size);
+			if (data->buf_size && !data->buf)
+				goto error;
+			if (data->buf_size)
+				memcpy(data->buf, bufs[i], data->buf_size);
 		}
 	}
 
+	free(bufs);
+
 	return 1;
 
  error:
+	free(bufs);
 	return 0;
 }
 
@@ -1480,7 +1823,8 @@ int read_module(struct ParseState *pstate, struct Module *module,
 
 		switch (id) {
 		case SECTION_ID_CUSTOM:
-			READ("custom section", advance_parser, size);
+			READ("custom section", read_custom_section, size,
+			     &module->name_section);
 			break;
 		case SECTION_ID_TYPE:
 			READ("type section", read_type_section,
@@ -33,10 +33,16 @@
 extern "C" {
 #endif
 
+/* write data segments into module->data_section.image_fd rather than
+   copying each into its own buffer, where possible */
+#define WASMJIT_PARSE_FLAG_DATA_IMAGE 1
+
 struct ParseState {
 	int eof;
+	const char *start;
 	const char *input;
 	size_t amt_left;
+	unsigned flags;
 };
 
 int read_module(struct ParseState *pstate, struct Module *module,
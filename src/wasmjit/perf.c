@@ -0,0 +1,345 @@
+/* -*-mode:c; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+  Copyright (c) 2018 Rian Hunter et. al, see AUTHORS file.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+
+#include <wasmjit/perf.h>
+
+#include <wasmjit/sys.h>
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* see tools/perf/Documentation/jitdump-specification.txt */
+
+#define JITDUMP_MAGIC 0x4A695444
+#define JITDUMP_VERSION 1
+#define JITDUMP_EM_X86_64 62
+
+enum {
+	JIT_CODE_LOAD = 0,
+	JIT_CODE_DEBUG_INFO = 2,
+	JIT_CODE_CLOSE = 3,
+};
+
+struct JitDumpHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t total_size;
+	uint32_t elf_mach;
+	uint32_t pad1;
+	uint32_t pid;
+	uint64_t timestamp;
+	uint64_t flags;
+};
+
+struct JitDumpRecord {
+	uint32_t id;
+	uint32_t total_size;
+	uint64_t timestamp;
+};
+
+struct JitDumpCodeLoad {
+	struct JitDumpRecord p;
+	uint32_t pid;
+	uint32_t tid;
+	uint64_t vma;
+	uint64_t code_addr;
+	uint64_t code_size;
+	uint64_t code_index;
+};
+
+struct JitDumpDebugInfo {
+	struct JitDumpRecord p;
+	uint64_t code_addr;
+	uint64_t nr_entry;
+};
+
+struct JitDumpDebugEntry {
+	uint64_t addr;
+	int32_t lineno;
+	int32_t discrim;
+};
+
+#define JITDUMP_SOURCE "<wasm>"
+
+static struct {
+	pthread_mutex_t lock;
+	unsigned flags;
+	FILE *map;
+	FILE *dump;
+	void *dump_marker;
+	size_t dump_marker_size;
+	uint64_t code_index;
+} perf = {
+	PTHREAD_MUTEX_INITIALIZER,
+	0, NULL, NULL, NULL, 0, 0,
+};
+
+static uint64_t perf_timestamp(void)
+{
+	struct timespec ts;
+
+	/* matches perf record -k mono */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int open_jitdump(void)
+{
+	char path[64];
+	struct JitDumpHeader header;
+	long page_size;
+
+	snprintf(path, sizeof(path), "/tmp/jit-%ld.dump", (long) getpid());
+	perf.dump = fopen(path, "w+");
+	if (!perf.dump)
+		goto error;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = JITDUMP_MAGIC;
+	header.version = JITDUMP_VERSION;
+	header.total_size = sizeof(header);
+	header.elf_mach = JITDUMP_EM_X86_64;
+	header.pid = getpid();
+	header.timestamp = perf_timestamp();
+
+	if (fwrite(&header, sizeof(header), 1, perf.dump) != 1 ||
+	    fflush(perf.dump))
+		goto error;
+
+	/* perf finds the dump through this executable mapping */
+	page_size = sysconf(_SC_PAGESIZE);
+	perf.dump_marker = mmap(NULL, page_size, PROT_READ | PROT_EXEC,
+				MAP_PRIVATE, fileno(perf.dump), 0);
+	if (perf.dump_marker == MAP_FAILED) {
+		perf.dump_marker = NULL;
+		goto error;
+	}
+	perf.dump_marker_size = page_size;
+
+	return 1;
+
+ error:
+	if (perf.dump) {
+		fclose(perf.dump);
+		perf.dump = NULL;
+	}
+	return 0;
+}
+
+static void close_jitdump(void)
+{
+	struct JitDumpRecord record;
+
+	record.id = JIT_CODE_CLOSE;
+	record.total_size = sizeof(record);
+	record.timestamp = perf_timestamp();
+	fwrite(&record, sizeof(record), 1, perf.dump);
+
+	munmap(perf.dump_marker, perf.dump_marker_size);
+	perf.dump_marker = NULL;
+	fclose(perf.dump);
+	perf.dump = NULL;
+}
+
+int wasmjit_perf_open(unsigned flags)
+{
+	int ret;
+
+	pthread_mutex_lock(&perf.lock);
+
+	if (perf.flags)
+		goto error;
+
+	if (flags & WASMJIT_PERF_MAP) {
+		char path[64];
+
+		snprintf(path, sizeof(path), "/tmp/perf-%ld.map",
+			 (long) getpid());
+		perf.map = fopen(path, "w");
+		if (!perf.map)
+			goto error;
+	}
+
+	if ((flags & WASMJIT_PERF_JITDUMP) && !open_jitdump()) {
+		if (perf.map) {
+			fclose(perf.map);
+			perf.map = NULL;
+		}
+		goto error;
+	}
+
+	__atomic_store_n(&perf.flags, flags, __ATOMIC_RELEASE);
+	ret = 1;
+
+	if (0) {
+	error:
+		ret = 0;
+	}
+
+	pthread_mutex_unlock(&perf.lock);
+
+	return ret;
+}
+
+void wasmjit_perf_close(void)
+{
+	pthread_mutex_lock(&perf.lock);
+
+	if (perf.map) {
+		fclose(perf.map);
+		perf.map = NULL;
+	}
+
+	if (perf.dump)
+		close_jitdump();
+
+	__atomic_store_n(&perf.flags, 0, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&perf.lock);
+}
+
+int wasmjit_perf_enabled(void)
+{
+	return __atomic_load_n(&perf.flags, __ATOMIC_ACQUIRE) != 0;
+}
+
+static void dump_code_load(const char *name, const void *code, size_t size,
+			   const struct WasmJITPcMap *pc_map)
+{
+	uint64_t timestamp = perf_timestamp();
+	size_t name_size = strlen(name) + 1;
+	size_t i, n_entries = 0;
+
+	if (pc_map) {
+		for (i = 0; i < pc_map->n_elts; ++i) {
+			if (pc_map->elts[i].wasm_offset != WASMJIT_PC_MAP_NO_OFFSET)
+				n_entries += 1;
+		}
+	}
+
+	if (n_entries) {
+		struct JitDumpDebugInfo info;
+
+		/* must come before the load record it describes */
+		info.p.id = JIT_CODE_DEBUG_INFO;
+		info.p.total_size = sizeof(info) + n_entries *
+			(sizeof(struct JitDumpDebugEntry) + sizeof(JITDUMP_SOURCE));
+		info.p.timestamp = timestamp;
+		info.code_addr = (uintptr_t) code;
+		info.nr_entry = n_entries;
+		fwrite(&info, sizeof(info), 1, perf.dump);
+
+		for (i = 0; i < pc_map->n_elts; ++i) {
+			struct JitDumpDebugEntry entry;
+
+			if (pc_map->elts[i].wasm_offset == WASMJIT_PC_MAP_NO_OFFSET)
+				continue;
+
+			entry.addr = (uintptr_t) code + pc_map->elts[i].code_offset;
+			entry.lineno = pc_map->elts[i].wasm_offset;
+			entry.discrim = 0;
+			fwrite(&entry, sizeof(entry), 1, perf.dump);
+			fwrite(JITDUMP_SOURCE, sizeof(JITDUMP_SOURCE), 1, perf.dump);
+		}
+	}
+
+	{
+		struct JitDumpCodeLoad load;
+
+		load.p.id = JIT_CODE_LOAD;
+		load.p.total_size = sizeof(load) + name_size + size;
+		load.p.timestamp = timestamp;
+		load.pid = getpid();
+		load.tid = syscall(SYS_gettid);
+		load.vma = (uintptr_t) code;
+		load.code_addr = (uintptr_t) code;
+		load.code_size = size;
+		load.code_index = perf.code_index++;
+
+		fwrite(&load, sizeof(load), 1, perf.dump);
+		fwrite(name, name_size, 1, perf.dump);
+		fwrite(code, size, 1, perf.dump);
+	}
+
+	fflush(perf.dump);
+}
+
+void wasmjit_perf_load_code(const char *name, const void *code, size_t size,
+			    const struct WasmJITPcMap *pc_map)
+{
+	pthread_mutex_lock(&perf.lock);
+
+	if (perf.map) {
+		fprintf(perf.map, "%" PRIxPTR " %zx %s\n",
+			(uintptr_t) code, size, name);
+		fflush(perf.map);
+	}
+
+	if (perf.dump)
+		dump_code_load(name, code, size, pc_map);
+
+	pthread_mutex_unlock(&perf.lock);
+}
+
+void wasmjit_perf_load_func(const char *name, uint32_t funcidx,
+			    const struct FuncInst *funcinst)
+{
+	char buf[256];
+
+	if (name)
+		snprintf(buf, sizeof(buf), "%s", name);
+	else
+		snprintf(buf, sizeof(buf), "wasm-function[%" PRIu32 "]",
+			 funcidx);
+	wasmjit_perf_load_code(buf, funcinst->compiled_code,
+			       funcinst->compiled_code_size, funcinst->pc_map);
+
+	if (name)
+		snprintf(buf, sizeof(buf), "invoker:%s", name);
+	else
+		snprintf(buf, sizeof(buf), "invoker:wasm-function[%" PRIu32 "]",
+			 funcidx);
+	wasmjit_perf_load_code(buf, (void *) funcinst->invoker,
+			       funcinst->invoker_size, NULL);
+}
+
+void wasmjit_perf_load_host_func(const char *name,
+				 const struct FuncInst *funcinst)
+{
+	char buf[256];
+
+	snprintf(buf, sizeof(buf), "host:%s", name);
+	wasmjit_perf_load_code(buf, funcinst->compiled_code,
+			       funcinst->compiled_code_size, NULL);
+
+	snprintf(buf, sizeof(buf), "invoker:host:%s", name);
+	wasmjit_perf_load_code(buf, (void *) funcinst->invoker,
+			       funcinst->invoker_size, NULL);
+}
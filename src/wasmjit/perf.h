@@ -0,0 +1,70 @@
+/* -*-mode:c; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+  Copyright (c) 2018 Rian Hunter et. al, see AUTHORS file.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+
+#ifndef __WASMJIT__PERF_H__
+#define __WASMJIT__PERF_H__
+
+#include <wasmjit/ast.h>
+#include <wasmjit/runtime.h>
+
+#include <wasmjit/sys.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+  Makes JIT code visible to Linux perf. WASMJIT_PERF_MAP writes
+  /tmp/perf-PID.map, which perf report reads directly.
+  WASMJIT_PERF_JITDUMP writes /tmp/jit-PID.dump with the code bytes
+  and, from the function's pc map, the module offset of each
+  instruction as its line number (source file "<wasm>"), for use with
+  perf record -k mono and perf inject --jit.
+
+  Once opened every function compiled by wasmjit_instantiate(), the
+  tier thread and the emscripten runtime is recorded, along with its
+  invoker.
+ */
+
+#define WASMJIT_PERF_MAP 1
+#define WASMJIT_PERF_JITDUMP 2
+
+int wasmjit_perf_open(unsigned flags);
+void wasmjit_perf_close(void);
+int wasmjit_perf_enabled(void);
+
+/* pc_map may be NULL */
+void wasmjit_perf_load_code(const char *name, const void *code, size_t size,
+			    const struct WasmJITPcMap *pc_map);
+void wasmjit_perf_load_func(const char *name, uint32_t funcidx,
+			    const struct FuncInst *funcinst);
+void wasmjit_perf_load_host_func(const char *name,
+				 const struct FuncInst *funcinst);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,173 @@
+/* -*-mode:c; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+  Copyright (c) 2018 Rian Hunter et. al, see AUTHORS file.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+
+#include <wasmjit/profile.h>
+
+#include <wasmjit/runtime.h>
+
+#include <wasmjit/sys.h>
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#define WASMJIT_PROFILE_MAGIC "wasmjit-profile"
+#define WASMJIT_PROFILE_VERSION 2
+
+/* FNV-1a */
+uint64_t wasmjit_profile_hash(const char *buf, size_t size)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < size; ++i) {
+		hash ^= (unsigned char) buf[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+uint64_t wasmjit_profile_target_funcidx(const struct ModuleInst *module_inst,
+					uint64_t target)
+{
+	size_t i;
+
+	for (i = 0; i < module_inst->funcs.n_elts; ++i) {
+		if ((uintptr_t) module_inst->funcs.elts[i] == target)
+			return i;
+	}
+
+	return UINT64_MAX;
+}
+
+int wasmjit_profile_save(const char *filename,
+			 const struct ModuleInst *module_inst)
+{
+	const struct WasmJITProfile *profile = module_inst->profile;
+	FILE *f;
+	size_t i, j, k;
+	int ret;
+
+	if (!profile)
+		return 0;
+
+	f = fopen(filename, "w");
+	if (!f)
+		return 0;
+
+	fprintf(f, "%s %d %016" PRIx64 " %d\n%zu\n", WASMJIT_PROFILE_MAGIC,
+		WASMJIT_PROFILE_VERSION, profile->module_hash,
+		profile->inlined, profile->n_funcs);
+
+	for (i = 0; i < profile->n_funcs; ++i) {
+		const struct WasmJITFunctionProfile *fprofile =
+			&profile->funcs[i];
+
+		fprintf(f, "%zu", fprofile->n_counters);
+		for (j = 0, k = 0; j < fprofile->n_counters; ++j) {
+			uint64_t val = fprofile->counters[j];
+
+			if (k < fprofile->n_targets &&
+			    fprofile->targets[k] == j) {
+				val = wasmjit_profile_target_funcidx(module_inst,
+								     val);
+				k += 1;
+			}
+
+			fprintf(f, " %" PRIu64, val);
+		}
+		fprintf(f, "\n");
+	}
+
+	ret = !ferror(f);
+	if (fclose(f))
+		ret = 0;
+
+	return ret;
+}
+
+struct WasmJITProfile *wasmjit_profile_load(const char *filename)
+{
+	struct WasmJITProfile *profile = NULL;
+	char magic[sizeof(WASMJIT_PROFILE_MAGIC)];
+	int version;
+	FILE *f;
+	size_t i, j;
+
+	f = fopen(filename, "r");
+	if (!f)
+		goto error;
+
+	profile = calloc(1, sizeof(*profile));
+	if (!profile)
+		goto error;
+
+	if (fscanf(f, "%15s %d %" SCNx64 " %d %zu", magic, &version,
+		   &profile->module_hash, &profile->inlined,
+		   &profile->n_funcs) != 5)
+		goto error;
+
+	if (strcmp(magic, WASMJIT_PROFILE_MAGIC) ||
+	    version != WASMJIT_PROFILE_VERSION ||
+	    (profile->inlined != 0 && profile->inlined != 1))
+		goto error;
+
+	profile->funcs = calloc(profile->n_funcs, sizeof(profile->funcs[0]));
+	if (profile->n_funcs && !profile->funcs) {
+		profile->n_funcs = 0;
+		goto error;
+	}
+
+	for (i = 0; i < profile->n_funcs; ++i) {
+		struct WasmJITFunctionProfile *fprofile = &profile->funcs[i];
+		size_t n_counters;
+
+		if (fscanf(f, "%zu", &n_counters) != 1)
+			goto error;
+
+		fprofile->counters = calloc(n_counters,
+					    sizeof(fprofile->counters[0]));
+		if (n_counters && !fprofile->counters)
+			goto error;
+		fprofile->n_counters = n_counters;
+
+		for (j = 0; j < n_counters; ++j) {
+			if (fscanf(f, "%" SCNu64, &fprofile->counters[j]) != 1)
+				goto error;
+		}
+	}
+
+	if (0) {
+	error:
+		if (profile)
+			wasmjit_free_profile(profile);
+		profile = NULL;
+	}
+
+	if (f)
+		fclose(f);
+
+	return profile;
+}
@@ -0,0 +1,59 @@
+/* -*-mode:c; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+  Copyright (c) 2018 Rian Hunter et. al, see AUTHORS file.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+
+#ifndef __WASMJIT__PROFILE_H__
+#define __WASMJIT__PROFILE_H__
+
+#include <wasmjit/runtime.h>
+
+#include <wasmjit/sys.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+  Profiles recorded with WASMJIT_INSTANTIATE_FLAG_PROFILE are saved as
+  text, one line of counters per function, with call_indirect
+  candidates turned into function indexes. A loaded profile is passed
+  to wasmjit_instantiate() to lay out code for it; module_hash ties it
+  to the module binary it was recorded for and inlined whether its
+  counter layout is that of inlined code.
+ */
+
+uint64_t wasmjit_profile_hash(const char *buf, size_t size);
+int wasmjit_profile_save(const char *filename,
+			 const struct ModuleInst *module_inst);
+struct WasmJITProfile *wasmjit_profile_load(const char *filename);
+/* a recorded call_indirect candidate as a function index, UINT64_MAX
+   if it isn't one of module_inst's */
+uint64_t wasmjit_profile_target_funcidx(const struct ModuleInst *module_inst,
+					uint64_t target);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
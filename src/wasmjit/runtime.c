@@ -29,6 +29,16 @@
 
 #include <wasmjit/sys.h>
 
+#ifndef __KERNEL__
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
 DEFINE_VECTOR_GROW(func_types, struct FuncTypeVector);
 
 
@@ -76,12 +86,20 @@ void wasmjit_free_func_inst(struct FuncInst *funcinst)
 	if (funcinst->compiled_code)
 		wasmjit_unmap_code_segment(funcinst->compiled_code,
 					   funcinst->compiled_code_size);
+	if (funcinst->pc_map)
+		wasmjit_free_pc_map(funcinst->pc_map);
 	free(funcinst);
 }
 
 void wasmjit_free_module_inst(struct ModuleInst *module)
 {
 	size_t i;
+	/* stop recompiling before anything goes away */
+	if (module->free_tier)
+		module->free_tier(module->tier);
+	/* before the code it describes is unmapped */
+	if (module->free_debug_info)
+		module->free_debug_info(module->debug_info);
 	if (module->free_private_data)
 		module->free_private_data(module->private_data);
 	free(module->types.elts);
@@ -95,7 +113,7 @@ void wasmjit_free_module_inst(struct ModuleInst *module)
 	}
 	free(module->tables.elts);
 	for (i = module->n_imported_mems; i < module->mems.n_elts; ++i) {
-		free(module->mems.elts[i]->data);
+		wasmjit_unmap_memory(module->mems.elts[i]);
 		free(module->mems.elts[i]);
 	}
 	free(module->mems.elts);
@@ -108,9 +126,184 @@ void wasmjit_free_module_inst(struct ModuleInst *module)
 			free(module->exports.elts[i].name);
 	}
 	free(module->exports.elts);
+	if (module->profile)
+		wasmjit_free_profile(module->profile);
+	if (module->func_names) {
+		for (i = 0; i < module->funcs.n_elts; ++i)
+			free(module->func_names[i]);
+		free(module->func_names);
+	}
+	if (module->code_map) {
+		module->code_map->next_retired = module->retired_code_maps;
+		module->retired_code_maps = module->code_map;
+	}
+	while (module->retired_code_maps) {
+		struct WasmJITCodeMap *code_map = module->retired_code_maps;
+
+		module->retired_code_maps = code_map->next_retired;
+		free(code_map->elts);
+		free(code_map);
+	}
 	free(module);
 }
 
+void wasmjit_free_profile(struct WasmJITProfile *profile)
+{
+	size_t i;
+	for (i = 0; i < profile->n_funcs; ++i) {
+		free(profile->funcs[i].counters);
+		free(profile->funcs[i].targets);
+	}
+	free(profile->funcs);
+	free(profile);
+}
+
+void wasmjit_free_pc_map(struct WasmJITPcMap *pc_map)
+{
+	free(pc_map->elts);
+	free(pc_map);
+}
+
+int wasmjit_lookup_pc(const struct ModuleInst *module_inst,
+		      uintptr_t pc, struct WasmJITCodeLocation *loc)
+{
+	/* counted so a map being replaced isn't freed under us, this
+	   may run in a signal handler */
+	unsigned *readers = (unsigned *) &module_inst->code_map_readers;
+	const struct WasmJITCodeMap *code_map;
+	const struct WasmJITCodeRange *range;
+	const struct WasmJITPcMap *pc_map;
+	size_t lo, hi, code_offset;
+	int ret = 0;
+
+	__atomic_add_fetch(readers, 1, __ATOMIC_SEQ_CST);
+	code_map = __atomic_load_n(&module_inst->code_map, __ATOMIC_SEQ_CST);
+	if (!code_map || !code_map->n_elts)
+		goto out;
+
+	/* last range starting at or before pc */
+	lo = 0;
+	hi = code_map->n_elts;
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (code_map->elts[mid].start <= pc)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	range = &code_map->elts[lo];
+	if (pc < range->start || pc - range->start >= range->size)
+		goto out;
+	pc_map = range->pc_map;
+
+	/* last entry at or before pc */
+	code_offset = pc - range->start;
+	lo = 0;
+	hi = pc_map->n_elts;
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (pc_map->elts[mid].code_offset <= code_offset)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	loc->funcinst = module_inst->funcs.elts[range->funcidx];
+	loc->funcidx = range->funcidx;
+	loc->wasm_offset = pc_map->elts[lo].wasm_offset;
+	ret = 1;
+
+ out:
+	__atomic_sub_fetch(readers, 1, __ATOMIC_RELEASE);
+	return ret;
+}
+
+int wasmjit_lookup_return_address(const struct ModuleInst *module_inst,
+				  uintptr_t ret_addr,
+				  struct WasmJITCodeLocation *loc)
+{
+	/* the call instruction ends at ret_addr */
+	return wasmjit_lookup_pc(module_inst, ret_addr - 1, loc);
+}
+
+#ifndef __KERNEL__
+
+static int cmp_code_range(const void *a, const void *b)
+{
+	const struct WasmJITCodeRange *ra = a, *rb = b;
+
+	if (ra->start < rb->start)
+		return -1;
+	return ra->start > rb->start;
+}
+
+int wasmjit_update_code_map(struct ModuleInst *module_inst)
+{
+	struct WasmJITCodeMap *code_map, *old;
+	size_t i, n_elts = 0;
+
+	for (i = module_inst->n_imported_funcs; i < module_inst->funcs.n_elts; ++i) {
+		const struct WasmJITPcMap *pc_map;
+
+		for (pc_map = module_inst->funcs.elts[i]->pc_map; pc_map;
+		     pc_map = pc_map->prev) {
+			if (pc_map->n_elts)
+				n_elts += 1;
+		}
+	}
+
+	code_map = calloc(1, sizeof(*code_map));
+	if (!code_map)
+		return 0;
+	code_map->elts = calloc(n_elts, sizeof(code_map->elts[0]));
+	if (n_elts && !code_map->elts) {
+		free(code_map);
+		return 0;
+	}
+
+	for (i = module_inst->n_imported_funcs; i < module_inst->funcs.n_elts; ++i) {
+		const struct WasmJITPcMap *pc_map;
+
+		for (pc_map = module_inst->funcs.elts[i]->pc_map; pc_map;
+		     pc_map = pc_map->prev) {
+			struct WasmJITCodeRange *range;
+
+			if (!pc_map->n_elts)
+				continue;
+			range = &code_map->elts[code_map->n_elts++];
+			range->start = (uintptr_t) pc_map->code;
+			range->size = pc_map->code_size;
+			range->funcidx = i;
+			range->pc_map = pc_map;
+		}
+	}
+
+	qsort(code_map->elts, code_map->n_elts, sizeof(code_map->elts[0]),
+	      cmp_code_range);
+
+	old = __atomic_exchange_n(&module_inst->code_map, code_map,
+				  __ATOMIC_SEQ_CST);
+	if (old) {
+		old->next_retired = module_inst->retired_code_maps;
+		module_inst->retired_code_maps = old;
+	}
+
+	/* lookups starting after the exchange see the new map, so none
+	   can be using a retired one */
+	if (!__atomic_load_n(&module_inst->code_map_readers, __ATOMIC_SEQ_CST)) {
+		while (module_inst->retired_code_maps) {
+			old = module_inst->retired_code_maps;
+			module_inst->retired_code_maps = old->next_retired;
+			free(old->elts);
+			free(old);
+		}
+	}
+
+	return 1;
+}
+
+#endif
+
 int wasmjit_typecheck_func(const struct FuncType *type,
 			   const struct FuncInst *funcinst)
 {
@@ -138,7 +331,9 @@ int wasmjit_typecheck_memory(const struct MemoryType *type,
 {
 	size_t msize = meminst->size / WASM_PAGE_SIZE;
 	size_t mmax = meminst->max / WASM_PAGE_SIZE;
-	return (msize >= type->limits.min &&
+	int shared = !!(meminst->flags & WASMJIT_MEMORY_FLAG_SHARED);
+	return (shared == type->limits.shared &&
+		msize >= type->limits.min &&
 		(!type->limits.max ||
 		 (type->limits.max && mmax &&
 		  mmax <= type->limits.max)));
@@ -171,6 +366,244 @@ void _wasmjit_create_func_type(struct FuncType *ft,
 	}
 }
 
+static uint32_t grow_memory(struct MemInst *meminst, uint32_t delta)
+{
+	size_t old_pages, max_pages;
+
+	old_pages = meminst->size / WASM_PAGE_SIZE;
+	max_pages = meminst->max ? meminst->max / WASM_PAGE_SIZE : WASM_MAX_PAGES;
+
+	if (delta > max_pages - old_pages)
+		return (uint32_t) -1;
+
+	if (delta &&
+	    !wasmjit_extend_memory(meminst, meminst->size + delta * WASM_PAGE_SIZE))
+		return (uint32_t) -1;
+
+	return old_pages;
+}
+
+#ifndef __KERNEL__
+
+static pthread_mutex_t shared_memory_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint32_t wasmjit_grow_memory(struct MemInst *meminst, uint32_t delta)
+{
+	uint32_t ret;
+
+	if (!(meminst->flags & WASMJIT_MEMORY_FLAG_SHARED))
+		return grow_memory(meminst, delta);
+
+	/* other threads keep running against the old size until the
+	   new one is stored, data never moves */
+	pthread_mutex_lock(&shared_memory_lock);
+	ret = grow_memory(meminst, delta);
+	pthread_mutex_unlock(&shared_memory_lock);
+
+	return ret;
+}
+
+static uint32_t futex_wait(uint32_t *addr, uint32_t expected,
+			   int64_t timeout)
+{
+	struct timespec deadline, *deadlinep = NULL;
+
+	if (timeout >= 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout / 1000000000;
+		deadline.tv_nsec += timeout % 1000000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		deadlinep = &deadline;
+	}
+
+	for (;;) {
+		/* FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC
+		   deadline, so restarts don't stretch the timeout */
+		if (!syscall(SYS_futex, addr, FUTEX_WAIT_BITSET_PRIVATE,
+			     expected, deadlinep, NULL,
+			     FUTEX_BITSET_MATCH_ANY))
+			return 0;
+
+		switch (errno) {
+		case EINTR:
+			break;
+		case EAGAIN:
+			return 1;
+		case ETIMEDOUT:
+			return 2;
+		default:
+			wasmjit_trap(WASMJIT_TRAP_ABORT);
+		}
+	}
+}
+
+uint32_t wasmjit_atomic_wait32(uint32_t *addr, uint32_t expected,
+			       int64_t timeout)
+{
+	return futex_wait(addr, expected, timeout);
+}
+
+/*
+ * futexes are 32 bits, so 64 bit waiters queue on a bucket hashed from
+ * their address instead. The compare and the enqueue happen under the
+ * bucket lock, which notify also takes, so a store followed by a notify
+ * either fails the compare or finds the waiter.
+ */
+#define WAIT64_BUCKETS 64
+
+struct Wait64Waiter {
+	struct Wait64Waiter *next;
+	uint64_t *addr;
+	/* a futex word, set by notify */
+	uint32_t woken;
+};
+
+static struct Wait64Bucket {
+	pthread_mutex_t lock;
+	struct Wait64Waiter *waiters;
+	size_t n_waiters;
+} wait64_buckets[WAIT64_BUCKETS] = {
+	[0 ... WAIT64_BUCKETS - 1] = { PTHREAD_MUTEX_INITIALIZER, NULL, 0 },
+};
+
+static struct Wait64Bucket *wait64_bucket(void *addr)
+{
+	return &wait64_buckets[((uintptr_t) addr >> 3) % WAIT64_BUCKETS];
+}
+
+uint32_t wasmjit_atomic_wait64(uint64_t *addr, uint64_t expected,
+			       int64_t timeout)
+{
+	struct Wait64Bucket *bucket = wait64_bucket(addr);
+	struct Wait64Waiter waiter, **pp;
+	uint32_t ret;
+
+	pthread_mutex_lock(&bucket->lock);
+	/* seen by notify before it looks at the list */
+	__atomic_add_fetch(&bucket->n_waiters, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(addr, __ATOMIC_SEQ_CST) != expected) {
+		__atomic_sub_fetch(&bucket->n_waiters, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&bucket->lock);
+		return 1;
+	}
+	waiter.addr = addr;
+	waiter.woken = 0;
+	waiter.next = bucket->waiters;
+	bucket->waiters = &waiter;
+	pthread_mutex_unlock(&bucket->lock);
+
+	while (!__atomic_load_n(&waiter.woken, __ATOMIC_SEQ_CST) &&
+	       futex_wait(&waiter.woken, 0, timeout) != 2)
+		;
+
+	pthread_mutex_lock(&bucket->lock);
+	if (waiter.woken) {
+		/* notify already unlinked us */
+		ret = 0;
+	} else {
+		for (pp = &bucket->waiters; *pp != &waiter; pp = &(*pp)->next)
+			;
+		*pp = waiter.next;
+		__atomic_sub_fetch(&bucket->n_waiters, 1, __ATOMIC_SEQ_CST);
+		ret = 2;
+	}
+	pthread_mutex_unlock(&bucket->lock);
+
+	return ret;
+}
+
+static uint32_t notify_wait64(void *addr, uint32_t count)
+{
+	struct Wait64Bucket *bucket = wait64_bucket(addr);
+	struct Wait64Waiter **pp;
+	uint32_t woken = 0;
+
+	/* orders the notifier's store before the check below */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&bucket->n_waiters, __ATOMIC_SEQ_CST))
+		return 0;
+
+	pthread_mutex_lock(&bucket->lock);
+	pp = &bucket->waiters;
+	while (*pp && woken < count) {
+		struct Wait64Waiter *waiter = *pp;
+
+		if (waiter->addr != addr) {
+			pp = &waiter->next;
+			continue;
+		}
+
+		*pp = waiter->next;
+		__atomic_sub_fetch(&bucket->n_waiters, 1, __ATOMIC_SEQ_CST);
+		/* the waiter can't return until we drop the lock */
+		__atomic_store_n(&waiter->woken, 1, __ATOMIC_SEQ_CST);
+		syscall(SYS_futex, &waiter->woken, FUTEX_WAKE_PRIVATE, 1,
+			NULL, NULL, 0);
+		woken++;
+	}
+	pthread_mutex_unlock(&bucket->lock);
+
+	return woken;
+}
+
+uint32_t wasmjit_atomic_notify(void *addr, uint32_t count)
+{
+	long ret;
+	uint32_t woken;
+
+	if (!count)
+		return 0;
+
+	ret = syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE,
+		      count > INT_MAX ? INT_MAX : (int) count,
+		      NULL, NULL, 0);
+	woken = ret < 0 ? 0 : ret;
+
+	if (woken < count)
+		woken += notify_wait64(addr, count - woken);
+
+	return woken;
+}
+
+#else
+
+/* there are no shared memories in the kernel, nothing can wait */
+
+uint32_t wasmjit_grow_memory(struct MemInst *meminst, uint32_t delta)
+{
+	return grow_memory(meminst, delta);
+}
+
+uint32_t wasmjit_atomic_wait32(uint32_t *addr, uint32_t expected,
+			       int64_t timeout)
+{
+	(void)addr;
+	(void)expected;
+	(void)timeout;
+	wasmjit_trap(WASMJIT_TRAP_WAIT_ON_UNSHARED_MEMORY);
+}
+
+uint32_t wasmjit_atomic_wait64(uint64_t *addr, uint64_t expected,
+			       int64_t timeout)
+{
+	(void)addr;
+	(void)expected;
+	(void)timeout;
+	wasmjit_trap(WASMJIT_TRAP_WAIT_ON_UNSHARED_MEMORY);
+}
+
+uint32_t wasmjit_atomic_notify(void *addr, uint32_t count)
+{
+	(void)addr;
+	(void)count;
+	return 0;
+}
+
+#endif
+
 struct FuncInst *wasmjit_resolve_indirect_call(const struct TableInst *tableinst,
 					       const struct FuncType *expected_type,
 					       uint32_t idx)
@@ -191,6 +624,15 @@ struct FuncInst *wasmjit_resolve_indirect_call(const struct TableInst *tableinst
 	return funcinst;
 }
 
+/* called from tier 0 code when a function becomes hot */
+void wasmjit_tier_up(struct FuncInst *funcinst)
+{
+	struct ModuleInst *module_inst = funcinst->module_inst;
+
+	if (module_inst->tier_up)
+		module_inst->tier_up(module_inst->tier, funcinst);
+}
+
 union ValueUnion wasmjit_invoke_function_raw(struct FuncInst *funcinst,
 					     union ValueUnion *values)
 {
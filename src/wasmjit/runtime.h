@@ -44,6 +44,38 @@ struct Value {
 	} data;
 };
 
+/* native code offset to module bytecode offset, sorted by code_offset */
+struct WasmJITPcMap {
+	const char *code;
+	size_t code_size;
+	size_t n_elts;
+	struct WasmJITPcMapElt {
+		uint32_t code_offset;
+		uint32_t wasm_offset;
+	} *elts;
+	/* code this replaced, activations may still be running it */
+	const struct WasmJITPcMap *prev;
+};
+
+/* shared trap stubs don't belong to any one instruction */
+#define WASMJIT_PC_MAP_NO_OFFSET UINT32_MAX
+
+/*
+  The code ranges of every pc map of a module instance, replaced ones
+  included, sorted by start. It is rebuilt whenever code is swapped
+  in, replaced maps are freed once no lookup can be using them.
+ */
+struct WasmJITCodeMap {
+	size_t n_elts;
+	struct WasmJITCodeRange {
+		uintptr_t start;
+		size_t size;
+		uint32_t funcidx;
+		const struct WasmJITPcMap *pc_map;
+	} *elts;
+	struct WasmJITCodeMap *next_retired;
+};
+
 struct FuncInst {
 	struct ModuleInst *module_inst;
 	/*
@@ -57,6 +89,17 @@ struct FuncInst {
 	size_t invoker_size;
 	size_t stack_usage;
 	struct FuncType type;
+	/* decremented on entry and loop back-edges by tier 0 code,
+	   wasmjit_tier_up() is called when it hits zero */
+	uint32_t tier_countdown;
+	/* NULL for host functions, replaced along with compiled_code */
+	struct WasmJITPcMap *pc_map;
+	/* updated by code compiled with WASMJIT_COMPILE_FLAG_CALL_COUNTS */
+	struct WasmJITFuncStats {
+		uint64_t calls;
+		/* inclusive of callees, WASMJIT_COMPILE_FLAG_CYCLES */
+		uint64_t cycles;
+	} stats;
 };
 
 struct TableInst {
@@ -66,10 +109,17 @@ struct TableInst {
 	size_t max;
 };
 
+#define WASMJIT_MEMORY_FLAG_HUGE_PAGES 1
+#define WASMJIT_MEMORY_FLAG_HUGETLB 2
+/* may be used by several threads at once, it never moves and growth
+   is serialized */
+#define WASMJIT_MEMORY_FLAG_SHARED 4
+
 struct MemInst {
 	char *data;
 	size_t size;
 	size_t max; /* max of 0 means no max */
+	unsigned flags;
 };
 
 struct GlobalInst {
@@ -88,6 +138,30 @@ struct Export {
 	} value;
 };
 
+/*
+  Branch and call_indirect profile of one function, the counter layout
+  is given by wasmjit_profile_n_counters(). While recording the
+  call_indirect candidate slot holds a FuncInst pointer, in a loaded
+  profile it holds the function index.
+ */
+struct WasmJITFunctionProfile {
+	size_t n_counters;
+	uint64_t *counters;
+	/* offsets of the call_indirect candidates while recording */
+	size_t n_targets;
+	size_t *targets;
+};
+
+struct WasmJITProfile {
+	uint64_t module_hash;
+	/* recorded from code with leaf callees inlined, the counters of
+	   a call site's callee are then part of the caller's */
+	int inlined;
+	/* indexed by code section entry */
+	size_t n_funcs;
+	struct WasmJITFunctionProfile *funcs;
+};
+
 struct ModuleInst {
 	struct FuncTypeVector {
 		size_t n_elts;
@@ -102,6 +176,24 @@ struct ModuleInst {
 		n_imported_mems, n_imported_globals;
 	void *private_data;
 	void (*free_private_data)(void *);
+	void *tier;
+	void (*tier_up)(void *, struct FuncInst *);
+	void (*free_tier)(void *);
+	/* recorded with WASMJIT_INSTANTIATE_FLAG_PROFILE, or by tier 0
+	   for tier 1 */
+	struct WasmJITProfile *profile;
+	void *debug_info;
+	void (*free_debug_info)(void *);
+	/* instrumentation the tier thread must keep, e.g.
+	   WASMJIT_COMPILE_FLAG_FUEL */
+	unsigned compile_flags;
+	/* indexed by funcidx, NULL entries for unnamed and imported
+	   functions, kept with WASMJIT_COMPILE_FLAG_CALL_COUNTS */
+	char **func_names;
+	/* see wasmjit_update_code_map() */
+	struct WasmJITCodeMap *code_map;
+	struct WasmJITCodeMap *retired_code_maps;
+	unsigned code_map_readers;
 };
 
 DECLARE_VECTOR_GROW(func_types, struct FuncTypeVector);
@@ -114,6 +206,8 @@ struct NamedModule {
 #define IS_HOST(funcinst) ((funcinst)->host_function)
 
 #define WASM_PAGE_SIZE ((size_t) (64 * 1024))
+/* what a 32-bit address can reach */
+#define WASM_MAX_PAGES ((size_t) 65536)
 
 void _wasmjit_create_func_type(struct FuncType *ft,
 			       size_t n_inputs,
@@ -154,6 +248,11 @@ enum {
 	WASMJIT_TRAP_STACK_OVERFLOW,
 	WASMJIT_TRAP_INTEGER_OVERFLOW,
 	WASMJIT_TRAP_EXIT,
+	WASMJIT_TRAP_INTEGER_DIVIDE_BY_ZERO,
+	WASMJIT_TRAP_OUT_OF_FUEL,
+	WASMJIT_TRAP_INTERRUPTED,
+	WASMJIT_TRAP_UNALIGNED_ATOMIC,
+	WASMJIT_TRAP_WAIT_ON_UNSHARED_MEMORY,
 };
 
 __attribute__ ((unused))
@@ -187,6 +286,21 @@ static const char *wasmjit_trap_reason_to_string(int reason) {
 	case WASMJIT_TRAP_EXIT:
 		msg = "exit";
 		break;
+	case WASMJIT_TRAP_INTEGER_DIVIDE_BY_ZERO:
+		msg = "integer divide by zero";
+		break;
+	case WASMJIT_TRAP_OUT_OF_FUEL:
+		msg = "out of fuel";
+		break;
+	case WASMJIT_TRAP_INTERRUPTED:
+		msg = "interrupted";
+		break;
+	case WASMJIT_TRAP_UNALIGNED_ATOMIC:
+		msg = "unaligned atomic";
+		break;
+	case WASMJIT_TRAP_WAIT_ON_UNSHARED_MEMORY:
+		msg = "wait on unshared memory";
+		break;
 	default:
 		assert(0);
 		__builtin_unreachable();
@@ -200,18 +314,127 @@ struct FuncInst *wasmjit_resolve_indirect_call(const struct TableInst *tableinst
 void wasmjit_trap(int reason) __attribute__((noreturn));
 void wasmjit_exit(int status) __attribute__((noreturn));
 void *wasmjit_stack_top(void);
+void wasmjit_tier_up(struct FuncInst *funcinst);
 
 void wasmjit_free_func_inst(struct FuncInst *funcinst);
 void wasmjit_free_module_inst(struct ModuleInst *module);
+void wasmjit_free_profile(struct WasmJITProfile *profile);
+void wasmjit_free_pc_map(struct WasmJITPcMap *pc_map);
+
+struct WasmJITCodeLocation {
+	struct FuncInst *funcinst;
+	uint32_t funcidx;
+	/* or WASMJIT_PC_MAP_NO_OFFSET */
+	uint32_t wasm_offset;
+};
+
+int wasmjit_lookup_pc(const struct ModuleInst *module_inst,
+		      uintptr_t pc, struct WasmJITCodeLocation *loc);
+int wasmjit_lookup_return_address(const struct ModuleInst *module_inst,
+				  uintptr_t ret_addr,
+				  struct WasmJITCodeLocation *loc);
 
 void *wasmjit_map_code_segment(size_t code_size);
 int wasmjit_mark_code_segment_executable(void *code, size_t code_size);
 int wasmjit_unmap_code_segment(void *code, size_t code_size);
 
+/* sets up meminst with size zeroed bytes, leaving room to grow to
+   max in place (a max of 0 means no max). WASMJIT_MEMORY_FLAG_HUGE_PAGES
+   asks for transparent huge pages, _HUGETLB for pages from the
+   hugetlbfs pool, committed 2MiB at a time */
+int wasmjit_map_memory(struct MemInst *meminst, size_t size, size_t max,
+		       unsigned flags);
+void wasmjit_unmap_memory(struct MemInst *meminst);
+/* commits up to new_size without moving data, 0 if it can't */
+int wasmjit_extend_memory(struct MemInst *meminst, size_t new_size);
+/* how much of meminst is currently backed by huge pages */
+int wasmjit_memory_huge_page_bytes(const struct MemInst *meminst,
+				   size_t *bytes);
+/* address space set aside for meminst, how much of it is accessible
+   and how much of that is in RAM as meminst's own pages, not counting
+   ones still shared with a snapshot or data image */
+int wasmjit_memory_usage(const struct MemInst *meminst,
+			 size_t *reserved, size_t *committed,
+			 size_t *resident);
+/* memory.grow, returns the old size in pages or (uint32_t) -1 */
+uint32_t wasmjit_grow_memory(struct MemInst *meminst, uint32_t delta);
+
+/*
+  memory.atomic.wait32/64 and memory.atomic.notify on an address inside
+  a shared memory. A negative timeout waits forever. Wait returns 0
+  when woken, 1 if *addr didn't hold expected and 2 on timeout, notify
+  returns how many waiters it woke.
+ */
+uint32_t wasmjit_atomic_wait32(uint32_t *addr, uint32_t expected,
+			       int64_t timeout);
+uint32_t wasmjit_atomic_wait64(uint64_t *addr, uint64_t expected,
+			       int64_t timeout);
+uint32_t wasmjit_atomic_notify(void *addr, uint32_t count);
+
 int wasmjit_set_stack_top(void *stack_top);
 int wasmjit_set_jmp_buf(wasmjit_thread_state *jmpbuf);
 wasmjit_thread_state *wasmjit_get_jmp_buf(void);
 
+#ifndef __KERNEL__
+/*
+  Per thread budget for code instantiated with
+  WASMJIT_INSTANTIATE_FLAG_FUEL, one unit per instruction. It traps
+  with WASMJIT_TRAP_OUT_OF_FUEL when it would go negative.
+ */
+void wasmjit_set_fuel(int64_t fuel);
+int64_t wasmjit_get_fuel(void);
+uintptr_t wasmjit_fuel_tls_offset(void);
+
+/*
+  Code instantiated with WASMJIT_INSTANTIATE_FLAG_EPOCH checks on
+  function entry and at loop headers whether the process wide epoch
+  has reached the calling thread's deadline. Any thread may bump the
+  epoch. Once the deadline has passed the thread's callback, if any,
+  returns how many more epochs to run for, or 0 to trap with
+  WASMJIT_TRAP_INTERRUPTED. Without a deadline code never stops.
+ */
+typedef uint64_t (*wasmjit_epoch_callback_t)(void *data);
+
+uint64_t wasmjit_increment_epoch(void);
+void wasmjit_set_epoch_deadline(uint64_t delta);
+void wasmjit_clear_epoch_deadline(void);
+void wasmjit_set_epoch_callback(wasmjit_epoch_callback_t callback,
+				void *data);
+void wasmjit_epoch_deadline_reached(void);
+uint64_t *wasmjit_epoch_address(void);
+uintptr_t wasmjit_epoch_deadline_tls_offset(void);
+
+/*
+  Linear memory reservations released by wasmjit_unmap_memory() are
+  reset to untouched PROT_NONE address space and kept, up to capacity,
+  for the next wasmjit_map_memory() with the same reservation size and
+  flags. A capacity of 0 releases them all and turns pooling off.
+ */
+struct WasmJITMemoryPoolStats {
+	size_t capacity;
+	size_t n_free;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t resets;
+	uint64_t reset_ns;
+};
+
+int wasmjit_memory_pool_init(size_t capacity);
+void wasmjit_memory_pool_stats(struct WasmJITMemoryPoolStats *stats);
+
+/* replaces the first size bytes of meminst with fd's contents at
+   offset, mapped copy-on-write where the backing allows it */
+int wasmjit_memory_map_image(struct MemInst *meminst, int fd,
+			     size_t offset, size_t size);
+/* whether the first size bytes of meminst are all zero */
+int wasmjit_memory_is_zero(const struct MemInst *meminst, size_t size);
+
+/* rebuilds module_inst->code_map for wasmjit_lookup_pc() after
+   instantiating or swapping code, from one thread at a time. The old
+   map stays in use if this fails */
+int wasmjit_update_code_map(struct ModuleInst *module_inst);
+#endif
+
 union ExportPtr wasmjit_get_export(const struct ModuleInst *, const char *name, wasmjit_desc_t type);
 
 union ValueUnion wasmjit_invoke_function_raw(struct FuncInst *funcinst,
@@ -0,0 +1,638 @@
+/* -*-mode:c; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+  Copyright (c) 2018 Rian Hunter et. al, see AUTHORS file.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <wasmjit/sampler.h>
+
+#include <wasmjit/sys.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+#define SAMPLER_MAX_DEPTH 128
+/* words of host stack searched for the WASM caller's return address */
+#define SAMPLER_MAX_SCAN 512
+#define SAMPLER_BUF_SIZE (1 << 21)
+
+/*
+  A frame is a module index in bits 32-47 and either a funcidx or,
+  for FRAME_HOST, the module offset of the call instruction that
+  left JIT code. The host function is resolved when writing.
+ */
+#define FRAME_WASM ((uint64_t) 1 << 48)
+#define FRAME_HOST ((uint64_t) 2 << 48)
+#define FRAME_KIND(f) ((f) & ((uint64_t) 0xffff << 48))
+#define FRAME_MODULE(f) ((size_t) (((f) >> 32) & 0xffff))
+#define FRAME_IDX(f) ((uint32_t) (f))
+#define MAKE_FRAME(kind, module, idx) \
+	((kind) | ((uint64_t) (module) << 32) | (idx))
+
+struct SamplerCallSite {
+	uint32_t wasm_offset;
+	uint32_t funcidx;
+};
+
+struct SamplerModule {
+	struct ModuleInst *module_inst;
+	size_t n_func_names;
+	char **func_names;
+	size_t n_call_sites;
+	struct SamplerCallSite *call_sites;
+};
+
+static struct {
+	int enabled;
+	int armed;
+	unsigned interval_us;
+	timer_t timer;
+	struct sigaction old_action;
+	uintptr_t stack_end;
+	size_t n_modules;
+	struct SamplerModule *modules;
+	/* each sample is its depth followed by its frames, leaf first */
+	uint64_t *buf;
+	size_t buf_used;
+	size_t n_samples;
+	size_t n_dropped;
+} sampler;
+
+static void block_sigprof(int how)
+{
+	sigset_t set;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGPROF);
+	pthread_sigmask(how, &set, NULL);
+}
+
+static int lookup_pc(uintptr_t pc, int is_return_address,
+		     uint64_t *frame, uint32_t *wasm_offset)
+{
+	size_t i;
+
+	for (i = 0; i < sampler.n_modules; ++i) {
+		struct WasmJITCodeLocation loc;
+		int found;
+
+		if (!sampler.modules[i].module_inst)
+			continue;
+
+		if (is_return_address)
+			found = wasmjit_lookup_return_address(sampler.modules[i].module_inst,
+							      pc, &loc);
+		else
+			found = wasmjit_lookup_pc(sampler.modules[i].module_inst,
+						  pc, &loc);
+		if (found) {
+			*frame = MAKE_FRAME(FRAME_WASM, i, loc.funcidx);
+			*wasm_offset = loc.wasm_offset;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int valid_fp(uintptr_t fp, uintptr_t sp)
+{
+	return !(fp % 8) && fp >= sp && fp < sampler.stack_end - 16;
+}
+
+static size_t walk_stack(const ucontext_t *uc, uint64_t *frames)
+{
+	uintptr_t pc, sp, fp;
+	uint32_t wasm_offset;
+	size_t n_frames = 0;
+	int in_wasm;
+
+	pc = uc->uc_mcontext.gregs[REG_RIP];
+	sp = uc->uc_mcontext.gregs[REG_RSP];
+	fp = uc->uc_mcontext.gregs[REG_RBP];
+
+	if (sp >= sampler.stack_end)
+		return 0;
+
+	/* NB: in a prologue %rbp is still the caller's and the caller
+	   gets skipped */
+	in_wasm = lookup_pc(pc, 0, &frames[n_frames], &wasm_offset);
+	if (in_wasm)
+		n_frames += 1;
+
+	while (n_frames < SAMPLER_MAX_DEPTH) {
+		uintptr_t slot, ret;
+
+		if (in_wasm) {
+			if (!valid_fp(fp, sp))
+				break;
+
+			ret = ((uintptr_t *) fp)[1];
+			sp = fp + 16;
+			fp = ((uintptr_t *) fp)[0];
+
+			/* otherwise we returned into an invoker */
+			in_wasm = lookup_pc(ret, 1, &frames[n_frames],
+					    &wasm_offset);
+			if (in_wasm)
+				n_frames += 1;
+			continue;
+		}
+
+		/* host code, look for the call that left JIT code */
+		if (n_frames + 2 > SAMPLER_MAX_DEPTH)
+			break;
+
+		for (slot = sp;
+		     slot < sampler.stack_end && slot < sp + 8 * SAMPLER_MAX_SCAN;
+		     slot += 8) {
+			ret = *(uintptr_t *) slot;
+			if (ret > 4096 &&
+			    (ret < sp || ret >= sampler.stack_end) &&
+			    lookup_pc(ret, 1, &frames[n_frames + 1],
+				      &wasm_offset))
+				break;
+		}
+
+		if (slot >= sampler.stack_end || slot >= sp + 8 * SAMPLER_MAX_SCAN)
+			break;
+
+		frames[n_frames] = MAKE_FRAME(FRAME_HOST,
+					      FRAME_MODULE(frames[n_frames + 1]),
+					      wasm_offset);
+		n_frames += 2;
+
+		/* the caller's %rbp is callee saved, either the host
+		   code left it alone or its own chain leads to it */
+		while (fp <= slot && valid_fp(fp, sp))
+			fp = *(uintptr_t *) fp;
+		if (fp <= slot)
+			break;
+
+		sp = slot + 8;
+		in_wasm = 1;
+	}
+
+	return n_frames;
+}
+
+static void sampler_handler(int signum, siginfo_t *info, void *ctx)
+{
+	uint64_t frames[SAMPLER_MAX_DEPTH];
+	size_t n_frames;
+	int saved_errno = errno;
+
+	(void)signum;
+	(void)info;
+
+	if (!sampler.armed)
+		return;
+
+	n_frames = walk_stack(ctx, frames);
+
+	if (sampler.buf_used + 1 + n_frames > SAMPLER_BUF_SIZE) {
+		sampler.n_dropped += 1;
+	} else {
+		sampler.buf[sampler.buf_used] = n_frames;
+		memcpy(&sampler.buf[sampler.buf_used + 1], frames,
+		       n_frames * sizeof(frames[0]));
+		sampler.buf_used += 1 + n_frames;
+		sampler.n_samples += 1;
+	}
+
+	errno = saved_errno;
+}
+
+int wasmjit_sampler_enable(unsigned interval_us)
+{
+	pthread_attr_t attr;
+	void *stack_addr;
+	size_t stack_size;
+
+	if (sampler.enabled)
+		return 1;
+
+	if (pthread_getattr_np(pthread_self(), &attr))
+		return 0;
+	if (pthread_attr_getstack(&attr, &stack_addr, &stack_size)) {
+		pthread_attr_destroy(&attr);
+		return 0;
+	}
+	pthread_attr_destroy(&attr);
+
+	/* address space is only committed as samples come in */
+	sampler.buf = malloc(SAMPLER_BUF_SIZE * sizeof(sampler.buf[0]));
+	if (!sampler.buf)
+		return 0;
+
+	sampler.stack_end = (uintptr_t) stack_addr + stack_size;
+	sampler.interval_us = interval_us ? interval_us : 1;
+	sampler.enabled = 1;
+	return 1;
+}
+
+int wasmjit_sampler_enabled(void)
+{
+	return sampler.enabled;
+}
+
+static int add_call_sites(struct SamplerModule *smodule,
+			  uint32_t n_imported_funcs,
+			  size_t n_instructions,
+			  const struct Instr *instructions)
+{
+	size_t i;
+
+	for (i = 0; i < n_instructions; ++i) {
+		const struct Instr *instr = &instructions[i];
+
+		switch (instr->opcode) {
+		case OPCODE_BLOCK:
+			if (!add_call_sites(smodule, n_imported_funcs,
+					    instr->data.block.n_instructions,
+					    instr->data.block.instructions))
+				return 0;
+			break;
+		case OPCODE_LOOP:
+			if (!add_call_sites(smodule, n_imported_funcs,
+					    instr->data.loop.n_instructions,
+					    instr->data.loop.instructions))
+				return 0;
+			break;
+		case OPCODE_IF:
+			if (!add_call_sites(smodule, n_imported_funcs,
+					    instr->data.if_.n_instructions_then,
+					    instr->data.if_.instructions_then) ||
+			    !add_call_sites(smodule, n_imported_funcs,
+					    instr->data.if_.n_instructions_else,
+					    instr->data.if_.instructions_else))
+				return 0;
+			break;
+		case OPCODE_CALL: {
+			struct SamplerCallSite *new_call_sites;
+
+			if (instr->data.call.funcidx >= n_imported_funcs)
+				break;
+
+			new_call_sites = realloc(smodule->call_sites,
+						 (smodule->n_call_sites + 1) *
+						 sizeof(smodule->call_sites[0]));
+			if (!new_call_sites)
+				return 0;
+			smodule->call_sites = new_call_sites;
+			smodule->call_sites[smodule->n_call_sites].wasm_offset =
+				instr->offset;
+			smodule->call_sites[smodule->n_call_sites].funcidx =
+				instr->data.call.funcidx;
+			smodule->n_call_sites += 1;
+			break;
+		}
+		default:
+			break;
+		}
+	}
+
+	return 1;
+}
+
+static int cmp_call_site(const void *a, const void *b)
+{
+	const struct SamplerCallSite *sa = a, *sb = b;
+
+	if (sa->wasm_offset < sb->wasm_offset)
+		return -1;
+	return sa->wasm_offset > sb->wasm_offset;
+}
+
+static void free_sampler_module(struct SamplerModule *smodule)
+{
+	size_t i;
+
+	for (i = 0; i < smodule->n_func_names; ++i)
+		free(smodule->func_names[i]);
+	free(smodule->func_names);
+	free(smodule->call_sites);
+}
+
+int wasmjit_sampler_add_module(struct ModuleInst *module_inst,
+			       const struct Module *module)
+{
+	struct SamplerModule smodule;
+	struct SamplerModule *new_modules;
+	uint32_t i, funcidx;
+	int ret;
+
+	memset(&smodule, 0, sizeof(smodule));
+	smodule.module_inst = module_inst;
+
+	smodule.func_names = calloc(module_inst->funcs.n_elts,
+				    sizeof(smodule.func_names[0]));
+	if (module_inst->funcs.n_elts && !smodule.func_names)
+		goto error;
+	smodule.n_func_names = module_inst->funcs.n_elts;
+
+	funcidx = 0;
+	for (i = 0; i < module->import_section.n_imports; ++i) {
+		const struct ImportSectionImport *import =
+			&module->import_section.imports[i];
+		char buf[256];
+
+		if (import->desc_type != IMPORT_DESC_TYPE_FUNC)
+			continue;
+
+		snprintf(buf, sizeof(buf), "host:%s", import->name);
+		smodule.func_names[funcidx] = strdup(buf);
+		if (!smodule.func_names[funcidx])
+			goto error;
+		funcidx += 1;
+	}
+
+	for (; funcidx < smodule.n_func_names; ++funcidx) {
+		const char *name;
+		char buf[256];
+
+		name = wasmjit_module_func_name(module, funcidx);
+		if (name)
+			snprintf(buf, sizeof(buf), "%s", name);
+		else
+			snprintf(buf, sizeof(buf), "wasm-function[%" PRIu32 "]",
+				 funcidx);
+		smodule.func_names[funcidx] = strdup(buf);
+		if (!smodule.func_names[funcidx])
+			goto error;
+	}
+
+	for (i = 0; i < module->code_section.n_codes; ++i) {
+		const struct CodeSectionCode *code =
+			&module->code_section.codes[i];
+
+		if (!add_call_sites(&smodule, module_inst->n_imported_funcs,
+				    code->n_instructions, code->instructions))
+			goto error;
+	}
+
+	qsort(smodule.call_sites, smodule.n_call_sites,
+	      sizeof(smodule.call_sites[0]), cmp_call_site);
+
+	/* the handler may run while we're in realloc() */
+	block_sigprof(SIG_BLOCK);
+	new_modules = realloc(sampler.modules,
+			      (sampler.n_modules + 1) * sizeof(sampler.modules[0]));
+	if (new_modules) {
+		sampler.modules = new_modules;
+		sampler.modules[sampler.n_modules] = smodule;
+		sampler.n_modules += 1;
+	}
+	block_sigprof(SIG_UNBLOCK);
+	if (!new_modules)
+		goto error;
+
+	ret = 1;
+
+	if (0) {
+	error:
+		free_sampler_module(&smodule);
+		ret = 0;
+	}
+
+	return ret;
+}
+
+void wasmjit_sampler_remove_module(struct ModuleInst *module_inst)
+{
+	size_t i;
+
+	/* keep the slot, samples refer to it by index */
+	block_sigprof(SIG_BLOCK);
+	for (i = 0; i < sampler.n_modules; ++i) {
+		if (sampler.modules[i].module_inst == module_inst)
+			sampler.modules[i].module_inst = NULL;
+	}
+	block_sigprof(SIG_UNBLOCK);
+}
+
+int wasmjit_sampler_start(void)
+{
+	struct sigaction act;
+	struct sigevent sev;
+	struct itimerspec its;
+
+	if (!sampler.enabled || sampler.armed)
+		return 0;
+
+	memset(&act, 0, sizeof(act));
+	act.sa_sigaction = sampler_handler;
+	act.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&act.sa_mask);
+	if (sigaction(SIGPROF, &act, &sampler.old_action))
+		return 0;
+
+	/* only this thread runs WASM code */
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD_ID;
+	sev.sigev_signo = SIGPROF;
+	sev.sigev_notify_thread_id = syscall(SYS_gettid);
+	if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &sampler.timer))
+		goto error;
+
+	sampler.armed = 1;
+
+	its.it_interval.tv_sec = sampler.interval_us / 1000000;
+	its.it_interval.tv_nsec = (sampler.interval_us % 1000000) * 1000;
+	its.it_value = its.it_interval;
+	if (timer_settime(sampler.timer, 0, &its, NULL)) {
+		sampler.armed = 0;
+		timer_delete(sampler.timer);
+		goto error;
+	}
+
+	return 1;
+
+ error:
+	sigaction(SIGPROF, &sampler.old_action, NULL);
+	return 0;
+}
+
+static const uint64_t *sample_frames(size_t offset, size_t *n_frames)
+{
+	*n_frames = sampler.buf[offset];
+	return &sampler.buf[offset + 1];
+}
+
+static int cmp_sample(const void *a, const void *b)
+{
+	const uint64_t *fa, *fb;
+	size_t na, nb, i;
+
+	fa = sample_frames(*(const size_t *) a, &na);
+	fb = sample_frames(*(const size_t *) b, &nb);
+
+	for (i = 0; i < na && i < nb; ++i) {
+		if (fa[i] != fb[i])
+			return fa[i] < fb[i] ? -1 : 1;
+	}
+
+	if (na != nb)
+		return na < nb ? -1 : 1;
+
+	return 0;
+}
+
+static const char *frame_name(uint64_t frame)
+{
+	const struct SamplerModule *smodule =
+		&sampler.modules[FRAME_MODULE(frame)];
+
+	if (FRAME_KIND(frame) == FRAME_HOST) {
+		size_t lo = 0, hi = smodule->n_call_sites;
+
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			if (smodule->call_sites[mid].wasm_offset < FRAME_IDX(frame))
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		if (lo == smodule->n_call_sites ||
+		    smodule->call_sites[lo].wasm_offset != FRAME_IDX(frame))
+			return "[native]";
+
+		return smodule->func_names[smodule->call_sites[lo].funcidx];
+	}
+
+	if (FRAME_IDX(frame) >= smodule->n_func_names)
+		return "[unknown]";
+
+	return smodule->func_names[FRAME_IDX(frame)];
+}
+
+static int write_folded(const char *filename)
+{
+	FILE *stream = NULL;
+	size_t *samples = NULL;
+	size_t n_samples, offset, i;
+	int ret;
+
+	stream = fopen(filename, "w");
+	if (!stream)
+		goto error;
+
+	samples = calloc(sampler.n_samples, sizeof(samples[0]));
+	if (sampler.n_samples && !samples)
+		goto error;
+
+	n_samples = 0;
+	for (offset = 0; offset < sampler.buf_used;
+	     offset += 1 + sampler.buf[offset])
+		samples[n_samples++] = offset;
+
+	qsort(samples, n_samples, sizeof(samples[0]), cmp_sample);
+
+	for (i = 0; i < n_samples;) {
+		const uint64_t *frames;
+		size_t n_frames, j, count;
+
+		count = 1;
+		while (i + count < n_samples &&
+		       !cmp_sample(&samples[i], &samples[i + count]))
+			count += 1;
+
+		frames = sample_frames(samples[i], &n_frames);
+		if (!n_frames)
+			fprintf(stream, "[native]");
+		for (j = n_frames; j > 0; --j)
+			fprintf(stream, "%s%s", j == n_frames ? "" : ";",
+				frame_name(frames[j - 1]));
+		fprintf(stream, " %zu\n", count);
+
+		i += count;
+	}
+
+	if (fclose(stream)) {
+		stream = NULL;
+		goto error;
+	}
+	stream = NULL;
+
+	ret = 1;
+
+	if (0) {
+	error:
+		ret = 0;
+	}
+
+	if (stream)
+		fclose(stream);
+	free(samples);
+
+	return ret;
+}
+
+int wasmjit_sampler_stop(const char *filename)
+{
+	struct sigaction ign;
+	size_t i;
+	int ret = 1;
+
+	if (!sampler.enabled)
+		return 0;
+
+	if (sampler.armed) {
+		block_sigprof(SIG_BLOCK);
+		timer_delete(sampler.timer);
+		sampler.armed = 0;
+
+		/* discard a pending signal before restoring the old action */
+		memset(&ign, 0, sizeof(ign));
+		ign.sa_handler = SIG_IGN;
+		sigemptyset(&ign.sa_mask);
+		sigaction(SIGPROF, &ign, NULL);
+		sigaction(SIGPROF, &sampler.old_action, NULL);
+		block_sigprof(SIG_UNBLOCK);
+	}
+
+	if (filename)
+		ret = write_folded(filename);
+
+	if (sampler.n_dropped)
+		fprintf(stderr, "sampler: dropped %zu samples\n",
+			sampler.n_dropped);
+
+	for (i = 0; i < sampler.n_modules; ++i)
+		free_sampler_module(&sampler.modules[i]);
+	free(sampler.modules);
+	free(sampler.buf);
+	memset(&sampler, 0, sizeof(sampler));
+
+	return ret;
+}
@@ -0,0 +1,64 @@
+/* -*-mode:c; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+  Copyright (c) 2018 Rian Hunter et. al, see AUTHORS file.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+#ifndef __WASMJIT__SAMPLER_H__
+#define __WASMJIT__SAMPLER_H__
+
+#include <wasmjit/ast.h>
+#include <wasmjit/runtime.h>
+
+#include <wasmjit/sys.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+  Statistical profiler for JIT code. A SIGPROF timer on the calling
+  thread's CPU clock interrupts it every interval_us microseconds and
+  the handler walks the %rbp chain of the WASM frames, mapping each
+  pc back to its function through the pc maps. Time spent in a host
+  function shows up as a "host:name" frame under its WASM caller,
+  anything else outside of JIT code as "[native]".
+
+  wasmjit_sampler_stop() writes the samples in the folded format of
+  flamegraph.pl ("root;...;leaf count" per line).
+
+  Modules must be added before they are run and removed before they
+  are freed, if that happens before wasmjit_sampler_stop().
+ */
+
+int wasmjit_sampler_enable(unsigned interval_us);
+int wasmjit_sampler_enabled(void);
+int wasmjit_sampler_add_module(struct ModuleInst *module_inst,
+			       const struct Module *module);
+void wasmjit_sampler_remove_module(struct ModuleInst *module_inst);
+int wasmjit_sampler_start(void);
+int wasmjit_sampler_stop(const char *filename);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
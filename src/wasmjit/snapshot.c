@@ -0,0 +1,259 @@
+/* -*-mode:c; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+  Copyright (c) 2018 Rian Hunter et. al, see AUTHORS file.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <wasmjit/snapshot.h>
+
+#include <wasmjit/runtime.h>
+
+#include <wasmjit/sys.h>
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#define SNAPSHOT_CHUNK_SIZE WASM_PAGE_SIZE
+
+static int is_zero(const char *buf, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size; ++i) {
+		if (buf[i])
+			return 0;
+	}
+
+	return 1;
+}
+
+static int write_all(int fd, const char *buf, size_t size, off_t offset)
+{
+	while (size) {
+		ssize_t ret = pwrite(fd, buf, size, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		buf += ret;
+		size -= ret;
+		offset += ret;
+	}
+
+	return 1;
+}
+
+static uint32_t func_index(const struct ModuleInst *module_inst,
+			   const struct FuncInst *funcinst)
+{
+	size_t i;
+
+	for (i = 0; i < module_inst->funcs.n_elts; ++i) {
+		if (module_inst->funcs.elts[i] == funcinst)
+			return i + 1;
+	}
+
+	return 0;
+}
+
+struct WasmJITSnapshot *wasmjit_snapshot_create(const struct ModuleInst *module_inst)
+{
+	struct WasmJITSnapshot *snapshot;
+	size_t i, j, total_size = 0;
+	off_t offset;
+
+	snapshot = calloc(1, sizeof(*snapshot));
+	if (!snapshot)
+		goto error;
+	snapshot->memfd = -1;
+
+	snapshot->n_funcs = module_inst->funcs.n_elts;
+
+	snapshot->n_mems = module_inst->mems.n_elts;
+	snapshot->mem_sizes = calloc(snapshot->n_mems,
+				     sizeof(snapshot->mem_sizes[0]));
+	if (snapshot->n_mems && !snapshot->mem_sizes)
+		goto error;
+
+	for (i = 0; i < module_inst->mems.n_elts; ++i) {
+		snapshot->mem_sizes[i] = module_inst->mems.elts[i]->size;
+		total_size += snapshot->mem_sizes[i];
+	}
+
+	if (total_size) {
+		snapshot->memfd = memfd_create("wasmjit-snapshot", MFD_CLOEXEC);
+		if (snapshot->memfd < 0)
+			goto error;
+
+		if (ftruncate(snapshot->memfd, total_size))
+			goto error;
+	}
+
+	offset = 0;
+	for (i = 0; i < module_inst->mems.n_elts; ++i) {
+		const struct MemInst *meminst = module_inst->mems.elts[i];
+
+		/* leave holes for zero chunks, they read back as zero */
+		for (j = 0; j < meminst->size; j += SNAPSHOT_CHUNK_SIZE) {
+			size_t chunk_size = meminst->size - j < SNAPSHOT_CHUNK_SIZE
+				? meminst->size - j
+				: SNAPSHOT_CHUNK_SIZE;
+
+			if (is_zero(meminst->data + j, chunk_size))
+				continue;
+
+			if (!write_all(snapshot->memfd, meminst->data + j,
+				       chunk_size, offset + j))
+				goto error;
+		}
+
+		offset += meminst->size;
+	}
+
+	/* imported globals are immutable */
+	snapshot->n_globals = module_inst->globals.n_elts -
+		module_inst->n_imported_globals;
+	snapshot->globals = calloc(snapshot->n_globals,
+				   sizeof(snapshot->globals[0]));
+	if (snapshot->n_globals && !snapshot->globals)
+		goto error;
+
+	for (i = 0; i < snapshot->n_globals; ++i) {
+		snapshot->globals[i] =
+			module_inst->globals.elts[i + module_inst->n_imported_globals]->value;
+	}
+
+	snapshot->n_tables = module_inst->tables.n_elts;
+	snapshot->tables = calloc(snapshot->n_tables,
+				  sizeof(snapshot->tables[0]));
+	if (snapshot->n_tables && !snapshot->tables)
+		goto error;
+
+	for (i = 0; i < module_inst->tables.n_elts; ++i) {
+		const struct TableInst *tableinst = module_inst->tables.elts[i];
+		struct WasmJITTableSnapshot *table = &snapshot->tables[i];
+
+		table->length = tableinst->length;
+		table->funcidxs = calloc(table->length,
+					 sizeof(table->funcidxs[0]));
+		if (table->length && !table->funcidxs)
+			goto error;
+
+		for (j = 0; j < tableinst->length; ++j) {
+			if (!tableinst->data[j])
+				continue;
+
+			/* only functions this module can name survive */
+			table->funcidxs[j] = func_index(module_inst,
+							tableinst->data[j]);
+			if (!table->funcidxs[j])
+				goto error;
+		}
+	}
+
+	if (0) {
+	error:
+		if (snapshot)
+			wasmjit_free_snapshot(snapshot);
+		snapshot = NULL;
+	}
+
+	return snapshot;
+}
+
+int wasmjit_snapshot_restore(const struct WasmJITSnapshot *snapshot,
+			     struct ModuleInst *module_inst)
+{
+	size_t i, j;
+	size_t offset;
+
+	if (snapshot->n_funcs != module_inst->funcs.n_elts ||
+	    snapshot->n_mems != module_inst->mems.n_elts ||
+	    snapshot->n_globals != module_inst->globals.n_elts -
+	    module_inst->n_imported_globals ||
+	    snapshot->n_tables != module_inst->tables.n_elts)
+		return 0;
+
+	for (i = 0; i < module_inst->tables.n_elts; ++i) {
+		if (module_inst->tables.elts[i]->length !=
+		    snapshot->tables[i].length)
+			return 0;
+	}
+
+	offset = 0;
+	for (i = 0; i < module_inst->mems.n_elts; ++i) {
+		struct MemInst *meminst = module_inst->mems.elts[i];
+		size_t size = snapshot->mem_sizes[i];
+
+		if (meminst->size > size)
+			return 0;
+
+		if (meminst->size < size &&
+		    !wasmjit_extend_memory(meminst, size))
+			return 0;
+
+		if (!wasmjit_memory_map_image(meminst, snapshot->memfd,
+					      offset, size))
+			return 0;
+
+		offset += size;
+	}
+
+	for (i = 0; i < snapshot->n_globals; ++i) {
+		module_inst->globals.elts[i + module_inst->n_imported_globals]->value =
+			snapshot->globals[i];
+	}
+
+	for (i = 0; i < snapshot->n_tables; ++i) {
+		struct TableInst *tableinst = module_inst->tables.elts[i];
+		const struct WasmJITTableSnapshot *table = &snapshot->tables[i];
+
+		for (j = 0; j < table->length; ++j) {
+			tableinst->data[j] = table->funcidxs[j]
+				? module_inst->funcs.elts[table->funcidxs[j] - 1]
+				: NULL;
+		}
+	}
+
+	return 1;
+}
+
+void wasmjit_free_snapshot(struct WasmJITSnapshot *snapshot)
+{
+	size_t i;
+
+	if (snapshot->memfd >= 0)
+		close(snapshot->memfd);
+	free(snapshot->mem_sizes);
+	free(snapshot->globals);
+	if (snapshot->tables) {
+		for (i = 0; i < snapshot->n_tables; ++i)
+			free(snapshot->tables[i].funcidxs);
+		free(snapshot->tables);
+	}
+	free(snapshot);
+}
@@ -0,0 +1,72 @@
+/* -*-mode:c; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+  Copyright (c) 2018 Rian Hunter et. al, see AUTHORS file.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+
+#ifndef __WASMJIT__SNAPSHOT_H__
+#define __WASMJIT__SNAPSHOT_H__
+
+#include <wasmjit/runtime.h>
+
+#include <wasmjit/sys.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+  The wasm visible state of an instance: memory contents live in a
+  memfd, sparse where the memory was zero, and table entries are kept
+  as function indexes. Restoring it into a new instance of the same
+  module, instantiated with WASMJIT_INSTANTIATE_FLAG_NO_INIT, maps the
+  memfd copy-on-write so pages are shared until written. Host state,
+  e.g. the Emscripten runtime's, is not part of it.
+ */
+
+struct WasmJITTableSnapshot {
+	size_t length;
+	/* funcidx + 1, 0 for an empty entry */
+	uint32_t *funcidxs;
+};
+
+struct WasmJITSnapshot {
+	int memfd;
+	size_t n_funcs;
+	size_t n_mems;
+	size_t *mem_sizes;
+	size_t n_globals;
+	struct Value *globals;
+	size_t n_tables;
+	struct WasmJITTableSnapshot *tables;
+};
+
+struct WasmJITSnapshot *wasmjit_snapshot_create(const struct ModuleInst *module_inst);
+int wasmjit_snapshot_restore(const struct WasmJITSnapshot *snapshot,
+			     struct ModuleInst *module_inst);
+void wasmjit_free_snapshot(struct WasmJITSnapshot *snapshot);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
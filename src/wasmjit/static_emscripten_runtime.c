@@ -47,6 +47,8 @@
 #define END_FUNCTION_DEFS()
 #define DEFINE_EXTERNAL_WASM_TABLE(name)	\
 	extern struct TableInst WASM_TABLE_SYMBOL(CURRENT_MODULE, name);
+#define DEFINE_EXTERNAL_WASM_MEMORY(name)	\
+	extern struct MemInst WASM_MEMORY_SYMBOL(CURRENT_MODULE, name);
 #define DEFINE_EXTERNAL_WASM_GLOBAL(name) \
 	extern struct GlobalInst WASM_GLOBAL_SYMBOL(CURRENT_MODULE, name);
 
@@ -68,6 +70,7 @@
 #undef END_FUNCTION_DEFS
 #undef DEFINE_WASM_START_FUNCTION
 #undef DEFINE_EXTERNAL_WASM_TABLE
+#undef DEFINE_EXTERNAL_WASM_MEMORY
 #undef DEFINE_EXTERNAL_WASM_GLOBAL
 
 #define DEFINE_WASM_START_FUNCTION(...)
@@ -86,6 +89,8 @@
 	static struct MemInst *CAT(CURRENT_MODULE, _mems)[] = {
 #define DEFINE_WASM_MEMORY(_name, ...)			\
 	&WASM_MEMORY_SYMBOL(CURRENT_MODULE, _name),
+#define DEFINE_EXTERNAL_WASM_MEMORY(_name)			\
+	&WASM_MEMORY_SYMBOL(CURRENT_MODULE, _name),
 #define END_MEMORY_DEFS()			\
 	};
 
@@ -127,6 +132,7 @@ struct EmscriptenContext g_emscripten_ctx;
 #undef END_FUNCTION_DEFS
 #undef DEFINE_WASM_START_FUNCTION
 #undef DEFINE_EXTERNAL_WASM_TABLE
+#undef DEFINE_EXTERNAL_WASM_MEMORY
 #undef DEFINE_EXTERNAL_WASM_GLOBAL
 
 /* create exports */
@@ -168,6 +174,7 @@ struct EmscriptenContext g_emscripten_ctx;
 			.mem = &WASM_MEMORY_SYMBOL(CURRENT_MODULE, _name), \
 		}							\
 	},
+#define DEFINE_EXTERNAL_WASM_MEMORY(_name) DEFINE_WASM_MEMORY(_name)
 #define DEFINE_WASM_GLOBAL(_name, ...)				\
 	{							\
 		.name = #_name,					\
@@ -198,6 +205,7 @@ struct EmscriptenContext g_emscripten_ctx;
 #undef END_FUNCTION_DEFS
 #undef DEFINE_WASM_START_FUNCTION
 #undef DEFINE_EXTERNAL_WASM_TABLE
+#undef DEFINE_EXTERNAL_WASM_MEMORY
 #undef DEFINE_EXTERNAL_WASM_GLOBAL
 
 /* create module */
@@ -216,6 +224,7 @@ struct EmscriptenContext g_emscripten_ctx;
 #define DEFINE_WASM_MEMORY(...)
 #define DEFINE_EXTERNAL_WASM_GLOBAL(...)
 #define DEFINE_EXTERNAL_WASM_TABLE(...)
+#define DEFINE_EXTERNAL_WASM_MEMORY(...)
 
 #define START_MODULE()						\
 	struct StaticModuleInst WASM_MODULE_SYMBOL(CURRENT_MODULE) = {	\
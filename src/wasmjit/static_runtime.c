@@ -36,6 +36,19 @@ int wasmjit_unmap_code_segment(void *code, size_t code_size)
 	return 1;
 }
 
+void wasmjit_unmap_memory(struct MemInst *meminst)
+{
+	(void)meminst;
+}
+
+int wasmjit_extend_memory(struct MemInst *meminst, size_t new_size)
+{
+	/* statically sized */
+	(void)meminst;
+	(void)new_size;
+	return 0;
+}
+
 __attribute__((noreturn))
 void wasmjit_trap(int reason)
 {
@@ -119,10 +119,12 @@ void wasmjit_init_static_module(struct StaticModuleInst *smi);
    with a compiled code signature from a function with host function signature */
 
 #define CTYPE_VALTYPE_I32 uint32_t
+#define CTYPE_VALTYPE_F64 double
 #define CTYPE_VALTYPE_NULL void
 #define CTYPE(val) CTYPE_ ## val
 
 #define VALUE_MEMBER_VALTYPE_I32 i32
+#define VALUE_MEMBER_VALTYPE_F64 f64
 #define VALUE_MEMBER(val) VALUE_MEMBER_ ## val
 
 #define ITER __KMAP
@@ -0,0 +1,249 @@
+/* -*-mode:c; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+  Copyright (c) 2018 Rian Hunter et. al, see AUTHORS file.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+
+#include <wasmjit/stats.h>
+
+#include <wasmjit/compile.h>
+#include <wasmjit/tier.h>
+#include <wasmjit/sys.h>
+
+#include <inttypes.h>
+
+struct StatsEntry {
+	const char *module_name;
+	const char *func_name;
+	size_t funcidx;
+	struct WasmJITFuncStats stats;
+};
+
+static int by_calls(const void *a, const void *b)
+{
+	const struct StatsEntry *ea = a, *eb = b;
+	if (ea->stats.calls != eb->stats.calls)
+		return ea->stats.calls < eb->stats.calls ? 1 : -1;
+	return 0;
+}
+
+static int by_cycles(const void *a, const void *b)
+{
+	const struct StatsEntry *ea = a, *eb = b;
+	if (ea->stats.cycles != eb->stats.cycles)
+		return ea->stats.cycles < eb->stats.cycles ? 1 : -1;
+	return by_calls(a, b);
+}
+
+int wasmjit_dump_function_stats(FILE *stream,
+				size_t n_modules,
+				const struct NamedModule *modules,
+				size_t top_n)
+{
+	size_t i, j, n_entries = 0;
+	struct StatsEntry *entries = NULL;
+	int cycles = 0, ret;
+
+	for (i = 0; i < n_modules; ++i) {
+		const struct ModuleInst *module_inst = modules[i].module;
+
+		if (module_inst->compile_flags & WASMJIT_COMPILE_FLAG_CALL_COUNTS)
+			n_entries += module_inst->funcs.n_elts -
+				module_inst->n_imported_funcs;
+	}
+
+	entries = calloc(n_entries, sizeof(entries[0]));
+	if (n_entries && !entries)
+		goto error;
+
+	n_entries = 0;
+	for (i = 0; i < n_modules; ++i) {
+		const struct ModuleInst *module_inst = modules[i].module;
+
+		if (!(module_inst->compile_flags & WASMJIT_COMPILE_FLAG_CALL_COUNTS))
+			continue;
+		if (module_inst->compile_flags & WASMJIT_COMPILE_FLAG_CYCLES)
+			cycles = 1;
+
+		for (j = module_inst->n_imported_funcs;
+		     j < module_inst->funcs.n_elts; ++j) {
+			const struct FuncInst *funcinst = module_inst->funcs.elts[j];
+			struct StatsEntry *entry;
+
+			if (!funcinst->stats.calls)
+				continue;
+
+			entry = &entries[n_entries++];
+			entry->module_name = modules[i].name;
+			entry->func_name = module_inst->func_names[j];
+			entry->funcidx = j;
+			entry->stats = funcinst->stats;
+		}
+	}
+
+	if (n_entries)
+		qsort(entries, n_entries, sizeof(entries[0]),
+		      cycles ? by_cycles : by_calls);
+
+	if (cycles)
+		fprintf(stream, "%20s %20s %14s  %s\n",
+			"calls", "cycles", "cycles/call", "function");
+	else
+		fprintf(stream, "%20s  %s\n", "calls", "function");
+
+	for (i = 0; i < n_entries && i < top_n; ++i) {
+		struct StatsEntry *entry = &entries[i];
+
+		if (cycles)
+			fprintf(stream, "%20" PRIu64 " %20" PRIu64 " %14" PRIu64 "  ",
+				entry->stats.calls, entry->stats.cycles,
+				entry->stats.cycles / entry->stats.calls);
+		else
+			fprintf(stream, "%20" PRIu64 "  ", entry->stats.calls);
+
+		if (entry->func_name)
+			fprintf(stream, "%s:%s\n",
+				entry->module_name, entry->func_name);
+		else
+			fprintf(stream, "%s:wasm-function[%zu]\n",
+				entry->module_name, entry->funcidx);
+	}
+
+	if (0) {
+	error:
+		ret = -1;
+	} else {
+		ret = ferror(stream) ? -1 : 0;
+	}
+
+	free(entries);
+
+	return ret;
+}
+
+int wasmjit_module_inst_memory_usage(const struct ModuleInst *module_inst,
+				     struct WasmJITModuleMemoryUsage *usage)
+{
+	size_t i, retired;
+
+	memset(usage, 0, sizeof(*usage));
+
+	for (i = module_inst->n_imported_mems; i < module_inst->mems.n_elts; ++i) {
+		size_t reserved, committed, resident;
+
+		if (!wasmjit_memory_usage(module_inst->mems.elts[i],
+					  &reserved, &committed, &resident))
+			return -1;
+
+		usage->memory_reserved += reserved;
+		usage->memory_committed += committed;
+		usage->memory_resident += resident;
+	}
+
+	for (i = module_inst->n_imported_funcs; i < module_inst->funcs.n_elts; ++i) {
+		const struct FuncInst *funcinst = module_inst->funcs.elts[i];
+		usage->code_bytes += funcinst->compiled_code_size +
+			funcinst->invoker_size;
+	}
+
+	for (i = module_inst->n_imported_tables; i < module_inst->tables.n_elts; ++i) {
+		usage->table_bytes += sizeof(struct TableInst) +
+			module_inst->tables.elts[i]->length *
+			sizeof(module_inst->tables.elts[i]->data[0]);
+	}
+
+	usage->global_bytes = (module_inst->globals.n_elts -
+			       module_inst->n_imported_globals) *
+		sizeof(struct GlobalInst);
+
+	wasmjit_tier_memory_usage(module_inst, &usage->ast_bytes, &retired);
+	usage->code_bytes += retired;
+
+	return 0;
+}
+
+int wasmjit_dump_memory_stats(FILE *stream,
+			      size_t n_modules,
+			      const struct NamedModule *modules)
+{
+	size_t i, j;
+
+	fprintf(stream, "%14s %14s %14s %14s  %s\n",
+		"reserved", "committed", "resident", "huge pages", "memory");
+
+	for (i = 0; i < n_modules; ++i) {
+		const struct ModuleInst *module_inst = modules[i].module;
+
+		for (j = module_inst->n_imported_mems;
+		     j < module_inst->mems.n_elts; ++j) {
+			const struct MemInst *meminst = module_inst->mems.elts[j];
+			size_t reserved, committed, resident, huge;
+
+			if (!wasmjit_memory_usage(meminst, &reserved,
+						  &committed, &resident) ||
+			    !wasmjit_memory_huge_page_bytes(meminst, &huge))
+				return -1;
+
+			fprintf(stream, "%14zu %14zu %14zu %14zu  %s:memory[%zu]%s%s\n",
+				reserved, committed, resident, huge,
+				modules[i].name, j,
+				(meminst->flags & WASMJIT_MEMORY_FLAG_HUGETLB)
+				? " (hugetlb)"
+				: (meminst->flags & WASMJIT_MEMORY_FLAG_HUGE_PAGES)
+				? " (thp)" : "",
+				(meminst->flags & WASMJIT_MEMORY_FLAG_SHARED)
+				? " (shared)" : "");
+		}
+	}
+
+	if (n_modules)
+		fprintf(stream, "%14s %14s %14s %14s  %s\n",
+			"code", "tables", "globals", "ast", "module");
+
+	for (i = 0; i < n_modules; ++i) {
+		struct WasmJITModuleMemoryUsage usage;
+
+		if (wasmjit_module_inst_memory_usage(modules[i].module, &usage))
+			return -1;
+
+		fprintf(stream, "%14zu %14zu %14zu %14zu  %s\n",
+			usage.code_bytes, usage.table_bytes,
+			usage.global_bytes, usage.ast_bytes,
+			modules[i].name);
+	}
+
+	{
+		struct WasmJITMemoryPoolStats pool;
+
+		wasmjit_memory_pool_stats(&pool);
+		if (pool.capacity)
+			fprintf(stream,
+				"memory pool: %zu/%zu free, %" PRIu64 " hits, %"
+				PRIu64 " misses, %" PRIu64 " resets, %" PRIu64
+				" ns/reset\n",
+				pool.n_free, pool.capacity, pool.hits,
+				pool.misses, pool.resets,
+				pool.resets ? pool.reset_ns / pool.resets : 0);
+	}
+
+	return ferror(stream) ? -1 : 0;
+}
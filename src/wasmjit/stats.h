@@ -0,0 +1,86 @@
+/* -*-mode:c; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+  Copyright (c) 2018 Rian Hunter et. al, see AUTHORS file.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+
+#ifndef __WASMJIT__STATS_H__
+#define __WASMJIT__STATS_H__
+
+#include <wasmjit/runtime.h>
+
+#include <wasmjit/sys.h>
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+  Per-function counters kept by modules instantiated with
+  WASMJIT_INSTANTIATE_FLAG_CALL_STATS or _CYCLE_STATS. Writes the
+  top_n functions of all such modules to stream, ordered by inclusive
+  cycles when those were counted and by calls otherwise. Calls that
+  were inlined are counted in their caller.
+ */
+
+int wasmjit_dump_function_stats(FILE *stream,
+				size_t n_modules,
+				const struct NamedModule *modules,
+				size_t top_n);
+
+/*
+  Bytes held by a single instance, only counting what it defines
+  itself. ast_bytes is the module kept around for tiering, it's zero
+  for instances that weren't attached to a tier.
+ */
+
+struct WasmJITModuleMemoryUsage {
+	size_t memory_reserved;
+	size_t memory_committed;
+	size_t memory_resident;
+	size_t code_bytes;
+	size_t table_bytes;
+	size_t global_bytes;
+	size_t ast_bytes;
+};
+
+int wasmjit_module_inst_memory_usage(const struct ModuleInst *module_inst,
+				     struct WasmJITModuleMemoryUsage *usage);
+
+/*
+  Reservation, commit, residency and huge page backing of every memory
+  defined by one of the modules, imported memories are listed under
+  their defining module. Followed by the rest of each module's
+  footprint and the memory pool's counters when it's enabled.
+ */
+
+int wasmjit_dump_memory_stats(FILE *stream,
+			      size_t n_modules,
+			      const struct NamedModule *modules);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
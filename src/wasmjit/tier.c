@@ -0,0 +1,393 @@
+/* -*-mode:c; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+  Copyright (c) 2018 Rian Hunter et. al, see AUTHORS file.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+
+#include <wasmjit/tier.h>
+
+#include <wasmjit/ast.h>
+#include <wasmjit/inline.h>
+#include <wasmjit/instantiate.h>
+#include <wasmjit/perf.h>
+#include <wasmjit/profile.h>
+#include <wasmjit/compile.h>
+#include <wasmjit/gdb_jit.h>
+#include <wasmjit/runtime.h>
+#include <wasmjit/vector.h>
+
+#include <wasmjit/sys.h>
+
+#include <pthread.h>
+
+struct RetiredCode {
+	void *code;
+	size_t size;
+	struct WasmJITPcMap *pc_map;
+};
+
+struct WasmJITTier {
+	struct Module module;
+	struct ModuleInst *module_inst;
+	/* a copy of the profile given to wasmjit_tier_attach(), NULL
+	   to use what tier 0 recorded */
+	struct WasmJITProfile *profile;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int stop;
+	DEFINE_ANON_VECTOR(struct FuncInst *) queue;
+	/* only touched by the tier thread, unmapped on free */
+	DEFINE_ANON_VECTOR(struct RetiredCode) retired;
+	/* written by the tier thread, read atomically */
+	size_t module_bytes;
+	size_t retired_bytes;
+};
+
+static int retire_code(struct WasmJITTier *tier, void *code, size_t size,
+		       struct WasmJITPcMap *pc_map)
+{
+	if (!VECTOR_GROW(&tier->retired, 1)) {
+		/* VECTOR_GROW frees on failure, older code stays mapped */
+		tier->retired.elts = NULL;
+		tier->retired.n_elts = 0;
+		return 0;
+	}
+	tier->retired.elts[tier->retired.n_elts - 1].code = code;
+	tier->retired.elts[tier->retired.n_elts - 1].size = size;
+	tier->retired.elts[tier->retired.n_elts - 1].pc_map = pc_map;
+	__atomic_store_n(&tier->retired_bytes, tier->retired_bytes + size,
+			 __ATOMIC_RELAXED);
+	return 1;
+}
+
+/*
+ * Counters for code that was just inlined, from the counters tier 0
+ * recorded, or a loaded profile of code without inlining has, for the
+ * function and its callees.
+ */
+static uint64_t *inlined_counters(struct WasmJITTier *tier,
+				  const struct WasmJITProfile *recorded,
+				  uint32_t codeidx, size_t *n_counters)
+{
+	const struct WasmJITFunctionProfile *caller;
+	uint64_t *counters = NULL, *out = NULL;
+	size_t i;
+
+	if (!recorded || codeidx >= recorded->n_funcs)
+		goto error;
+	caller = &recorded->funcs[codeidx];
+
+	/* still being incremented, work from a copy */
+	counters = malloc(caller->n_counters * sizeof(counters[0]));
+	if (caller->n_counters && !counters)
+		goto error;
+	memcpy(counters, caller->counters,
+	       caller->n_counters * sizeof(counters[0]));
+	for (i = 0; i < caller->n_targets; ++i) {
+		counters[caller->targets[i]] =
+			wasmjit_profile_target_funcidx(tier->module_inst,
+						       counters[caller->targets[i]]);
+	}
+
+	*n_counters =
+		wasmjit_profile_n_counters(&tier->module.code_section.codes[codeidx]);
+	out = calloc(*n_counters, sizeof(out[0]));
+	if (*n_counters && !out)
+		goto error;
+
+	if (!wasmjit_profile_inline_counters(&tier->module.code_section.codes[codeidx],
+					     counters, caller->n_counters,
+					     recorded->funcs, recorded->n_funcs,
+					     out))
+		goto error;
+
+	free(counters);
+	return out;
+
+ error:
+	free(counters);
+	free(out);
+	return NULL;
+}
+
+static void tier_recompile(struct WasmJITTier *tier, struct FuncInst *funcinst)
+{
+	struct ModuleInst *module_inst = tier->module_inst;
+	struct WasmJITFunctionProfile fprofile, *profile = NULL;
+	struct FuncInst out;
+	size_t i;
+	uint32_t codeidx;
+	int ret;
+
+	for (i = module_inst->n_imported_funcs; i < module_inst->funcs.n_elts; ++i) {
+		if (module_inst->funcs.elts[i] == funcinst)
+			break;
+	}
+	if (i == module_inst->funcs.n_elts)
+		return;
+	codeidx = i - module_inst->n_imported_funcs;
+	if (codeidx >= tier->module.code_section.n_codes)
+		return;
+
+	if (!wasmjit_inline_function(&tier->module, codeidx))
+		return;
+
+	__atomic_store_n(&tier->module_bytes,
+			 wasmjit_module_bytes(&tier->module), __ATOMIC_RELAXED);
+
+	/* tier 1 is laid out for a profile, tier 0 isn't */
+	memset(&fprofile, 0, sizeof(fprofile));
+	if (tier->profile && tier->profile->inlined) {
+		if (codeidx < tier->profile->n_funcs)
+			profile = &tier->profile->funcs[codeidx];
+	} else {
+		fprofile.counters =
+			inlined_counters(tier,
+					 tier->profile ? tier->profile : module_inst->profile,
+					 codeidx, &fprofile.n_counters);
+		if (fprofile.counters)
+			profile = &fprofile;
+	}
+
+	ret = wasmjit_instantiate_recompile(module_inst,
+					    &tier->module.code_section.codes[codeidx],
+					    funcinst, profile, &out);
+	free(fprofile.counters);
+	if (!ret)
+		return;
+
+	/* frames may still be running tier 0 code, keep it mapped */
+	if (!retire_code(tier, funcinst->compiled_code,
+			 funcinst->compiled_code_size, funcinst->pc_map) ||
+	    !retire_code(tier, funcinst->invoker, funcinst->invoker_size,
+			 NULL)) {
+		wasmjit_unmap_code_segment(out.compiled_code,
+					   out.compiled_code_size);
+		wasmjit_unmap_code_segment(out.invoker, out.invoker_size);
+		wasmjit_free_pc_map(out.pc_map);
+		return;
+	}
+
+	/* retired maps are freed along with the tier */
+	out.pc_map->prev = funcinst->pc_map;
+	__atomic_store_n(&funcinst->pc_map, out.pc_map, __ATOMIC_RELEASE);
+	/* before the code can run, best effort */
+	wasmjit_update_code_map(module_inst);
+
+	/* callers load compiled_code before stack_usage, so one that
+	   sees the new code also sees the bound it needs */
+	if (out.stack_usage > funcinst->stack_usage)
+		__atomic_store_n(&funcinst->stack_usage, out.stack_usage,
+				 __ATOMIC_RELEASE);
+	funcinst->compiled_code_size = out.compiled_code_size;
+	__atomic_store_n(&funcinst->compiled_code, out.compiled_code,
+			 __ATOMIC_RELEASE);
+	funcinst->invoker_size = out.invoker_size;
+	__atomic_store_n(&funcinst->invoker, out.invoker, __ATOMIC_RELEASE);
+
+	if (wasmjit_perf_enabled())
+		wasmjit_perf_load_func(wasmjit_module_func_name(&tier->module, i),
+				       i, funcinst);
+	if (wasmjit_gdb_jit_enabled())
+		wasmjit_gdb_jit_register_func(module_inst,
+					      wasmjit_module_func_name(&tier->module, i),
+					      i, funcinst);
+}
+
+static void *tier_thread(void *arg)
+{
+	struct WasmJITTier *tier = arg;
+
+	pthread_mutex_lock(&tier->lock);
+	while (1) {
+		struct FuncInst *funcinst;
+
+		while (!tier->stop && !tier->queue.n_elts)
+			pthread_cond_wait(&tier->cond, &tier->lock);
+
+		if (tier->stop)
+			break;
+
+		tier->queue.n_elts -= 1;
+		funcinst = tier->queue.elts[tier->queue.n_elts];
+
+		pthread_mutex_unlock(&tier->lock);
+		tier_recompile(tier, funcinst);
+		pthread_mutex_lock(&tier->lock);
+	}
+	pthread_mutex_unlock(&tier->lock);
+
+	return NULL;
+}
+
+/* runs on the wasm thread, from tier 0 code */
+static void tier_request(void *arg, struct FuncInst *funcinst)
+{
+	struct WasmJITTier *tier = arg;
+
+	pthread_mutex_lock(&tier->lock);
+	if (VECTOR_GROW(&tier->queue, 1)) {
+		tier->queue.elts[tier->queue.n_elts - 1] = funcinst;
+		pthread_cond_signal(&tier->cond);
+	} else {
+		/* VECTOR_GROW frees on failure, try again later */
+		tier->queue.elts = NULL;
+		tier->queue.n_elts = 0;
+		funcinst->tier_countdown = WASMJIT_TIER_UP_THRESHOLD;
+	}
+	pthread_mutex_unlock(&tier->lock);
+}
+
+static void tier_free(void *arg)
+{
+	struct WasmJITTier *tier = arg;
+	size_t i;
+
+	pthread_mutex_lock(&tier->lock);
+	tier->stop = 1;
+	pthread_cond_signal(&tier->cond);
+	pthread_mutex_unlock(&tier->lock);
+
+	pthread_join(tier->thread, NULL);
+
+	for (i = 0; i < tier->retired.n_elts; ++i) {
+		wasmjit_unmap_code_segment(tier->retired.elts[i].code,
+					   tier->retired.elts[i].size);
+		if (tier->retired.elts[i].pc_map)
+			wasmjit_free_pc_map(tier->retired.elts[i].pc_map);
+	}
+	free(tier->retired.elts);
+	free(tier->queue.elts);
+	if (tier->profile)
+		wasmjit_free_profile(tier->profile);
+
+	pthread_cond_destroy(&tier->cond);
+	pthread_mutex_destroy(&tier->lock);
+	wasmjit_free_module(&tier->module);
+	free(tier);
+}
+
+static struct WasmJITProfile *copy_profile(const struct WasmJITProfile *profile)
+{
+	struct WasmJITProfile *copy;
+	size_t i;
+
+	copy = calloc(1, sizeof(*copy));
+	if (!copy)
+		return NULL;
+
+	copy->funcs = calloc(profile->n_funcs, sizeof(copy->funcs[0]));
+	if (profile->n_funcs && !copy->funcs)
+		goto error;
+	copy->n_funcs = profile->n_funcs;
+	copy->module_hash = profile->module_hash;
+	copy->inlined = profile->inlined;
+
+	for (i = 0; i < profile->n_funcs; ++i) {
+		size_t n = profile->funcs[i].n_counters;
+
+		copy->funcs[i].counters = malloc(n * sizeof(uint64_t));
+		if (n && !copy->funcs[i].counters)
+			goto error;
+		memcpy(copy->funcs[i].counters, profile->funcs[i].counters,
+		       n * sizeof(uint64_t));
+		copy->funcs[i].n_counters = n;
+	}
+
+	return copy;
+
+ error:
+	wasmjit_free_profile(copy);
+	return NULL;
+}
+
+int wasmjit_tier_attach(struct ModuleInst *module_inst,
+			struct Module *module,
+			const struct WasmJITProfile *profile)
+{
+	struct WasmJITTier *tier = NULL;
+	int has_lock = 0, has_cond = 0;
+
+	tier = calloc(1, sizeof(*tier));
+	if (!tier)
+		goto error;
+
+	if (profile) {
+		tier->profile = copy_profile(profile);
+		if (!tier->profile)
+			goto error;
+	}
+
+	if (pthread_mutex_init(&tier->lock, NULL))
+		goto error;
+	has_lock = 1;
+
+	if (pthread_cond_init(&tier->cond, NULL))
+		goto error;
+	has_cond = 1;
+
+	tier->module_inst = module_inst;
+
+	if (pthread_create(&tier->thread, NULL, tier_thread, tier))
+		goto error;
+
+	tier->module = *module;
+	wasmjit_init_module(module);
+	tier->module_bytes = wasmjit_module_bytes(&tier->module);
+
+	module_inst->tier = tier;
+	module_inst->tier_up = &tier_request;
+	module_inst->free_tier = &tier_free;
+
+	if (0) {
+	error:
+		if (tier) {
+			if (tier->profile)
+				wasmjit_free_profile(tier->profile);
+			if (has_cond)
+				pthread_cond_destroy(&tier->cond);
+			if (has_lock)
+				pthread_mutex_destroy(&tier->lock);
+			free(tier);
+		}
+		return 0;
+	}
+
+	return 1;
+}
+
+void wasmjit_tier_memory_usage(const struct ModuleInst *module_inst,
+			       size_t *module_bytes,
+			       size_t *retired_code_bytes)
+{
+	const struct WasmJITTier *tier = module_inst->tier;
+
+	*module_bytes = 0;
+	*retired_code_bytes = 0;
+	if (!tier)
+		return;
+
+	*module_bytes = __atomic_load_n(&tier->module_bytes, __ATOMIC_RELAXED);
+	*retired_code_bytes = __atomic_load_n(&tier->retired_bytes,
+					      __ATOMIC_RELAXED);
+}
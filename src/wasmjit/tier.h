@@ -0,0 +1,71 @@
+/* -*-mode:c; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*- */
+
+/*
+  Copyright (c) 2018 Rian Hunter et. al, see AUTHORS file.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+ */
+
+
+#ifndef __WASMJIT__TIER_H__
+#define __WASMJIT__TIER_H__
+
+#include <wasmjit/ast.h>
+#include <wasmjit/runtime.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+  Tier 0 is the regular single-pass output compiled with
+  WASMJIT_INSTANTIATE_FLAG_TIERED, which also records a branch profile
+  into ModuleInst.profile. Once a function's entry and loop back-edge
+  counter runs out it is queued to a background thread that inlines its
+  callees and recompiles it without counters, laid out for what tier 0
+  recorded of it and its inlined callees. Tier 1 also keeps the most
+  used integer locals in callee-saved registers and drops the bounds
+  check of an access through a local that was already checked for at
+  least that offset earlier in the same straight-line run, see
+  WASMJIT_COMPILE_FLAG_OPTIMIZE; operand stack slots stay in memory.
+  The new code is published through FuncInst.compiled_code (and
+  FuncInst.invoker); calls and table entries always go through the
+  FuncInst so they pick it up on their next call.
+
+  wasmjit_tier_attach() takes ownership of *module, which must be the
+  module module_inst was instantiated from, and starts the thread. If
+  profile isn't NULL it must be the one module_inst was instantiated
+  with, tier 0 didn't record and tier 1 is laid out for a copy of it
+  instead, recorded with or without inlining.
+ */
+int wasmjit_tier_attach(struct ModuleInst *module_inst,
+			struct Module *module,
+			const struct WasmJITProfile *profile);
+
+/* the module kept for recompiling and the tier 0 code kept mapped
+   after being replaced, 0 without a tier */
+void wasmjit_tier_memory_usage(const struct ModuleInst *module_inst,
+			       size_t *module_bytes,
+			       size_t *retired_code_bytes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -46,16 +46,17 @@ int output_buf(struct SizedBuffer *sstack, const void *buf,
 #include <unistd.h>
 #include <fcntl.h>
 
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+/* mapped rather than read, data segments are copied straight out of
+   the page cache */
 char *wasmjit_load_file(const char *filename, size_t *size)
 {
-	FILE *f = NULL;
 	char *input = NULL;
 	int fd = -1, ret;
 	struct stat st;
-	size_t rets;
 
 	fd = open(filename, O_RDONLY);
 	if (fd < 0) {
@@ -67,35 +68,18 @@ char *wasmjit_load_file(const char *filename, size_t *size)
 		goto error_exit;
 	}
 
-	f = fdopen(fd, "r");
-	if (!f) {
+	if (!st.st_size) {
 		goto error_exit;
 	}
-	fd = -1;
 
 	*size = st.st_size;
-	input = malloc(st.st_size);
-	if (!input) {
+	input = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (input == MAP_FAILED) {
+		input = NULL;
 		goto error_exit;
 	}
 
-	rets = fread(input, sizeof(char), st.st_size, f);
-	if (rets != (size_t) st.st_size) {
-		goto error_exit;
-	}
-
-	goto success_exit;
-
  error_exit:
-	if (input) {
-		free(input);
-	}
-
- success_exit:
-	if (f) {
-		fclose(f);
-	}
-
 	if (fd >= 0) {
 		close(fd);
 	}
@@ -105,8 +89,7 @@ char *wasmjit_load_file(const char *filename, size_t *size)
 
 void wasmjit_unload_file(char *buf, size_t size)
 {
-	free(buf);
-	(void) size;
+	munmap(buf, size);
 }
 
 #else